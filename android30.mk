@@ -26,11 +26,11 @@ LIBS = -L$(TOOLCHAIN)/sysroot/usr/lib/aarch64-linux-android/30 -lstdc++ -lz -lm
 
 TARGET = waterslide-android30
 PROTOBUFS = init-config.proto monitor.proto
-SRCSC = main.c audio-linux.c sender.c receiver.c globals.c utils.c mux.c demux.c endpoint.c pcm.c event-recorder.c
-SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/receiver-sync.cpp config.cpp monitor.cpp $(subst .proto,.pb.cpp,$(addprefix protobufs/,$(PROTOBUFS)))
+SRCSC = main.c audio-linux.c sender.c receiver.c globals.c utils.c mux.c demux.c endpoint.c peer-cache.c pcm.c lossless.c opus-group.c rt-arena.c sample-convert.c audio-meter.c event-recorder.c
+SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/vari-resamp.cpp syncer/receiver-sync.cpp config.cpp monitor.cpp $(subst .proto,.pb.cpp,$(addprefix protobufs/,$(PROTOBUFS)))
 OBJS = $(subst .c,.o,$(addprefix src/,$(SRCSC))) $(subst .cpp,.o,$(addprefix src/,$(SRCSCPP)))
 
-.PHONY: setup
+.PHONY: setup bench
 
 all: setup protobufs bin/$(TARGET)
 
@@ -47,6 +47,21 @@ setup:
 bin/$(TARGET): $(OBJS)
 	$(CC) $(LDFLAGS) -o $@ $(subst src,obj,$(OBJS)) $(LIBS)
 
+# sample format conversion microbenchmark, see bench/sample-convert.c
+# mux/demux/syncer pipeline benchmark with a simulated lossy network, see bench/pipeline.c
+bench: bin/sample-convert-bench bin/pipeline-bench
+
+bin/sample-convert-bench: bench/sample-convert.c src/sample-convert.c
+	mkdir -p bin
+	$(CC) $(CFLAGS) $(LDFLAGS) -o $@ bench/sample-convert.c src/sample-convert.c
+
+PIPELINE_BENCH_SRCSC = globals.c utils.c mux.c demux.c pcm.c opus-group.c rt-arena.c sample-convert.c audio-meter.c event-recorder.c
+PIPELINE_BENCH_SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/vari-resamp.cpp syncer/receiver-sync.cpp
+PIPELINE_BENCH_OBJS = $(subst .c,.o,$(addprefix src/,$(PIPELINE_BENCH_SRCSC))) $(subst .cpp,.o,$(addprefix src/,$(PIPELINE_BENCH_SRCSCPP)))
+bin/pipeline-bench: setup $(PIPELINE_BENCH_OBJS)
+	mkdir -p bin
+	$(CC) $(CFLAGS) $(LDFLAGS) -o $@ bench/pipeline.c $(subst src,obj,$(PIPELINE_BENCH_OBJS)) $(LIBS)
+
 .c.o:
 	$(CC) $(CFLAGS) -c $< -o $(subst src,obj,$@)
 
@@ -59,3 +74,5 @@ clean:
 		$(subst .proto,.pb.cpp,$(addprefix src/protobufs/,$(PROTOBUFS))) \
 		$(subst .proto,.pb.h,$(addprefix include/protobufs/,$(PROTOBUFS))) \
 		bin/$(TARGET) \
+		bin/sample-convert-bench \
+		bin/pipeline-bench \
@@ -0,0 +1,331 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Benchmark for the two endpoint network backends over loopback UDP, Linux only.
+// receive: a blaster thread floods endpointCount sockets, the receiving thread drains them with poll + recvmmsg
+//   (dataLoopPoll) or with one multishot recv per socket on an io_uring with provided buffers (dataLoopUring).
+// send: batches of ENDPOINT_BATCH_LEN packets to every endpoint with one sendmmsg per endpoint (flushSendBatch),
+//   or as linked SENDMSG SQEs for all endpoints with one io_uring_enter (flushSendBatchUring).
+// Packets per CPU second is the packet count divided by the CPU time of the thread being measured, i.e. how many
+// packets one core could handle.
+// Build with: make -f linux-x64.mk bench
+// Run with: bin/endpoint-io-bench [endpointCount] [packetLen] [seconds]
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "uring.h"
+
+#define DEFAULT_ENDPOINT_COUNT 2
+#define DEFAULT_PACKET_LEN 1200
+#define DEFAULT_SECONDS 3.0
+#define MAX_ENDPOINTS 16 // same as globals.h
+#define BATCH_LEN 32 // ENDPOINT_BATCH_LEN
+#define RECV_BUF_LEN 1500
+#define RECV_BUF_COUNT 256 // URING_RECV_BUF_COUNT
+#define RING_ENTRIES 256 // URING_DATA_RING_ENTRIES
+
+static int endpointCount, packetLen;
+static double seconds;
+static int recvSocks[MAX_ENDPOINTS];
+static struct sockaddr_in recvAddrs[MAX_ENDPOINTS];
+static int sendSocks[MAX_ENDPOINTS];
+static uint8_t packet[RECV_BUF_LEN];
+static atomic_bool blasting;
+
+typedef struct {
+  long long packets;
+  double wallS, cpuS;
+} result_t;
+
+static double getS (clockid_t clock) {
+  struct timespec tsp;
+  clock_gettime(clock, &tsp);
+  return tsp.tv_sec + tsp.tv_nsec / 1e9;
+}
+
+static int openSocket (struct sockaddr_in *addr) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) return -1;
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(struct sockaddr_in);
+  if (bind(sock, (struct sockaddr *)addr, addrLen) < 0 || getsockname(sock, (struct sockaddr *)addr, &addrLen) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// same setup as the msghdrs in flushSendBatch
+static void fillMsgs (struct mmsghdr *msgs, struct iovec *iovec, struct sockaddr_in *addr) {
+  iovec->iov_base = packet;
+  iovec->iov_len = packetLen;
+  for (int i = 0; i < BATCH_LEN; i++) {
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_iov = iovec;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+}
+
+static void *blastLoop (void *arg) {
+  (void)arg;
+  static struct mmsghdr msgs[MAX_ENDPOINTS][BATCH_LEN];
+  static struct iovec iovecs[MAX_ENDPOINTS];
+  for (int i = 0; i < endpointCount; i++) fillMsgs(msgs[i], &iovecs[i], &recvAddrs[i]);
+
+  while (atomic_load(&blasting)) {
+    for (int i = 0; i < endpointCount; i++) sendmmsg(sendSocks[i], msgs[i], BATCH_LEN, 0);
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// receive
+////////////////////////////////////////////////////////////////////////////////
+
+static long long recvPoll (double endS) {
+  static uint8_t bufs[BATCH_LEN][RECV_BUF_LEN];
+  static struct sockaddr_in addrs[BATCH_LEN];
+  static struct iovec iovecs[BATCH_LEN];
+  static struct mmsghdr msgs[BATCH_LEN];
+  for (int i = 0; i < BATCH_LEN; i++) {
+    iovecs[i].iov_base = bufs[i];
+    iovecs[i].iov_len = RECV_BUF_LEN;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+  }
+
+  long long packets = 0;
+  struct pollfd pfds[MAX_ENDPOINTS];
+  while (getS(CLOCK_MONOTONIC) < endS) {
+    // rebuilt every time, like dataLoopPoll
+    for (int i = 0; i < endpointCount; i++) {
+      pfds[i].fd = recvSocks[i];
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds, endpointCount, 10) <= 0) continue;
+
+    for (int i = 0; i < endpointCount; i++) {
+      if (!(pfds[i].revents & POLLIN)) continue;
+      for (int j = 0; j < BATCH_LEN; j++) msgs[j].msg_hdr.msg_namelen = sizeof(addrs[j]);
+      int recvCount = recvmmsg(recvSocks[i], msgs, BATCH_LEN, MSG_DONTWAIT, NULL);
+      if (recvCount > 0) packets += recvCount;
+    }
+  }
+  return packets;
+}
+
+static long long recvUring (double endS) {
+  uring_t ring;
+  int err = uring_init(&ring, RING_ENTRIES, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+  if (err == 0) err = uring_registerFiles(&ring, endpointCount);
+  if (err == 0) err = uring_initBufRing(&ring, 0, RECV_BUF_COUNT, RECV_BUF_LEN);
+  for (int i = 0; err == 0 && i < endpointCount; i++) err = uring_updateFile(&ring, i, recvSocks[i]);
+  if (err < 0) {
+    printf("io_uring setup failed: %s\n", strerror(-err));
+    uring_deinit(&ring);
+    return -1;
+  }
+
+  bool armed[MAX_ENDPOINTS] = { 0 };
+  long long packets = 0;
+  while (getS(CLOCK_MONOTONIC) < endS) {
+    for (int i = 0; i < endpointCount; i++) {
+      if (armed[i]) continue;
+      struct io_uring_sqe *sqe = uring_getSqe(&ring);
+      if (sqe == NULL) break;
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = i;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->buf_group = 0;
+      sqe->user_data = i;
+      armed[i] = true;
+    }
+
+    if (uring_submitAndWait(&ring, 1, 10000) < 0) break;
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peekCqe(&ring)) != NULL) {
+      int i = cqe->user_data;
+      if (!(cqe->flags & IORING_CQE_F_MORE)) armed[i] = false;
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        if (cqe->res > 0) packets++;
+        uring_recycleBuf(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      }
+      uring_advanceCq(&ring);
+    }
+  }
+
+  uring_deinit(&ring);
+  return packets;
+}
+
+static result_t runRecv (long long (*fn) (double)) {
+  // drain anything left over from the last run
+  uint8_t buf[RECV_BUF_LEN];
+  for (int i = 0; i < endpointCount; i++) {
+    while (recv(recvSocks[i], buf, sizeof(buf), MSG_DONTWAIT) > 0);
+  }
+
+  pthread_t blastThread;
+  atomic_store(&blasting, true);
+  pthread_create(&blastThread, NULL, blastLoop, NULL);
+
+  result_t result;
+  double startS = getS(CLOCK_MONOTONIC);
+  double startCpuS = getS(CLOCK_THREAD_CPUTIME_ID);
+  result.packets = fn(startS + seconds);
+  result.cpuS = getS(CLOCK_THREAD_CPUTIME_ID) - startCpuS;
+  result.wallS = getS(CLOCK_MONOTONIC) - startS;
+
+  atomic_store(&blasting, false);
+  pthread_join(blastThread, NULL);
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// send
+////////////////////////////////////////////////////////////////////////////////
+
+static long long sendMmsg (double endS) {
+  static struct mmsghdr msgs[MAX_ENDPOINTS][BATCH_LEN];
+  static struct iovec iovecs[MAX_ENDPOINTS];
+  for (int i = 0; i < endpointCount; i++) fillMsgs(msgs[i], &iovecs[i], &recvAddrs[i]);
+
+  long long packets = 0;
+  while (getS(CLOCK_MONOTONIC) < endS) {
+    for (int i = 0; i < endpointCount; i++) {
+      int sentCount = 0;
+      while (sentCount < BATCH_LEN) {
+        int result = sendmmsg(sendSocks[i], &msgs[i][sentCount], BATCH_LEN - sentCount, MSG_DONTWAIT);
+        if (result < 0) break;
+        sentCount += result;
+      }
+      packets += sentCount;
+    }
+  }
+  return packets;
+}
+
+static long long sendUring (double endS) {
+  static struct mmsghdr msgs[MAX_ENDPOINTS][BATCH_LEN];
+  static struct iovec iovecs[MAX_ENDPOINTS];
+  for (int i = 0; i < endpointCount; i++) fillMsgs(msgs[i], &iovecs[i], &recvAddrs[i]);
+
+  uring_t ring;
+  int err = uring_init(&ring, endpointCount * BATCH_LEN, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+  if (err == 0) err = uring_registerFiles(&ring, endpointCount);
+  for (int i = 0; err == 0 && i < endpointCount; i++) err = uring_updateFile(&ring, i, sendSocks[i]);
+  if (err < 0) {
+    printf("io_uring setup failed: %s\n", strerror(-err));
+    uring_deinit(&ring);
+    return -1;
+  }
+
+  long long packets = 0;
+  while (getS(CLOCK_MONOTONIC) < endS) {
+    int queuedCount = 0;
+    for (int i = 0; i < endpointCount; i++) {
+      for (int j = 0; j < BATCH_LEN; j++) {
+        struct io_uring_sqe *sqe = uring_getSqe(&ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = i;
+        sqe->flags = IOSQE_FIXED_FILE | (j < BATCH_LEN - 1 ? IOSQE_IO_LINK : 0);
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[i][j].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        queuedCount++;
+      }
+    }
+
+    int completedCount = 0;
+    err = uring_submitAndWait(&ring, queuedCount, -1);
+    while (err >= 0 && completedCount < queuedCount) {
+      struct io_uring_cqe *cqe = uring_peekCqe(&ring);
+      if (cqe == NULL) {
+        err = uring_submitAndWait(&ring, queuedCount - completedCount, -1);
+        continue;
+      }
+      if (cqe->res >= 0) packets++;
+      uring_advanceCq(&ring);
+      completedCount++;
+    }
+    if (err < 0) break;
+  }
+
+  uring_deinit(&ring);
+  return packets;
+}
+
+static result_t runSend (long long (*fn) (double)) {
+  result_t result;
+  double startS = getS(CLOCK_MONOTONIC);
+  double startCpuS = getS(CLOCK_THREAD_CPUTIME_ID);
+  result.packets = fn(startS + seconds);
+  result.cpuS = getS(CLOCK_THREAD_CPUTIME_ID) - startCpuS;
+  result.wallS = getS(CLOCK_MONOTONIC) - startS;
+  return result;
+}
+
+static void printResult (const char *name, result_t result) {
+  if (result.packets < 0) {
+    printf("  %-18s not available\n", name);
+    return;
+  }
+  printf("  %-18s %12.0f %12.0f\n", name, result.packets / result.wallS, result.cpuS > 0.0 ? result.packets / result.cpuS : 0.0);
+}
+
+int main (int argc, char *argv[]) {
+  endpointCount = argc > 1 ? atoi(argv[1]) : DEFAULT_ENDPOINT_COUNT;
+  packetLen = argc > 2 ? atoi(argv[2]) : DEFAULT_PACKET_LEN;
+  seconds = argc > 3 ? atof(argv[3]) : DEFAULT_SECONDS;
+  if (endpointCount <= 0 || endpointCount > MAX_ENDPOINTS || packetLen <= 0 || packetLen > RECV_BUF_LEN || seconds <= 0.0) {
+    printf("Usage: %s [endpointCount (1 to %d)] [packetLen (1 to %d)] [seconds]\n", argv[0], MAX_ENDPOINTS, RECV_BUF_LEN);
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < endpointCount; i++) {
+    struct sockaddr_in sendAddr;
+    recvSocks[i] = openSocket(&recvAddrs[i]);
+    sendSocks[i] = openSocket(&sendAddr);
+    if (recvSocks[i] < 0 || sendSocks[i] < 0) {
+      printf("Could not open loopback sockets: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+  memset(packet, 0x5a, sizeof(packet));
+
+  printf("%d endpoints, %d byte packets, %.1f s per run, %ld CPUs online\n", endpointCount, packetLen, seconds, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  %-18s %12s %12s\n", "", "packets/s", "per CPU s");
+
+  printf("receive\n");
+  printResult("poll + recvmmsg", runRecv(recvPoll));
+  printResult("io_uring", runRecv(recvUring));
+
+  printf("send, %d packets per endpoint per batch\n", BATCH_LEN);
+  printResult("sendmmsg", runSend(sendMmsg));
+  printResult("io_uring", runSend(sendUring));
+
+  return EXIT_SUCCESS;
+}
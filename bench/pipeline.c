@@ -0,0 +1,728 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Benchmark for the audio path (codec, mux, FEC, demux, syncer) without sound cards or a network.
+// source: a thread makes a sine wave in real time, encodes each frame with PCM or Opus and passes it to mux, as
+//   startAudioLoop in sender.c does. Only the audio channel is set up, there is no config channel.
+// network: the mux packet thread hands every packet to each simulated link (endpoint), which drops it (Gilbert-Elliott
+//   burst loss), delays it (fixed delay + uniform jitter), holds some packets back so they arrive out of order, and
+//   duplicates some. The link thread passes the packets to demux_readPacket when they are due, like endpoint.c.
+// receiver: the demux decode thread decodes each frame into the syncer, filling lost frames with silence (PCM) or
+//   Opus PLC/FEC like receiver.c, and a sink thread pulls from the decode ring like dmaBufWrite in audio-linux.c.
+// Reported: packets/s, CPU time per stage (% of one core), source to decode latency percentiles of the frames, lost
+//   and late frames, and decode ring underruns and overruns.
+// With speed > 1 everything runs that many times faster, including the link delays, to measure how much one core
+// can handle. The syncer receiver sync still sees real time then, so leave speed at 1 to measure underruns.
+// Build with: make -f <platform>.mk bench
+// Run with: bin/pipeline-bench [option=value ...], e.g. bin/pipeline-bench links=2 loss=2,0.5 burst=3 jitter=1000
+// Link options take one value for every link, or a comma separated list with one value per link.
+// bin/pipeline-bench help lists the options and their defaults.
+
+// first, it sets _GNU_SOURCE on Linux (also for M_PI)
+#include "xwait.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "globals.h"
+#include "utils.h"
+#include "rt-arena.h"
+#include "sample-convert.h"
+#include "sample-ring.h"
+#include "mux.h"
+#include "demux.h"
+#include "pcm.h"
+#include "opus-group.h"
+#include "syncer.h"
+#include "audio.h"
+
+#define MAX_LINKS MAX_ENDPOINTS
+#define LINK_QUEUE_LEN 8192 // packets in flight on all links, more are counted as queue overflows
+#define LINK_POLL_NS 100000 // the link thread checks for new packets at least this often, or every delay if longer
+#define DRAIN_NS 200000000LL // after the source stops, how long to wait for the packets still in flight
+#define SINE_HZ 440.0
+#define SINE_LEVEL 0.5
+
+enum { STAGE_SOURCE, STAGE_MUX_PACKET, STAGE_LINK, STAGE_DECODE, STAGE_SINK, STAGE_COUNT };
+static const char *stageNames[STAGE_COUNT] = { "source (encode)", "mux packet", "link", "decode (FEC + codec + syncer)", "sink" };
+
+typedef struct {
+  const char *name;
+  char type; // 'i' int, 'd' double, 's' string
+  void *value; // an array of MAX_LINKS values if perLink
+  bool perLink;
+  const char *help;
+} option_t;
+
+// options, see the table in main
+static double seconds = 10.0, speed = 1.0;
+static char codec[16] = "pcm";
+static int channelCount = 2, sampleRate = 48000, frameSize = 240, crcMode = 0;
+static int bitrate = 128000, groupCount = 1, inbandFecLossPerc = 0;
+static int symbolLen = 256, sourceSymbols = 6, repairSymbols = 3, pacedSend = 0, streamPartialBlocks = 0;
+static int maxPacketSize = 1500, decodeRingLength = 8192, sinkFrames = 128, resamplerMode = SYNCER_RESAMPLER_CROSSFADE;
+static int decodeWorkerCount = 1, linkCount = 1, seed = 1;
+static double linkLoss[MAX_LINKS], linkBurst[MAX_LINKS], linkDelayUs[MAX_LINKS], linkJitterUs[MAX_LINKS];
+static double linkReorder[MAX_LINKS], linkReorderUs[MAX_LINKS], linkDup[MAX_LINKS];
+
+// only accessed by the mux packet thread, except the counters which are read at the end
+typedef struct {
+  uint64_t rand;
+  bool bad; // Gilbert-Elliott state
+  long long sentCount, lostCount, dupCount, reorderCount, overflowCount;
+} link_t;
+
+typedef struct {
+  int64_t dueNs;
+  uint64_t order; // packets due at the same time are delivered in the order they were sent
+  int linkIndex;
+  size_t len;
+  uint8_t *buf;
+} delivery_t;
+
+static link_t links[MAX_LINKS];
+static delivery_t deliveries[LINK_QUEUE_LEN];
+static int heap[LINK_QUEUE_LEN], heapLen = 0; // deliveries in flight, soonest first
+static int freeSlots[LINK_QUEUE_LEN], freeSlotCount = 0;
+static uint64_t deliveryOrder = 0;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool isOpus;
+static int encodedPacketSize, totalFrames;
+static int64_t *sendNs; // per frame, written by the source thread before mux_writeData
+static int *latenciesUs; // per frame received, decode thread only
+static opusgroup_t opusEncoder, opusDecoder;
+static pcm_codec_t pcmEncoder = { 0 }, pcmDecoder = { 0 };
+static samplering_t decodeRing;
+static float *decodeSamples;
+static int maxConcealedFrames;
+
+static atomic_bool sourceRunning, sinkRunning, linkRunning;
+static atomic_llong stageStartCpuNs[STAGE_COUNT], stageCpuNs[STAGE_COUNT];
+static atomic_llong muxPacketCount, deliveredCount, demuxErrorCount;
+static long long muxBlockCount = 0; // mux packet thread only, read at the end
+static int lastMuxSbn = -1;
+// decode thread only, read at the end
+static long long receivedFrameCount = 0, lostFrameCount = 0, lateFrameCount = 0, decodeErrorCount = 0, overrunCount = 0;
+static int lastFrameIndex = -1;
+static uint16_t lastSeq = 0;
+// sink thread only, read at the end
+static long long underrunCount = 0, sinkCallbackCount = 0;
+
+// needed by utils_setCallerThreadRealtime on macOS, the sink period stands in for the device latency
+double audio_getDeviceLatency (void) {
+  return (double)sinkFrames / sampleRate;
+}
+
+static int64_t getCpuNs (clockid_t clock) {
+  struct timespec tsp;
+  clock_gettime(clock, &tsp);
+  return (int64_t)tsp.tv_sec * 1000000000LL + tsp.tv_nsec;
+}
+
+// the CPU time of the calling thread between the first and the latest call, for the threads that keep running after
+// processCpuS is measured in main
+static void updateStageCpu (int stage) {
+  int64_t cpuNs = getCpuNs(CLOCK_THREAD_CPUTIME_ID);
+  if (atomic_load_explicit(&stageStartCpuNs[stage], memory_order_relaxed) == 0) {
+    atomic_store_explicit(&stageStartCpuNs[stage], cpuNs, memory_order_relaxed);
+  }
+  atomic_store_explicit(&stageCpuNs[stage], cpuNs, memory_order_relaxed);
+}
+
+// xorshift64*, between 0 and 1
+static double randUnit (link_t *link) {
+  link->rand ^= link->rand >> 12;
+  link->rand ^= link->rand << 25;
+  link->rand ^= link->rand >> 27;
+  return (double)((link->rand * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/////////////////////
+// network
+/////////////////////
+
+static bool heapLess (int a, int b) {
+  const delivery_t *da = &deliveries[heap[a]], *db = &deliveries[heap[b]];
+  return da->dueNs < db->dueNs || (da->dueNs == db->dueNs && da->order < db->order);
+}
+
+static void heapSwap (int a, int b) {
+  int tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+// queueLock must be held
+static void heapPush (int slot) {
+  int i = heapLen++;
+  heap[i] = slot;
+  while (i > 0 && heapLess(i, (i - 1) / 2)) {
+    heapSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+// queueLock must be held
+static int heapPop (void) {
+  int slot = heap[0];
+  heap[0] = heap[--heapLen];
+  int i = 0;
+  while (true) {
+    int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < heapLen && heapLess(left, smallest)) smallest = left;
+    if (right < heapLen && heapLess(right, smallest)) smallest = right;
+    if (smallest == i) break;
+    heapSwap(i, smallest);
+    i = smallest;
+  }
+  return slot;
+}
+
+// two state Gilbert-Elliott model: every packet is lost in the bad state and none in the good state, the chance of
+// staying in the bad state sets the average burst length and the chance of entering it sets the average loss
+static bool isLost (link_t *link, double lossPerc, double burstLen) {
+  double loss = lossPerc / 100.0;
+  if (loss <= 0.0) return false;
+  if (loss >= 1.0) return true;
+
+  double leaveBad = 1.0 / (burstLen < 1.0 ? 1.0 : burstLen);
+  double enterBad = loss * leaveBad / (1.0 - loss);
+  link->bad = randUnit(link) < (link->bad ? 1.0 - leaveBad : enterBad);
+  return link->bad;
+}
+
+static void sendOnLink (int linkIndex, const uint8_t *buf, size_t len, int64_t nowNs) {
+  link_t *link = &links[linkIndex];
+  double delayUs = linkDelayUs[linkIndex] + linkJitterUs[linkIndex] * randUnit(link);
+  if (randUnit(link) < linkReorder[linkIndex] / 100.0) {
+    delayUs += linkReorderUs[linkIndex];
+    link->reorderCount++;
+  }
+
+  pthread_mutex_lock(&queueLock);
+  if (freeSlotCount == 0) {
+    pthread_mutex_unlock(&queueLock);
+    link->overflowCount++;
+    return;
+  }
+  int slot = freeSlots[--freeSlotCount];
+  delivery_t *delivery = &deliveries[slot];
+  delivery->dueNs = nowNs + (int64_t)(1000.0 * delayUs / speed);
+  delivery->order = deliveryOrder++;
+  delivery->linkIndex = linkIndex;
+  delivery->len = len;
+  memcpy(delivery->buf, buf, len);
+  heapPush(slot);
+  pthread_mutex_unlock(&queueLock);
+}
+
+// mux packet thread, in place of endpoint_send
+static int onMuxPacket (uint8_t *buf, size_t len) {
+  int64_t nowNs = utils_getMonotonicNs();
+  atomic_fetch_add_explicit(&muxPacketCount, 1, memory_order_relaxed);
+
+  // count blocks by their SBN, the bench only has chId 0: flags, chId, then a chunk starting with the SBN
+  if (len >= 3 && buf[2] != lastMuxSbn) {
+    lastMuxSbn = buf[2];
+    muxBlockCount++;
+  }
+
+  for (int i = 0; i < linkCount; i++) {
+    link_t *link = &links[i];
+    link->sentCount++;
+    if (isLost(link, linkLoss[i], linkBurst[i])) {
+      link->lostCount++;
+      continue;
+    }
+
+    sendOnLink(i, buf, len, nowNs);
+    if (randUnit(link) < linkDup[i] / 100.0) {
+      sendOnLink(i, buf, len, nowNs);
+      link->dupCount++;
+    }
+  }
+
+  updateStageCpu(STAGE_MUX_PACKET);
+  return 0;
+}
+
+static void *startLinkThread (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_NETWORK, 0, 98, 0);
+
+  // a packet sent from now on can't be due before the shortest link delay, so there is no need to wake up sooner
+  double minDelayUs = linkDelayUs[0];
+  for (int i = 1; i < linkCount; i++) {
+    if (linkDelayUs[i] < minDelayUs) minDelayUs = linkDelayUs[i];
+  }
+  int64_t pollNs = (int64_t)(1000.0 * minDelayUs / speed);
+  if (pollNs < LINK_POLL_NS) pollNs = LINK_POLL_NS;
+
+  while (atomic_load(&linkRunning)) {
+    int64_t nowNs = utils_getMonotonicNs();
+    int64_t nextNs = nowNs + pollNs;
+
+    pthread_mutex_lock(&queueLock);
+    while (heapLen > 0 && deliveries[heap[0]].dueNs <= nowNs) {
+      int slot = heapPop();
+      pthread_mutex_unlock(&queueLock);
+
+      delivery_t *delivery = &deliveries[slot];
+      if (demux_readPacket(delivery->buf, delivery->len, delivery->linkIndex) < 0) {
+        atomic_fetch_add_explicit(&demuxErrorCount, 1, memory_order_relaxed);
+      }
+      atomic_fetch_add_explicit(&deliveredCount, 1, memory_order_relaxed);
+
+      pthread_mutex_lock(&queueLock);
+      freeSlots[freeSlotCount++] = slot;
+    }
+    if (heapLen > 0 && deliveries[heap[0]].dueNs < nextNs) nextNs = deliveries[heap[0]].dueNs;
+    pthread_mutex_unlock(&queueLock);
+
+    updateStageCpu(STAGE_LINK);
+    utils_sleepUntilNs(nextNs);
+  }
+
+  return NULL;
+}
+
+/////////////////////
+// sender
+/////////////////////
+
+static void *startSourceThread (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_ENCODE, 0, 98, 2);
+  int64_t startCpuNs = getCpuNs(CLOCK_THREAD_CPUTIME_ID);
+
+  float *samples = (float *)rtarena_alloc(sizeof(float) * channelCount * frameSize);
+  uint8_t *encodedBuf = (uint8_t *)rtarena_alloc(encodedPacketSize);
+  if (samples == NULL || encodedBuf == NULL) return NULL;
+
+  const double phaseStep = 2.0 * M_PI * SINE_HZ / sampleRate;
+  const int64_t periodNs = (int64_t)(1e9 * frameSize / sampleRate / speed);
+  const int64_t startNs = utils_getMonotonicNs();
+  double phase = 0.0;
+
+  for (int frameIndex = 0; frameIndex < totalFrames && atomic_load(&sourceRunning); frameIndex++) {
+    utils_sleepUntilNs(startNs + frameIndex * periodNs);
+
+    for (int i = 0; i < frameSize; i++) {
+      float sample = SINE_LEVEL * sin(phase);
+      for (int j = 0; j < channelCount; j++) samples[i * channelCount + j] = sample;
+      phase += phaseStep;
+    }
+    phase = fmod(phase, 2.0 * M_PI);
+
+    // same header as sender.c, the receive side only uses the sequence number here
+    utils_writeU16LE(encodedBuf, frameIndex & 0xffff);
+    utils_writeU16LE(&encodedBuf[2], 0);
+    utils_writeU32LE(&encodedBuf[4], (uint32_t)utils_getCurrentUTime());
+
+    uint8_t *payload = &encodedBuf[AUDIO_PACKET_HEADER_LEN];
+    int encodedLen = isOpus
+      ? opusgroup_encode(&opusEncoder, samples, payload)
+      : pcm_encode(&pcmEncoder, samples, channelCount * frameSize, payload);
+    if (encodedLen < 0) continue;
+
+    sendNs[frameIndex] = utils_getMonotonicNs();
+    mux_writeData(0, encodedBuf, encodedLen + AUDIO_PACKET_HEADER_LEN);
+  }
+
+  rtarena_free(samples);
+  rtarena_free(encodedBuf);
+  atomic_store(&stageStartCpuNs[STAGE_SOURCE], startCpuNs);
+  atomic_store(&stageCpuNs[STAGE_SOURCE], getCpuNs(CLOCK_THREAD_CPUTIME_ID));
+  return NULL;
+}
+
+/////////////////////
+// receiver
+/////////////////////
+
+static void enqueueDecoded (void) {
+  if (syncer_enqueueBufF32(decodeSamples, frameSize, channelCount, false) < 0) overrunCount++;
+}
+
+// demux decode thread, like onDataAudioChannel in receiver.c
+static void onData (const uint8_t *buf, int len) {
+  int64_t nowNs = utils_getMonotonicNs();
+  if (len < AUDIO_PACKET_HEADER_LEN) {
+    decodeErrorCount++;
+    return;
+  }
+
+  uint16_t seq = utils_readU16LE(buf);
+  int frameIndex = lastFrameIndex < 0 ? seq : lastFrameIndex + (int16_t)(seq - lastSeq);
+  if (frameIndex <= lastFrameIndex || frameIndex >= totalFrames) {
+    lateFrameCount++;
+    return;
+  }
+  int lostCount = lastFrameIndex < 0 ? 0 : frameIndex - lastFrameIndex - 1;
+  lastFrameIndex = frameIndex;
+  lastSeq = seq;
+  lostFrameCount += lostCount;
+  latenciesUs[receivedFrameCount++] = (int)((nowNs - sendNs[frameIndex]) / 1000);
+
+  syncer_onPacket(seq, frameSize);
+
+  const uint8_t *payload = &buf[AUDIO_PACKET_HEADER_LEN];
+  int payloadLen = len - AUDIO_PACKET_HEADER_LEN;
+  if (lostCount > maxConcealedFrames) lostCount = 0;
+
+  if (isOpus) {
+    for (int i = 0; i < lostCount; i++) {
+      if (opusgroup_decodeLost(&opusDecoder, i == lostCount - 1 ? payload : NULL, payloadLen, decodeSamples) >= 0) enqueueDecoded();
+    }
+    if (opusgroup_decode(&opusDecoder, payload, payloadLen, decodeSamples) < 0) {
+      decodeErrorCount++;
+    } else {
+      enqueueDecoded();
+    }
+  } else {
+    if (lostCount > 0) memset(decodeSamples, 0, sizeof(float) * channelCount * frameSize);
+    for (int i = 0; i < lostCount; i++) enqueueDecoded();
+
+    const uint8_t *pcmSamples;
+    if (pcm_decode(&pcmDecoder, payload, payloadLen, &pcmSamples) != channelCount * frameSize) {
+      decodeErrorCount++;
+    } else if (syncer_enqueueBufS24Packed(pcmSamples, frameSize, channelCount, false) < 0) {
+      overrunCount++;
+    }
+  }
+
+  // NOTE: the thread CPU time only adds up for one worker, with more the decode CPU shows up under other
+  if (decodeWorkerCount == 1) updateStageCpu(STAGE_DECODE);
+}
+
+// like dmaBufWrite in audio-linux.c
+static void *startSinkThread (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_AUDIO, 0, 99, 0);
+  int64_t startCpuNs = getCpuNs(CLOCK_THREAD_CPUTIME_ID);
+
+  const unsigned int sampleCount = channelCount * sinkFrames;
+  const unsigned int fullRingSize = channelCount * decodeRingLength;
+  samplering_sample_t *samples = (samplering_sample_t *)rtarena_alloc(sizeof(samplering_sample_t) * sampleCount);
+  if (samples == NULL) return NULL;
+
+  const int64_t periodNs = (int64_t)(1e9 * sinkFrames / sampleRate / speed);
+  const int64_t startNs = utils_getMonotonicNs();
+  bool ringUnderrun = true; // let ring fill to half before we start dequeuing
+
+  for (long long i = 0; atomic_load(&sinkRunning); i++) {
+    utils_sleepUntilNs(startNs + i * periodNs);
+    sinkCallbackCount++;
+
+    unsigned int ringCurrentSize = samplering_size(&decodeRing);
+    syncer_onAudio(sinkFrames);
+
+    if (ringUnderrun) {
+      if (ringCurrentSize < fullRingSize / 2) continue;
+      ringUnderrun = false;
+    }
+
+    if (ringCurrentSize < sampleCount) {
+      ringUnderrun = true;
+      underrunCount++;
+      continue;
+    }
+
+    samplering_read(&decodeRing, samples, sampleCount);
+  }
+
+  rtarena_free(samples);
+  atomic_store(&stageStartCpuNs[STAGE_SINK], startCpuNs);
+  atomic_store(&stageCpuNs[STAGE_SINK], getCpuNs(CLOCK_THREAD_CPUTIME_ID));
+  return NULL;
+}
+
+/////////////////////
+// setup and report
+/////////////////////
+
+static int parseOption (option_t *options, int optionCount, const char *arg) {
+  const char *eq = strchr(arg, '=');
+  if (eq == NULL) return -1;
+
+  for (int i = 0; i < optionCount; i++) {
+    option_t *opt = &options[i];
+    if (strncmp(arg, opt->name, eq - arg) != 0 || opt->name[eq - arg] != '\0') continue;
+
+    const char *value = eq + 1;
+    if (opt->type == 's') {
+      snprintf((char *)opt->value, sizeof(codec), "%s", value);
+      return 0;
+    }
+
+    // link options: one value per link, the last one is repeated for the rest
+    int count = 0;
+    char *end;
+    while (count < (opt->perLink ? MAX_LINKS : 1)) {
+      double x = strtod(value, &end);
+      if (end == value) return -2;
+      if (opt->type == 'i') {
+        ((int *)opt->value)[count++] = (int)x;
+      } else {
+        ((double *)opt->value)[count++] = x;
+      }
+      if (*end != ',') break;
+      value = end + 1;
+    }
+    if (*end != '\0') return -2;
+    for (int j = count; opt->perLink && j < MAX_LINKS; j++) ((double *)opt->value)[j] = ((double *)opt->value)[count - 1];
+    return 0;
+  }
+
+  return -3;
+}
+
+static void printOptions (option_t *options, int optionCount) {
+  for (int i = 0; i < optionCount; i++) {
+    option_t *opt = &options[i];
+    if (opt->type == 's') {
+      printf("  %-16s %-10s %s\n", opt->name, (char *)opt->value, opt->help);
+    } else if (opt->type == 'i') {
+      printf("  %-16s %-10d %s\n", opt->name, *(int *)opt->value, opt->help);
+    } else {
+      printf("  %-16s %-10g %s%s\n", opt->name, *(double *)opt->value, opt->help, opt->perLink ? " (per link)" : "");
+    }
+  }
+}
+
+static int compareInts (const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static int percentile (const int *sorted, long long count, double p) {
+  if (count == 0) return 0;
+  long long i = (long long)ceil(p / 100.0 * count) - 1;
+  if (i < 0) i = 0;
+  if (i >= count) i = count - 1;
+  return sorted[i];
+}
+
+static int initPipeline (void) {
+  isOpus = strcmp(codec, "opus") == 0;
+  if (!isOpus && strcmp(codec, "pcm") != 0) return -1;
+
+  globals_set1i(audio, networkChannelCount, channelCount);
+  globals_set1i(audio, deviceChannelCount, channelCount);
+  globals_set1i(audio, networkSampleRate, sampleRate);
+  globals_set1ff(audio, deviceSampleRate, sampleRate);
+  globals_set1i(audio, decodeRingLength, decodeRingLength);
+  globals_set1i(audio, resamplerMode, resamplerMode);
+  globals_set1ui(audio, encoding, isOpus ? AUDIO_ENCODING_OPUS : AUDIO_ENCODING_PCM);
+  globals_set1ui(mux, maxPacketSize, maxPacketSize);
+
+  if (isOpus) {
+    if (opusgroup_initEncoder(&opusEncoder, channelCount, groupCount, bitrate, frameSize) < 0) return -2;
+    if (opusgroup_setInbandFec(&opusEncoder, inbandFecLossPerc) < 0) return -2;
+    if (opusgroup_initDecoder(&opusDecoder, channelCount, groupCount, bitrate, frameSize) < 0) return -2;
+    encodedPacketSize = opusEncoder.dataLen + AUDIO_PACKET_HEADER_LEN;
+  } else {
+    pcm_init(&pcmEncoder, crcMode);
+    pcm_init(&pcmDecoder, crcMode);
+    encodedPacketSize = 3 * channelCount * frameSize + pcm_getCrcLen(crcMode) + AUDIO_PACKET_HEADER_LEN;
+  }
+  if (encodedPacketSize > symbolLen * sourceSymbols - 8) {
+    printf("A frame (%d bytes) doesn't fit in a block, increase symbolLen or source\n", encodedPacketSize);
+    return -3;
+  }
+
+  totalFrames = (int)(seconds * sampleRate / frameSize);
+  sendNs = (int64_t *)calloc(totalFrames, sizeof(int64_t));
+  latenciesUs = (int *)calloc(totalFrames, sizeof(int));
+  decodeSamples = (float *)rtarena_alloc(sizeof(float) * channelCount * frameSize);
+  if (sendNs == NULL || latenciesUs == NULL || decodeSamples == NULL) return -4;
+  maxConcealedFrames = decodeRingLength / 2 / frameSize;
+
+  for (int i = 0; i < LINK_QUEUE_LEN; i++) {
+    deliveries[i].buf = (uint8_t *)malloc(maxPacketSize);
+    if (deliveries[i].buf == NULL) return -4;
+    freeSlots[freeSlotCount++] = i;
+  }
+  for (int i = 0; i < linkCount; i++) links[i].rand = 0x9e3779b97f4a7c15ULL * (seed + i + 1);
+
+  // receiver first, so that nothing is enqueued before syncer_init
+  if (samplering_init(&decodeRing, channelCount * decodeRingLength) < 0) return -5;
+  int maxInBufFrames = frameSize > sinkFrames ? frameSize : sinkFrames;
+  if (syncer_init(sampleRate, sampleRate, maxInBufFrames, &decodeRing, channelCount * decodeRingLength) < 0) return -6;
+  if (demux_init(decodeWorkerCount) < 0) return -7;
+  if (demux_addChannel(encodedPacketSize, sourceSymbols, repairSymbols, symbolLen, pacedSend, streamPartialBlocks, onData) < 0) return -7;
+
+  if (mux_init(onMuxPacket, NULL, 0) < 0) return -8;
+  int chId = mux_addChannel(encodedPacketSize, sourceSymbols, repairSymbols, symbolLen, pacedSend);
+  if (chId < 0) return -9;
+  mux_setAnchorChannel(chId);
+
+  return 0;
+}
+
+// returns 1 if a check failed
+static int printReport (double wallS, double processCpuS, const double *stageCpuS) {
+  printf("\n%s, %d ch, %d frames @ %d Hz, FEC %d+%d x %d bytes%s%s, %d link%s, %.1f s at %gx\n",
+    isOpus ? "Opus" : "PCM", channelCount, frameSize, sampleRate, sourceSymbols, repairSymbols, symbolLen,
+    pacedSend ? ", paced" : "", streamPartialBlocks ? ", streamed" : "", linkCount, linkCount == 1 ? "" : "s", wallS, speed);
+
+  long long muxPackets = atomic_load(&muxPacketCount);
+  printf("packets: %.0f/s from mux, %.0f/s delivered, %lld demux errors\n",
+    muxPackets / wallS, atomic_load(&deliveredCount) / wallS, (long long)atomic_load(&demuxErrorCount));
+  for (int i = 0; i < linkCount; i++) {
+    link_t *link = &links[i];
+    double sent = link->sentCount > 0 ? link->sentCount : 1;
+    printf("  link %d: %.2f%% lost, %.2f%% reordered, %.2f%% duplicated, %lld queue overflows\n",
+      i, 100.0 * link->lostCount / sent, 100.0 * link->reorderCount / sent, 100.0 * link->dupCount / sent, link->overflowCount);
+  }
+
+  printf("frames: %d sent, %lld decoded, %lld lost, %lld late, %lld decode errors, %d still in flight\n",
+    totalFrames, receivedFrameCount, lostFrameCount, lateFrameCount, decodeErrorCount, totalFrames - lastFrameIndex - 1);
+  printf("decode ring: %lld underruns in %lld sink callbacks, %lld overruns\n", underrunCount, sinkCallbackCount, overrunCount);
+  unsigned int fastPathBlocks = globals_get1uiv(statsDemux, fastPathBlockCount, 0);
+  printf("demux: %u of %lld blocks on the fast path, %u out of order blocks, %u ring overruns\n",
+    fastPathBlocks, muxBlockCount, globals_get1uiv(statsDemux, oooBlockCount, 0), globals_get1uiv(statsDemux, ringOverrunCount, 0));
+
+  // with nothing lost or reordered, every block should be emitted from its source symbols without RaptorQ
+  int failed = 0;
+  bool cleanLinks = true;
+  for (int i = 0; i < linkCount; i++) {
+    if (linkLoss[i] > 0.0 || linkJitterUs[i] > 0.0 || linkReorder[i] > 0.0) cleanLinks = false;
+  }
+  if (cleanLinks && fastPathBlocks != muxBlockCount) {
+    printf("CHECK FAILED: no loss, but only %u of %lld blocks took the fast path\n", fastPathBlocks, muxBlockCount);
+    failed = 1;
+  }
+
+  qsort(latenciesUs, receivedFrameCount, sizeof(int), compareInts);
+  printf("source to decode latency (ms): p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+    percentile(latenciesUs, receivedFrameCount, 50) / 1000.0, percentile(latenciesUs, receivedFrameCount, 90) / 1000.0,
+    percentile(latenciesUs, receivedFrameCount, 99) / 1000.0, percentile(latenciesUs, receivedFrameCount, 99.9) / 1000.0,
+    percentile(latenciesUs, receivedFrameCount, 100) / 1000.0);
+
+  printf("CPU (%% of one core):\n");
+  double stagesS = 0.0;
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    stagesS += stageCpuS[i];
+    printf("  %-32s %6.2f\n", stageNames[i], 100.0 * stageCpuS[i] / wallS);
+  }
+  printf("  %-32s %6.2f\n", "other (FEC encode, syncer, Opus)", 100.0 * (processCpuS - stagesS) / wallS);
+  printf("  %-32s %6.2f (%.0f mux packets per CPU second)\n", "total", 100.0 * processCpuS / wallS, processCpuS > 0.0 ? muxPackets / processCpuS : 0.0);
+  return failed;
+}
+
+int main (int argc, char *argv[]) {
+  for (int i = 0; i < MAX_LINKS; i++) {
+    linkLoss[i] = 0.0;
+    linkBurst[i] = 1.0;
+    linkDelayUs[i] = 1000.0;
+    linkJitterUs[i] = 0.0;
+    linkReorder[i] = 0.0;
+    linkReorderUs[i] = 2000.0;
+    linkDup[i] = 0.0;
+  }
+
+  option_t options[] = {
+    { "seconds", 'd', &seconds, false, "length of the stream" },
+    { "speed", 'd', &speed, false, "run this many times faster than real time" },
+    { "codec", 's', codec, false, "pcm or opus" },
+    { "channels", 'i', &channelCount, false, "" },
+    { "rate", 'i', &sampleRate, false, "sample rate in Hz" },
+    { "frameSize", 'i', &frameSize, false, "samples per frame" },
+    { "crcMode", 'i', &crcMode, false, "PCM only, PCM_CRC_MODE_*" },
+    { "bitrate", 'i', &bitrate, false, "Opus only, in bits per second" },
+    { "groups", 'i', &groupCount, false, "Opus only, opus.groupCount" },
+    { "fecLoss", 'i', &inbandFecLossPerc, false, "Opus only, opus.inbandFecLossPerc" },
+    { "symbolLen", 'i', &symbolLen, false, "fec.symbolLen" },
+    { "source", 'i', &sourceSymbols, false, "fec.sourceSymbolsPerBlock" },
+    { "repair", 'i', &repairSymbols, false, "fec.repairSymbolsPerBlock" },
+    { "paced", 'i', &pacedSend, false, "fec.pacedSend" },
+    { "stream", 'i', &streamPartialBlocks, false, "fec.streamPartialBlocks" },
+    { "maxPacketSize", 'i', &maxPacketSize, false, "mux.maxPacketSize" },
+    { "decodeRing", 'i', &decodeRingLength, false, "audio.decodeRingLength, in samples" },
+    { "sinkFrames", 'i', &sinkFrames, false, "frames pulled from the decode ring per sink callback" },
+    { "resampler", 'i', &resamplerMode, false, "audio.resamplerMode, SYNCER_RESAMPLER_*" },
+    { "decodeWorkers", 'i', &decodeWorkerCount, false, "demux decode threads, decode CPU is only split out for 1" },
+    { "links", 'i', &linkCount, false, "every packet is sent on each link" },
+    { "seed", 'i', &seed, false, "for the link impairments" },
+    { "loss", 'd', linkLoss, true, "% of packets lost" },
+    { "burst", 'd', linkBurst, true, "average number of packets lost in a row" },
+    { "delay", 'd', linkDelayUs, true, "in us" },
+    { "jitter", 'd', linkJitterUs, true, "extra delay between 0 and this, in us" },
+    { "reorder", 'd', linkReorder, true, "% of packets held back by reorderDelay" },
+    { "reorderDelay", 'd', linkReorderUs, true, "in us" },
+    { "dup", 'd', linkDup, true, "% of packets sent twice" }
+  };
+  const int optionCount = sizeof(options) / sizeof(options[0]);
+
+  for (int i = 1; i < argc; i++) {
+    if (parseOption(options, optionCount, argv[i]) < 0) {
+      printf("Usage: %s [option=value ...]\n", argv[0]);
+      printOptions(options, optionCount);
+      return 1;
+    }
+  }
+  if (linkCount < 1 || linkCount > MAX_LINKS || seconds <= 0.0 || speed <= 0.0 || channelCount < 1 || frameSize < 1 || sinkFrames < 1 || decodeWorkerCount < 1) {
+    printf("links must be 1 to %d, seconds, speed, channels, frameSize, sinkFrames and decodeWorkers must be > 0\n", MAX_LINKS);
+    return 1;
+  }
+
+  sampleconvert_init();
+  utils_initCrc();
+  rtarena_init(0);
+
+  int err = initPipeline();
+  if (err < 0) {
+    printf("initPipeline failed: %d\n", err);
+    return 1;
+  }
+
+  pthread_t sourceThread, sinkThread, linkThread;
+  atomic_store(&sourceRunning, true);
+  atomic_store(&sinkRunning, true);
+  atomic_store(&linkRunning, true);
+  int64_t startNs = utils_getMonotonicNs();
+  int64_t startCpuNs = getCpuNs(CLOCK_PROCESS_CPUTIME_ID);
+  if (pthread_create(&linkThread, NULL, startLinkThread, NULL) != 0) return 1;
+  if (pthread_create(&sinkThread, NULL, startSinkThread, NULL) != 0) return 1;
+  if (pthread_create(&sourceThread, NULL, startSourceThread, NULL) != 0) return 1;
+
+  pthread_join(sourceThread, NULL);
+  // underruns after the source has stopped don't count
+  atomic_store(&sinkRunning, false);
+  pthread_join(sinkThread, NULL);
+  double wallS = (utils_getMonotonicNs() - startNs) / 1e9;
+  double processCpuS = (getCpuNs(CLOCK_PROCESS_CPUTIME_ID) - startCpuNs) / 1e9;
+  double stageCpuS[STAGE_COUNT];
+  for (int i = 0; i < STAGE_COUNT; i++) stageCpuS[i] = (atomic_load(&stageCpuNs[i]) - atomic_load(&stageStartCpuNs[i])) / 1e9;
+
+  // let the packets still on the links arrive, for the latency and loss counts
+  double maxDelayUs = 0.0;
+  for (int i = 0; i < linkCount; i++) {
+    double delayUs = linkDelayUs[i] + linkJitterUs[i] + linkReorderUs[i];
+    if (delayUs > maxDelayUs) maxDelayUs = delayUs;
+  }
+  utils_sleepUntilNs(utils_getMonotonicNs() + DRAIN_NS + (int64_t)(1000.0 * maxDelayUs / speed));
+  mux_deinit();
+  atomic_store(&linkRunning, false);
+  pthread_join(linkThread, NULL);
+  demux_deinit();
+  syncer_deinit();
+
+  int failed = printReport(wallS, processCpuS, stageCpuS);
+
+  if (isOpus) {
+    opusgroup_deinit(&opusEncoder);
+    opusgroup_deinit(&opusDecoder);
+  }
+  for (int i = 0; i < LINK_QUEUE_LEN; i++) free(deliveries[i].buf);
+  free(sendNs);
+  free(latenciesUs);
+  rtarena_deinit();
+  return failed;
+}
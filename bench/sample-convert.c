@@ -0,0 +1,215 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Microbenchmark for the sample format conversion kernels in src/sample-convert.c.
+// Each kernel is timed against the per-sample code it replaced (the ref* functions below, taken from the old
+// syncer_enqueueBuf, dmaBufWrite and pcm_encode), and its output is checked against the scalar kernel.
+// Build with: make -f <platform>.mk bench
+// Run with: bin/sample-convert-bench [frameCount] [channelCount]
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sample-convert.h"
+
+#define DEFAULT_FRAME_COUNT 512
+#define DEFAULT_CHANNEL_COUNT 16
+#define SAMPLES_PER_RUN 100000000LL // each measurement converts about this many samples
+
+enum FormatEnum { S16, S24, S32, F32 };
+
+static int sampleCount;
+static int16_t *bufS16;
+static uint8_t *bufS24;
+static int32_t *bufS32;
+static float *bufF32;
+static double *bufDouble;
+static uint8_t *outS24;
+static int32_t *outS32;
+static float *outF32;
+static const sampleconvert_kernels_t *kernels;
+
+static int64_t getNs (void) {
+  struct timespec tsp;
+  clock_gettime(CLOCK_MONOTONIC, &tsp);
+  return (int64_t)tsp.tv_sec * 1000000000LL + tsp.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// reference: the per-sample code the kernels replaced
+////////////////////////////////////////////////////////////////////////////////
+
+// old syncer_enqueueBuf: switch on the format inside the inner loop, branchy asymmetric scaling
+static void refToDouble (enum FormatEnum format) {
+  for (int i = 0; i < sampleCount; i++) {
+    switch (format) {
+      case S16: {
+        double sample = bufS16[i];
+        bufDouble[i] = sample > 0.0 ? sample/32767.0 : sample/32768.0;
+        break;
+      }
+      case S24: {
+        int32_t sampleInt = 0;
+        memcpy((uint8_t *)&sampleInt + 1, &bufS24[3*i], 3);
+        sampleInt >>= 8;
+        bufDouble[i] = sampleInt > 0 ? sampleInt/8388607.0 : sampleInt/8388608.0;
+        break;
+      }
+      case S32: {
+        double sample = bufS32[i];
+        bufDouble[i] = sample > 0.0 ? sample/2147483647.0 : sample/2147483648.0;
+        break;
+      }
+      case F32:
+        bufDouble[i] = bufF32[i];
+        break;
+    }
+  }
+}
+
+static void refS16ToF32 (void) { refToDouble(S16); }
+static void refS24ToF32 (void) { refToDouble(S24); }
+static void refS32ToF32 (void) { refToDouble(S32); }
+
+// old dmaBufWrite
+static void refF32ToS32 (void) {
+  for (int i = 0; i < sampleCount; i++) {
+    double outSampleDouble = bufF32[i];
+    if (outSampleDouble < -1.0) outSampleDouble = -1.0;
+    else if (outSampleDouble > 1.0) outSampleDouble = 1.0;
+    int32_t sampleInt = outSampleDouble > 0.0 ? 2147483647.0*outSampleDouble : 2147483648.0*outSampleDouble;
+    memcpy(&((uint8_t *)outS32)[4*i], &sampleInt, 4);
+  }
+}
+
+// old pcm_encode
+static void refF32ToS24 (void) {
+  for (int i = 0; i < sampleCount; i++) {
+    double sampleDouble = bufF32[i];
+    if (sampleDouble < -1.0) sampleDouble = -1.0;
+    else if (sampleDouble > 1.0) sampleDouble = 1.0;
+    int32_t sampleInt = sampleDouble > 0.0 ? 8388607.0 * sampleDouble : 8388608.0 * sampleDouble;
+    memcpy(&outS24[3*i], &sampleInt, 3);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// kernels, using the implementation in kernels
+////////////////////////////////////////////////////////////////////////////////
+
+static void runS16ToF32 (void) { kernels->s16ToF32(bufS16, outF32, sampleCount); }
+static void runS24ToF32 (void) { kernels->s24ToF32(bufS24, outF32, sampleCount); }
+static void runS32ToF32 (void) { kernels->s32ToF32(bufS32, outF32, sampleCount); }
+static void runF32ToS32 (void) { kernels->f32ToS32(bufF32, outS32, sampleCount); }
+static void runF32ToS24 (void) { kernels->f32ToS24(bufF32, outS24, sampleCount); }
+
+typedef struct {
+  const char *name;
+  void (*ref) (void);
+  void (*run) (void);
+  bool floatOut; // output is in outF32, otherwise outS32 or outS24
+  bool s24Out;
+} bench_t;
+
+static const bench_t benches[] = {
+  { "s16 -> f32", refS16ToF32, runS16ToF32, true, false },
+  { "s24 -> f32", refS24ToF32, runS24ToF32, true, false },
+  { "s32 -> f32", refS32ToF32, runS32ToF32, true, false },
+  { "f32 -> s32", refF32ToS32, runF32ToS32, false, false },
+  { "f32 -> s24", refF32ToS24, runF32ToS24, false, true }
+};
+
+// returns nanoseconds per sample
+static double timeFn (void (*fn) (void)) {
+  long long runs = SAMPLES_PER_RUN / sampleCount + 1;
+  fn(); // warm up
+  int64_t start = getNs();
+  for (long long i = 0; i < runs; i++) fn();
+  return (double)(getNs() - start) / (runs * sampleCount);
+}
+
+static int32_t readS24 (const uint8_t *buf, int i) {
+  int32_t sampleInt = 0;
+  memcpy((uint8_t *)&sampleInt + 1, &buf[3*i], 3);
+  return sampleInt >> 8;
+}
+
+// runs the current kernels and compares them with the scalar kernel, returns the largest difference
+static double maxDiffFromScalar (const bench_t *bench, float *scalarF32, int32_t *scalarS32, uint8_t *scalarS24) {
+  const sampleconvert_kernels_t *current = kernels;
+  kernels = sampleconvert_getKernels(SAMPLECONVERT_IMPL_SCALAR);
+  bench->run();
+  memcpy(scalarF32, outF32, sizeof(float) * sampleCount);
+  memcpy(scalarS32, outS32, sizeof(int32_t) * sampleCount);
+  memcpy(scalarS24, outS24, 3 * sampleCount);
+  kernels = current;
+  bench->run();
+
+  double maxDiff = 0.0;
+  for (int i = 0; i < sampleCount; i++) {
+    double diff;
+    if (bench->floatOut) diff = (double)outF32[i] - scalarF32[i];
+    else if (bench->s24Out) diff = readS24(outS24, i) - readS24(scalarS24, i);
+    else diff = (double)outS32[i] - scalarS32[i];
+    if (diff < 0) diff = -diff;
+    if (diff > maxDiff) maxDiff = diff;
+  }
+  return maxDiff;
+}
+
+int main (int argc, char *argv[]) {
+  int frameCount = argc > 1 ? atoi(argv[1]) : DEFAULT_FRAME_COUNT;
+  int channelCount = argc > 2 ? atoi(argv[2]) : DEFAULT_CHANNEL_COUNT;
+  if (frameCount <= 0 || channelCount <= 0) {
+    printf("Usage: %s [frameCount] [channelCount]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  sampleCount = frameCount * channelCount;
+
+  bufS16 = (int16_t *)malloc(sizeof(int16_t) * sampleCount);
+  bufS24 = (uint8_t *)malloc(3 * sampleCount);
+  bufS32 = (int32_t *)malloc(sizeof(int32_t) * sampleCount);
+  bufF32 = (float *)malloc(sizeof(float) * sampleCount);
+  bufDouble = (double *)malloc(sizeof(double) * sampleCount);
+  outS24 = (uint8_t *)malloc(3 * sampleCount);
+  outS32 = (int32_t *)malloc(sizeof(int32_t) * sampleCount);
+  outF32 = (float *)malloc(sizeof(float) * sampleCount);
+  float *scalarF32 = (float *)malloc(sizeof(float) * sampleCount);
+  int32_t *scalarS32 = (int32_t *)malloc(sizeof(int32_t) * sampleCount);
+  uint8_t *scalarS24 = (uint8_t *)malloc(3 * sampleCount);
+
+  // full scale noise, with some samples just outside (-1.0, 1.0) to exercise clamping
+  srand(1);
+  for (int i = 0; i < sampleCount; i++) {
+    int32_t x = (int32_t)((uint32_t)rand() << 16 ^ (uint32_t)rand());
+    bufS32[i] = x;
+    bufS16[i] = x >> 16;
+    int32_t x24 = x >> 8;
+    memcpy(&bufS24[3*i], &x24, 3);
+    bufF32[i] = 1.05f * (x > 0 ? x/2147483647.0f : x/2147483648.0f);
+  }
+
+  sampleconvert_init();
+  printf("%d frames x %d channels, sampleconvert_init picked: %s\n", frameCount, channelCount, sampleconvert_kernels->name);
+  printf("ns per sample, speedup relative to the reference, largest difference from the scalar kernel\n\n");
+
+  for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+    const bench_t *bench = &benches[b];
+    double refNs = timeFn(bench->ref);
+    printf("%s\n  %-10s %7.3f ns\n", bench->name, "reference", refNs);
+
+    for (int impl = 0; impl < SAMPLECONVERT_IMPL_COUNT; impl++) {
+      kernels = sampleconvert_getKernels(impl);
+      if (kernels == NULL) continue;
+      double ns = timeFn(bench->run);
+      double maxDiff = maxDiffFromScalar(bench, scalarF32, scalarS32, scalarS24);
+      printf("  %-10s %7.3f ns %6.2fx  max diff %g\n", kernels->name, ns, refNs / ns, maxDiff);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -3,8 +3,15 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
+#if defined(__linux__)
+// recvmmsg and sendmmsg are used to batch socket I/O on Linux
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdatomic.h>
@@ -27,20 +34,62 @@
 // 36     | remotePort
 
 #define SERVER_BIND_PORT 26172
-#define MAX_PEERS 1000
+#define MAX_PEERS 65536 // default, can be changed with the MAX_PEERS environment variable
 #define MAX_ENDPOINTS 5
 #define PEER_EXPIRY_TIME 5000000 // microseconds
 #define RECV_LOOP_IDLE_INTERVAL 1 // second
+#define MAX_SERVER_THREADS 64
+#define SHARD_COUNT 64 // must be a power of 2
+#define SHARD_SHIFT 58 // 64 - log2(SHARD_COUNT)
+#define TIMER_WHEEL_TICK 100000 // microseconds
+#define BATCH_LEN 32 // max requests received (and responses sent) per syscall
+
+// NOTES:
+// - The peer table is split into SHARD_COUNT shards by the hash of the public key. Each shard has its own lock,
+//   hash buckets (chained through peer_t.bucketNext) and timer wheel, so requests on different threads rarely wait
+//   for each other. A request locks the shard of myPubKey and then the shard of remotePubKey, never both at once.
+// - Each shard holds up to ceil(maxPeers / SHARD_COUNT) peers. Public keys are random so the shards fill evenly,
+//   but a shard can be full slightly before maxPeers is reached. New peers are ignored while their shard is full.
+// - Expiry uses a timer wheel with TIMER_WHEEL_TICK slots covering peerExpiryTime. Updating a peer moves it to the
+//   current slot, and everything still in a slot when the wheel comes back around to it has expired. This makes
+//   expiry O(expired peers) instead of a scan, and peers expire between peerExpiryTime and
+//   peerExpiryTime + TIMER_WHEEL_TICK after their last update.
+// - On Linux, each thread has its own socket bound with SO_REUSEPORT so the kernel spreads requests over the
+//   threads, and requests and responses are batched with recvmmsg and sendmmsg. Other platforms don't balance
+//   SO_REUSEPORT sockets like this, so they default to 1 thread.
 
 typedef struct {
   uint8_t myPubKey[32];
   struct sockaddr_in myAddrs[MAX_ENDPOINTS];
-  int lastUpdatedUTime;
+  int32_t bucketNext; // next peer in the same hash bucket, or the free list
+  int32_t wheelPrev, wheelNext; // neighbours in the same timer wheel slot
+  int32_t wheelSlot; // -1 if the peer is not in use
 } peer_t;
 
-static peer_t peerList[MAX_PEERS] = { 0 };
-static atomic_int serverSock = -1;
+typedef struct {
+  pthread_mutex_t lock;
+  peer_t *peers;
+  int32_t *buckets; // first peer in each bucket, -1 if empty
+  uint32_t bucketMask;
+  int32_t freeHead;
+  int32_t *wheel; // first peer in each slot, -1 if empty
+  int wheelPos;
+  int lastTickUTime;
+} shard_t;
+
+typedef struct {
+  int sock;
+  int sendCount;
+  uint8_t sendBufs[BATCH_LEN][38];
+  struct sockaddr_in sendAddrs[BATCH_LEN];
+} server_thread_t;
+
+static shard_t shards[SHARD_COUNT];
+static server_thread_t serverThreads[MAX_SERVER_THREADS];
 static int peerExpiryTime = PEER_EXPIRY_TIME;
+static int maxPeers = MAX_PEERS;
+static int wheelSlotCount;
+static uint64_t hashSeed;
 
 void utils_usleep (unsigned int us) {
   #if defined(__linux__) || defined(__ANDROID__)
@@ -67,15 +116,176 @@ int utils_getElapsedUTime (int lastUTime) {
   return intervalUTime < 0 ? intervalUTime + 1000000000 : intervalUTime;
 }
 
-static bool pubKeyMatch (const uint8_t *key1, const uint8_t *key2) {
-  for (int i = 0; i < 32; i++) {
-    if (key1[i] != key2[i]) return false;
+static int getEnvInt (const char *name, int defaultVal) {
+  char *str = getenv(name);
+  if (str == NULL) return defaultVal;
+  char *end;
+  int val = strtol(str, &end, 10);
+  return end == str ? defaultVal : val;
+}
+
+// splitmix64 finaliser
+static uint64_t mix64 (uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Seeded so that clients can't pick keys that all land in the same bucket
+static uint64_t hashPubKey (const uint8_t *key) {
+  uint64_t hash = hashSeed;
+  for (int i = 0; i < 4; i++) {
+    uint64_t word;
+    memcpy(&word, &key[8*i], 8);
+    hash = mix64(hash ^ word);
+  }
+  return hash;
+}
+
+static void initHashSeed (void) {
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (f == NULL || fread(&hashSeed, sizeof(hashSeed), 1, f) != 1) {
+    hashSeed = mix64((uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32));
   }
-  return true;
+  if (f != NULL) fclose(f);
 }
 
-static void sendRes (const struct sockaddr_in *yourAddr, const struct sockaddr_in *remoteAddr, const uint8_t *myPubKey, const uint8_t *remotePubKey) {
-  static uint8_t sendBuf[38];
+static int initShards (void) {
+  int shardCapacity = (maxPeers + SHARD_COUNT - 1) / SHARD_COUNT;
+  uint32_t bucketCount = 1;
+  while (bucketCount < 2 * (uint32_t)shardCapacity) bucketCount <<= 1;
+
+  wheelSlotCount = peerExpiryTime / TIMER_WHEEL_TICK + 1;
+  if (wheelSlotCount < 2) wheelSlotCount = 2;
+
+  for (int i = 0; i < SHARD_COUNT; i++) {
+    shard_t *shard = &shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->peers = calloc(shardCapacity, sizeof(peer_t));
+    shard->buckets = malloc(sizeof(int32_t) * bucketCount);
+    shard->wheel = malloc(sizeof(int32_t) * wheelSlotCount);
+    if (shard->peers == NULL || shard->buckets == NULL || shard->wheel == NULL) return -1;
+
+    shard->bucketMask = bucketCount - 1;
+    for (uint32_t j = 0; j < bucketCount; j++) shard->buckets[j] = -1;
+    for (int j = 0; j < wheelSlotCount; j++) shard->wheel[j] = -1;
+    for (int j = 0; j < shardCapacity; j++) {
+      shard->peers[j].wheelSlot = -1;
+      shard->peers[j].bucketNext = j + 1 < shardCapacity ? j + 1 : -1;
+    }
+    shard->freeHead = 0;
+    shard->wheelPos = 0;
+    shard->lastTickUTime = utils_getCurrentUTime();
+  }
+
+  return 0;
+}
+
+static void wheelUnlink (shard_t *shard, int32_t index) {
+  peer_t *peer = &shard->peers[index];
+  if (peer->wheelPrev != -1) shard->peers[peer->wheelPrev].wheelNext = peer->wheelNext;
+  else shard->wheel[peer->wheelSlot] = peer->wheelNext;
+  if (peer->wheelNext != -1) shard->peers[peer->wheelNext].wheelPrev = peer->wheelPrev;
+}
+
+// move the peer to the current wheel slot
+static void touchPeer (shard_t *shard, int32_t index) {
+  peer_t *peer = &shard->peers[index];
+  if (peer->wheelSlot == shard->wheelPos) return;
+  if (peer->wheelSlot != -1) wheelUnlink(shard, index);
+
+  peer->wheelSlot = shard->wheelPos;
+  peer->wheelPrev = -1;
+  peer->wheelNext = shard->wheel[shard->wheelPos];
+  if (peer->wheelNext != -1) shard->peers[peer->wheelNext].wheelPrev = index;
+  shard->wheel[shard->wheelPos] = index;
+}
+
+static void removePeer (shard_t *shard, int32_t index, uint64_t hash) {
+  peer_t *peer = &shard->peers[index];
+
+  int32_t *link = &shard->buckets[hash & shard->bucketMask];
+  while (*link != index) link = &shard->peers[*link].bucketNext;
+  *link = peer->bucketNext;
+
+  wheelUnlink(shard, index);
+
+  // Zero out everything for a bit more safety.
+  memset(peer, 0, sizeof(peer_t));
+  peer->wheelSlot = -1;
+  peer->bucketNext = shard->freeHead;
+  shard->freeHead = index;
+}
+
+// Remove the peers in every slot the wheel has moved onto since the last call. shard->lock must be held.
+static void advanceWheel (shard_t *shard) {
+  int ticks = utils_getElapsedUTime(shard->lastTickUTime) / TIMER_WHEEL_TICK;
+  if (ticks == 0) return;
+  shard->lastTickUTime = (shard->lastTickUTime + ticks * TIMER_WHEEL_TICK) % 1000000000;
+  if (ticks > wheelSlotCount) ticks = wheelSlotCount; // everything has expired
+
+  for (int i = 0; i < ticks; i++) {
+    if (++shard->wheelPos == wheelSlotCount) shard->wheelPos = 0;
+    while (shard->wheel[shard->wheelPos] != -1) {
+      int32_t index = shard->wheel[shard->wheelPos];
+      removePeer(shard, index, hashPubKey(shard->peers[index].myPubKey));
+    }
+  }
+}
+
+// returns -1 if not found
+static int32_t findPeer (shard_t *shard, const uint8_t *pubKey, uint64_t hash) {
+  int32_t index = shard->buckets[hash & shard->bucketMask];
+  while (index != -1 && memcmp(shard->peers[index].myPubKey, pubKey, 32) != 0) {
+    index = shard->peers[index].bucketNext;
+  }
+  return index;
+}
+
+// returns -1 if the shard is full
+static int32_t insertPeer (shard_t *shard, const uint8_t *pubKey, uint64_t hash) {
+  int32_t index = shard->freeHead;
+  if (index == -1) return -1;
+
+  peer_t *peer = &shard->peers[index];
+  shard->freeHead = peer->bucketNext;
+  memcpy(peer->myPubKey, pubKey, 32);
+  peer->bucketNext = shard->buckets[hash & shard->bucketMask];
+  shard->buckets[hash & shard->bucketMask] = index;
+  return index;
+}
+
+static void flushRes (server_thread_t *thread) {
+  if (thread->sendCount == 0) return;
+
+  #if defined(__linux__)
+  struct mmsghdr msgs[BATCH_LEN];
+  struct iovec iovecs[BATCH_LEN];
+  memset(msgs, 0, sizeof(struct mmsghdr) * thread->sendCount);
+  for (int i = 0; i < thread->sendCount; i++) {
+    iovecs[i].iov_base = thread->sendBufs[i];
+    iovecs[i].iov_len = sizeof(thread->sendBufs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &thread->sendAddrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+  // NOTE: responses that don't fit in the socket buffer are dropped, the client will ask again
+  sendmmsg(thread->sock, msgs, thread->sendCount, 0);
+  #else
+  for (int i = 0; i < thread->sendCount; i++) {
+    sendto(thread->sock, thread->sendBufs[i], sizeof(thread->sendBufs[i]), 0, (struct sockaddr*)&thread->sendAddrs[i], sizeof(struct sockaddr_in));
+  }
+  #endif
+
+  thread->sendCount = 0;
+}
+
+static void queueRes (server_thread_t *thread, const struct sockaddr_in *yourAddr, const struct sockaddr_in *remoteAddr, const uint8_t *myPubKey, const uint8_t *remotePubKey) {
+  if (thread->sendCount == BATCH_LEN) flushRes(thread);
+  uint8_t *sendBuf = thread->sendBufs[thread->sendCount];
 
   memcpy(&sendBuf[0], remotePubKey, 32);
   memcpy(&sendBuf[32], &remoteAddr->sin_addr.s_addr, 4);
@@ -86,21 +296,11 @@ static void sendRes (const struct sockaddr_in *yourAddr, const struct sockaddr_i
     sendBuf[32 + i] ^= myPubKey[i];
   }
 
-  sendto(serverSock, sendBuf, sizeof(sendBuf), 0, (struct sockaddr*)yourAddr, sizeof(struct sockaddr_in));
-}
-
-static void removePeerIfExpired (peer_t *peer) {
-  if (utils_getElapsedUTime(peer->lastUpdatedUTime) >= peerExpiryTime) {
-    // Zero out everything for a bit more safety.
-    memset(peer->myPubKey, 0, 32);
-    for (int j = 0; j < MAX_ENDPOINTS; j++) {
-      memset(&peer->myAddrs[j], 0, sizeof(struct sockaddr_in));
-    }
-    peer->lastUpdatedUTime = -1;
-  }
+  memcpy(&thread->sendAddrs[thread->sendCount], yourAddr, sizeof(struct sockaddr_in));
+  thread->sendCount++;
 }
 
-static void handleReq (const uint8_t *buf, ssize_t bufLen, const struct sockaddr_in *addr) {
+static void handleReq (server_thread_t *thread, const uint8_t *buf, ssize_t bufLen, const struct sockaddr_in *addr) {
   if (bufLen != 65) return;
   if (addr->sin_family != AF_INET) return; // No IPv6 support yet.
 
@@ -110,102 +310,180 @@ static void handleReq (const uint8_t *buf, ssize_t bufLen, const struct sockaddr
 
   if (endpointIndex >= MAX_ENDPOINTS) return;
 
-  int insertIndex = -1;
-  bool entryUpdated = false;
-  for (int i = 0; i < MAX_PEERS; i++) {
-    peer_t *peer = &peerList[i];
-
-    if (peer->lastUpdatedUTime == -1) {
-      insertIndex = i;
-      continue;
-    }
-
-    if (pubKeyMatch(myPubKey, peer->myPubKey)) {
-      // myPubKey is already in the peerList, update its address and port
-      memcpy(&peer->myAddrs[endpointIndex], addr, sizeof(struct sockaddr_in));
-      peer->lastUpdatedUTime = utils_getCurrentUTime();
-      entryUpdated = true;
-    }
+  // Insert or update the entry for myPubKey
+  uint64_t myHash = hashPubKey(myPubKey);
+  shard_t *shard = &shards[myHash >> SHARD_SHIFT];
+  pthread_mutex_lock(&shard->lock);
+  advanceWheel(shard);
+  int32_t index = findPeer(shard, myPubKey, myHash);
+  if (index == -1) index = insertPeer(shard, myPubKey, myHash);
+  if (index != -1) {
+    memcpy(&shard->peers[index].myAddrs[endpointIndex], addr, sizeof(struct sockaddr_in));
+    touchPeer(shard, index);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  // Look for the remotePubKey the requester is looking for
+  uint64_t remoteHash = hashPubKey(remotePubKey);
+  struct sockaddr_in remoteAddr;
+  bool found = false;
+  shard = &shards[remoteHash >> SHARD_SHIFT];
+  pthread_mutex_lock(&shard->lock);
+  advanceWheel(shard);
+  index = findPeer(shard, remotePubKey, remoteHash);
+  if (index != -1 && shard->peers[index].myAddrs[endpointIndex].sin_family != 0) {
+    memcpy(&remoteAddr, &shard->peers[index].myAddrs[endpointIndex], sizeof(struct sockaddr_in));
+    found = true;
+  }
+  pthread_mutex_unlock(&shard->lock);
 
-    if (pubKeyMatch(remotePubKey, peer->myPubKey)) {
-      // We found the remotePubKey the requester was looking for!
-      if (peer->myAddrs[endpointIndex].sin_family != 0) {
-        sendRes(addr, &peer->myAddrs[endpointIndex], myPubKey, remotePubKey);
-      }
-    }
+  if (found) queueRes(thread, addr, &remoteAddr, myPubKey, remotePubKey);
+}
 
-    removePeerIfExpired(peer);
+static void expireAllShards (void) {
+  for (int i = 0; i < SHARD_COUNT; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+    advanceWheel(&shards[i]);
+    pthread_mutex_unlock(&shards[i].lock);
   }
+}
 
-  if (!entryUpdated && insertIndex != -1) {
-    // Insert a new entry for myPubKey
-    memcpy(peerList[insertIndex].myPubKey, myPubKey, 32);
-    memcpy(&peerList[insertIndex].myAddrs[endpointIndex], addr, sizeof(struct sockaddr_in));
-    peerList[insertIndex].lastUpdatedUTime = utils_getCurrentUTime();
+// returns the number of requests received, or -1 with errno set
+static int recvReqs (server_thread_t *thread, uint8_t (*recvBufs)[1500], struct sockaddr_in *recvAddrs, ssize_t *recvLens) {
+  #if defined(__linux__)
+  struct mmsghdr msgs[BATCH_LEN];
+  struct iovec iovecs[BATCH_LEN];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < BATCH_LEN; i++) {
+    iovecs[i].iov_base = recvBufs[i];
+    iovecs[i].iov_len = sizeof(recvBufs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &recvAddrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+  // MSG_WAITFORONE: block (up to SO_RCVTIMEO) for the first request, then take whatever else is already queued
+  int recvCount = recvmmsg(thread->sock, msgs, BATCH_LEN, MSG_WAITFORONE, NULL);
+  for (int i = 0; i < recvCount; i++) {
+    recvLens[i] = msgs[i].msg_hdr.msg_namelen == sizeof(struct sockaddr_in) ? (ssize_t)msgs[i].msg_len : -1;
   }
+  return recvCount;
+  #else
+  socklen_t recvAddrLen = sizeof(struct sockaddr_in);
+  recvLens[0] = recvfrom(thread->sock, recvBufs[0], sizeof(recvBufs[0]), 0, (struct sockaddr*)&recvAddrs[0], &recvAddrLen);
+  if (recvLens[0] < 0) return -1;
+  if (recvAddrLen != sizeof(struct sockaddr_in)) recvLens[0] = -1;
+  return 1;
+  #endif
 }
 
-int main (void) {
-  static uint8_t recvBuf[1500] = { 0 };
-  static struct sockaddr_in recvAddr = { 0 };
+static void *serverLoop (void *arg) {
+  server_thread_t *thread = arg;
+  static _Thread_local uint8_t recvBufs[BATCH_LEN][1500];
+  static _Thread_local struct sockaddr_in recvAddrs[BATCH_LEN];
+  static _Thread_local ssize_t recvLens[BATCH_LEN];
 
-  printf("Waterslide discovery server, build 4\n");
+  while (true) {
+    int recvCount = recvReqs(thread, recvBufs, recvAddrs, recvLens);
 
-  char *peerExpiryTimeStr = getenv("PEER_EXPIRY_TIME");
-  if (peerExpiryTimeStr != NULL) {
-    char *end;
-    peerExpiryTime = strtol(peerExpiryTimeStr, &end, 10);
-    if (end == peerExpiryTimeStr) peerExpiryTime = PEER_EXPIRY_TIME;
+    if (recvCount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Timeout reached, do periodic cleanup
+      expireAllShards();
+      continue;
+    }
+
+    // If recv failed, ignore it but wait a bit first
+    if (recvCount < 0) {
+      utils_usleep(10000);
+      continue;
+    }
+
+    for (int i = 0; i < recvCount; i++) {
+      if (recvLens[i] >= 0) handleReq(thread, recvBufs[i], recvLens[i], &recvAddrs[i]);
+    }
+    flushRes(thread);
   }
 
-  printf("PEER_EXPIRY_TIME = %d\n", peerExpiryTime);
+  return NULL;
+}
 
-  serverSock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (serverSock < 0) {
+static int openServerSock (void) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
     printf("socket() failed.\n");
-    return EXIT_FAILURE;
+    return -1;
+  }
+
+  int reusePort = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) < 0) {
+    printf("setsockopt(SO_REUSEPORT) failed.\n");
+    close(sock);
+    return -1;
   }
 
   // Set recv timeout so we can still remove expired peers when no packets are being received.
   struct timeval tv;
   tv.tv_sec = RECV_LOOP_IDLE_INTERVAL;
   tv.tv_usec = 0;
-  setsockopt(serverSock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
 
   struct sockaddr_in bindAddr = { 0 };
   bindAddr.sin_family = AF_INET;
   bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
   bindAddr.sin_port = htons(SERVER_BIND_PORT);
 
-  if (bind(serverSock, (const struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
+  if (bind(sock, (const struct sockaddr*)&bindAddr, sizeof(bindAddr)) < 0) {
     printf("bind() failed.\n");
-    return EXIT_FAILURE;
+    close(sock);
+    return -1;
   }
 
-  printf("Bound to port %d\n", SERVER_BIND_PORT);
+  return sock;
+}
 
-  for (int i = 0; i < MAX_PEERS; i++) peerList[i].lastUpdatedUTime = -1;
+int main (void) {
+  printf("Waterslide discovery server, build 5\n");
 
-  while (true) {
-    socklen_t recvAddrLen = sizeof(recvAddr);
-    ssize_t recvLen = recvfrom(serverSock, recvBuf, sizeof(recvBuf), 0, (struct sockaddr*)&recvAddr, &recvAddrLen);
+  #if defined(__linux__)
+  int defaultThreadCount = sysconf(_SC_NPROCESSORS_ONLN);
+  #else
+  int defaultThreadCount = 1;
+  #endif
 
-    if (recvLen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-      // Timeout reached, do periodic cleanup
-      for (int i = 0; i < MAX_PEERS; i++) {
-        if (peerList[i].lastUpdatedUTime != -1) removePeerIfExpired(&peerList[i]);
-      }
-      continue;
-    }
+  peerExpiryTime = getEnvInt("PEER_EXPIRY_TIME", PEER_EXPIRY_TIME);
+  maxPeers = getEnvInt("MAX_PEERS", MAX_PEERS);
+  int threadCount = getEnvInt("SERVER_THREADS", defaultThreadCount);
+  if (peerExpiryTime < 0) peerExpiryTime = PEER_EXPIRY_TIME;
+  if (maxPeers < 1) maxPeers = MAX_PEERS;
+  if (threadCount < 1) threadCount = 1;
+  if (threadCount > MAX_SERVER_THREADS) threadCount = MAX_SERVER_THREADS;
 
-    // If recv failed, ignore it but wait a bit first
-    if (recvLen < 0 || recvAddrLen != sizeof(recvAddr)) {
-      utils_usleep(10000);
-      continue;
-    }
+  printf("PEER_EXPIRY_TIME = %d\n", peerExpiryTime);
+  printf("MAX_PEERS = %d\n", maxPeers);
+  printf("SERVER_THREADS = %d\n", threadCount);
+
+  initHashSeed();
+  if (initShards() < 0) {
+    printf("Failed to allocate the peer table.\n");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < threadCount; i++) {
+    serverThreads[i].sock = openServerSock();
+    if (serverThreads[i].sock < 0) return EXIT_FAILURE;
+  }
 
-    handleReq(recvBuf, recvLen, &recvAddr);
+  printf("Bound to port %d\n", SERVER_BIND_PORT);
+
+  // the main thread runs the first server loop
+  for (int i = 1; i < threadCount; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serverLoop, &serverThreads[i]) != 0) {
+      printf("pthread_create() failed.\n");
+      return EXIT_FAILURE;
+    }
   }
+  serverLoop(&serverThreads[0]);
 
   return EXIT_SUCCESS;
 }
@@ -19,6 +19,12 @@ interface ConfigDiscovery {
 
 interface ConfigEndpoint {
   interface: string
+  weight?: number
+}
+
+interface ConfigEndpointDistribution {
+  mode?: number
+  copies?: number
 }
 
 interface ConfigMux {
@@ -30,6 +36,8 @@ interface ConfigFEC {
   symbolLen: number
   sourceSymbolsPerBlock: number
   repairSymbolsPerBlock: number
+  streamPartialBlocks?: boolean
+  pacedSend?: boolean
 }
 
 interface ConfigMonitor {
@@ -44,6 +52,7 @@ interface Config {
   peerPublicKey: number
   discovery: ConfigDiscovery
   endpoints: ConfigEndpoint[]
+  endpointDistribution?: ConfigEndpointDistribution
   mux: ConfigMux
   audio?: any // TODO
   video?: any // TODO
@@ -0,0 +1,37 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _AUDIO_METER_H
+#define _AUDIO_METER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sample-ring.h"
+
+// NOTES:
+// - Level meters and clipping counts for the monitor (statsCh1Audio levelsFast, levelsSlow and clippingCounts).
+// - Each call meters a whole buffer: the levels are loaded from statsCh1Audio once at the start, kept in a local
+//   struct while the buffer is processed, and published once at the end. So there are no atomic operations per
+//   sample, and the monitor thread only sees one update per buffer.
+// - Only one thread should be metering at a time, otherwise one thread's update can overwrite the other's.
+// - The ballistics are the same one-pole attack/release filters as before (audio levelFastAttack etc.), run on
+//   every sample. For interleaved buffers, the inner loop runs across the channels of a frame without branches
+//   so the compiler can vectorise it.
+// - These are audio callback safe (no syscalls), except for audiometer_init.
+
+// loads levelFastAttack etc., call before the other functions
+void audiometer_init (void);
+// samples are interleaved with channelCount channels, the span must start on a frame boundary
+void audiometer_meterSpan (const samplering_span_t *span, int channelCount);
+// samples[channel][frame]
+void audiometer_meterPlanar (double **samples, int frameCount, int channelCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,7 +10,8 @@
 extern "C" {
 #endif
 
-#include "ck/ck_ring.h"
+#include "sample-ring.h"
+#include "xwait.h"
 
 // call in this order:
 // stats_init
@@ -22,7 +23,11 @@ extern "C" {
 
 int audio_init (bool receiver);
 double audio_getDeviceLatency (void); // in seconds
-int audio_start (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, unsigned int fullRingSize);
+int audio_start (samplering_t *ring, unsigned int fullRingSize);
+// sender only, call before audio_start
+// after writing to the ring, the audio callback calls xwait_notify on waitHandle if the ring holds at least
+// notifySize samples
+void audio_setRingNotify (xwait_t *waitHandle, unsigned int notifySize);
 int audio_deinit (void);
 
 #ifdef __cplusplus
@@ -7,6 +7,7 @@
 #define _DEMUX_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // Definitions:
 // block: a buffer of data that is error corrected (consistent with RaptorQ terminology).
@@ -19,12 +20,27 @@
 // chId: channel ID.
 // channel: a stream of data, error corrected indepentenly from the other channels.
 
+// NOTES:
+// - FEC and audio/video decoding happens in a fixed pool of realtime decode workers shared by all channels, so the
+//   number of channels doesn't change the number of threads. When chunks arrive for a channel that no worker has,
+//   the channel is queued and an idle worker takes it and decodes until its chunk ring is empty.
+// - A channel is only ever decoded by one worker at a time, so its blocks are decoded in order and its onData is
+//   never called concurrently, but successive calls may come from different threads. Don't rely on thread locals
+//   in onData.
+
+// starts threadCount decode workers, 0 means one per core of the decode role in the threads init config, or
+// DEMUX_DEFAULT_WORKER_COUNT if there are none
+int demux_init (int threadCount);
 void demux_deinit (void);
 
-// each time demux_addChannel is called a new thread is created, so each onData is called from a different thread
+// call after demux_init, from one thread at a time; up to MUX_MAX_CHANNELS channels
 // symbolLen must be: 64, 128, 256, 512 or 1024
 // additional channels may be added after calling demux_readPacket
-int demux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, void (*onData)(const uint8_t *, int));
+// paced must match the sender's mux_addChannel, so that a paced block isn't sent to RaptorQ before its repair
+// symbols that come early have arrived
+// if streamPartialBlocks is true, onData is called for data as soon as the source symbols covering it have
+// arrived in order, rather than waiting for the whole block; FEC is only used when there is a gap
+int demux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, bool paced, bool streamPartialBlocks, void (*onData)(const uint8_t *, int));
 
 // call demux_readPacket from one thread only (RT network thread); the data is passed to other threads for decoding
 int demux_readPacket (const uint8_t *buf, size_t bufLen, int endpointIndex);
@@ -17,6 +17,7 @@ enum endpoint_state { Open, Discovery, GotPeerAddr, Close, WaitForReopen };
 typedef struct {
   _Atomic enum endpoint_state state;
   int sock;
+  unsigned int sockGeneration; // incremented every time sock is opened
   char ifName[MAX_NET_IF_NAME_LEN + 1];
   uint32_t peerAddr;
   uint16_t peerPort;
@@ -25,8 +26,19 @@ typedef struct {
   int lastPacketUTime;
 } endpoint_t;
 
+// Bytes reserved at the start of each buf passed to endpoint_send, for the fake IPv4 header BoringTun expects
+#define ENDPOINT_SEND_HEADROOM 20
+// Bytes that can be passed to endpoint_send, including ENDPOINT_SEND_HEADROOM. WireGuard adds 32 bytes.
+#define ENDPOINT_SEND_MAX_LEN (1500 - 32)
+
 int endpoint_init (int (*onPacket)(const uint8_t*, size_t, int));
-int endpoint_send (const uint8_t *buf, size_t bufLen); // NOTE: this is not thread safe
+// buf starts with ENDPOINT_SEND_HEADROOM bytes that endpoint_send overwrites, followed by the data, and bufLen
+// includes them. This avoids copying the data to put a header in front of it.
+// NOTE: this must be called from one thread only, pickEndpoints and the send batch have no locks
+int endpoint_send (uint8_t *buf, size_t bufLen);
+// On Linux, packets passed to endpoint_send are batched and sent with sendmmsg when the batch is full or
+// endpoint_flush is called. Call endpoint_flush from the same thread as endpoint_send after each burst of packets.
+void endpoint_flush (void);
 void endpoint_deinit (void);
 
 #endif
@@ -12,11 +12,41 @@ extern "C" {
 
 #include <stdint.h>
 
-// NOTE: after calling eventrecorder_writeFile, you need to call eventrecorder_init again before eventrecorder_event1i
+// NOTES:
+// - Every thread that records events gets its own buffer from a pool allocated in eventrecorder_init, claimed by
+//   its first event. Only that thread writes to it, so recording is lock-free.
+// - Timestamps are raw counter ticks: TSC on x86, CNTVCT_EL0 on aarch64, CLOCK_MONOTONIC_RAW ns elsewhere. The
+//   file has the counter and CLOCK_MONOTONIC_RAW from init and from the dump, to convert ticks to ns.
+// - The trace points in the audio path use EVENTRECORDER_TRACE, which compiles to nothing unless W_EVENT_RECORDER
+//   is defined (add -DW_EVENT_RECORDER to CFLAGS and CPPFLAGS). main.c then dumps to EVENTRECORDER_FILENAME on exit.
+// - File format, little endian. Header: "WSEV", u32 version (1), u32 bufferCount, u32 0, u64 startTicks,
+//   u64 startNs, u64 endTicks, u64 endNs. Then for each buffer: u32 threadIndex, u32 eventCount, u32 droppedCount,
+//   u32 0, then eventCount * { u64 ticks, i32 id, i32 val }.
+
+#define EVENTRECORDER_MAX_THREADS 16
+#define EVENTRECORDER_BUF_LEN 65536 // events per thread, later events are dropped
+#define EVENTRECORDER_FILENAME "waterslide-events.bin"
+
+// trace point ids, val is in brackets
+#define EVENTRECORDER_ID_PACKET_RECEIVE 1 // endpoint received and decrypted a packet (endpoint index)
+#define EVENTRECORDER_ID_DEMUX_ENQUEUE 2 // chunk put on the decode thread's ring (SBN)
+#define EVENTRECORDER_ID_BLOCK_DECODED 3 // block recovered, by RaptorQ or from source symbols alone (SBN)
+#define EVENTRECORDER_ID_AUDIO_DECODE 4 // Opus or PCM packet decoded (sequence number)
+#define EVENTRECORDER_ID_SYNCER_ENQUEUE 5 // decoded audio resampled onto the ring (frames enqueued or error code)
+#define EVENTRECORDER_ID_DMA_WRITE 6 // receiver audio callback is writing to the device (ring size in samples)
+
+#ifdef W_EVENT_RECORDER
+#define EVENTRECORDER_TRACE(id, val) eventrecorder_event1i((id), (val))
+#else
+#define EVENTRECORDER_TRACE(id, val) ((void)0)
+#endif
 
 int eventrecorder_init (void);
 int eventrecorder_event1i (int32_t id, int32_t val); // this is thread safe and realtime safe (no syscalls)
-int eventrecorder_writeFile (const char *filename); // this is not
+// this is not realtime safe, it can be called while other threads are recording
+// and writes whatever they have committed so far
+int eventrecorder_writeFile (const char *filename);
+void eventrecorder_deinit (void); // call after all recording threads have stopped
 
 #ifdef __cplusplus
 }
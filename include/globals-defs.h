@@ -22,6 +22,13 @@ using namespace std;
 // 1ui: scalar unsigned integer (32-bit or 64-bit depending on arch)
 // 1iv: individually addressable array of signed integers (32-bit or 64-bit depending on arch)
 // 1uiv: individually addressable array of unsigned integers (32-bit or 64-bit depending on arch)
+// 1iv and 1uiv can also be declared Padded or Sharded (e.g. globals_declare1uivSharded), which only changes how
+// they are stored. They are still read and written with the 1iv and 1uiv macros below.
+// - Padded: each element is on its own cache line. For arrays where each element is written by a different thread.
+// - Sharded: GLOBALS_SHARD_COUNT copies of the array, each on its own cache lines. globals_add1uiv adds to the
+//   calling thread's copy and globals_get1uiv sums all the copies, so counters that are incremented by several
+//   threads at once don't share cache lines between those threads. globals_set1uiv is not atomic across the
+//   copies, only use it while nothing is adding to the counter.
 // 1ff: scalar double-precision float
 // 1ffv: individually addressable array of doubles
 // 1s: null-terminated char array
@@ -30,8 +37,8 @@ using namespace std;
 #define globals_set1i(GROUP, NAME, VALUE) globals_1i_##GROUP##_##NAME = (VALUE)
 #define globals_set1il(GROUP, NAME, VALUE) globals_1il_##GROUP##_##NAME = (VALUE)
 #define globals_set1ui(GROUP, NAME, VALUE) globals_1ui_##GROUP##_##NAME = (VALUE)
-#define globals_set1iv(GROUP, NAME, INDEX, VALUE) globals_1iv_##GROUP##_##NAME[INDEX] = (VALUE)
-#define globals_set1uiv(GROUP, NAME, INDEX, VALUE) globals_1uiv_##GROUP##_##NAME[INDEX] = (VALUE)
+#define globals_set1iv(GROUP, NAME, INDEX, VALUE) _globals_set1iv_##GROUP##_##NAME(INDEX, VALUE)
+#define globals_set1uiv(GROUP, NAME, INDEX, VALUE) _globals_set1uiv_##GROUP##_##NAME(INDEX, VALUE)
 #define globals_set1ff(GROUP, NAME, VALUE) _globals_set1ff_##GROUP##_##NAME(VALUE)
 #define globals_set1ffv(GROUP, NAME, INDEX, VALUE) _globals_set1ffv_##GROUP##_##NAME(INDEX, VALUE)
 #define globals_set1s(GROUP, NAME, VALUE) _globals_set1s_##GROUP##_##NAME(VALUE)
@@ -40,8 +47,8 @@ using namespace std;
 #define globals_get1i(GROUP, NAME) (globals_1i_##GROUP##_##NAME)
 #define globals_get1il(GROUP, NAME) (globals_1il_##GROUP##_##NAME)
 #define globals_get1ui(GROUP, NAME) (globals_1ui_##GROUP##_##NAME)
-#define globals_get1iv(GROUP, NAME, INDEX) (globals_1iv_##GROUP##_##NAME[INDEX])
-#define globals_get1uiv(GROUP, NAME, INDEX) (globals_1uiv_##GROUP##_##NAME[INDEX])
+#define globals_get1iv(GROUP, NAME, INDEX) _globals_get1iv_##GROUP##_##NAME(INDEX)
+#define globals_get1uiv(GROUP, NAME, INDEX) _globals_get1uiv_##GROUP##_##NAME(INDEX)
 
 #define globals_get1ff(GROUP, NAME, VAR) _globals_get1ff_##GROUP##_##NAME(VAR)
 #define globals_get1ffv(GROUP, NAME, INDEX, VAR) _globals_get1ffv_##GROUP##_##NAME(INDEX, VAR)
@@ -52,8 +59,32 @@ using namespace std;
 #define globals_add1i(GROUP, NAME, VALUE) atomic_fetch_add_explicit(&globals_1i_##GROUP##_##NAME, (int)(VALUE), memory_order_relaxed)
 #define globals_add1il(GROUP, NAME, VALUE) atomic_fetch_add_explicit(&globals_1il_##GROUP##_##NAME, (int_fast64_t)(VALUE), memory_order_relaxed)
 #define globals_add1ui(GROUP, NAME, VALUE) atomic_fetch_add_explicit(&globals_1ui_##GROUP##_##NAME, (unsigned int)(VALUE), memory_order_relaxed)
-#define globals_add1iv(GROUP, NAME, INDEX, VALUE) atomic_fetch_add_explicit(&globals_1iv_##GROUP##_##NAME[INDEX], (int)(VALUE), memory_order_relaxed)
-#define globals_add1uiv(GROUP, NAME, INDEX, VALUE) atomic_fetch_add_explicit(&globals_1uiv_##GROUP##_##NAME[INDEX], (unsigned int)(VALUE), memory_order_relaxed)
+#define globals_add1iv(GROUP, NAME, INDEX, VALUE) _globals_add1iv_##GROUP##_##NAME(INDEX, VALUE)
+#define globals_add1uiv(GROUP, NAME, INDEX, VALUE) _globals_add1uiv_##GROUP##_##NAME(INDEX, VALUE)
+
+// NOTE: 128 rather than 64 because Apple silicon has 128 byte cache lines, and x86 prefetches lines in pairs
+#define GLOBALS_CACHE_LINE 128
+#define GLOBALS_SHARD_COUNT 8
+// LEN elements of TYPE, rounded up to a whole number of cache lines
+#define GLOBALS_PADDED_LEN(LEN, TYPE) ((((LEN) * sizeof(TYPE) + GLOBALS_CACHE_LINE - 1) / GLOBALS_CACHE_LINE) * GLOBALS_CACHE_LINE / sizeof(TYPE))
+#define GLOBALS_ALIGNED __attribute__((aligned(GLOBALS_CACHE_LINE)))
+
+#ifdef __cplusplus
+#define GLOBALS_THREAD_LOCAL thread_local
+#else
+#define GLOBALS_THREAD_LOCAL _Thread_local
+#endif
+
+// Each thread picks a shard the first time it adds to a Sharded global. This is per source file, which is fine:
+// any shard gives the right total, the point is only that two threads rarely pick the same one.
+extern atomic_uint globals_nextShardIndex;
+static GLOBALS_THREAD_LOCAL int _globals_shardIndex = -1;
+static inline int _globals_getShardIndex (void) {
+  if (_globals_shardIndex < 0) {
+    _globals_shardIndex = atomic_fetch_add_explicit(&globals_nextShardIndex, 1, memory_order_relaxed) % GLOBALS_SHARD_COUNT;
+  }
+  return _globals_shardIndex;
+}
 
 // These go in the header file
 #define globals_declare1i(GROUP, NAME) \
@@ -65,11 +96,52 @@ extern atomic_int_fast64_t globals_1il_##GROUP##_##NAME;
 #define globals_declare1ui(GROUP, NAME) \
 extern atomic_uint globals_1ui_##GROUP##_##NAME;
 
+// GROUP here includes the type, e.g. 1uiv_statsEndpoints. ELEMENT is where element index is stored.
+#define _globals_declareArrayFns(TYPE, GROUP, NAME, ELEMENT) \
+static inline TYPE _globals_get##GROUP##_##NAME (size_t index) { \
+  return ELEMENT; \
+} \
+static inline void _globals_set##GROUP##_##NAME (size_t index, TYPE x) { \
+  ELEMENT = x; \
+} \
+static inline TYPE _globals_add##GROUP##_##NAME (size_t index, TYPE x) { \
+  return atomic_fetch_add_explicit(&ELEMENT, x, memory_order_relaxed); \
+}
+
 #define globals_declare1iv(GROUP, NAME) \
-extern atomic_int globals_1iv_##GROUP##_##NAME[];
+extern atomic_int globals_1iv_##GROUP##_##NAME[]; \
+_globals_declareArrayFns(int, 1iv_##GROUP, NAME, globals_1iv_##GROUP##_##NAME[index])
 
 #define globals_declare1uiv(GROUP, NAME) \
-extern atomic_uint globals_1uiv_##GROUP##_##NAME[];
+extern atomic_uint globals_1uiv_##GROUP##_##NAME[]; \
+_globals_declareArrayFns(unsigned int, 1uiv_##GROUP, NAME, globals_1uiv_##GROUP##_##NAME[index])
+
+#define globals_declare1ivPadded(GROUP, NAME) \
+extern atomic_int globals_1iv_##GROUP##_##NAME[][GLOBALS_CACHE_LINE / sizeof(atomic_int)] GLOBALS_ALIGNED; \
+_globals_declareArrayFns(int, 1iv_##GROUP, NAME, globals_1iv_##GROUP##_##NAME[index][0])
+
+#define globals_declare1uivPadded(GROUP, NAME) \
+extern atomic_uint globals_1uiv_##GROUP##_##NAME[][GLOBALS_CACHE_LINE / sizeof(atomic_uint)] GLOBALS_ALIGNED; \
+_globals_declareArrayFns(unsigned int, 1uiv_##GROUP, NAME, globals_1uiv_##GROUP##_##NAME[index][0])
+
+// LEN must be the same as in globals_define1uivSharded
+#define globals_declare1uivSharded(GROUP, NAME, LEN) \
+extern atomic_uint globals_1uiv_##GROUP##_##NAME[GLOBALS_SHARD_COUNT][GLOBALS_PADDED_LEN(LEN, atomic_uint)] GLOBALS_ALIGNED; \
+static inline unsigned int _globals_get1uiv_##GROUP##_##NAME (size_t index) { \
+  unsigned int sum = 0; \
+  for (int i = 0; i < GLOBALS_SHARD_COUNT; i++) { \
+    sum += atomic_load_explicit(&globals_1uiv_##GROUP##_##NAME[i][index], memory_order_relaxed); \
+  } \
+  return sum; \
+} \
+static inline void _globals_set1uiv_##GROUP##_##NAME (size_t index, unsigned int x) { \
+  for (int i = 1; i < GLOBALS_SHARD_COUNT; i++) globals_1uiv_##GROUP##_##NAME[i][index] = 0; \
+  globals_1uiv_##GROUP##_##NAME[0][index] = x; \
+} \
+/* returns the previous value of this thread's shard only */ \
+static inline unsigned int _globals_add1uiv_##GROUP##_##NAME (size_t index, unsigned int x) { \
+  return atomic_fetch_add_explicit(&globals_1uiv_##GROUP##_##NAME[_globals_getShardIndex()][index], x, memory_order_relaxed); \
+}
 
 // NOTE: If we don't do an explicit store for set1ff and set1ffv (and just memcpy directly into the atomic),
 // g++ (but not gcc or clang) complains about atomic_uint_fast64_t having no trivial copy-assignment.
@@ -148,6 +220,9 @@ static inline int _globals_set1sv_##GROUP##_##NAME (size_t index, const char *s)
 #define globals_define1ui(GROUP, NAME) atomic_uint globals_1ui_##GROUP##_##NAME = 0;
 #define globals_define1iv(GROUP, NAME, LEN) atomic_int globals_1iv_##GROUP##_##NAME[LEN] = { 0 };
 #define globals_define1uiv(GROUP, NAME, LEN) atomic_uint globals_1uiv_##GROUP##_##NAME[LEN] = { 0 };
+#define globals_define1ivPadded(GROUP, NAME, LEN) atomic_int globals_1iv_##GROUP##_##NAME[LEN][GLOBALS_CACHE_LINE / sizeof(atomic_int)] GLOBALS_ALIGNED = { { 0 } };
+#define globals_define1uivPadded(GROUP, NAME, LEN) atomic_uint globals_1uiv_##GROUP##_##NAME[LEN][GLOBALS_CACHE_LINE / sizeof(atomic_uint)] GLOBALS_ALIGNED = { { 0 } };
+#define globals_define1uivSharded(GROUP, NAME, LEN) atomic_uint globals_1uiv_##GROUP##_##NAME[GLOBALS_SHARD_COUNT][GLOBALS_PADDED_LEN(LEN, atomic_uint)] GLOBALS_ALIGNED = { { 0 } };
 #define globals_define1ff(GROUP, NAME) atomic_uint_fast64_t globals_1ff_##GROUP##_##NAME = 0;
 #define globals_define1ffv(GROUP, NAME, LEN) atomic_uint_fast64_t globals_1ffv_##GROUP##_##NAME[LEN] = { 0 };
 
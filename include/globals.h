@@ -20,7 +20,23 @@
 
 #define AUDIO_ENCODING_OPUS 0
 #define AUDIO_ENCODING_PCM 1
+#define AUDIO_ENCODING_LOSSLESS 2 // PCM compressed with lossless.c, uses the PCM capture path and pcm.frameSize
+
+// CRC at the end of each PCM frame
+#define PCM_CRC_MODE_CRC16 0
+#define PCM_CRC_MODE_CRC32C 1
+#define PCM_CRC_MODE_NONE 2 // WireGuard already authenticates every packet, so the CRC only catches bugs
 #define AUDIO_OPUS_SAMPLE_RATE 48000
+// Every audio packet starts with: u16 sequence number, u16 sender latency in us (capture buffer + encodeRing +
+// encode, saturates at 65535), u32 send time from utils_getCurrentUTime on the sender. Then the Opus, PCM or lossless payload.
+#define AUDIO_PACKET_HEADER_LEN 8
+// Receiver. In packets. A packet up to this far behind the newest one is dropped as late (its frame has already
+// been played or concealed), one further behind is taken as the sender starting again.
+#define AUDIO_LATE_SEQ_WINDOW 1000
+// Linux only. How the RT audio loop waits for the hw pointer to cross into the next half of the DMA buffer
+#define AUDIO_LOOP_MODE_SLEEP 0 // check the hw pointer every loopSleep microseconds
+#define AUDIO_LOOP_MODE_POLL 1 // wait on the PCM poll fd, woken by period interrupts
+#define AUDIO_LOOP_MODE_TIMER 2 // timerfd set from the hw pointer to just after the next half buffer boundary
 // Linearly change the mix this much for every audio frame e.g. 0.01 means it takes 100 frames or
 // ~2.1 ms @ 48 kHz for the sample rate to fully change.
 #define SYNCER_SWITCH_SPEED 0.01
@@ -32,6 +48,25 @@
 #define SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES 64
 // In percent. For example: for 44100 Hz and 8% the transition frequency is (1 - 8/100) * (44100 / 2) = 20286 Hz
 #define SYNCER_TRANSITION_BAND 8.0
+// In Hz. Rate changes are rounded to this grid, starting from the initial srcRate, so that resamplers built
+// ahead of time can be reused. Half of this must be under RS_ERROR_THRESHOLD, otherwise receiver sync could keep
+// asking for a rate change that rounds back to the current rate.
+#define SYNCER_RATE_STEP 0.1
+// Number of spare sets of resamplers (one per channel) built in the background for the rates either side of
+// the current one, alternating +1, -1, +2, -2... SYNCER_RATE_STEPs. A rate change to one of those rates
+// skips constructing new resamplers. 0 disables the cache.
+#define SYNCER_RESAMP_CACHE_SIZE 4
+// How syncer corrects for clock drift, see audio resamplerMode
+#define SYNCER_RESAMPLER_CROSSFADE 0 // A/B resamplers in resamp-state.cpp
+#define SYNCER_RESAMPLER_VARIABLE 1 // variable ratio resampler in vari-resamp.cpp
+// Variable ratio resampler filter length and number of tabulated fractional phases. Latency is SYNCER_VARI_TAPS / 2 frames.
+#define SYNCER_VARI_TAPS 64
+#define SYNCER_VARI_PHASES 128
+// Kaiser window beta for the variable ratio resampler, 8.0 gives about 80 dB of stopband rejection
+#define SYNCER_VARI_KAISER_BETA 8.0
+// In input frames per output frame. The variable ratio resampler changes its ratio by at most this much every
+// output frame, e.g. 1e-7 takes ~42 ms @ 48 kHz to move 10 Hz.
+#define SYNCER_VARI_SLEW 0.0000001
 
 // In seconds. Store a sample of receiverSync in rsHistory every x seconds (with interleaving to reduce the effects of packet loss).
 #define RS_SAMPLE_INTERVAL 5
@@ -41,16 +76,40 @@
 #define RS_ERROR_VARIANCE_WINDOW 40
 // The variance over RS_ERROR_VARIANCE_WINDOW must be less than this in order for a rate change to happen.
 #define RS_ERROR_VARIANCE_TARGET 0.0001
+// receiverSync fixed-point units per audio frame, the rate ratio given to syncer_onPacket uses the same scale
+#define RS_FIXED_ONE 100000000
 // In samples per second. The absolute value of the error must be higher than this in order for a rate change to happen.
 #define RS_ERROR_THRESHOLD 0.15
+// Same as RS_ERROR_THRESHOLD but for SYNCER_RESAMPLER_VARIABLE, where rate changes are cheap and not rounded
+#define RS_VARIABLE_ERROR_THRESHOLD 0.01
 
 #define MAX_ENDPOINTS 16
 #define MAX_DEVICE_NAME_LEN 100
 #define MAX_NET_IF_NAME_LEN 20
+#define MAX_FILE_PATH_LEN 255
 #define MAX_AUDIO_CHANNELS 64
 
 // channel 0: config, channel 1: audio, channel 2: video
 #define MUX_CHANNEL_COUNT 3
+// Channels mux and demux can carry, must be a power of two. The ones after the MUX_CHANNEL_COUNT configured above are
+// added at runtime e.g. for extra audio streams.
+#define MUX_MAX_CHANNELS 16
+
+// Thread roles that can be placed with the threads field of the init config, see utils_setCallerThreadRole.
+// Roles with one thread per channel or group use the instance number (chId, or group index - 1 for opus-worker)
+// to pick from the configured cores.
+#define THREAD_ROLE_AUDIO 0 // Linux audio loop, default core 0, priority 99
+#define THREAD_ROLE_NETWORK 1 // endpoint data loop, default core 0, priority 98
+#define THREAD_ROLE_MUX_PACKET 2 // sender, default core 0, priority 98
+#define THREAD_ROLE_MUX_ENCODE 3 // sender FEC encode per channel, default core chId + 2, priority 98
+#define THREAD_ROLE_DECODE 4 // receiver FEC and audio decode worker pool shared by all channels, one worker per configured core (default 2 workers), default core worker + 1, priority 98
+#define THREAD_ROLE_ENCODE 5 // sender audio encode loop, default core 2, priority 98
+#define THREAD_ROLE_OPUS_WORKER 6 // see opus-group.h, default core OPUSGROUP_FIRST_WORKER_CORE + instance, priority 98
+#define THREAD_ROLE_RESAMP_MANAGER 7 // not pinned or realtime by default
+#define THREAD_ROLE_RECEIVER_SYNC 8 // not pinned or realtime by default
+#define THREAD_ROLE_MONITOR 9 // websocket (instance 0) and stats (instance 1) threads, not pinned or realtime by default
+#define THREAD_ROLE_COUNT 10
+#define THREAD_ROLE_MAX_CORES 16
 
 #define SEC_KEY_LENGTH 44 // Length of base 64 encoded key string in chars, not including null terminator.
 #define ENDPOINT_KEEP_ALIVE_MS 600 // in milliseconds
@@ -58,11 +117,38 @@
 #define ENDPOINT_REOPEN_INTERVAL_MIN 50 // in ticks (1 tick = 100 ms)
 #define ENDPOINT_REOPEN_INTERVAL_MAX 100 // in ticks (1 tick = 100 ms)
 #define ENDPOINT_DISCOVERY_INTERVAL 10 // in ticks
+#define ENDPOINT_BATCH_LEN 32 // Linux only. Maximum number of packets sent or received per sendmmsg/recvmmsg call.
+// Which endpoints carry each data packet (sender). Handshakes and keepalives always go on all endpoints.
+#define ENDPOINT_DISTRIBUTION_DUPLICATE 0 // every packet on every endpoint
+#define ENDPOINT_DISTRIBUTION_ROUND_ROBIN 1 // each packet on distributionCopies endpoints in turn
+#define ENDPOINT_DISTRIBUTION_WEIGHTED 2 // like round robin but in proportion to weight, reduced by measured send loss
+#define ENDPOINT_DISTRIBUTION_WINDOW 1000 // in packets. How often send loss is measured for ENDPOINT_DISTRIBUTION_WEIGHTED.
+// Endpoint liveness. Both sides send a probe on every endpoint each interval, and data packets are only sent
+// on degraded endpoints if all the open endpoints are degraded.
+#define ENDPOINT_HEALTH_PROBE_INTERVAL_US 50000 // in microseconds
+#define ENDPOINT_HEALTH_MAX_GAP_US 250000 // in microseconds. Degraded if nothing has arrived on the endpoint for this long.
+#define ENDPOINT_HEALTH_MAX_SBN_LAG 4 // in blocks. Degraded if its last SBN on a channel is this far behind the other endpoints.
+#define ENDPOINT_HEALTH_RECOVER_US 500000 // in microseconds. How long a degraded endpoint must be healthy to be used again.
+#define ENDPOINT_HEALTH_DOWN 0 // not open
+#define ENDPOINT_HEALTH_UP 1
+#define ENDPOINT_HEALTH_DEGRADED 2 // open, but not used for data
 
 #define STATS_STREAM_METER_BINS 512
 #define STATS_BLOCK_TIMING_RING_LEN 512
+// Receiver latency histograms, one per stage. The last bin also counts anything longer.
+#define STATS_LATENCY_BINS 64
+#define STATS_LATENCY_BIN_US 500
+#define STATS_LATENCY_STAGE_SENDER 0 // capture buffer, encodeRing and encode, measured by the sender
+#define STATS_LATENCY_STAGE_NETWORK 1 // FEC block fill, network and FEC decode, see receiver.c
+#define STATS_LATENCY_STAGE_DECODE_RING 2 // receiver ring from syncer enqueue to the audio callback
+#define STATS_LATENCY_STAGE_DEVICE 3 // playback buffer
+#define STATS_LATENCY_STAGE_TOTAL 4
+#define STATS_LATENCY_STAGE_COUNT 5
+// In packets. The smallest send to receive time difference over this many packets is the network latency baseline.
+#define STATS_LATENCY_BASELINE_WINDOW 2000
 
 globals_declare1i(root, mode)
+globals_declare1i(root, rtArenaSize) // MB, locked memory for the buffers on the realtime path. 0 = RTARENA_DEFAULT_SIZE_MB
 globals_declare1s(root, privateKey)
 globals_declare1s(root, peerPublicKey)
 
@@ -71,6 +157,11 @@ globals_declare1i(discovery, serverPort)
 
 globals_declare1i(endpoints, endpointCount)
 globals_declare1sv(endpoints, interface)
+globals_declare1ffv(endpoints, weight) // Sender only, for ENDPOINT_DISTRIBUTION_WEIGHTED
+globals_declare1i(endpoints, ioUring) // Linux only, needs W_IO_URING. 1 = io_uring network backend instead of poll and recvmmsg/sendmmsg
+globals_declare1s(endpoints, peerCacheFile) // Last known peer addresses are saved here, see peer-cache.h. Empty = memory only
+globals_declare1i(endpoints, distributionMode) // Sender only, one of ENDPOINT_DISTRIBUTION_*
+globals_declare1i(endpoints, distributionCopies) // Sender only. Number of endpoints each packet is sent on, unless duplicating.
 
 globals_declare1ui(mux, maxPacketSize)
 
@@ -79,12 +170,14 @@ globals_declare1i(audio, deviceChannelCount) // Number of audio channels support
 globals_declare1i(audio, networkSampleRate)
 globals_declare1ff(audio, deviceSampleRate) // This is changed dynamically for receiver sync
 globals_declare1i(audio, decodeRingLength) // In samples. Must be larger than frameSize (Opus or PCM). Affects receive latency.
+globals_declare1i(audio, resamplerMode) // One of SYNCER_RESAMPLER_*
 globals_declare1s(audio, deviceName) // macOS only
 globals_declare1i(audio, cardId) // Linux only
 globals_declare1i(audio, deviceId) // Linux only
 globals_declare1i(audio, bitsPerSample) // Linux only
 globals_declare1i(audio, periodSize) // Linux only, in samples. Audio callback latency is periodSize*periodCount/2
 globals_declare1i(audio, periodCount) // Linux only, in samples. Setting this higher improves DMA pointer resolution on some systems. Set periodSize lower to compensate for this.
+globals_declare1i(audio, loopMode) // Linux only. One of AUDIO_LOOP_MODE_*
 globals_declare1i(audio, loopSleep) // Linux only. RT loop sleeps for this many microseconds after running the audio callback. Set low enough for no xruns, but high enough for reasonable CPU usage.
 
 globals_declare1ff(audio, levelSlowAttack) // Meter filtering for monitor
@@ -95,42 +188,74 @@ globals_declare1ui(audio, encoding)
 
 globals_declare1i(opus, bitrate) // In bits per second
 globals_declare1i(opus, frameSize) // Normally 240 samples = 5 ms @ 48 kHz
+globals_declare1i(opus, groupCount) // Encoders/decoders running in parallel, see opus-group.h
+globals_declare1i(opus, inbandFecLossPerc) // Sender only. 0 = no in-band FEC, see opusgroup_setInbandFec
 
-globals_declare1i(pcm, frameSize) // In samples. Packet size in bytes is 3 * channelCount * frameSize + 2
+globals_declare1i(pcm, frameSize) // In samples. Packet size in bytes is 3 * channelCount * frameSize + CRC length (0, 2 or 4). Also the lossless frameSize
 globals_declare1i(pcm, sampleRate)
+globals_declare1i(pcm, crcMode) // PCM_CRC_MODE_*
 
 globals_declare1iv(fec, symbolLen)
 globals_declare1iv(fec, sourceSymbolsPerBlock)
 globals_declare1iv(fec, repairSymbolsPerBlock)
+globals_declare1iv(fec, pacedSend) // Must be the same on sender and receiver. 1 to spread the packets of each block over the block interval
+globals_declare1iv(fec, streamPartialBlocks) // Receiver only. 1 to pass on data before the whole block has arrived
+
+globals_declare1iv(threads, priority) // Per THREAD_ROLE_*. SCHED_FIFO priority, 0 = default, -1 = not realtime
+globals_declare1iv(threads, coreCount) // Per THREAD_ROLE_*. 0 = default core
+globals_declare1iv(threads, cores) // THREAD_ROLE_COUNT * THREAD_ROLE_MAX_CORES, instance N goes on core N % coreCount
 
 globals_declare1i(monitor, udpPort)
 globals_declare1ui(monitor, udpAddr)
 globals_declare1i(monitor, wsPort)
 
 globals_declare1uiv(statsEndpoints, open)
-globals_declare1uiv(statsEndpoints, bytesOut)
-globals_declare1uiv(statsEndpoints, bytesIn)
-globals_declare1uiv(statsEndpoints, sendCongestion)
-globals_declare1iv(statsEndpoints, lastSbn)
-
-globals_declare1uiv(statsMux, ringOverrunCount)
-globals_declare1uiv(statsDemux, ringOverrunCount)
-globals_declare1uiv(statsDemux, dupBlockCount)
-globals_declare1uiv(statsDemux, oooBlockCount)
-globals_declare1uiv(statsDemux, blockTimingRingPos) // NOTE: blockTimingRingPos must only be written to in one place by one thread
-globals_declare1uiv(statsDemux, blockTimingRing)
-
-globals_declare1uiv(statsCh1Audio, clippingCounts)
+globals_declare1uiv(statsEndpoints, health) // ENDPOINT_HEALTH_*
+globals_declare1uiv(statsEndpoints, healthTransitionCount) // Number of times each endpoint went from up to degraded or back
+globals_declare1uivSharded(statsEndpoints, bytesOut, MAX_ENDPOINTS)
+globals_declare1uivSharded(statsEndpoints, bytesIn, MAX_ENDPOINTS)
+globals_declare1uivSharded(statsEndpoints, sendCongestion, MAX_ENDPOINTS)
+globals_declare1uivSharded(statsEndpoints, dataPacketsOut, MAX_ENDPOINTS) // Data packets from endpoint_send assigned to each endpoint
+globals_declare1ui(statsEndpoints, dataPacketCount) // Total data packets passed to endpoint_send
+globals_declare1ivPadded(statsEndpoints, lastSbn)
+globals_declare1uivSharded(statsEndpoints, dupChunkCount, MUX_MAX_CHANNELS * MAX_ENDPOINTS) // Chunks dropped by demux because another endpoint delivered them first
+globals_declare1uivSharded(statsEndpoints, lateChunkCount, MUX_MAX_CHANNELS * MAX_ENDPOINTS) // Chunks dropped by demux because their block was already decoded
+globals_declare1uivSharded(statsEndpoints, recvBatchCount, MAX_ENDPOINTS) // Number of recvmmsg (or recvfrom) calls, or data ring wakeups with io_uring
+globals_declare1uivSharded(statsEndpoints, recvBatchPacketCount, MAX_ENDPOINTS) // Number of packets received by those calls
+globals_declare1uivSharded(statsEndpoints, sendBatchCount, MAX_ENDPOINTS) // Number of endpoint_flush batches sent (Linux only)
+globals_declare1uivSharded(statsEndpoints, sendBatchPacketCount, MAX_ENDPOINTS) // Number of packets sent in those batches
+globals_declare1i(statsEndpoints, tunnelRttMs) // WireGuard's RTT estimate from the last handshake, -1 if there is none
+
+globals_declare1uivSharded(statsMux, ringOverrunCount, MUX_MAX_CHANNELS)
+globals_declare1uivPadded(statsMux, encodeQueueDepth) // Blocks waiting for the encode thread, including the one just handed off
+globals_declare1uivSharded(statsDemux, ringOverrunCount, MUX_MAX_CHANNELS)
+globals_declare1uivSharded(statsDemux, dupBlockCount, MUX_MAX_CHANNELS)
+globals_declare1uivSharded(statsDemux, oooBlockCount, MUX_MAX_CHANNELS)
+globals_declare1uivPadded(statsDemux, blockTimingRingPos) // NOTE: blockTimingRingPos must only be written to in one place by one thread
+globals_declare1uiv(statsDemux, blockTimingRing) // Time each block was decoded
+globals_declare1uiv(statsDemux, blockArrivalRing) // Time the first chunk of each block arrived, same positions as blockTimingRing
+globals_declare1uivSharded(statsDemux, fastPathBlockCount, MUX_MAX_CHANNELS) // Blocks emitted from source symbols alone, without the RaptorQ decoder
+
+globals_declare1uivSharded(statsCh1Audio, clippingCounts, MAX_AUDIO_CHANNELS)
 globals_declare1ffv(statsCh1Audio, levelsFast)
 globals_declare1ffv(statsCh1Audio, levelsSlow)
 globals_declare1i(statsCh1Audio, streamBufferSize)
-globals_declare1uiv(statsCh1Audio, streamMeterBins)
+globals_declare1uivSharded(statsCh1Audio, streamMeterBins, STATS_STREAM_METER_BINS)
 globals_declare1ui(statsCh1Audio, bufferOverrunCount)
 globals_declare1ui(statsCh1Audio, bufferUnderrunCount)
+globals_declare1ui(statsCh1Audio, concealedFrameCount) // Receiver. Frames lost or failing to decode, replaced by PLC, FEC or a fade
+globals_declare1ui(statsCh1Audio, lateFrameCount) // Receiver. Frames dropped because they arrived after their place in the stream
 globals_declare1ui(statsCh1Audio, encodeThreadJitterCount)
 globals_declare1ui(statsCh1Audio, audioLoopXrunCount)
+globals_declare1ui(statsCh1Audio, audioLoopSpuriousWakeCount) // Linux only. Audio loop wakeups with no half buffer to process
 globals_declare1ff(statsCh1Audio, clockError) // In PPM
+globals_declare1ff(statsCh1Audio, syncError) // In samples per second. Receiver sync slope over rsHistory
+globals_declare1ff(statsCh1Audio, syncErrorVariance) // Variance of syncError over RS_ERROR_VARIANCE_WINDOW
+globals_declare1uivSharded(statsCh1AudioLatency, histograms, STATS_LATENCY_STAGE_COUNT * STATS_LATENCY_BINS) // STATS_LATENCY_STAGE_COUNT * STATS_LATENCY_BINS packet counts
+globals_declare1iv(statsCh1AudioLatency, lastUs) // Latest measurement of each stage
 globals_declare1ui(statsCh1AudioOpus, codecErrorCount)
 globals_declare1ui(statsCh1AudioPCM, crcFailCount)
+globals_declare1ui(statsCh1AudioLossless, codecErrorCount)
+globals_declare1ff(statsCh1AudioLossless, compressionRatio) // Encoded size / 24-bit PCM size of the last frame
 
 #endif
@@ -0,0 +1,45 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _LOSSLESS_H
+#define _LOSSLESS_H
+
+#include <stdint.h>
+
+// NOTES:
+// - Lossless compression of the same 24-bit samples that PCM encoding sends. Each channel of a frame is coded with
+//   the best of the FLAC fixed polynomial predictors (order 0 to 4) and Rice coded residuals, with one Rice
+//   parameter per LOSSLESS_PARTITION_LEN residuals. Silent (constant) channels take 26 bits.
+// - Every frame is coded on its own, with no state carried over from the previous frame, so a lost packet only
+//   loses its own samples.
+// - A channel that doesn't compress is sent verbatim, so a frame is never larger than lossless_getMaxEncodedLen.
+// - There is no CRC, WireGuard already authenticates every packet. lossless_decode checks that the bitstream is
+//   well formed and uses exactly inDataLen bytes.
+
+#define LOSSLESS_PARTITION_LEN 64
+
+typedef struct {
+  int channelCount;
+  int frameSize;
+  uint8_t *packedBuf; // 3 * channelCount * frameSize, encoder: quantised input, decoder: decoded output
+  int32_t *samples; // frameSize, one channel at a time
+  uint32_t *residuals; // frameSize
+} lossless_codec_t;
+
+int lossless_init (lossless_codec_t *codec, int channelCount, int frameSize);
+void lossless_deinit (lossless_codec_t *codec);
+
+// upper bound of the lossless_encode result for channelCount * frameSize samples
+int lossless_getMaxEncodedLen (int channelCount, int frameSize);
+
+// inSampleBuf is channelCount * frameSize interleaved samples, outData must be at least
+// lossless_getMaxEncodedLen bytes. Returns the encoded length.
+int lossless_encode (lossless_codec_t *codec, const float *inSampleBuf, uint8_t *outData);
+
+// samples is set to a 24-bit LE packed buffer owned by codec, containing channelCount * frameSize interleaved
+// samples. Returns the sample count, or a negative number if inData is not a valid frame.
+int lossless_decode (lossless_codec_t *codec, const uint8_t *inData, int inDataLen, const uint8_t **samples);
+
+#endif
@@ -7,6 +7,7 @@
 #define _MUX_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // NOTES:
 //
@@ -31,13 +32,18 @@
 //
 // One chunk from each channel (4+symbolLen) plus mux protocol overhead must be <= maxPacketSize
 
-// onPacket will be called by the packet thread only
-int mux_init (int (*onPacket)(const uint8_t *, size_t));
+// onPacket and onFlush will be called by the packet thread only
+// onFlush is called after each burst of onPacket calls, it may be NULL
+// each buf passed to onPacket starts with headroom bytes that onPacket may overwrite, followed by the packet,
+// and its length includes them e.g. headroom = ENDPOINT_SEND_HEADROOM to pass endpoint_send as onPacket
+int mux_init (int (*onPacket)(uint8_t *, size_t), void (*onFlush)(void), size_t headroom);
 void mux_deinit (void);
 
 // symbolLen must be: 64, 128, 256, 512 or 1024
+// if paced is true, repair symbols are interleaved with source symbols, and if this is the anchor channel the
+// packets of each block are spread over the block interval instead of being sent in one burst
 // returns chId or negative error
-int mux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen);
+int mux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, bool paced);
 
 // call this once before mux_writeData
 // the anchor channel should be the channel that consistently has the highest chunk / sec rate e.g. video
@@ -48,9 +54,9 @@ int mux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbols
 int mux_setAnchorChannel (uint8_t chId);
 
 // call this from one thread per chId
-// first each buf passed is arranged as above into a block, then when a block is full
-// FEC encoding is done in the calling thread, then the block is sent to the packet thread
-// (one packet thread for all channels)
+// first each buf passed is arranged as above into a block, then when a block is full it is handed
+// to the channel's encode thread for FEC encoding, then the block is sent to the packet thread
+// (one encode thread per channel, one packet thread for all channels)
 // bufLen must be <= maxDataLen for the corresponding chId
 int mux_writeData (uint8_t chId, const uint8_t *dataBuf, int dataBufLen);
 
@@ -0,0 +1,90 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _OPUS_GROUP_H
+#define _OPUS_GROUP_H
+
+#include "xwait.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "opus/opus_multistream.h"
+
+// NOTES:
+// - Splits the channels into groupCount contiguous groups, each with its own Opus multistream encoder or decoder,
+//   so a frame with many channels is coded on several cores at once. Group 0 runs on the calling thread, the other
+//   groups each have a worker thread (THREAD_ROLE_OPUS_WORKER), by default pinned to its own core starting from
+//   OPUSGROUP_FIRST_WORKER_CORE.
+// - Every group is CBR with a share of the bitrate proportional to its channel count, so the packet is the group
+//   packets back to back and the receiver can split it without any length fields.
+// - With groupCount = 1 the packet is exactly what a single encoder for all channels would produce.
+// - opusgroup_encode and opusgroup_decode must always be called from the same thread.
+
+#define OPUSGROUP_MAX_GROUPS 16
+#define OPUSGROUP_FIRST_WORKER_CORE 4 // cores 0 to 3 are taken by the audio, mux and demux threads
+
+typedef struct opusgroup_s opusgroup_t;
+
+typedef struct {
+  opusgroup_t *parent;
+  int index;
+  int channelOffset, channelCount;
+  int dataOffset, dataLen; // this group's part of the packet
+  OpusMSEncoder *encoder;
+  OpusMSDecoder *decoder;
+  float *samples; // channelCount * frameSize interleaved
+  int result;
+  xwait_t startWait;
+  pthread_t thread;
+  bool threadStarted;
+} opusgroup_group_t;
+
+struct opusgroup_s {
+  int channelCount;
+  int groupCount;
+  int frameSize;
+  int dataLen; // sum of the group dataLens
+  opusgroup_group_t groups[OPUSGROUP_MAX_GROUPS];
+
+  // the frame being coded
+  const float *inSamples;
+  uint8_t *outData;
+  const uint8_t *inData; // NULL when concealing a lost frame
+  bool decodeFec;
+
+  atomic_bool running;
+  atomic_int pending; // groups still coding the current frame
+  xwait_t doneWait;
+};
+
+// bitrate is the total for all channels, like OPUS_SET_BITRATE for a single encoder
+int opusgroup_initEncoder (opusgroup_t *g, int channelCount, int groupCount, int bitrate, int frameSize);
+int opusgroup_initDecoder (opusgroup_t *g, int channelCount, int groupCount, int bitrate, int frameSize);
+void opusgroup_deinit (opusgroup_t *g);
+
+// encoded length of every frame, the same on both sides
+int opusgroup_getDataLen (int channelCount, int groupCount, int bitrate, int frameSize);
+
+// inSamples is channelCount * frameSize interleaved, outData must be at least g->dataLen bytes.
+// Returns g->dataLen, or a negative Opus error code.
+int opusgroup_encode (opusgroup_t *g, const float *inSamples, uint8_t *outData);
+
+// inDataLen must be g->dataLen, outSamples is channelCount * frameSize interleaved.
+// Returns frameSize, or a negative number if any group failed to decode.
+int opusgroup_decode (opusgroup_t *g, const uint8_t *inData, int inDataLen, float *outSamples);
+
+// Makes up a frame that never arrived, call it once for each lost frame before decoding the packet after them.
+// For the last lost frame pass that packet as nextData, the frame is then rebuilt from its in-band FEC data if it
+// has any. Otherwise (nextData = NULL, or no FEC data) Opus PLC extrapolates from the previous frames.
+// Returns the same as opusgroup_decode.
+int opusgroup_decodeLost (opusgroup_t *g, const uint8_t *nextData, int nextDataLen, float *outSamples);
+
+// Encoder only. lossPerc > 0 adds in-band FEC data (an LBRR copy of the previous frame) to every packet, sized
+// for that expected packet loss percentage. Opus only does this in SILK and hybrid modes, so it does nothing at
+// bitrates high enough for Opus to pick CELT.
+int opusgroup_setInbandFec (opusgroup_t *g, int lossPerc);
+
+#endif
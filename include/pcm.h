@@ -9,14 +9,20 @@
 #include <stdint.h>
 
 typedef struct {
-  uint16_t crc;
+  uint32_t crc;
+  int crcMode; // PCM_CRC_MODE_*
 } pcm_codec_t;
 
-// outData must be at least 3 * sampleCount + 2 bytes
+void pcm_init (pcm_codec_t *codec, int crcMode);
+
+// number of bytes after the samples: 2 for CRC16, 4 for CRC32C, 0 for no CRC
+int pcm_getCrcLen (int crcMode);
+
+// outData must be at least 3 * sampleCount + pcm_getCrcLen(codec->crcMode) bytes
 // sampleCount = channelCount * frameCount
-int pcm_encode (pcm_codec_t *codec, const double *inSampleBuf, int sampleCount, uint8_t *outData);
+int pcm_encode (pcm_codec_t *codec, const float *inSampleBuf, int sampleCount, uint8_t *outData);
 
-// samples is set to a 24-bit LE packed buffer containing (inDataLen-2)/3 elements
+// samples is set to a 24-bit LE packed buffer containing (inDataLen - CRC length)/3 elements
 // inData and samples reference the same memory, there is no extra malloc
 int pcm_decode (pcm_codec_t *codec, const uint8_t *inData, int inDataLen, const uint8_t **samples);
 
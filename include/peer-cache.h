@@ -0,0 +1,32 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _PEER_CACHE_H
+#define _PEER_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTES:
+// - The last known public address of the peer on each endpoint, so an endpoint that is (re)opened can try the
+//   peer directly while discovery runs, see endpoint.c.
+// - Kept in memory, and in a text file if a path is given so it survives restarts. One line per endpoint:
+//   <peer public key> <endpoint index> <interface> <addr>:<port>. Lines for another peer key or interface are
+//   ignored, and dropped the next time the file is written.
+// - peercache_get and peercache_set are RT safe and can be called from any thread. peercache_save does file I/O,
+//   call it from a thread that isn't realtime.
+
+// path can be NULL or empty to only keep the cache in memory. Returns the number of addresses loaded.
+int peercache_init (const char *path, const char *peerPubKeyStr, int endpointCount);
+void peercache_deinit (void);
+
+// addr and port in network byte order. Returns false if there is no address for the endpoint.
+bool peercache_get (int epIndex, uint32_t *addr, uint16_t *port);
+void peercache_set (int epIndex, uint32_t addr, uint16_t port);
+
+// Writes the file if anything changed since the last call
+int peercache_save (void);
+
+#endif
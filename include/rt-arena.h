@@ -0,0 +1,42 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _RT_ARENA_H
+#define _RT_ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// NOTES:
+// - One memory region for the buffers on the realtime path (audio rings and sample buffers, mux/demux block
+//   buffers, syncer buffers, codec state). rtarena_init maps it, faults every page in and mlocks it, so the RT
+//   threads don't take page faults on first touch or get stalled by swap.
+// - Linux tries explicit huge pages (MAP_HUGETLB) first, then asks for transparent huge pages.
+// - It is a bump allocator: rtarena_free does nothing for arena memory. Everything allocated from it lives until
+//   rtarena_deinit, so only allocate buffers that are set up once at init.
+// - rtarena_alloc takes a mutex, so it isn't RT safe. When the arena is full or rtarena_init has not been called,
+//   it falls back to malloc (and prints a warning once), and rtarena_free frees those.
+
+#define RTARENA_DEFAULT_SIZE_MB 32
+#define RTARENA_ALIGN 128 // GLOBALS_CACHE_LINE
+
+// sizeMb <= 0 uses RTARENA_DEFAULT_SIZE_MB, prints the size and whether it is locked
+int rtarena_init (int sizeMb);
+void rtarena_deinit (void);
+
+// zeroed, RTARENA_ALIGN aligned
+void *rtarena_alloc (size_t size);
+void rtarena_free (void *ptr);
+
+void rtarena_printUsage (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
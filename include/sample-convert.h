@@ -0,0 +1,52 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _SAMPLE_CONVERT_H
+#define _SAMPLE_CONVERT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// NOTES:
+// - Contiguous sample format conversion kernels. count is the number of samples (channelCount * frameCount),
+//   channel selection and deinterleaving are left to the caller.
+// - Integer to float uses the asymmetric scaling from
+//   http://blog.bjornroche.com/2009/12/int-float-int-its-jungle-out-there.html
+//   e.g. x > 0 ? x/32767 : x/32768, and float to integer clamps to [-1.0, 1.0] then does the reverse.
+// - Float to S32 is calculated in single precision, so the positive side saturates at 2147483520 (the largest
+//   float below 2^31) instead of 2147483647.
+// - These are audio callback safe (no syscalls), except for sampleconvert_init.
+
+#define SAMPLECONVERT_IMPL_SCALAR 0
+#define SAMPLECONVERT_IMPL_SSE2 1
+#define SAMPLECONVERT_IMPL_AVX2 2
+#define SAMPLECONVERT_IMPL_NEON 3
+#define SAMPLECONVERT_IMPL_COUNT 4
+
+typedef struct {
+  const char *name;
+  void (*s16ToF32) (const int16_t *in, float *out, int count);
+  void (*s24ToF32) (const uint8_t *in, float *out, int count); // packed 24-bit LE, 3 bytes per sample
+  void (*s32ToF32) (const int32_t *in, float *out, int count);
+  void (*f32ToS32) (const float *in, int32_t *out, int count);
+  void (*f32ToS24) (const float *in, uint8_t *out, int count); // packed 24-bit LE, 3 bytes per sample
+} sampleconvert_kernels_t;
+
+// picks the fastest implementation this CPU supports, call before using sampleconvert_kernels
+void sampleconvert_init (void);
+// returns NULL if impl (SAMPLECONVERT_IMPL_*) was not compiled in or is not supported by this CPU
+const sampleconvert_kernels_t *sampleconvert_getKernels (int impl);
+
+// the implementation picked by sampleconvert_init, falls back to scalar if sampleconvert_init has not been called
+extern const sampleconvert_kernels_t *sampleconvert_kernels;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
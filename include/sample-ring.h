@@ -0,0 +1,127 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _SAMPLE_RING_H
+#define _SAMPLE_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rt-arena.h"
+#ifdef __cplusplus
+#include <atomic>
+using namespace std;
+#else
+#include <stdatomic.h>
+#endif
+
+// NOTES:
+// - Single producer single consumer ring of interleaved audio samples, networkChannelCount samples per frame.
+// - The producer asks for a span of count samples with samplering_writeSpan, fills it in place and then
+//   publishes all of it with one samplering_commitWrite. The consumer does the same with samplering_readSpan
+//   and samplering_commitRead. A span is contiguous except where it wraps around the end of the ring, so it
+//   is returned as two parts: part 0 at the current position and part 1 (possibly empty) at the start of buf.
+// - head and tail are free-running sample counters, the allocated size is rounded up to a power of two so
+//   they can wrap.
+// - Samples are stored as float. Define W_SAMPLE_RING_DOUBLE to store doubles instead.
+// - These are audio callback safe (no syscalls), except for init and deinit.
+
+#ifdef W_SAMPLE_RING_DOUBLE
+typedef double samplering_sample_t;
+#else
+typedef float samplering_sample_t;
+#endif
+
+typedef struct {
+  samplering_sample_t *buf;
+  unsigned int allocSize, mask;
+  atomic_uint head; // written by consumer only
+  atomic_uint tail; // written by producer only
+} samplering_t;
+
+typedef struct {
+  samplering_sample_t *ptr[2];
+  unsigned int len[2];
+} samplering_span_t;
+
+// size is the number of samples the ring can hold, rounded up to the next power of two
+static inline int samplering_init (samplering_t *ring, unsigned int size) {
+  unsigned int allocSize = 1;
+  while (allocSize < size) allocSize <<= 1;
+
+  ring->buf = (samplering_sample_t *)rtarena_alloc(allocSize * sizeof(samplering_sample_t));
+  if (ring->buf == NULL) return -1;
+
+  ring->allocSize = allocSize;
+  ring->mask = allocSize - 1;
+  atomic_store(&ring->head, 0);
+  atomic_store(&ring->tail, 0);
+  return 0;
+}
+
+// number of samples that have been committed by the producer and not yet committed by the consumer
+static inline unsigned int samplering_size (const samplering_t *ring) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return tail - head;
+}
+
+static inline void samplering_setSpan (const samplering_t *ring, unsigned int pos, unsigned int count, samplering_span_t *span) {
+  unsigned int start = pos & ring->mask;
+  unsigned int firstLen = ring->allocSize - start;
+  if (firstLen > count) firstLen = count;
+  span->ptr[0] = &ring->buf[start];
+  span->len[0] = firstLen;
+  span->ptr[1] = ring->buf;
+  span->len[1] = count - firstLen;
+}
+
+// producer only, returns -1 if the ring does not have room for count samples
+static inline int samplering_writeSpan (samplering_t *ring, unsigned int count, samplering_span_t *span) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (ring->allocSize - (tail - head) < count) return -1;
+  samplering_setSpan(ring, tail, count, span);
+  return 0;
+}
+
+// producer only, publishes count samples from the span returned by samplering_writeSpan
+static inline void samplering_commitWrite (samplering_t *ring, unsigned int count) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+}
+
+// consumer only, returns -1 if the ring holds fewer than count samples
+// the span stays valid until samplering_commitRead is called
+static inline int samplering_readSpan (samplering_t *ring, unsigned int count, samplering_span_t *span) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (tail - head < count) return -1;
+  samplering_setSpan(ring, head, count, span);
+  return 0;
+}
+
+// consumer only, releases count samples from the span returned by samplering_readSpan back to the producer
+static inline void samplering_commitRead (samplering_t *ring, unsigned int count) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+}
+
+// consumer only, copies count samples into dest and releases them, returns -1 if the ring holds fewer than count
+static inline int samplering_read (samplering_t *ring, samplering_sample_t *dest, unsigned int count) {
+  samplering_span_t span;
+  if (samplering_readSpan(ring, count, &span) < 0) return -1;
+  memcpy(dest, span.ptr[0], span.len[0] * sizeof(samplering_sample_t));
+  memcpy(&dest[span.len[0]], span.ptr[1], span.len[1] * sizeof(samplering_sample_t));
+  samplering_commitRead(ring, count);
+  return 0;
+}
+
+static inline void samplering_deinit (samplering_t *ring) {
+  rtarena_free(ring->buf);
+  ring->buf = NULL;
+}
+
+#endif
@@ -0,0 +1,93 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _SLOT_RING_H
+#define _SLOT_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rt-arena.h"
+#ifdef __cplusplus
+#include <atomic>
+using namespace std;
+#else
+#include <stdatomic.h>
+#endif
+
+// NOTES:
+// - Single producer single consumer ring of fixed-size slots, e.g. one FEC chunk per slot.
+// - The producer gets a pointer to the next free slot with slotring_writeSlot, fills it in place and then
+//   publishes it with slotring_commitWrite. The consumer does the same with slotring_readSlot and
+//   slotring_commitRead, so data is never copied in or out of the ring word by word.
+// - head and tail are free-running counters, slotCount is rounded up to a power of two so they can wrap.
+// - These are audio callback safe (no syscalls), except for init and deinit.
+
+typedef struct {
+  uint8_t *buf;
+  size_t slotLen;
+  unsigned int slotCount, slotMask;
+  atomic_uint head; // written by consumer only
+  atomic_uint tail; // written by producer only
+} slotring_t;
+
+// slotCount is rounded up to the next power of two
+static inline int slotring_init (slotring_t *ring, unsigned int slotCount, size_t slotLen) {
+  unsigned int allocCount = 1;
+  while (allocCount < slotCount) allocCount <<= 1;
+
+  ring->buf = (uint8_t *)rtarena_alloc(allocCount * slotLen);
+  if (ring->buf == NULL) return -1;
+
+  ring->slotLen = slotLen;
+  ring->slotCount = allocCount;
+  ring->slotMask = allocCount - 1;
+  atomic_store(&ring->head, 0);
+  atomic_store(&ring->tail, 0);
+  return 0;
+}
+
+// number of slots that have been committed by the producer and not yet committed by the consumer
+static inline unsigned int slotring_size (const slotring_t *ring) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return tail - head;
+}
+
+// producer only, returns NULL if the ring is full
+static inline uint8_t *slotring_writeSlot (slotring_t *ring) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == ring->slotCount) return NULL;
+  return &ring->buf[ring->slotLen * (tail & ring->slotMask)];
+}
+
+// producer only, call after filling the slot returned by slotring_writeSlot
+static inline void slotring_commitWrite (slotring_t *ring) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// consumer only, returns NULL if the ring is empty
+// the slot stays valid until slotring_commitRead is called
+static inline uint8_t *slotring_readSlot (slotring_t *ring) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (tail == head) return NULL;
+  return &ring->buf[ring->slotLen * (head & ring->slotMask)];
+}
+
+// consumer only, releases the slot returned by slotring_readSlot back to the producer
+static inline void slotring_commitRead (slotring_t *ring) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline void slotring_deinit (slotring_t *ring) {
+  rtarena_free(ring->buf);
+  ring->buf = NULL;
+}
+
+#endif
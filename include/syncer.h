@@ -11,7 +11,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
-#include "ck/ck_ring.h"
+#include "sample-ring.h"
 
 /////////////////////
 // private
@@ -19,16 +19,25 @@ extern "C" {
 
 int _syncer_initResampState (double srcRate, double dstRate, int maxInBufFrames);
 int _syncer_initReceiverSync (double srcRate);
+void _syncer_setRateRatio (double ratio); // resampler output frames per input frame, published for syncer_onPacket
 int _syncer_enqueueSamples (double **samples, int frameCount, bool setStats);
 int _syncer_stepResampState (double **samples, int frameCount, bool setStats, int offset);
 void _syncer_deinitResampState (void);
 void _syncer_deinitReceiverSync (void);
+double _syncer_getResampStateRatio (void);
+int _syncer_changeResampStateRate (double srcRate);
+
+int _syncer_initVariResamp (double srcRate, double dstRate, int maxInBufFrames);
+int _syncer_stepVariResamp (double **samples, int frameCount, bool setStats);
+void _syncer_deinitVariResamp (void);
+double _syncer_getVariResampRatio (void);
+int _syncer_changeVariResampRate (double srcRate);
 
 /////////////////////
 // public
 /////////////////////
 
-int syncer_init (double srcRate, double dstRate, int maxInBufFrames, ck_ring_t *ring, ck_ring_buffer_t *ringBuf, int fullRingSize);
+int syncer_init (double srcRate, double dstRate, int maxInBufFrames, samplering_t *ring, int fullRingSize);
 
 // NOTES:
 // - This returns the new ratio when the rate change has completed, not immediately after calling syncer_changeRate
@@ -41,9 +50,14 @@ void syncer_onPacket (int seq, int audioFrameSize);
 // NOTES:
 // - This function is thread-safe (call it from anywhere).
 // - This function is asynchronous and returns immediately but the actual rate change takes a while to complete.
-// - The rate change could take > 100 ms due to constructing a new resampler which is expensive.
+// - The rate change could take > 100 ms due to constructing a new resampler which is expensive, unless srcRate is
+//   within SYNCER_RESAMP_CACHE_SIZE / 2 SYNCER_RATE_STEPs of the current rate, in which case a prebuilt one is used.
+// - srcRate is rounded to the nearest SYNCER_RATE_STEP from the initial srcRate, returns 0 without doing anything
+//   if that is the current rate.
 // - Changing the srcRate will cause a smooth blip on the waveform lasting a few ms, but it should not cause a click. I'm not sure if it's very audible.
 // - Try to keep each rate change within +/- 10 Hz.
+// - With resamplerMode SYNCER_RESAMPLER_VARIABLE none of the above applies: srcRate is not rounded and the ratio
+//   slews to it within a few tens of ms without any blip, and syncer_getRateRatio follows the ratio actually in use.
 // - Decreasing srcRate = receiverSync slopes up (increasing) = ring more full
 // - Increasing srcRate = receiverSync slopes down (decreasing) = ring less full
 int syncer_changeRate (double srcRate);
@@ -59,6 +73,9 @@ int syncer_changeRate (double srcRate);
 // -3: mixResamps: overflow in abMixOverflowLen, rate change was too much (fromOverflows)
 // -4: mixResamps: overflow in abMixOverflowLen, rate change was too much (toOverflows)
 // -5: stepResampState was called while in StoppingManager state. This is very bad!
+// -6: inChannelCount * inFrameCount is larger than the conversion buffer allocated in syncer_init
+// -7: inFrameCount is larger than the maxInBufFrames passed to syncer_init (SYNCER_RESAMPLER_VARIABLE only)
+// -2 to -5 only happen with SYNCER_RESAMPLER_CROSSFADE
 int syncer_enqueueBufS16 (const int16_t *inBuf, int inFrameCount, int inChannelCount, bool setStats); // for Android
 int syncer_enqueueBufS24Packed (const uint8_t *inBuf, int inFrameCount, int inChannelCount, bool setStats); // for PCM
 int syncer_enqueueBufS32 (const int32_t *inBuf, int inFrameCount, int inChannelCount, bool setStats); // for Android
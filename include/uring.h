@@ -0,0 +1,80 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// NOTES:
+// - Minimal io_uring wrapper on the raw syscalls (no liburing), Linux only. Used by the io_uring endpoint backend
+//   and bench/endpoint-io.c.
+// - A ring must only be used by one thread. uring_init is called from that thread so IORING_SETUP_SINGLE_ISSUER
+//   can be used.
+// - Registered files: uring_registerFiles creates a table of count empty slots, uring_updateFile puts a socket in
+//   a slot. SQEs then use the slot index as fd together with IOSQE_FIXED_FILE.
+// - Provided buffers: uring_initBufRing registers bufCount buffers of bufLen bytes as buffer group groupId, for
+//   receives with IOSQE_BUFFER_SELECT (e.g. multishot recv). Give each buffer back with uring_recycleBuf once the
+//   CQE that used it has been handled.
+
+typedef struct {
+  int fd;
+
+  unsigned *sqHead, *sqTail, *sqArray;
+  unsigned sqMask, sqEntries;
+  unsigned sqLocalTail; // SQEs filled in so far, published to the kernel by uring_submitAndWait
+  struct io_uring_sqe *sqes;
+
+  unsigned *cqHead, *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  void *ringPtr;
+  size_t ringLen, sqesLen;
+
+  struct io_uring_buf_ring *bufRing;
+  uint8_t *bufs;
+  size_t bufRingLen;
+  unsigned bufCount, bufLen;
+  uint16_t bufGroupId, bufTail;
+} uring_t;
+
+// flags are IORING_SETUP_*. Returns -errno if the kernel doesn't support io_uring or any of the flags.
+int uring_init (uring_t *ring, unsigned entries, unsigned flags);
+void uring_deinit (uring_t *ring);
+
+// zeroed, NULL if the SQ is full
+struct io_uring_sqe *uring_getSqe (uring_t *ring);
+
+// Submits the SQEs filled in since the last call, then waits for at least waitCount CQEs or timeoutUs
+// (< 0 = no timeout). Returns the number of SQEs submitted, or -errno. Timing out is not an error.
+int uring_submitAndWait (uring_t *ring, unsigned waitCount, int timeoutUs);
+
+int uring_registerFiles (uring_t *ring, unsigned count);
+int uring_updateFile (uring_t *ring, unsigned index, int fd); // fd = -1 empties the slot
+
+// bufCount must be a power of two
+int uring_initBufRing (uring_t *ring, uint16_t groupId, unsigned bufCount, unsigned bufLen);
+void uring_recycleBuf (uring_t *ring, uint16_t bufId);
+
+static inline uint8_t *uring_getBuf (uring_t *ring, uint16_t bufId) {
+  return &ring->bufs[(size_t)bufId * ring->bufLen];
+}
+
+// NULL if there are no CQEs. Call uring_advanceCq after handling each one.
+static inline struct io_uring_cqe *uring_peekCqe (uring_t *ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+  return &ring->cqes[head & ring->cqMask];
+}
+
+static inline void uring_advanceCq (uring_t *ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -12,16 +12,6 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "ck/ck_ring.h"
-
-// wrapper functions for ck_ring that work on both 32-bit and 64-bit architectures
-// size is the number of doubles ring can hold
-int utils_ringInit (ck_ring_t *ring, ck_ring_buffer_t **ringBuf, int size);
-unsigned int utils_ringSize (const ck_ring_t *ring);
-// NOTE: enqueue and dequeue have no bounds checking, call ringSize first!
-double utils_ringDequeueSample (ck_ring_t *ring, ck_ring_buffer_t *ringBuf);
-void utils_ringEnqueueSample (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, double x);
-void utils_ringDeinit (ck_ring_t *ring, ck_ring_buffer_t *ringBuf);
 
 // NOTE: us must be < 1000000 (1 second)
 void utils_usleep (unsigned int us);
@@ -29,20 +19,24 @@ void utils_usleep (unsigned int us);
 int utils_getCurrentUTime (void);
 // return value is in microseconds, intervals of > 500_000_000 us may return an incorrect value
 int utils_getElapsedUTime (int lastUTime);
+// for scheduling, does not roll over
+int64_t utils_getMonotonicNs (void);
+// sleep until utils_getMonotonicNs would return ns, returns straight away if that is in the past
+void utils_sleepUntilNs (int64_t ns);
 
+// core < 0 leaves the affinity alone, priority <= 0 leaves the scheduling policy alone
 int utils_setCallerThreadRealtime (int priority, int core);
+// THREAD_ROLE_* from the name used in the init config, or -1
+int utils_getThreadRole (const char *name);
+// Applies the placement from the threads init config for role (THREAD_ROLE_*), or the defaults if it is not
+// configured (-1 = leave to the OS), and prints where the thread ended up. Returns utils_setCallerThreadRealtime's
+// error.
+int utils_setCallerThreadRole (int role, int instance, int defaultPriority, int defaultCore);
 
 uint16_t utils_readU16LE (const uint8_t *buf);
 int utils_writeU16LE (uint8_t *buf, uint16_t val);
-
-// call utils_setAudioLevelFilters before using utils_setAudioStats
-void utils_setAudioLevelFilters (void);
-void utils_setAudioStats (double sample, int channel);
-
-double utils_s16ToDouble (const int16_t *inBuf, int index);
-// 24-bit index, i.e. 1 unit in index equals 3 bytes in inBuf
-double utils_s24ToDouble (const uint8_t *inBuf, int index);
-double utils_s32ToDouble (const int32_t *inBuf, int index);
+uint32_t utils_readU32LE (const uint8_t *buf);
+int utils_writeU32LE (uint8_t *buf, uint32_t val);
 
 // min is inclusive, max is not inclusive
 // call srand() first
@@ -59,7 +53,13 @@ uint8_t *utils_base64Decode (const uint8_t *src, size_t len, size_t *out_len);
 int utils_x25519Base64ToBuf (uint8_t *keyBuf, const char *keyStr);
 
 uint32_t utils_crc32 (uint32_t crc, const uint8_t *buf, int bufLen);
+// builds the CRC tables and picks the CRC32C implementation, call before utils_crc16 and utils_crc32c
+void utils_initCrc (void);
+// "hardware", "slicing-by-8", or "bitwise" before utils_initCrc
+const char *utils_getCrc32cImplName (void);
 uint16_t utils_crc16 (uint16_t crc, const uint8_t *buf, int bufLen);
+// CRC32C (Castagnoli)
+uint32_t utils_crc32c (uint32_t crc, const uint8_t *buf, int bufLen);
 
 #ifdef __cplusplus
 }
@@ -24,11 +24,16 @@
 // refs:
 // - https://stackoverflow.com/a/27847103
 // - https://stackoverflow.com/a/77147230/23387122
+// On Linux the top bit of the futex word is set while the (single) waiter is asleep, so xwait_notify only
+// does a syscall when there is someone to wake. This makes xwait_notify safe to call from audio callbacks
+// when the waiting thread is already busy. macOS dispatch_semaphore_signal only traps if there is a waiter.
+// Only one thread may wait on each handle.
 
 #ifdef __APPLE__
   typedef dispatch_semaphore_t xwait_t;
 #else
   typedef _Atomic uint32_t xwait_t;
+  #define XWAIT_SLEEPING 0x80000000u
 #endif
 
 static inline void xwait_init (xwait_t *handle) {
@@ -43,9 +48,19 @@ static inline void xwait_wait (xwait_t *handle) {
 #ifdef __APPLE__
   dispatch_semaphore_wait(*handle, DISPATCH_TIME_FOREVER);
 #else
-  // wait iff *handle == 0
-  syscall(SYS_futex, handle, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
-  atomic_fetch_sub(handle, 1);
+  uint32_t val = atomic_load(handle);
+  for (;;) {
+    if (val & ~XWAIT_SLEEPING) {
+      // there is a pending notify, take it
+      if (atomic_compare_exchange_weak(handle, &val, val - 1)) return;
+      continue;
+    }
+
+    // tell xwait_notify we are about to sleep, then wait iff nothing has changed since
+    if (!atomic_compare_exchange_weak(handle, &val, val | XWAIT_SLEEPING)) continue;
+    syscall(SYS_futex, handle, FUTEX_WAIT_PRIVATE, val | XWAIT_SLEEPING, NULL, NULL, 0);
+    val = atomic_fetch_and(handle, ~XWAIT_SLEEPING) & ~XWAIT_SLEEPING;
+  }
 #endif
 }
 
@@ -53,8 +68,8 @@ static inline void xwait_notify (xwait_t *handle) {
 #ifdef __APPLE__
   dispatch_semaphore_signal(*handle);
 #else
-  atomic_fetch_add(handle, 1);
-  syscall(SYS_futex, handle, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  uint32_t prev = atomic_fetch_add(handle, 1);
+  if (prev & XWAIT_SLEEPING) syscall(SYS_futex, handle, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 #endif
 }
 
@@ -10,7 +10,7 @@ CPP = g++
 PROTOC = bin/protoc
 PROTOCFLAGS = --cpp_out=.
 
-CFLAGS = -D_POSIX_C_SOURCE=200809L -std=c17 -O3 -fstrict-aliasing -pedantic -pedantic-errors -Wall -Wextra -I./include -I./include/deps -I./include/deps/ck
+CFLAGS = -D_POSIX_C_SOURCE=200809L -DW_IO_URING -std=c17 -O3 -fstrict-aliasing -pedantic -pedantic-errors -Wall -Wextra -I./include -I./include/deps -I./include/deps/ck
 CPPFLAGS = -std=c++20 -O3 -fstrict-aliasing -Wall -Wextra -I./include -I./include/deps -I./include/deps/ck
 ORIGIN=$ORIGIN
 O=$$O
@@ -19,11 +19,11 @@ LIBS = -lstdc++ -ldl -lm -lssl -lcrypto -lz -lopus -luwebsockets -lraptorq -lck
 
 TARGET = waterslide-linux-x64
 PROTOBUFS = init-config.proto monitor.proto
-SRCSC = main.c audio-linux.c sender.c receiver.c globals.c utils.c mux.c demux.c endpoint.c pcm.c event-recorder.c
-SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/receiver-sync.cpp config.cpp monitor.cpp $(subst .proto,.pb.cpp,$(addprefix protobufs/,$(PROTOBUFS)))
+SRCSC = main.c audio-linux.c sender.c receiver.c globals.c utils.c mux.c demux.c endpoint.c peer-cache.c pcm.c lossless.c opus-group.c rt-arena.c uring.c sample-convert.c audio-meter.c event-recorder.c
+SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/vari-resamp.cpp syncer/receiver-sync.cpp config.cpp monitor.cpp $(subst .proto,.pb.cpp,$(addprefix protobufs/,$(PROTOBUFS)))
 OBJS = $(subst .c,.o,$(addprefix src/,$(SRCSC))) $(subst .cpp,.o,$(addprefix src/,$(SRCSCPP)))
 
-.PHONY: exit setup
+.PHONY: exit setup bench
 
 all: exit setup protobufs bin/$(TARGET)
 
@@ -45,6 +45,26 @@ setup:
 bin/$(TARGET): $(OBJS)
 	$(CC) $(LDFLAGS) -o $@ $(subst src,obj,$(OBJS)) $(LIBS)
 
+# sample format conversion microbenchmark, see bench/sample-convert.c
+# poll vs io_uring network backend benchmark, see bench/endpoint-io.c
+# mux/demux/syncer pipeline benchmark with a simulated lossy network, see bench/pipeline.c
+bench: bin/sample-convert-bench bin/endpoint-io-bench bin/pipeline-bench
+
+bin/sample-convert-bench: bench/sample-convert.c src/sample-convert.c
+	mkdir -p bin
+	$(CC) $(CFLAGS) $(LDFLAGS) -o $@ bench/sample-convert.c src/sample-convert.c
+
+bin/endpoint-io-bench: bench/endpoint-io.c src/uring.c
+	mkdir -p bin
+	$(CC) $(CFLAGS) $(LDFLAGS) -o $@ bench/endpoint-io.c src/uring.c
+
+PIPELINE_BENCH_SRCSC = globals.c utils.c mux.c demux.c pcm.c opus-group.c rt-arena.c sample-convert.c audio-meter.c event-recorder.c
+PIPELINE_BENCH_SRCSCPP = syncer/enqueue.cpp syncer/resamp-state.cpp syncer/vari-resamp.cpp syncer/receiver-sync.cpp
+PIPELINE_BENCH_OBJS = $(subst .c,.o,$(addprefix src/,$(PIPELINE_BENCH_SRCSC))) $(subst .cpp,.o,$(addprefix src/,$(PIPELINE_BENCH_SRCSCPP)))
+bin/pipeline-bench: setup $(PIPELINE_BENCH_OBJS)
+	mkdir -p bin
+	$(CC) $(CFLAGS) $(LDFLAGS) -o $@ bench/pipeline.c $(subst src,obj,$(PIPELINE_BENCH_OBJS)) $(LIBS)
+
 .c.o:
 	$(CC) $(CFLAGS) -c $< -o $(subst src,obj,$@)
 
@@ -57,3 +77,6 @@ clean:
 		$(subst .proto,.pb.cpp,$(addprefix src/protobufs/,$(PROTOBUFS))) \
 		$(subst .proto,.pb.h,$(addprefix include/protobufs/,$(PROTOBUFS))) \
 		bin/$(TARGET) \
+		bin/sample-convert-bench \
+		bin/pipeline-bench \
+		bin/endpoint-io-bench \
@@ -12,31 +12,218 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "uWebSockets/libuwebsockets.h"
 
 #define UNUSED __attribute__((unused))
 #define WS_PORT 7681
 #define UDP_PORT 26173
-#define RECV_BUF_LEN 5000
+#define RECV_BUF_LEN 65536
 #define RECV_LOOP_IDLE_INTERVAL 200000 // microseconds
+#define MAX_NODES 64 // one bit each in client_t.syncedNodes
+#define NODE_EXPIRY_US 10000000 // a node is forgotten after this long without a frame
+#define NODE_EXPIRY_CHECK_INTERVAL_US 1000000
+#define NODE_MAX_REPLAY_FRAMES 200 // waterslide sends a key frame every 100 frames
+
+// NOTES:
+// - Any number of waterslide nodes (monitor udpPort/udpAddr in their init config) can send frames here, and any
+//   number of monitor clients can connect. Each frame is forwarded to every client, tagged with the node it came
+//   from (the node field of MonitorProto), so the monitor can show the nodes separately.
+// - The tag is appended to the datagram as an encoded protobuf field, which protobuf merges into the message, so
+//   frames don't need to be parsed or serialized again. Each frame is tagged once and the same bytes go to every
+//   client.
+// - Most frames are deltas (see src/monitor.cpp), so for each node we keep the last key frame and the frames after
+//   it, and replay them to clients that connect in between. A client that can't keep up has frames dropped, and
+//   gets nothing more from that node until its next key frame.
+
+typedef struct {
+  uint32_t addr; // network byte order
+  uint16_t port; // network byte order, 0 = unused
+  std::string name, tag; // tag is the encoded node field
+  std::vector<std::string> replay; // tagged frames: the last key frame and the ones after it
+  bool replayValid; // false until the first key frame, or if there were too many frames after it
+  int64_t lastRecvUs;
+} node_t;
+
+typedef struct {
+  uws_ws_t *ws;
+  uint64_t syncedNodes; // bit per nodes[] index, set if the client has the node's frames since a key frame
+} client_t;
 
 static std::atomic_bool running = true;
-static std::atomic<uws_ws_t*> wsClient = NULL;
+// nodes and clients are used by both the ws thread and the UDP loop
+static std::mutex stateMutex;
+static node_t nodes[MAX_NODES];
+static std::vector<client_t> clients;
+
+static int64_t getMonotonicUs (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool readVarint (const uint8_t *buf, size_t len, size_t *pos, uint64_t *val) {
+  *val = 0;
+  for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+    uint8_t byte = buf[(*pos)++];
+    *val |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+static void writeVarint (std::string &dest, uint64_t val) {
+  while (val >= 0x80) {
+    dest.push_back((char)(val | 0x80));
+    val >>= 7;
+  }
+  dest.push_back((char)val);
+}
+
+// walks the top level fields of a MonitorProto, returns true if keyFrame (field 2) is set
+static bool isKeyFrame (const uint8_t *buf, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    uint64_t key, val;
+    if (!readVarint(buf, len, &pos, &key)) return false;
+    switch (key & 7) {
+      case 0: // varint
+        if (!readVarint(buf, len, &pos, &val)) return false;
+        if ((key >> 3) == 2) return val != 0;
+        break;
+      case 1: // 64 bit
+        pos += 8;
+        break;
+      case 2: // length delimited
+        if (!readVarint(buf, len, &pos, &val) || val > len - pos) return false;
+        pos += val;
+        break;
+      case 5: // 32 bit
+        pos += 4;
+        break;
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+// stateMutex must be held, returns false if the client can't keep up
+static bool sendToClient (client_t &client, const std::string &frame) {
+  return uws_wsSend(client.ws, frame.data(), frame.length(), UWS_OPCODE_BINARY) >= 0;
+}
 
 static void openHandler(uws_ws_t *ws) {
-  printf("ws client connected\n");
-  wsClient = ws;
+  std::lock_guard<std::mutex> lock(stateMutex);
+  clients.push_back({ ws, 0 });
+  client_t &client = clients.back();
+  printf("ws client connected (%zu clients)\n", clients.size());
+
+  // catch the new client up on every node
+  for (int i = 0; i < MAX_NODES; i++) {
+    if (nodes[i].port == 0 || nodes[i].replay.empty()) continue;
+    bool synced = true;
+    for (const std::string &frame : nodes[i].replay) {
+      if (!sendToClient(client, frame)) {
+        synced = false;
+        break;
+      }
+    }
+    if (synced) client.syncedNodes |= (uint64_t)1 << i;
+  }
 }
 
 static void messageHandler(UNUSED uws_ws_t *ws, UNUSED const char *msg, UNUSED size_t length, UNUSED unsigned char opCode) {
   // printf("message (code: %d, length: %zu): %.*s\n", opCode, length, length, msg);
 }
 
-static void closeHandler(UNUSED uws_ws_t *ws, UNUSED int code) {
-  printf("ws client disconnected\n");
-  wsClient = NULL;
+static void closeHandler(uws_ws_t *ws, UNUSED int code) {
+  std::lock_guard<std::mutex> lock(stateMutex);
+  for (auto it = clients.begin(); it != clients.end(); it++) {
+    if (it->ws == ws) {
+      clients.erase(it);
+      break;
+    }
+  }
+  printf("ws client disconnected (%zu clients)\n", clients.size());
+}
+
+// stateMutex must be held, returns the nodes[] index or -1 if there is no room
+static int getNode (const struct sockaddr_in *addr, int64_t nowUs) {
+  int freeIndex = -1;
+  for (int i = 0; i < MAX_NODES; i++) {
+    node_t *node = &nodes[i];
+    if (node->port == 0) {
+      if (freeIndex < 0) freeIndex = i;
+      continue;
+    }
+    if (node->addr == addr->sin_addr.s_addr && node->port == addr->sin_port) return i;
+  }
+  if (freeIndex < 0) return -1;
+
+  node_t *node = &nodes[freeIndex];
+  char addrString[INET_ADDRSTRLEN] = { 0 };
+  inet_ntop(AF_INET, &addr->sin_addr, addrString, sizeof(addrString));
+  node->name = std::string(addrString) + ":" + std::to_string(ntohs(addr->sin_port));
+  node->addr = addr->sin_addr.s_addr;
+  node->port = addr->sin_port;
+  node->tag.clear();
+  node->tag.push_back((char)(3 << 3 | 2)); // field 3 (node), length delimited
+  writeVarint(node->tag, node->name.length());
+  node->tag += node->name;
+  node->replay.clear();
+  node->replayValid = false;
+  node->lastRecvUs = nowUs;
+  for (client_t &client : clients) client.syncedNodes &= ~((uint64_t)1 << freeIndex);
+  printf("node %s connected\n", node->name.c_str());
+  return freeIndex;
+}
+
+// stateMutex must be held
+static void expireNodes (int64_t nowUs) {
+  for (int i = 0; i < MAX_NODES; i++) {
+    node_t *node = &nodes[i];
+    if (node->port == 0 || nowUs - node->lastRecvUs < NODE_EXPIRY_US) continue;
+    printf("node %s timed out\n", node->name.c_str());
+    node->port = 0;
+    node->replay.clear();
+    node->replay.shrink_to_fit();
+  }
+}
+
+static void onFrame (const uint8_t *buf, size_t len, const struct sockaddr_in *addr) {
+  int64_t nowUs = getMonotonicUs();
+  std::lock_guard<std::mutex> lock(stateMutex);
+  int nodeIndex = getNode(addr, nowUs);
+  if (nodeIndex < 0) return; // MAX_NODES already sending
+  node_t *node = &nodes[nodeIndex];
+  node->lastRecvUs = nowUs;
+
+  bool keyFrame = isKeyFrame(buf, len);
+  if (keyFrame) {
+    node->replay.clear();
+    node->replayValid = true;
+  } else if (node->replay.size() == NODE_MAX_REPLAY_FRAMES) {
+    // the node isn't sending key frames often enough, new clients will wait for the next one
+    node->replay.clear();
+    node->replayValid = false;
+  }
+  std::string frame((const char *)buf, len);
+  frame += node->tag;
+
+  uint64_t nodeBit = (uint64_t)1 << nodeIndex;
+  for (client_t &client : clients) {
+    if (keyFrame) client.syncedNodes |= nodeBit;
+    if (!(client.syncedNodes & nodeBit)) continue;
+    if (!sendToClient(client, frame)) client.syncedNodes &= ~nodeBit;
+  }
+
+  if (node->replayValid) node->replay.push_back(std::move(frame));
 }
 
 static void listenHandler(void *listenSocket) {
@@ -60,7 +247,7 @@ static void sigintHandler (UNUSED int signum) {
 }
 
 int main () {
-  printf("Waterslide monitor UDP server, build 1\n");
+  printf("Waterslide monitor UDP server, build 2\n");
 
   uint8_t *recvBuf = (uint8_t *)malloc(RECV_BUF_LEN);
   if (recvBuf == NULL) {
@@ -105,12 +292,22 @@ int main () {
   memset(&recvAddr, 0, sizeof(recvAddr));
 
   signal(SIGINT, sigintHandler);
+  int64_t lastExpireUs = getMonotonicUs();
 
   while (running) {
     socklen_t recvAddrLen = sizeof(recvAddr);
     ssize_t recvLen = recvfrom(sock, recvBuf, RECV_BUF_LEN, 0, (struct sockaddr*)&recvAddr, &recvAddrLen);
+    int recvErrno = errno;
+
+    int64_t nowUs = getMonotonicUs();
+    if (nowUs - lastExpireUs >= NODE_EXPIRY_CHECK_INTERVAL_US) {
+      lastExpireUs = nowUs;
+      std::lock_guard<std::mutex> lock(stateMutex);
+      expireNodes(nowUs);
+    }
+    if (recvLen < 0 && (recvErrno == EAGAIN || recvErrno == EWOULDBLOCK)) continue; // no frames for a while
 
-    if (wsClient == NULL || recvLen < 0 || recvAddrLen != sizeof(recvAddr)) {
+    if (recvLen <= 0 || recvAddrLen != sizeof(recvAddr)) {
       // if something is going wrong keep the CPU usage down
       struct timespec tsp;
       tsp.tv_nsec = 20000000; // 20 ms
@@ -119,7 +316,7 @@ int main () {
       continue;
     }
 
-    uws_wsSend(wsClient, (char *)recvBuf, recvLen, UWS_OPCODE_BINARY);
+    onFrame(recvBuf, recvLen, &recvAddr);
   }
 
   printf("\nclosing...\n");
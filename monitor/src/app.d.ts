@@ -18,17 +18,35 @@ namespace App {
     crcFailCount?: number
   }
 
+  interface LosslessStats {
+    codecErrorCount?: number
+    compressionRatio?: number
+  }
+
+  interface LatencyStats {
+    bins?: number[]
+    lastUs?: number
+  }
+
   interface AudioStats {
     audioChannel?: AudioChannel[]
     streamBufferSize?: number
     streamMeterBins?: Uint8Array
     bufferOverrunCount?: number
     bufferUnderrunCount?: number
+    concealedFrameCount?: number
+    lateFrameCount?: number
     encodeThreadJitterCount?: number
     audioLoopXrunCount?: number
+    audioLoopSpuriousWakeCount?: number
     clockError?: number
+    syncError?: number
+    syncErrorVariance?: number
+    latency?: LatencyStats[]
+    latencyBinUs?: number
     opusStats?: OpusStats
     pcmStats?: PCMStats
+    losslessStats?: LosslessStats
   }
 
   interface EndpointStats {
@@ -38,12 +56,24 @@ namespace App {
     bytesOut?: number
     bytesIn?: number
     sendCongestion?: number
+    recvBatchCount?: number
+    recvBatchPacketCount?: number
+    sendBatchCount?: number
+    sendBatchPacketCount?: number
+    dupChunkCount?: number
+    lateChunkCount?: number
+    sendShare?: number
+    health?: number
+    healthTransitionCount?: number
   }
 
   interface MonitorData {
     dupBlockCount?: number
     oooBlockCount?: number
     blockTiming?: Uint8Array
+    blockArrivalTiming?: Uint8Array
+    fastPathBlockCount?: number
+    encodeQueueDepth?: number
     endpoint?: EndpointStats[]
     audioStats?: AudioStats
   }
@@ -0,0 +1,67 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// NOTES:
+// - Rebuilds the full stats from the delta frames sent by src/monitor.cpp. A key frame replaces the state, other
+//   frames add to the counters, append to the block timing rings and replace everything else.
+// - counterFields must match the counters sent with DELTA() in monitor.cpp.
+
+const counterFields = new Set([
+  'clippingCount',
+  'dupBlockCount', 'oooBlockCount', 'fastPathBlockCount',
+  'bytesOut', 'bytesIn', 'sendCongestion',
+  'recvBatchCount', 'recvBatchPacketCount', 'sendBatchCount', 'sendBatchPacketCount',
+  'dupChunkCount', 'lateChunkCount', 'healthTransitionCount',
+  'bufferOverrunCount', 'bufferUnderrunCount', 'concealedFrameCount', 'lateFrameCount', 'encodeThreadJitterCount',
+  'audioLoopXrunCount', 'audioLoopSpuriousWakeCount',
+  'codecErrorCount', 'crcFailCount',
+  'bins'
+])
+
+// only the new entries are sent, the UI keeps the same number of entries as the ring in monitor.cpp
+const ringFields = new Set(['blockTiming', 'blockArrivalTiming'])
+
+// only sent every few frames
+const keepIfEmptyFields = new Set(['streamMeterBins'])
+
+const appendRing = (prev: Uint8Array, added: Uint8Array): Uint8Array => {
+  if (added.length === 0) return prev
+  const ring = new Uint8Array(prev.length)
+  if (added.length >= prev.length) {
+    ring.set(added.subarray(added.length - prev.length))
+  } else {
+    ring.set(prev.subarray(added.length))
+    ring.set(added, prev.length - added.length)
+  }
+  return ring
+}
+
+const merge = (prev: any, frame: any, counter: boolean): any => {
+  if (prev === undefined || prev === null) return frame
+  if (frame instanceof Uint8Array) return frame
+  if (Array.isArray(frame)) {
+    return frame.map((value, i) => merge(prev[i], value, counter))
+  }
+  if (typeof frame === 'object' && frame !== null) {
+    const merged = {}
+    for (const key of Object.keys(frame)) {
+      if (ringFields.has(key)) {
+        merged[key] = appendRing(prev[key], frame[key])
+      } else if (keepIfEmptyFields.has(key) && frame[key].length === 0) {
+        merged[key] = prev[key]
+      } else {
+        merged[key] = merge(prev[key], frame[key], counterFields.has(key))
+      }
+    }
+    return merged
+  }
+  return counter ? prev + frame : frame
+}
+
+// frame must be converted with toObject({ longs: Number, defaults: true, arrays: true }) so every field is present
+export const applyFrame = (state: any, frame: any): any => {
+  if (frame.keyFrame || state === null) return frame
+  return merge(state, frame, false)
+}
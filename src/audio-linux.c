@@ -12,28 +12,39 @@
 #include <stdatomic.h>
 #include <time.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include "tinyalsa/pcm.h"
 #include "globals.h"
 #include "utils.h"
 #include "syncer.h"
+#include "sample-convert.h"
+#include "audio-meter.h"
+#include "event-recorder.h"
 #include "audio.h"
 
-static ck_ring_t *_ring;
-static ck_ring_buffer_t *_ringBuf;
+static samplering_t *_ring;
 static unsigned int _fullRingSize;
+static xwait_t *_ringNotifyHandle = NULL;
+static unsigned int _ringNotifySize = 0;
 static bool _receiver;
 static unsigned int bytesPerSample, networkChannelCount, deviceChannelCount, audioEncoding;
 static pthread_t audioLoopThread;
 static xwait_t audioLoopInitWait;
 static atomic_int audioLoopStatus = 0;
 
+// In microseconds. AUDIO_LOOP_MODE_TIMER wakes this long after the hw pointer is expected to cross
+// into the next half of the DMA buffer, so that it has actually crossed when we check it.
+#define TIMER_MARGIN_US 200
+
 // This is on the RT thread for receiver
 static void dmaBufWrite (uint8_t *dmaBuf, unsigned int frameCount) {
   static bool ringUnderrun = true; // let ring fill to half before we start dequeuing
-  unsigned int ringCurrentSize = utils_ringSize(_ring);
+  unsigned int ringCurrentSize = samplering_size(_ring);
 
   memset(dmaBuf, 0, bytesPerSample * deviceChannelCount * frameCount);
 
+  EVENTRECORDER_TRACE(EVENTRECORDER_ID_DMA_WRITE, ringCurrentSize);
   syncer_onAudio(frameCount);
 
   if (ringUnderrun) {
@@ -54,25 +65,50 @@ static void dmaBufWrite (uint8_t *dmaBuf, unsigned int frameCount) {
     return;
   }
 
-  for (unsigned int i = 0; i < frameCount; i++) {
-    for (unsigned int j = 0; j < networkChannelCount; j++) {
-      // If networkChannelCount > networkChannelCount, dequeue the sample then discard it.
+  unsigned int sampleCount = networkChannelCount * frameCount;
+  samplering_span_t span;
+  samplering_readSpan(_ring, sampleCount, &span); // ring size is checked above
+
+  #ifndef W_SAMPLE_RING_DOUBLE
+  if (deviceChannelCount == networkChannelCount) {
+    // The channels line up, so convert each part of the span straight into dmaBuf with the SIMD kernel.
+    // NOTE: Only bytesPerSample = 4 is implemented
+    int32_t *dmaBufS32 = (int32_t *)dmaBuf;
+    sampleconvert_kernels->f32ToS32(span.ptr[0], dmaBufS32, span.len[0]);
+    sampleconvert_kernels->f32ToS32(span.ptr[1], &dmaBufS32[span.len[0]], span.len[1]);
+    audiometer_meterSpan(&span, networkChannelCount);
+    samplering_commitRead(_ring, sampleCount);
+    return;
+  }
+  #endif
+
+  unsigned int i = 0, j = 0;
+  for (int s = 0; s < 2; s++) {
+    for (unsigned int k = 0; k < span.len[s]; k++) {
+      // If networkChannelCount > deviceChannelCount, skip over the sample.
       // If networkChannelCount < deviceChannelCount, don't write to the remaining channels in outBuf,
       // they are already set to zero above.
       // NOTE: audio-linux and audio-macos have different behaviour when deviceChannelCount < networkChannelCount:
       // - audio-linux: output the first deviceChannelCount channels and discard the rest
       // - audio-macos: don't proceed, return an error from audio_init
-      double outSampleDouble = utils_ringDequeueSample(_ring, _ringBuf);
-      if (j >= deviceChannelCount) continue;
-      if (outSampleDouble < -1.0) outSampleDouble = -1.0;
-      else if (outSampleDouble > 1.0) outSampleDouble = 1.0;
-      // NOTE: Only bytesPerSample = 4 is implemented
-      // http://blog.bjornroche.com/2009/12/int-float-int-its-jungle-out-there.html
-      int32_t sampleInt = outSampleDouble > 0.0 ? 2147483647.0*outSampleDouble : 2147483648.0*outSampleDouble;
-      memcpy(&dmaBuf[4 * (deviceChannelCount*i + j)], &sampleInt, 4);
-      utils_setAudioStats(outSampleDouble, j);
+      if (j < deviceChannelCount) {
+        double outSampleDouble = span.ptr[s][k];
+        if (outSampleDouble < -1.0) outSampleDouble = -1.0;
+        else if (outSampleDouble > 1.0) outSampleDouble = 1.0;
+        // NOTE: Only bytesPerSample = 4 is implemented
+        // http://blog.bjornroche.com/2009/12/int-float-int-its-jungle-out-there.html
+        int32_t sampleInt = outSampleDouble > 0.0 ? 2147483647.0*outSampleDouble : 2147483648.0*outSampleDouble;
+        memcpy(&dmaBuf[4 * (deviceChannelCount*i + j)], &sampleInt, 4);
+      }
+      if (++j == networkChannelCount) {
+        j = 0;
+        i++;
+      }
     }
   }
+
+  audiometer_meterSpan(&span, networkChannelCount);
+  samplering_commitRead(_ring, sampleCount);
 }
 
 // This is on the RT thread for sender
@@ -87,8 +123,35 @@ static void dmaBufRead (const uint8_t *dmaBuf, unsigned int frameCount) {
       break;
 
     case AUDIO_ENCODING_PCM:
-      for (unsigned int i = 0; i < frameCount; i++) {
-        for (unsigned int j = 0; j < networkChannelCount; j++) {
+    case AUDIO_ENCODING_LOSSLESS: {
+      unsigned int sampleCount = networkChannelCount * frameCount;
+      samplering_span_t span;
+      if ((int)(samplering_size(_ring) + sampleCount) > (int)_fullRingSize || samplering_writeSpan(_ring, sampleCount, &span) < 0) {
+        globals_add1ui(statsCh1Audio, bufferOverrunCount, 1);
+        break;
+      }
+
+      #ifndef W_SAMPLE_RING_DOUBLE
+      if (deviceChannelCount == networkChannelCount) {
+        // The channels line up, so convert straight from dmaBuf into each part of the span with the SIMD kernel
+        if (bytesPerSample == 4) {
+          const int32_t *dmaBufS32 = (const int32_t *)dmaBuf;
+          sampleconvert_kernels->s32ToF32(dmaBufS32, span.ptr[0], span.len[0]);
+          sampleconvert_kernels->s32ToF32(&dmaBufS32[span.len[0]], span.ptr[1], span.len[1]);
+        } else { // bytesPerSample == 2
+          const int16_t *dmaBufS16 = (const int16_t *)dmaBuf;
+          sampleconvert_kernels->s16ToF32(dmaBufS16, span.ptr[0], span.len[0]);
+          sampleconvert_kernels->s16ToF32(&dmaBufS16[span.len[0]], span.ptr[1], span.len[1]);
+        }
+        audiometer_meterSpan(&span, networkChannelCount);
+        samplering_commitWrite(_ring, sampleCount);
+        break;
+      }
+      #endif
+
+      unsigned int i = 0, j = 0;
+      for (int s = 0; s < 2; s++) {
+        for (unsigned int k = 0; k < span.len[s]; k++) {
           double inSampleDouble;
 
           // No clipping is required as we are converting from int to float
@@ -103,13 +166,22 @@ static void dmaBufRead (const uint8_t *dmaBuf, unsigned int frameCount) {
             inSampleDouble = sampleInt > 0 ? sampleInt/32767.0 : sampleInt/32768.0;
           }
 
-          // DEBUG: I think we need to check for overrun here before enqueuing. We are doing it above for AUDIO_ENCODING_OPUS when we call syncer_enqueueBuf
-          utils_ringEnqueueSample(_ring, _ringBuf, inSampleDouble);
-          utils_setAudioStats(inSampleDouble, j);
+          span.ptr[s][k] = inSampleDouble;
+          if (++j == networkChannelCount) {
+            j = 0;
+            i++;
+          }
         }
       }
+
+      audiometer_meterSpan(&span, networkChannelCount);
+      samplering_commitWrite(_ring, sampleCount);
       break;
+    }
   }
+
+  // wake the sender encode thread, this doesn't do a syscall if it is already awake
+  if (_ringNotifyHandle != NULL && samplering_size(_ring) >= _ringNotifySize) xwait_notify(_ringNotifyHandle);
 }
 
 static inline void setAudioLoopStatus (int status) {
@@ -161,7 +233,7 @@ static void *startAudioLoop (UNUSED void *arg) {
 
   if (!_receiver && audioEncoding == AUDIO_ENCODING_OPUS) {
     int framesPerCallbackBuffer = dmaBufLen / 2;
-    err = syncer_init(deviceSampleRate, networkSampleRate, framesPerCallbackBuffer, _ring, _ringBuf, _fullRingSize);
+    err = syncer_init(deviceSampleRate, networkSampleRate, framesPerCallbackBuffer, _ring, _fullRingSize);
   } else if (_receiver) {
     int framesPerCallbackBuffer;
     if (audioEncoding == AUDIO_ENCODING_OPUS) {
@@ -169,7 +241,7 @@ static void *startAudioLoop (UNUSED void *arg) {
     } else {
       framesPerCallbackBuffer = globals_get1i(pcm, frameSize);
     }
-    err = syncer_init(networkSampleRate, deviceSampleRate, framesPerCallbackBuffer, _ring, _ringBuf, _fullRingSize);
+    err = syncer_init(networkSampleRate, deviceSampleRate, framesPerCallbackBuffer, _ring, _fullRingSize);
   } else {
     // PCM sender uses deviceSampleRate, no syncer required.
   }
@@ -178,7 +250,10 @@ static void *startAudioLoop (UNUSED void *arg) {
     return NULL;
   }
 
-  unsigned int flags = (_receiver ? PCM_OUT : PCM_IN) | PCM_MMAP | PCM_NOIRQ;
+  int loopMode = globals_get1i(audio, loopMode);
+  // AUDIO_LOOP_MODE_POLL needs period interrupts to wake the poll fd, the other modes read the hw pointer themselves
+  unsigned int flags = (_receiver ? PCM_OUT : PCM_IN) | PCM_MMAP;
+  if (loopMode != AUDIO_LOOP_MODE_POLL) flags |= PCM_NOIRQ;
   struct pcm *pcm = pcm_open(cardId, deviceId, flags, &config);
   if (pcm == NULL) {
     setAudioLoopStatus(-3);
@@ -210,14 +285,30 @@ static void *startAudioLoop (UNUSED void *arg) {
     memset(dmaBuf, 0, bytesPerSample * deviceChannelCount * dmaBufLen);
   }
 
-  if (pcm_start(pcm) < 0) {
+  // In poll mode the appl pointer has to follow us around the DMA buffer, otherwise avail stays above
+  // avail_min and the poll fd is always ready. For playback the whole (silent) buffer starts off ready.
+  if (loopMode == AUDIO_LOOP_MODE_POLL && _receiver && pcm_mmap_commit(pcm, 0, dmaBufLen) < 0) {
     setAudioLoopStatus(-7);
     return NULL;
   }
 
-  err = utils_setCallerThreadRealtime(99, 0);
+  int timerFd = -1;
+  if (loopMode == AUDIO_LOOP_MODE_TIMER) {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (timerFd < 0) {
+      setAudioLoopStatus(-8);
+      return NULL;
+    }
+  }
+
+  if (pcm_start(pcm) < 0) {
+    setAudioLoopStatus(-9);
+    return NULL;
+  }
+
+  err = utils_setCallerThreadRole(THREAD_ROLE_AUDIO, 0, 99, 0);
   if (err < 0) {
-    setAudioLoopStatus(err - 7);
+    setAudioLoopStatus(err - 9);
     return NULL;
   }
 
@@ -227,6 +318,9 @@ static void *startAudioLoop (UNUSED void *arg) {
 
   unsigned int hwPos = 0, lastHwPos = 0; // DEBUG: overflow at approx. 25 hours at 48 kHz on 32-bit arch
   bool lastBufHalf = false;
+  unsigned int halfBufLen = dmaBufLen / 2;
+  // for AUDIO_LOOP_MODE_POLL, wait for up to two half buffers before checking the hw pointer anyway
+  int pollTimeoutMs = 2000.0 * halfBufLen / deviceSampleRate + 1;
 
   // Wait a bit, otherwise pcm_mmap_get_hw_ptr will error out due to the timestamp being 0
   utils_usleep(50000);
@@ -236,12 +330,16 @@ static void *startAudioLoop (UNUSED void *arg) {
   while (audioLoopStatus == 1) {
     if (pcm_mmap_get_hw_ptr(pcm, &hwPos, &tsp) < 0) {
       pcm_close(pcm);
+      if (timerFd >= 0) close(timerFd);
       audioLoopStatus = -10; // don't xwait_notify in the loop, the other thread is not waiting anymore
       return NULL;
     }
 
     bool bufHalf = (hwPos % dmaBufLen) >= (dmaBufLen / 2);
-    if (bufHalf != lastBufHalf) {
+    if (bufHalf == lastBufHalf) {
+      // woke up but there is nothing to do yet
+      globals_add1ui(statsCh1Audio, audioLoopSpuriousWakeCount, 1);
+    } else {
       if (bufHalf && _receiver) {
         dmaBufWrite(dmaBuf, dmaBufLen / 2);
       } else if (bufHalf && !_receiver) {
@@ -252,6 +350,7 @@ static void *startAudioLoop (UNUSED void *arg) {
         dmaBufRead(&dmaBuf[bytesPerSample * deviceChannelCount * dmaBufLen / 2], dmaBufLen / 2);
       }
       lastBufHalf = bufHalf;
+      if (loopMode == AUDIO_LOOP_MODE_POLL) pcm_mmap_commit(pcm, 0, halfBufLen);
     }
 
     if (lastHwPos != 0 && hwPos - lastHwPos > periodSize * periodCount / 2) {
@@ -260,10 +359,37 @@ static void *startAudioLoop (UNUSED void *arg) {
     }
     lastHwPos = hwPos;
 
-    clock_nanosleep(CLOCK_MONOTONIC, 0, &loopSleep, NULL);
+    switch (loopMode) {
+      case AUDIO_LOOP_MODE_POLL:
+        // period interrupt; on timeout or error we just check the hw pointer again
+        pcm_wait(pcm, pollTimeoutMs);
+        break;
+
+      case AUDIO_LOOP_MODE_TIMER: {
+        // sleep until just after the hw pointer should cross into the next half
+        unsigned int framesToNextHalf = halfBufLen - (hwPos % halfBufLen);
+        long long timerNs = 1000000000.0 * framesToNextHalf / deviceSampleRate + 1000 * TIMER_MARGIN_US;
+        struct itimerspec its = { 0 };
+        its.it_value.tv_sec = timerNs / 1000000000LL;
+        its.it_value.tv_nsec = timerNs % 1000000000LL;
+        uint64_t expirations;
+        if (timerfd_settime(timerFd, 0, &its, NULL) == 0) {
+          if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+            clock_nanosleep(CLOCK_MONOTONIC, 0, &loopSleep, NULL);
+          }
+        } else {
+          clock_nanosleep(CLOCK_MONOTONIC, 0, &loopSleep, NULL);
+        }
+        break;
+      }
+
+      default: // AUDIO_LOOP_MODE_SLEEP
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &loopSleep, NULL);
+    }
   }
 
   pcm_close(pcm);
+  if (timerFd >= 0) close(timerFd);
   return NULL;
 }
 
@@ -274,7 +400,7 @@ int audio_init (bool receiver) {
   deviceChannelCount = globals_get1i(audio, deviceChannelCount);
   audioEncoding = globals_get1ui(audio, encoding);
 
-  utils_setAudioLevelFilters();
+  audiometer_init();
 
   if (!receiver && deviceChannelCount < networkChannelCount) {
     printf("Device does not have enough output channels.\n");
@@ -292,9 +418,13 @@ double audio_getDeviceLatency (void) {
   return (double)(periodSize * periodCount / 2) / deviceSampleRate;
 }
 
-int audio_start (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, unsigned int fullRingSize) {
+void audio_setRingNotify (xwait_t *waitHandle, unsigned int notifySize) {
+  _ringNotifyHandle = waitHandle;
+  _ringNotifySize = notifySize;
+}
+
+int audio_start (samplering_t *ring, unsigned int fullRingSize) {
   _ring = ring;
-  _ringBuf = ringBuf;
   _fullRingSize = fullRingSize;
 
   xwait_init(&audioLoopInitWait);
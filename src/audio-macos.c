@@ -9,12 +9,15 @@
 #include "globals.h"
 #include "utils.h"
 #include "syncer.h"
+#include "audio-meter.h"
+#include "event-recorder.h"
 #include "audio.h"
 
 static PaStream *stream = NULL;
-static ck_ring_t *_ring;
-static ck_ring_buffer_t *_ringBuf;
+static samplering_t *_ring;
 static int _fullRingSize;
+static xwait_t *_ringNotifyHandle = NULL;
+static unsigned int _ringNotifySize = 0;
 static bool _receiver;
 static int networkChannelCount, deviceChannelCount;
 static unsigned int audioEncoding;
@@ -30,7 +33,7 @@ static double deviceLatency = 0.0;
 static int playCallback (UNUSED const void *inputBuffer, void *outputBuffer, unsigned long framesPerBuffer, UNUSED const PaStreamCallbackTimeInfo* timeInfo, UNUSED PaStreamCallbackFlags statusFlags, UNUSED void *userData) {
   static bool ringUnderrun = true; // let ring fill to half before we start dequeuing
   float *outBufFloat = (float *)outputBuffer;
-  int ringCurrentSize = utils_ringSize(_ring);
+  int ringCurrentSize = samplering_size(_ring);
   // This condition is ensured in audio_init: outBufFloatCount >= ringFloatCount
   int outBufFrameCount = (int)framesPerBuffer;
   int outBufFloatCount = deviceChannelCount * outBufFrameCount;
@@ -38,6 +41,7 @@ static int playCallback (UNUSED const void *inputBuffer, void *outputBuffer, uns
 
   memset(outBufFloat, 0, 4 * outBufFloatCount);
 
+  EVENTRECORDER_TRACE(EVENTRECORDER_ID_DMA_WRITE, ringCurrentSize);
   syncer_onAudio(framesPerBuffer);
 
   if (ringUnderrun) {
@@ -58,17 +62,27 @@ static int playCallback (UNUSED const void *inputBuffer, void *outputBuffer, uns
     return paContinue;
   }
 
-  for (int i = 0; i < outBufFrameCount; i++) {
-    for (int j = 0; j < networkChannelCount; j++) {
+  samplering_span_t span;
+  samplering_readSpan(_ring, ringFloatCount, &span); // ring size is checked above
+
+  int i = 0, j = 0;
+  for (int s = 0; s < 2; s++) {
+    for (unsigned int k = 0; k < span.len[s]; k++) {
       // If networkChannelCount < deviceChannelCount, don't write to the remaining channels in outBufFloat,
       // they are already set to zero above.
-      double outSampleDouble = utils_ringDequeueSample(_ring, _ringBuf);
+      double outSampleDouble = span.ptr[s][k];
       // Setting stats here instead of in syncer_enqueueBuf allows us to see silence from underruns on the audio level monitor.
       outBufFloat[deviceChannelCount*i + j] = outSampleDouble;
-      utils_setAudioStats(outSampleDouble, j);
+      if (++j == networkChannelCount) {
+        j = 0;
+        i++;
+      }
     }
   }
 
+  audiometer_meterSpan(&span, networkChannelCount);
+  samplering_commitRead(_ring, ringFloatCount);
+
   return paContinue;
 }
 
@@ -82,16 +96,36 @@ static int recordCallback (const void *inputBuffer, UNUSED void *outputBuffer, u
       break;
 
     case AUDIO_ENCODING_PCM:
-      for (unsigned long i = 0; i < framesPerBuffer; i++) {
-        for (int j = 0; j < networkChannelCount; j++) {
+    case AUDIO_ENCODING_LOSSLESS: {
+      int sampleCount = networkChannelCount * framesPerBuffer;
+      samplering_span_t span;
+      if ((int)samplering_size(_ring) + sampleCount > _fullRingSize || samplering_writeSpan(_ring, sampleCount, &span) < 0) {
+        globals_add1ui(statsCh1Audio, bufferOverrunCount, 1);
+        break;
+      }
+
+      unsigned long i = 0;
+      int j = 0;
+      for (int s = 0; s < 2; s++) {
+        for (unsigned int k = 0; k < span.len[s]; k++) {
           double inSampleDouble = inBufFloat[deviceChannelCount*i + j];
-          utils_ringEnqueueSample(_ring, _ringBuf, inSampleDouble);
-          utils_setAudioStats(inSampleDouble, j);
+          span.ptr[s][k] = inSampleDouble;
+          if (++j == networkChannelCount) {
+            j = 0;
+            i++;
+          }
         }
       }
+
+      audiometer_meterSpan(&span, networkChannelCount);
+      samplering_commitWrite(_ring, sampleCount);
       break;
+    }
   }
 
+  // wake the sender encode thread, dispatch_semaphore_signal doesn't trap if it is already awake
+  if (_ringNotifyHandle != NULL && (int)samplering_size(_ring) >= (int)_ringNotifySize) xwait_notify(_ringNotifyHandle);
+
   return paContinue;
 }
 
@@ -105,7 +139,7 @@ int audio_init (bool receiver) {
   networkChannelCount = globals_get1i(audio, networkChannelCount);
   audioEncoding = globals_get1ui(audio, encoding);
 
-  utils_setAudioLevelFilters();
+  audiometer_init();
 
   if (Pa_Initialize() != paNoError) return -2;
 
@@ -157,7 +191,7 @@ int audio_init (bool receiver) {
   if (receiver) {
     if (audioEncoding == AUDIO_ENCODING_OPUS) {
       framesPerCallbackBuffer = globals_get1i(opus, frameSize);
-    } else if (audioEncoding == AUDIO_ENCODING_PCM) {
+    } else if (audioEncoding == AUDIO_ENCODING_PCM || audioEncoding == AUDIO_ENCODING_LOSSLESS) {
       framesPerCallbackBuffer = globals_get1i(pcm, frameSize);
     } else {
       return -7;
@@ -188,8 +222,8 @@ int audio_init (bool receiver) {
   deviceLatency = receiver ? streamInfo->outputLatency : streamInfo->inputLatency; // seconds
   double actualDeviceSampleRate = streamInfo->sampleRate; // Hz
 
-  if (audioEncoding == AUDIO_ENCODING_PCM && !receiver && requestedDeviceSampleRate != actualDeviceSampleRate) {
-    printf("We requested %f Hz but the device requires %f Hz. This is only an issue when using PCM encoding.\n", requestedDeviceSampleRate, actualDeviceSampleRate);
+  if (audioEncoding != AUDIO_ENCODING_OPUS && !receiver && requestedDeviceSampleRate != actualDeviceSampleRate) {
+    printf("We requested %f Hz but the device requires %f Hz. This is only an issue when using PCM or lossless encoding.\n", requestedDeviceSampleRate, actualDeviceSampleRate);
     return -9;
   }
 
@@ -206,11 +240,15 @@ double audio_getDeviceLatency (void) {
   return deviceLatency;
 }
 
-int audio_start (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, unsigned int fullRingSize) {
+void audio_setRingNotify (xwait_t *waitHandle, unsigned int notifySize) {
+  _ringNotifyHandle = waitHandle;
+  _ringNotifySize = notifySize;
+}
+
+int audio_start (samplering_t *ring, unsigned int fullRingSize) {
   if (stream == NULL) return -1;
 
   _ring = ring;
-  _ringBuf = ringBuf;
   _fullRingSize = fullRingSize;
 
   int err = 0;
@@ -221,7 +259,7 @@ int audio_start (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, unsigned int fullRi
   if (!_receiver && audioEncoding == AUDIO_ENCODING_OPUS) {
     // Calculate the maximum value that framesPerBuffer could be in recordCallback, leaving plenty of spare room.
     int framesPerCallbackBuffer = 3.0 * deviceLatency * deviceSampleRate;
-    err = syncer_init(deviceSampleRate, networkSampleRate, framesPerCallbackBuffer, ring, ringBuf, fullRingSize);
+    err = syncer_init(deviceSampleRate, networkSampleRate, framesPerCallbackBuffer, ring, fullRingSize);
   } else if (_receiver) {
     int framesPerCallbackBuffer;
     if (audioEncoding == AUDIO_ENCODING_OPUS) {
@@ -229,7 +267,7 @@ int audio_start (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, unsigned int fullRi
     } else {
       framesPerCallbackBuffer = globals_get1i(pcm, frameSize);
     }
-    err = syncer_init(networkSampleRate, deviceSampleRate, framesPerCallbackBuffer, ring, ringBuf, fullRingSize);
+    err = syncer_init(networkSampleRate, deviceSampleRate, framesPerCallbackBuffer, ring, fullRingSize);
   } else {
     // PCM sender uses deviceSampleRate, no syncer required.
   }
@@ -0,0 +1,126 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include <math.h>
+#include "globals.h"
+#include "audio-meter.h"
+
+typedef struct {
+  int channelCount;
+  double fastAttack, fastRelease, slowAttack, slowRelease;
+  double levelsFast[MAX_AUDIO_CHANNELS];
+  double levelsSlow[MAX_AUDIO_CHANNELS];
+  unsigned int clippingCounts[MAX_AUDIO_CHANNELS]; // since loadMeter
+} meter_t;
+
+static double levelFastAttack = 0.0, levelFastRelease = 0.0, levelSlowAttack = 0.0, levelSlowRelease = 0.0;
+
+static void loadMeter (meter_t *meter, int channelCount) {
+  if (channelCount > MAX_AUDIO_CHANNELS) channelCount = MAX_AUDIO_CHANNELS;
+  meter->channelCount = channelCount;
+  meter->fastAttack = levelFastAttack;
+  meter->fastRelease = levelFastRelease;
+  meter->slowAttack = levelSlowAttack;
+  meter->slowRelease = levelSlowRelease;
+  for (int j = 0; j < channelCount; j++) {
+    globals_get1ffv(statsCh1Audio, levelsFast, j, &meter->levelsFast[j]);
+    globals_get1ffv(statsCh1Audio, levelsSlow, j, &meter->levelsSlow[j]);
+    meter->clippingCounts[j] = 0;
+  }
+}
+
+static void publishMeter (const meter_t *meter) {
+  for (int j = 0; j < meter->channelCount; j++) {
+    globals_set1ffv(statsCh1Audio, levelsFast, j, meter->levelsFast[j]);
+    globals_set1ffv(statsCh1Audio, levelsSlow, j, meter->levelsSlow[j]);
+    if (meter->clippingCounts[j] > 0) globals_add1uiv(statsCh1Audio, clippingCounts, j, meter->clippingCounts[j]);
+  }
+}
+
+static inline void meterSample (meter_t *meter, int j, double sample) {
+  double level = fabs(sample);
+  double levelFastDiff = level - meter->levelsFast[j];
+  double levelSlowDiff = level - meter->levelsSlow[j];
+  meter->levelsFast[j] += (levelFastDiff > 0.0 ? meter->fastAttack : meter->fastRelease) * levelFastDiff;
+  meter->levelsSlow[j] += (levelSlowDiff > 0.0 ? meter->slowAttack : meter->slowRelease) * levelSlowDiff;
+  meter->clippingCounts[j] += level >= 1.0;
+}
+
+// whole interleaved frames of frameLen samples, of which the first meter->channelCount are metered
+static void meterFrames (meter_t *meter, const samplering_sample_t *samples, unsigned int frameCount, int frameLen) {
+  const int channelCount = meter->channelCount;
+  const double fastAttack = meter->fastAttack, fastRelease = meter->fastRelease;
+  const double slowAttack = meter->slowAttack, slowRelease = meter->slowRelease;
+  double *levelsFast = meter->levelsFast;
+  double *levelsSlow = meter->levelsSlow;
+  unsigned int *clippingCounts = meter->clippingCounts;
+
+  for (unsigned int i = 0; i < frameCount; i++) {
+    const samplering_sample_t *frame = &samples[i * frameLen];
+    // NOTE: keep this branchless (selects only) so that it vectorises across channels
+    for (int j = 0; j < channelCount; j++) {
+      double level = fabs((double)frame[j]);
+      double levelFastDiff = level - levelsFast[j];
+      double levelSlowDiff = level - levelsSlow[j];
+      levelsFast[j] += (levelFastDiff > 0.0 ? fastAttack : fastRelease) * levelFastDiff;
+      levelsSlow[j] += (levelSlowDiff > 0.0 ? slowAttack : slowRelease) * levelSlowDiff;
+      clippingCounts[j] += level >= 1.0;
+    }
+  }
+}
+
+void audiometer_init (void) {
+  globals_get1ff(audio, levelFastAttack, &levelFastAttack);
+  globals_get1ff(audio, levelFastRelease, &levelFastRelease);
+  globals_get1ff(audio, levelSlowAttack, &levelSlowAttack);
+  globals_get1ff(audio, levelSlowRelease, &levelSlowRelease);
+}
+
+void audiometer_meterSpan (const samplering_span_t *span, int channelCount) {
+  meter_t meter;
+  loadMeter(&meter, channelCount);
+  // NOTE: channels past MAX_AUDIO_CHANNELS are skipped, the same as audiometer_meterPlanar
+
+  int j = 0; // channel of the next sample
+  for (int s = 0; s < 2; s++) {
+    const samplering_sample_t *samples = span->ptr[s];
+    unsigned int len = span->len[s];
+
+    // finish the frame that wrapped around the end of the ring
+    while (j != 0 && len > 0) {
+      if (j < meter.channelCount) meterSample(&meter, j, *samples);
+      samples++;
+      len--;
+      if (++j == channelCount) j = 0;
+    }
+
+    unsigned int frameCount = len / channelCount;
+    meterFrames(&meter, samples, frameCount, channelCount);
+    samples += frameCount * channelCount;
+    len -= frameCount * channelCount;
+
+    // start of a frame that continues in the next part
+    while (len > 0) {
+      if (j < meter.channelCount) meterSample(&meter, j, *samples);
+      j++;
+      samples++;
+      len--;
+    }
+  }
+
+  publishMeter(&meter);
+}
+
+void audiometer_meterPlanar (double **samples, int frameCount, int channelCount) {
+  meter_t meter;
+  loadMeter(&meter, channelCount);
+
+  for (int j = 0; j < meter.channelCount; j++) {
+    const double *channelSamples = samples[j];
+    for (int i = 0; i < frameCount; i++) meterSample(&meter, j, channelSamples[i]);
+  }
+
+  publishMeter(&meter);
+}
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include "globals.h"
 #include "utils.h"
 // the Abseil people don't "endorse" -Wpedantic *eyeroll*
@@ -139,24 +140,35 @@ static int parseAudio (int mode, const Audio &audio, const Audio_SenderReceiver
     globals_set1ui(audio, encoding, AUDIO_ENCODING_OPUS);
     globals_set1i(opus, bitrate, audio.opus().bitrate());
     globals_set1i(opus, frameSize, audio.opus().framesize());
+    globals_set1i(opus, groupCount, audio.opus().groupcount());
+    globals_set1i(opus, inbandFecLossPerc, audio.opus().inbandfeclossperc());
     globals_set1i(audio, networkSampleRate, 48000);
-  } else if (audio.has_pcm()) {
-    globals_set1ui(audio, encoding, AUDIO_ENCODING_PCM);
-    globals_set1i(pcm, frameSize, audio.pcm().framesize());
+  } else if (audio.has_pcm() || audio.has_lossless()) {
+    int networkSampleRate;
+    if (audio.has_pcm()) {
+      globals_set1ui(audio, encoding, AUDIO_ENCODING_PCM);
+      globals_set1i(pcm, frameSize, audio.pcm().framesize());
+      globals_set1i(pcm, crcMode, audio.pcm().crcmode());
+      networkSampleRate = audio.pcm().networksamplerate();
+    } else {
+      globals_set1ui(audio, encoding, AUDIO_ENCODING_LOSSLESS);
+      globals_set1i(pcm, frameSize, audio.lossless().framesize());
+      networkSampleRate = audio.lossless().networksamplerate();
+    }
 
-    int networkSampleRate = audio.pcm().networksamplerate();
     if (mode == 0) { // receiver
       if (networkSampleRate > 0) globals_set1i(audio, networkSampleRate, networkSampleRate);
     } else { // sender, set networkSampleRate to deviceSampleRate
       globals_set1i(audio, networkSampleRate, senderReceiver.devicesamplerate());
     }
   } else {
-    printf("Init config: audio: opus or pcm field required.\n");
+    printf("Init config: audio: opus, pcm or lossless field required.\n");
     return -3;
   }
 
   globals_set1ff(audio, deviceSampleRate, senderReceiver.devicesamplerate());
   globals_set1i(audio, decodeRingLength, senderReceiver.decoderinglength());
+  globals_set1i(audio, resamplerMode, senderReceiver.resamplermode());
 
   #if defined(__linux__) || defined(__ANDROID__)
   if (!senderReceiver.has_linux()) {
@@ -172,6 +184,7 @@ static int parseAudio (int mode, const Audio &audio, const Audio_SenderReceiver
   globals_set1i(audio, bitsPerSample, linux.bitspersample());
   globals_set1i(audio, periodSize, linux.periodsize());
   globals_set1i(audio, periodCount, linux.periodcount());
+  globals_set1i(audio, loopMode, linux.loopmode());
   globals_set1i(audio, loopSleep, linux.loopsleep());
   #else
   if (!senderReceiver.has_macos()) {
@@ -188,6 +201,39 @@ static int parseAudio (int mode, const Audio &audio, const Audio_SenderReceiver
   return 0;
 }
 
+static int parseThreads (const InitConfigProto &initConfig) {
+  long onlineCores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 0; i < initConfig.threads_size(); i++) {
+    auto thread = initConfig.threads(i);
+    int role = utils_getThreadRole(thread.role().c_str());
+    if (role < 0) {
+      printf("Init config: threads: unknown role %s.\n", thread.role().c_str());
+      return -1;
+    }
+    if (thread.priority() < -1 || thread.priority() > 99) {
+      printf("Init config: threads: %s: priority must be -1 to 99.\n", thread.role().c_str());
+      return -2;
+    }
+    if (thread.cores_size() > THREAD_ROLE_MAX_CORES) {
+      printf("Init config: threads: %s: too many cores! Max is %d.\n", thread.role().c_str(), THREAD_ROLE_MAX_CORES);
+      return -3;
+    }
+    for (int j = 0; j < thread.cores_size(); j++) {
+      int core = thread.cores(j);
+      if (core < 0 || (onlineCores > 0 && core >= onlineCores)) {
+        printf("Init config: threads: %s: core %d does not exist, there are %ld cores online.\n", thread.role().c_str(), core, onlineCores);
+        return -4;
+      }
+      globals_set1iv(threads, cores, role * THREAD_ROLE_MAX_CORES + j, core);
+    }
+    globals_set1iv(threads, coreCount, role, thread.cores_size());
+    globals_set1iv(threads, priority, role, thread.priority());
+  }
+
+  return 0;
+}
+
 int config_parseBuf (const uint8_t *buf, size_t bufLen) {
   if (!decodedInitialConfig) return -1;
 
@@ -198,6 +244,7 @@ int config_parseBuf (const uint8_t *buf, size_t bufLen) {
   // unset is the same as 0, so when a proto is parsed from the config channel, mode will be set to receiver
   int mode = initConfig.mode();
   globals_set1i(root, mode, mode);
+  globals_set1i(root, rtArenaSize, initConfig.rtarenasize());
 
   int err;
   uint32_t serverAddr = 0;
@@ -217,10 +264,23 @@ int config_parseBuf (const uint8_t *buf, size_t bufLen) {
     for (int i = 0; i < endpointCount; i++) {
       auto endpoint = initConfig.endpoints(i);
       globals_set1sv(endpoints, interface, i, endpoint.interface().c_str());
+      globals_set1ffv(endpoints, weight, i, endpoint.weight());
     }
     globals_set1i(endpoints, endpointCount, endpointCount);
   }
 
+  globals_set1i(endpoints, ioUring, initConfig.iouring());
+  if (globals_set1s(endpoints, peerCacheFile, initConfig.peercachefile().c_str()) < 0) {
+    printf("Init config: peerCacheFile is too long! Max is %d characters.\n", MAX_FILE_PATH_LEN);
+    return -40;
+  }
+
+  if (initConfig.has_endpointdistribution()) {
+    auto distribution = initConfig.endpointdistribution();
+    globals_set1i(endpoints, distributionMode, distribution.mode());
+    globals_set1i(endpoints, distributionCopies, distribution.copies());
+  }
+
   if (initConfig.privatekey().length() == 44) {
     globals_set1s(root, privateKey, initConfig.privatekey().c_str());
   }
@@ -232,6 +292,9 @@ int config_parseBuf (const uint8_t *buf, size_t bufLen) {
     globals_set1ui(mux, maxPacketSize, initConfig.mux().maxpacketsize());
   }
 
+  err = parseThreads(initConfig);
+  if (err < 0) return err - 30;
+
   if (initConfig.has_audio()) {
     if (initConfig.audio().has_receiver() && mode == 0) {
       err = parseAudio(mode, initConfig.audio(), initConfig.audio().receiver());
@@ -257,6 +320,8 @@ int config_parseBuf (const uint8_t *buf, size_t bufLen) {
     globals_set1iv(fec, symbolLen, fec.chid(), fec.symbollen());
     globals_set1iv(fec, sourceSymbolsPerBlock, fec.chid(), fec.sourcesymbolsperblock());
     globals_set1iv(fec, repairSymbolsPerBlock, fec.chid(), fec.repairsymbolsperblock());
+    globals_set1iv(fec, pacedSend, fec.chid(), fec.pacedsend());
+    globals_set1iv(fec, streamPartialBlocks, fec.chid(), fec.streampartialblocks());
   }
 
   int wsPort = 0, udpPort = 0;
@@ -300,6 +365,10 @@ int config_encodeReceiverConfig (uint8_t **destBuf) {
   initConfig.clear_privatekey(); // important code here!!
   initConfig.clear_peerpublickey();
   initConfig.clear_mux();
+  initConfig.clear_threads();
+  initConfig.clear_rtarenasize();
+  initConfig.clear_iouring();
+  initConfig.clear_peercachefile();
   initConfig.mutable_audio()->clear_sender();
   // TODO: video
   initConfig.mutable_monitor()->clear_sender();
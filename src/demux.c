@@ -4,65 +4,96 @@
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
 #include "xwait.h"
+#include <stdio.h>
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <pthread.h>
 #include "raptorq/raptorq.h"
-#include "ck/ck_ring.h"
+#include "slot-ring.h"
+#include "rt-arena.h"
 #include "utils.h"
 #include "globals.h"
+#include "event-recorder.h"
 #include "demux.h"
 
+// Chunks with an ESI >= DEMUX_SEEN_MAX_ESI are not checked for duplicates. Repair ESIs start after the
+// extended source symbol count (K') so this needs to be larger than K' + repairSymbolsPerBlock, otherwise
+// demux_addChannel makes the chunk ring larger to hold every endpoint's copy of the unchecked chunks.
+#define DEMUX_SEEN_MAX_ESI 256
+// Number of blocks that can be collecting source symbols at once in the decode thread, must be a power of two
+#define DEMUX_STAGING_COUNT 4
+// Decode workers when demux_init is given 0 and the threads init config has no cores for the decode role
+#define DEMUX_DEFAULT_WORKER_COUNT 2
+
+// source symbols of one block, collected by the decode thread so that a block can be emitted without
+// running the RaptorQ decoder when none of them were lost
+typedef struct {
+  int sbn; // -1 if unused
+  int sourceCount, repairCount;
+  int highestSourceEsi; // -1 if no source symbols yet
+  bool fedToDecoder; // the block needed a repair symbol, so everything goes through raptorq_decodePacket
+  bool emitted; // decodeBlock has been called for this block
+  uint64_t sourceSeen[DEMUX_SEEN_MAX_ESI / 64];
+  // sourceSymbolsPerBlock chunks including Payload IDs indexed by ESI, then repair chunks in arrival order
+  uint8_t *chunks;
+} demux_staging_t;
+
 typedef struct {
   uint8_t chId;
   void (*onData)(const uint8_t *, int);
-  ck_ring_t chunkRing;
-  ck_ring_buffer_t *chunkRingBuf; // encoded block made of chunks
+  slotring_t chunkRing; // one chunk per slot, slots are passed directly to the rust code
   uint8_t *blockBuf; // decoded block used in decode thread
   uint8_t *dataBuf; // final buf that is passed to callback in decode thread
-  uint8_t *chunkBuf; // used to pass the chunks between the ring and the rust code
   int maxDataLen, dataBufPos, sbnLast;
-  size_t chunkLen, chunkLenWords, chunkRingLenWords;
+  int blockPos; // how far parseBlock has got through the current block, 0 means it hasn't started
+  // streaming: pass on data from the source symbols of a block before the whole block is available
+  bool streamPartialBlocks;
+  int streamSbn; // block currently being streamed, -1 if none
+  int streamSymbolCount; // source symbols copied into streamBuf, always in order from ESI 0
+  uint8_t *streamBuf;
+  size_t chunkLen;
+  unsigned int chunkRingLen;
+  // only accessed by the network thread (demux_readPacket)
+  uint64_t seenChunks[256][DEMUX_SEEN_MAX_ESI / 64]; // bitmap of chunks put on chunkRing, indexed by SBN then ESI
+  int sbnNewest;
+  // set by the decode thread when a block is decoded, cleared by the network thread when the SBN is reused
+  atomic_bool decodedSbns[256];
+  // set by the network thread when the first chunk of a block arrives, read by the decode thread for stats
+  atomic_uint chunkArrivalUs[256];
+  // only accessed by the decode thread
+  demux_staging_t staging[DEMUX_STAGING_COUNT];
+  bool fastPathEnabled;
+  int sourceSymbolsPerBlock, repairSymbolsPerBlock, symbolLen;
+  // the most repair symbols the sender can send before the last source symbol, see mux_addChannel's paced order.
+  // 0 if not paced, because all the repair symbols come after the source symbols
+  int repairsBeforeLastSource;
   int blockBufLen;
-  pthread_t decodeThread;
-  xwait_t waitHandle;
+  // true while the channel is on readyChIds or a worker is decoding it, so only one worker has it at a time
+  atomic_bool scheduled;
   void *raptorqHandle;
 } demux_channel_t;
 
-static demux_channel_t channels[MUX_CHANNEL_COUNT];
-static atomic_uint_fast8_t chCount = 0;
-static atomic_bool threadsRunning = true;
-
-void demux_deinit (void) {
-  atomic_store(&threadsRunning, false);
-  uint8_t chCountLocal = atomic_load(&chCount);
-  for (int i = 0; i < chCountLocal; i++) {
-    xwait_notify(&channels[i].waitHandle);
-    pthread_join(channels[i].decodeThread, NULL);
-    xwait_destroy(&channels[i].waitHandle);
-    raptorq_deinitDecoder(channels[i].raptorqHandle);
-    free(channels[i].chunkRingBuf);
-    free(channels[i].blockBuf);
-    free(channels[i].dataBuf);
-    free(channels[i].chunkBuf);
-  }
-
-  atomic_store(&chCount, 0);
-}
-
-static int decodeBlock (int sbn, demux_channel_t *chan) {
-  // first update stats
-  int us = utils_getCurrentUTime();
-
-  unsigned int chRingPos = globals_get1uiv(statsDemux, blockTimingRingPos, chan->chId);
-  unsigned int ringIndex = chan->chId * STATS_BLOCK_TIMING_RING_LEN + chRingPos;
-  globals_set1uiv(statsDemux, blockTimingRing, ringIndex, (unsigned int)us);
-  if (++chRingPos == STATS_BLOCK_TIMING_RING_LEN) chRingPos = 0;
-  // NOTE: blockTimingRingPos must only be written to here
-  globals_set1uiv(statsDemux, blockTimingRingPos, chan->chId, chRingPos);
+typedef struct {
+  int index;
+  pthread_t thread;
+  xwait_t waitHandle;
+  atomic_bool idle; // set by the worker before it waits, cleared by whoever wakes it
+} demux_worker_t;
 
+static demux_channel_t *channels[MUX_MAX_CHANNELS];
+static atomic_uint_fast8_t chCount = 0;
+static demux_worker_t workers[THREAD_ROLE_MAX_CORES];
+static int workerCount = 0;
+static atomic_bool threadsRunning = false;
+// channels that have chunks on their ring and no worker yet, written by the network thread only
+// NOTE: a channel is on here at most once, so it can't overflow
+static atomic_uint_fast8_t readyChIds[MUX_MAX_CHANNELS];
+static atomic_uint readyHead = 0, readyTail = 0;
+
+// call once per block before parseBlock
+// returns < 0 if the block should not be parsed (duplicate or old block)
+static int beginBlock (int sbn, demux_channel_t *chan) {
   if (chan->sbnLast != -1) {
     int sbnDiff = sbn - chan->sbnLast;
     // Overflow
@@ -86,132 +117,527 @@ static int decodeBlock (int sbn, demux_channel_t *chan) {
       chan->dataBufPos = 0;
     }
   }
-  chan->sbnLast = sbn;
 
-  // then read data from the block
-  // audio/video decoding happens in the chan->onData callback
+  if (chan->streamSbn != -1) {
+    // the block we were streaming never completed, so any partial data from before it is useless
+    chan->streamSbn = -1;
+    chan->dataBufPos = 0;
+  }
 
-  int32_t dataLen = 0; // int32 so there is no sign difference for comparsions
-  memcpy(&dataLen, chan->blockBuf, 4);
-  if (dataLen < 0) return -3;
+  chan->sbnLast = sbn;
+  chan->blockPos = 0;
+  return 0;
+}
 
-  int blockPos = 4 + dataLen;
-  if (blockPos > chan->blockBufLen) return -4;
-  if (chan->dataBufPos + dataLen > chan->maxDataLen) return -5;
+// read data from the first availLen bytes of block, carrying on from chan->blockPos
+// availLen == chan->blockBufLen means the whole block is available, otherwise the data that doesn't
+// fit in availLen yet is left for the next call
+// audio/video decoding happens in the chan->onData callback
+static int parseBlock (demux_channel_t *chan, const uint8_t *block, int availLen) {
+  bool complete = availLen == chan->blockBufLen;
+  int32_t dataLen = 0; // int32 so there is no sign difference for comparsions
 
-  memcpy(&chan->dataBuf[chan->dataBufPos], &chan->blockBuf[4], dataLen);
-  if (chan->dataBufPos > 0) chan->onData(chan->dataBuf, chan->dataBufPos + dataLen);
-  chan->dataBufPos = 0;
+  if (chan->blockPos == 0) {
+    if (availLen < 4) return 3;
+    memcpy(&dataLen, block, 4);
+    if (dataLen < 0) {
+      chan->blockPos = chan->blockBufLen;
+      return -3;
+    }
+    if (4 + dataLen > chan->blockBufLen) {
+      chan->blockPos = chan->blockBufLen;
+      return -4;
+    }
+    if (chan->dataBufPos + dataLen > chan->maxDataLen) {
+      chan->blockPos = chan->blockBufLen;
+      return -5;
+    }
+    if (4 + dataLen > availLen) return 3;
 
-  if (chan->blockBufLen - blockPos < 5) {
-    // done! nothing left to decode as we need at least a length field and 1 byte of data
-    // there will be 0 to 4 bytes of ignored padding in chan->blockBuf
-    return 0;
+    memcpy(&chan->dataBuf[chan->dataBufPos], &block[4], dataLen);
+    if (chan->dataBufPos > 0) chan->onData(chan->dataBuf, chan->dataBufPos + dataLen);
+    chan->dataBufPos = 0;
+    chan->blockPos = 4 + dataLen;
   }
 
-  while (true) {
-    memcpy(&dataLen, &chan->blockBuf[blockPos], 4);
-    if (dataLen <= 0) return -6;
-    blockPos += 4;
+  // we need at least a length field and 1 byte of data
+  // there will be 0 to 4 bytes of ignored padding at the end of the block
+  while (chan->blockBufLen - chan->blockPos >= 5) {
+    if (availLen - chan->blockPos < 4) return 3;
+    memcpy(&dataLen, &block[chan->blockPos], 4);
+    if (dataLen <= 0) {
+      chan->blockPos = chan->blockBufLen;
+      return -6;
+    }
+    int dataPos = chan->blockPos + 4;
 
-    int leftoverLen = chan->blockBufLen - blockPos;
+    int leftoverLen = chan->blockBufLen - dataPos;
     if (leftoverLen < dataLen) {
-      // partial data
-      memcpy(&chan->dataBuf[chan->dataBufPos], &chan->blockBuf[blockPos], leftoverLen);
+      // partial data, the rest is at the start of the next block
+      if (!complete) return 3;
+      memcpy(&chan->dataBuf[chan->dataBufPos], &block[dataPos], leftoverLen);
       chan->dataBufPos += leftoverLen;
+      chan->blockPos = chan->blockBufLen;
       return 1;
     }
 
+    if (availLen < dataPos + dataLen) return 3;
+
     // full data
-    memcpy(&chan->dataBuf[chan->dataBufPos], &chan->blockBuf[blockPos], dataLen);
-    blockPos += dataLen;
+    memcpy(&chan->dataBuf[chan->dataBufPos], &block[dataPos], dataLen);
+    chan->blockPos = dataPos + dataLen;
     chan->onData(chan->dataBuf, chan->dataBufPos + dataLen);
     chan->dataBufPos = 0;
+  }
+
+  return 2; // done, no partial
+}
+
+// chan->blockBuf has the whole block
+static int decodeBlock (int sbn, demux_channel_t *chan) {
+  EVENTRECORDER_TRACE(EVENTRECORDER_ID_BLOCK_DECODED, sbn);
+
+  // first update stats
+  int us = utils_getCurrentUTime();
+
+  unsigned int chRingPos = globals_get1uiv(statsDemux, blockTimingRingPos, chan->chId);
+  unsigned int ringIndex = chan->chId * STATS_BLOCK_TIMING_RING_LEN + chRingPos;
+  globals_set1uiv(statsDemux, blockTimingRing, ringIndex, (unsigned int)us);
+  unsigned int arrivalUs = atomic_load_explicit(&chan->chunkArrivalUs[sbn], memory_order_relaxed);
+  globals_set1uiv(statsDemux, blockArrivalRing, ringIndex, arrivalUs);
+  if (++chRingPos == STATS_BLOCK_TIMING_RING_LEN) chRingPos = 0;
+  // NOTE: blockTimingRingPos must only be written to here
+  globals_set1uiv(statsDemux, blockTimingRingPos, chan->chId, chRingPos);
 
-    if (chan->blockBufLen - blockPos < 5) return 2; // done, no partial, ignore padding
+  if (chan->streamSbn == sbn) {
+    // some of this block has already been parsed from streamBuf, parse the rest
+    chan->streamSbn = -1;
+  } else {
+    int err = beginBlock(sbn, chan);
+    if (err < 0) return err;
   }
+
+  return parseBlock(chan, chan->blockBuf, chan->blockBufLen);
 }
 
-// this is a realtime thread where all FEC and audio/video decoding happens
-static void *startDecodeThread (void *arg) {
-  intptr_t chId = (intptr_t)arg;
-  demux_channel_t *chan = &channels[chId];
+// pass on any data covered by the source symbols that have arrived in order so far
+// only the block after the last one that was parsed is streamed, anything else waits for decodeBlock
+static void streamBlock (demux_channel_t *chan, demux_staging_t *staging, int sbn) {
+  if (chan->streamSbn != sbn) {
+    if (chan->streamSbn != -1) return; // still waiting on an earlier block
+    if (chan->sbnLast != -1 && sbn != ((chan->sbnLast + 1) & 0xff)) return;
+    // ESI 0 is needed before we can start
+    if (!(staging->sourceSeen[0] & 1)) return;
+    if (beginBlock(sbn, chan) < 0) return;
+    chan->streamSbn = sbn;
+    chan->streamSymbolCount = 0;
+  }
 
-  // pin each channel decode thread to a different core, leaving core 0 for other stuff (Linux only)
-  // DEBUG: check the CPU core count before calling this
-  utils_setCallerThreadRealtime(98, chId + 1);
+  int prevCount = chan->streamSymbolCount;
+  while (chan->streamSymbolCount < chan->sourceSymbolsPerBlock) {
+    int esi = chan->streamSymbolCount;
+    if (!(staging->sourceSeen[esi / 64] & ((uint64_t)1 << (esi % 64)))) break;
+    memcpy(&chan->streamBuf[esi * chan->symbolLen], &staging->chunks[esi * chan->chunkLen + 4], chan->symbolLen);
+    chan->streamSymbolCount++;
+  }
+  if (chan->streamSymbolCount == prevCount) return;
 
-  while (atomic_load(&threadsRunning)) {
-    xwait_wait(&chan->waitHandle);
-
-    // feed chunks from all endpoints to raptorq_decodePacket until the ring is empty
-    while (ck_ring_size(&chan->chunkRing) >= chan->chunkLenWords) {
-      for (size_t i = 0; i < chan->chunkLenWords; i++) {
-        intptr_t chunkWord = 0;
-        ck_ring_dequeue_spsc(&chan->chunkRing, chan->chunkRingBuf, (void*)&chunkWord);
-        memcpy(&chan->chunkBuf[4*i], &chunkWord, 4);
+  // NOTE: the last bit of the block is always left for decodeBlock
+  if (chan->streamSymbolCount < chan->sourceSymbolsPerBlock) {
+    parseBlock(chan, chan->streamBuf, chan->streamSymbolCount * chan->symbolLen);
+  }
+}
+
+static inline uint32_t readEsi (const uint8_t *chunk) {
+  // Payload ID: 1 byte SBN, 3 byte ESI big-endian
+  return ((uint32_t)chunk[1] << 16) | ((uint32_t)chunk[2] << 8) | chunk[3];
+}
+
+static void emitBlock (demux_channel_t *chan, demux_staging_t *staging, int sbn) {
+  // tell the network thread to drop any more chunks for this block
+  atomic_store_explicit(&chan->decodedSbns[sbn], true, memory_order_relaxed);
+  if (staging != NULL) staging->emitted = true;
+  decodeBlock(sbn, chan);
+}
+
+// hand the staged source and repair symbols to the decoder, from now on this block's chunks go straight to it
+static void feedStagedToDecoder (demux_channel_t *chan, demux_staging_t *staging, int sbn) {
+  staging->fedToDecoder = true;
+
+  for (int i = 0; i < chan->sourceSymbolsPerBlock; i++) {
+    if (!(staging->sourceSeen[i / 64] & ((uint64_t)1 << (i % 64)))) continue;
+    if (raptorq_decodePacket(chan->raptorqHandle, &staging->chunks[i * chan->chunkLen], chan->blockBuf) == chan->blockBufLen) {
+      emitBlock(chan, staging, sbn);
+      return;
+    }
+  }
+
+  for (int i = 0; i < staging->repairCount; i++) {
+    int chunkIndex = chan->sourceSymbolsPerBlock + i;
+    if (raptorq_decodePacket(chan->raptorqHandle, &staging->chunks[chunkIndex * chan->chunkLen], chan->blockBuf) == chan->blockBufLen) {
+      emitBlock(chan, staging, sbn);
+      return;
+    }
+  }
+}
+
+// true if there are enough symbols to decode and a source symbol must have been lost, so the block can't take
+// the fast path. Paced senders interleave repair symbols with the source symbols, so having K symbols isn't enough:
+// a source symbol is only missing once a later one has arrived past it, or more repair symbols have arrived than
+// can be sent before the last source symbol, or the next block has started (see also decodeChunk).
+// NOTE: the missing symbols could still be on their way from a slower endpoint, but waiting for them would add latency
+static bool isSourceLost (const demux_channel_t *chan, const demux_staging_t *staging, int sbn) {
+  if (staging->sourceCount + staging->repairCount < chan->sourceSymbolsPerBlock) return false;
+  if (staging->highestSourceEsi + 1 > staging->sourceCount) return true; // gap
+  if (staging->repairCount > chan->repairsBeforeLastSource) return true;
+  int nextSbn = (sbn + 1) & 0xff;
+  return chan->staging[nextSbn & (DEMUX_STAGING_COUNT - 1)].sbn == nextSbn;
+}
+
+static void decodeChunk (demux_channel_t *chan, const uint8_t *chunk) {
+  int sbn = chunk[0];
+
+  if (!chan->fastPathEnabled) {
+    if (raptorq_decodePacket(chan->raptorqHandle, chunk, chan->blockBuf) == chan->blockBufLen) {
+      emitBlock(chan, NULL, sbn);
+    }
+    return;
+  }
+
+  demux_staging_t *staging = &chan->staging[sbn & (DEMUX_STAGING_COUNT - 1)];
+  if (staging->sbn != sbn) {
+    // the next block has started, so the previous one's missing source symbols were most likely lost
+    demux_staging_t *prevStaging = &chan->staging[(sbn - 1) & (DEMUX_STAGING_COUNT - 1)];
+    if (prevStaging->sbn == ((sbn - 1) & 0xff) && !prevStaging->emitted && !prevStaging->fedToDecoder
+      && prevStaging->sourceCount + prevStaging->repairCount >= chan->sourceSymbolsPerBlock) {
+      feedStagedToDecoder(chan, prevStaging, prevStaging->sbn);
+    }
+
+    // first chunk of this block to reach the decode thread, any older block using this slot is abandoned
+    staging->sbn = sbn;
+    staging->sourceCount = 0;
+    staging->repairCount = 0;
+    staging->highestSourceEsi = -1;
+    staging->fedToDecoder = false;
+    staging->emitted = false;
+    memset(staging->sourceSeen, 0, sizeof(staging->sourceSeen));
+  }
+
+  // this includes repair symbols for a block that took the fast path
+  if (staging->emitted) return;
+
+  if (staging->fedToDecoder) {
+    if (raptorq_decodePacket(chan->raptorqHandle, chunk, chan->blockBuf) == chan->blockBufLen) {
+      emitBlock(chan, staging, sbn);
+    }
+    return;
+  }
+
+  uint32_t esi = readEsi(chunk);
+  if (esi < (uint32_t)chan->sourceSymbolsPerBlock) {
+    if (staging->sourceSeen[esi / 64] & ((uint64_t)1 << (esi % 64))) return;
+    staging->sourceSeen[esi / 64] |= (uint64_t)1 << (esi % 64);
+    staging->sourceCount++;
+    if ((int)esi > staging->highestSourceEsi) staging->highestSourceEsi = esi;
+
+    memcpy(&staging->chunks[esi * chan->chunkLen], chunk, chan->chunkLen);
+    if (chan->streamPartialBlocks) streamBlock(chan, staging, sbn);
+
+    if (staging->sourceCount == chan->sourceSymbolsPerBlock) {
+      // systematic code: the source symbols are the block, no need for the decoder
+      for (int i = 0; i < chan->sourceSymbolsPerBlock; i++) {
+        memcpy(&chan->blockBuf[i * chan->symbolLen], &staging->chunks[i * chan->chunkLen + 4], chan->symbolLen);
       }
+      globals_add1uiv(statsDemux, fastPathBlockCount, chan->chId, 1);
+      emitBlock(chan, staging, sbn);
+      return;
+    }
+  } else if (staging->repairCount < chan->repairSymbolsPerBlock) {
+    // hold on to repair symbols as the sender may interleave them with the source symbols
+    int chunkIndex = chan->sourceSymbolsPerBlock + staging->repairCount;
+    memcpy(&staging->chunks[chunkIndex * chan->chunkLen], chunk, chan->chunkLen);
+    staging->repairCount++;
+  } else {
+    // more repair symbols than we have room for, shouldn't happen
+    feedStagedToDecoder(chan, staging, sbn);
+    if (!staging->emitted && raptorq_decodePacket(chan->raptorqHandle, chunk, chan->blockBuf) == chan->blockBufLen) {
+      emitBlock(chan, staging, sbn);
+    }
+    return;
+  }
+
+  if (isSourceLost(chan, staging, sbn)) feedStagedToDecoder(chan, staging, sbn);
+}
 
-      int result = raptorq_decodePacket(chan->raptorqHandle, chan->chunkBuf, chan->blockBuf);
+// any worker, returns -1 if no channel is ready
+static int popReadyChannel (void) {
+  unsigned int head = atomic_load(&readyHead);
+  while (head != atomic_load(&readyTail)) {
+    uint8_t chId = atomic_load_explicit(&readyChIds[head % MUX_MAX_CHANNELS], memory_order_relaxed);
+    // if another worker took this one, head is updated and we try the next
+    if (atomic_compare_exchange_weak(&readyHead, &head, head + 1)) return chId;
+  }
+  return -1;
+}
+
+// network thread only, call after putting a chunk on the channel's ring
+static void scheduleChannel (demux_channel_t *chan) {
+  // a worker already has it, and checks the ring again before letting go of it
+  if (atomic_exchange(&chan->scheduled, true)) return;
 
-      if (result == chan->blockBufLen) decodeBlock(chan->chunkBuf[0], chan);
+  unsigned int tail = atomic_load_explicit(&readyTail, memory_order_relaxed);
+  atomic_store_explicit(&readyChIds[tail % MUX_MAX_CHANNELS], chan->chId, memory_order_relaxed);
+  atomic_store(&readyTail, tail + 1);
+
+  // wake one idle worker, if they are all busy one of them will pick it up before going idle
+  for (int i = 0; i < workerCount; i++) {
+    if (atomic_load(&workers[i].idle) && atomic_exchange(&workers[i].idle, false)) {
+      xwait_notify(&workers[i].waitHandle);
+      return;
     }
   }
+}
+
+// decode chunks from all endpoints until the ring is empty
+// only one worker at a time has the channel, so its chunks are decoded in order and onData is never called
+// concurrently (though successive calls can come from different threads)
+static void decodeChannel (demux_channel_t *chan) {
+  while (true) {
+    const uint8_t *chunk;
+    while ((chunk = slotring_readSlot(&chan->chunkRing)) != NULL) {
+      decodeChunk(chan, chunk);
+      slotring_commitRead(&chan->chunkRing);
+    }
+
+    atomic_store(&chan->scheduled, false);
+    // the network thread doesn't reschedule the channel for a chunk it wrote after the ring looked empty to us
+    // but before scheduled was cleared, so look again
+    atomic_thread_fence(memory_order_seq_cst);
+    if (slotring_size(&chan->chunkRing) == 0 || atomic_exchange(&chan->scheduled, true)) return;
+  }
+}
+
+// this is a realtime thread where all FEC and audio/video decoding happens, for whichever channels are ready
+static void *startDecodeWorker (void *arg) {
+  demux_worker_t *worker = (demux_worker_t *)arg;
+
+  // by default pin each worker to a different core, leaving core 0 for other stuff (Linux only)
+  utils_setCallerThreadRole(THREAD_ROLE_DECODE, worker->index, 98, worker->index + 1);
+
+  while (atomic_load(&threadsRunning)) {
+    int chId;
+    while ((chId = popReadyChannel()) >= 0) decodeChannel(channels[chId]);
+
+    atomic_store(&worker->idle, true);
+    // a channel may have been queued after we last looked, but before the network thread could see we were idle
+    // if the network thread has already woken us, the wait returns straight away
+    if (atomic_load(&readyHead) != atomic_load(&readyTail) && atomic_exchange(&worker->idle, false)) continue;
+    xwait_wait(&worker->waitHandle);
+  }
 
   return NULL;
 }
 
-int demux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, void (*onData)(const uint8_t *, int)) {
+int demux_init (int threadCount) {
+  if (threadCount <= 0) threadCount = globals_get1iv(threads, coreCount, THREAD_ROLE_DECODE);
+  if (threadCount <= 0) threadCount = DEMUX_DEFAULT_WORKER_COUNT;
+  if (threadCount > THREAD_ROLE_MAX_CORES) threadCount = THREAD_ROLE_MAX_CORES;
+
+  atomic_store(&chCount, 0);
+  atomic_store(&readyHead, 0);
+  atomic_store(&readyTail, 0);
+  atomic_store(&threadsRunning, true);
+
+  for (workerCount = 0; workerCount < threadCount; workerCount++) {
+    demux_worker_t *worker = &workers[workerCount];
+    worker->index = workerCount;
+    xwait_init(&worker->waitHandle);
+    atomic_store(&worker->idle, false);
+    if (pthread_create(&worker->thread, NULL, startDecodeWorker, worker) != 0) {
+      xwait_destroy(&worker->waitHandle);
+      demux_deinit();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void demux_deinit (void) {
+  atomic_store(&threadsRunning, false);
+  for (int i = 0; i < workerCount; i++) {
+    xwait_notify(&workers[i].waitHandle);
+    pthread_join(workers[i].thread, NULL);
+    xwait_destroy(&workers[i].waitHandle);
+  }
+  workerCount = 0;
+
   uint8_t chCountLocal = atomic_load(&chCount);
-  if (chCountLocal == MUX_CHANNEL_COUNT) return -1;
+  for (int i = 0; i < chCountLocal; i++) {
+    demux_channel_t *chan = channels[i];
+    raptorq_deinitDecoder(chan->raptorqHandle);
+    slotring_deinit(&chan->chunkRing);
+    rtarena_free(chan->blockBuf);
+    rtarena_free(chan->dataBuf);
+    rtarena_free(chan->streamBuf);
+    for (int j = 0; j < DEMUX_STAGING_COUNT; j++) rtarena_free(chan->staging[j].chunks);
+    rtarena_free(chan);
+    channels[i] = NULL;
+  }
 
-  demux_channel_t *chan = &channels[chCountLocal];
+  atomic_store(&chCount, 0);
+}
 
-  int endpointCount = globals_get1i(endpoints, endpointCount);
+// K' values from RFC 6330 Table 2, up to the first one past DEMUX_SEEN_MAX_ESI
+static const int extendedSymbolCounts[] = {
+  10, 12, 18, 20, 26, 30, 32, 36, 42, 46, 48, 49, 55, 60, 62, 69, 75, 84, 88, 91, 95, 97, 101, 114,
+  119, 125, 127, 138, 140, 149, 153, 160, 166, 168, 179, 181, 185, 187, 200, 213, 217, 225, 236, 242, 248, 257
+};
+
+// K' for a block of sourceSymbolsPerBlock, the ESI of the first repair symbol
+// NOTE: above the table this returns sourceSymbolsPerBlock, which is enough to tell it is past the bitmap
+static int getExtendedSymbolCount (int sourceSymbolsPerBlock) {
+  for (unsigned int i = 0; i < sizeof(extendedSymbolCounts) / sizeof(extendedSymbolCounts[0]); i++) {
+    if (extendedSymbolCounts[i] >= sourceSymbolsPerBlock) return extendedSymbolCounts[i];
+  }
+  return sourceSymbolsPerBlock;
+}
+
+int demux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, bool paced, bool streamPartialBlocks, void (*onData)(const uint8_t *, int)) {
+  uint8_t chCountLocal = atomic_load(&chCount);
+  if (chCountLocal == MUX_MAX_CHANNELS) return -1;
+  if (workerCount == 0) return -6; // demux_init has not been called
+
+  // NOTE: if this fails part way the channel is left unused, and its slot is reused by the next call
+  if (channels[chCountLocal] == NULL) channels[chCountLocal] = (demux_channel_t *)rtarena_alloc(sizeof(demux_channel_t));
+  demux_channel_t *chan = channels[chCountLocal];
+  if (chan == NULL) return -3;
 
   chan->chunkLen = 4 + symbolLen;
-  chan->chunkLenWords = chan->chunkLen / 4;
   // ring space for up to 2 encoded blocks (with Payload IDs and repair symbols)
-  // with space for duplicate chunks from each endpoint
+  // duplicate chunks from other endpoints are dropped in demux_readPacket before they get here,
+  // so we don't need to multiply by endpointCount, unless some ESIs are past the seen bitmap
   // if the ring gets full it means there is not enough CPU for the decode thread
   // we don't make the ring larger as it would add latency; if the ring is
   // overflowing due to bunching due to poor network, the block size should be increased
-  // assume 4 bytes per ring word to simplify this code (uses twice the memory on 64-bit arch)
   // TODO: can we reduce the ring size to 1 encoded block?
-  chan->chunkRingLenWords = 2 * endpointCount * chan->chunkLen * (sourceSymbolsPerBlock+repairSymbolsPerBlock) / 4;
+  chan->chunkRingLen = 2 * (sourceSymbolsPerBlock+repairSymbolsPerBlock);
+  int lastEsi = getExtendedSymbolCount(sourceSymbolsPerBlock) + repairSymbolsPerBlock - 1;
+  int endpointCount = globals_get1i(endpoints, endpointCount);
+  if (lastEsi >= DEMUX_SEEN_MAX_ESI && endpointCount > 1) {
+    // every endpoint's copy of the symbols past the bitmap gets on the ring
+    printf("demux: warning, channel %d ESIs up to %d are past %d and not checked for duplicates, reduce sourceSymbolsPerBlock or repairSymbolsPerBlock\n",
+      chCountLocal, lastEsi, DEMUX_SEEN_MAX_ESI - 1);
+    chan->chunkRingLen *= endpointCount;
+  }
 
-  // ck requires the size to be a power of two but we will pretend ring is chunkRingLenWords
-  // in size, and ignore the rest
-  int ringAllocSize = utils_roundUpPowerOfTwo(chan->chunkRingLenWords);
-  chan->chunkRingBuf = (ck_ring_buffer_t*)malloc(sizeof(ck_ring_buffer_t) * ringAllocSize);
-  if (chan->chunkRingBuf == NULL) return -2;
-  memset(chan->chunkRingBuf, 0, sizeof(ck_ring_buffer_t) * ringAllocSize);
-  ck_ring_init(&chan->chunkRing, ringAllocSize);
+  // slotring rounds the slot count up to a power of two but we will pretend ring is chunkRingLen
+  // slots in size, and ignore the rest
+  if (slotring_init(&chan->chunkRing, chan->chunkRingLen, chan->chunkLen) < 0) return -2;
 
   chan->blockBufLen = symbolLen * sourceSymbolsPerBlock;
-  chan->blockBuf = (uint8_t *)malloc(chan->blockBufLen);
+  chan->blockBuf = (uint8_t *)rtarena_alloc(chan->blockBufLen);
   if (chan->blockBuf == NULL) return -3;
 
   chan->dataBufPos = 0;
   chan->maxDataLen = maxDataLen;
-  chan->dataBuf = (uint8_t *)malloc(chan->maxDataLen);
+  chan->dataBuf = (uint8_t *)rtarena_alloc(chan->maxDataLen);
   if (chan->dataBuf == NULL) return -4;
 
-  chan->chunkBuf = (uint8_t *)malloc(chan->chunkLen);
-  if (chan->chunkBuf == NULL) return -5;
+  chan->sourceSymbolsPerBlock = sourceSymbolsPerBlock;
+  chan->repairSymbolsPerBlock = repairSymbolsPerBlock;
+  chan->symbolLen = symbolLen;
+  // same order as mux_addChannel with paced, which sends the most repair symbols early
+  chan->repairsBeforeLastSource = 0;
+  for (int i = 0, sourceIndex = 0, repairIndex = 0; paced && sourceIndex < sourceSymbolsPerBlock; i++) {
+    if (repairIndex < (i + 1) * repairSymbolsPerBlock / (sourceSymbolsPerBlock + repairSymbolsPerBlock)) {
+      repairIndex++;
+    } else {
+      sourceIndex++;
+    }
+    chan->repairsBeforeLastSource = repairIndex;
+  }
+  // the fast path tracks source symbols with a bitmap of DEMUX_SEEN_MAX_ESI bits
+  chan->fastPathEnabled = sourceSymbolsPerBlock <= DEMUX_SEEN_MAX_ESI;
+  for (int i = 0; i < DEMUX_STAGING_COUNT; i++) {
+    chan->staging[i].sbn = -1;
+    chan->staging[i].chunks = NULL;
+    if (!chan->fastPathEnabled) continue;
+    chan->staging[i].chunks = (uint8_t *)rtarena_alloc((sourceSymbolsPerBlock + repairSymbolsPerBlock) * chan->chunkLen);
+    if (chan->staging[i].chunks == NULL) return -4;
+  }
+
+  // streaming needs the staged source symbols from the fast path
+  chan->streamPartialBlocks = streamPartialBlocks && chan->fastPathEnabled;
+  chan->streamSbn = -1;
+  chan->streamBuf = NULL;
+  if (chan->streamPartialBlocks) {
+    chan->streamBuf = (uint8_t *)rtarena_alloc(chan->blockBufLen);
+    if (chan->streamBuf == NULL) return -4;
+  }
 
   chan->sbnLast = -1;
+  chan->sbnNewest = -1;
+  memset(chan->seenChunks, 0, sizeof(chan->seenChunks));
+  for (int i = 0; i < 256; i++) {
+    atomic_store(&chan->decodedSbns[i], false);
+    atomic_store(&chan->chunkArrivalUs[i], 0);
+  }
   chan->chId = chCountLocal;
   chan->onData = onData;
   chan->raptorqHandle = raptorq_initDecoder(chan->chunkLen, sourceSymbolsPerBlock);
-  xwait_init(&chan->waitHandle);
-
-  intptr_t arg = chCountLocal;
-  if (pthread_create(&chan->decodeThread, NULL, startDecodeThread, (void*)arg) != 0) return -6;
+  atomic_store(&chan->scheduled, false);
 
+  // the network thread can see the channel from here on
   return (int)atomic_fetch_add(&chCount, 1);
 }
 
+// network thread only
+// returns true if a chunk with this SBN and ESI has already been put on the ring, or its block has already been decoded
+static bool isChunkRedundant (demux_channel_t *chan, int sbn, uint32_t esi, int endpointIndex) {
+  if (chan->sbnNewest == -1) {
+    chan->sbnNewest = sbn;
+  } else {
+    int sbnDiff = sbn - chan->sbnNewest;
+    // Overflow
+    if (sbnDiff < -128) {
+      sbnDiff += 256;
+    } else if (sbnDiff > 128) {
+      sbnDiff -= 256;
+    }
+
+    // first chunk of a new block, forget about the blocks that previously used these SBNs
+    for (int i = 1; i <= sbnDiff; i++) {
+      int sbnReused = (chan->sbnNewest + i) & 0xff;
+      memset(chan->seenChunks[sbnReused], 0, sizeof(chan->seenChunks[sbnReused]));
+      atomic_store_explicit(&chan->decodedSbns[sbnReused], false, memory_order_relaxed);
+      atomic_store_explicit(&chan->chunkArrivalUs[sbnReused], 0, memory_order_relaxed);
+    }
+    if (sbnDiff > 0) chan->sbnNewest = sbn;
+  }
+
+  unsigned int statsIndex = chan->chId * MAX_ENDPOINTS + endpointIndex;
+
+  if (atomic_load_explicit(&chan->decodedSbns[sbn], memory_order_relaxed)) {
+    globals_add1uiv(statsEndpoints, lateChunkCount, statsIndex, 1);
+    return true;
+  }
+
+  if (esi >= DEMUX_SEEN_MAX_ESI) return false;
+
+  if (chan->seenChunks[sbn][esi / 64] & ((uint64_t)1 << (esi % 64))) {
+    globals_add1uiv(statsEndpoints, dupChunkCount, statsIndex, 1);
+    return true;
+  }
+
+  return false;
+}
+
+static void setChunkSeen (demux_channel_t *chan, int sbn, uint32_t esi) {
+  if (esi >= DEMUX_SEEN_MAX_ESI) return;
+  chan->seenChunks[sbn][esi / 64] |= (uint64_t)1 << (esi % 64);
+}
+
 // this is called by a single realtime priority network thread
 int demux_readPacket (const uint8_t *buf, size_t bufLen, int endpointIndex) {
   uint8_t chCountLocal = atomic_load(&chCount);
@@ -224,26 +650,38 @@ int demux_readPacket (const uint8_t *buf, size_t bufLen, int endpointIndex) {
     uint8_t chId = buf[pos++];
     if (chId >= chCountLocal) return -2;
 
-    demux_channel_t *chan = &channels[chId];
+    demux_channel_t *chan = channels[chId];
 
     if (bufLen < pos + chan->chunkLen) return -3;
+
+    int sbn = buf[pos];
+    uint32_t esi = readEsi(&buf[pos]);
+    globals_set1iv(statsEndpoints, lastSbn, chan->chId * MAX_ENDPOINTS + endpointIndex, sbn);
+
+    // with multihoming, every endpoint delivers a copy of each chunk; only the first one goes to the decoder
+    if (isChunkRedundant(chan, sbn, esi, endpointIndex)) {
+      pos += chan->chunkLen;
+      continue;
+    }
+
     // check there is space for at least one chunk on the ring
-    if (ck_ring_size(&chan->chunkRing) > chan->chunkRingLenWords - chan->chunkLenWords) {
+    uint8_t *chunkSlot = slotring_writeSlot(&chan->chunkRing);
+    if (chunkSlot == NULL || slotring_size(&chan->chunkRing) >= chan->chunkRingLen) {
       globals_add1uiv(statsDemux, ringOverrunCount, chId, 1);
       return -4;
     }
 
-    int sbn = buf[pos];
-    globals_set1iv(statsEndpoints, lastSbn, chan->chId * MAX_ENDPOINTS + endpointIndex, sbn);
-
-    for (size_t i = 0; i < chan->chunkLenWords; i++) {
-      intptr_t chunkWord = 0;
-      memcpy(&chunkWord, &buf[pos + 4*i], 4);
-      ck_ring_enqueue_spsc(&chan->chunkRing, chan->chunkRingBuf, (void*)chunkWord);
+    memcpy(chunkSlot, &buf[pos], chan->chunkLen);
+    // NOTE: 0 means no chunks yet, a real timestamp of 0 just loses one arrival stat
+    if (atomic_load_explicit(&chan->chunkArrivalUs[sbn], memory_order_relaxed) == 0) {
+      atomic_store_explicit(&chan->chunkArrivalUs[sbn], (unsigned int)utils_getCurrentUTime(), memory_order_relaxed);
     }
+    slotring_commitWrite(&chan->chunkRing);
+    EVENTRECORDER_TRACE(EVENTRECORDER_ID_DEMUX_ENQUEUE, sbn);
+    setChunkSeen(chan, sbn, esi);
 
-    // tell decode thread another chunk is ready
-    xwait_notify(&chan->waitHandle);
+    // hand the channel to a decode worker if none has it
+    scheduleChannel(chan);
 
     pos += chan->chunkLen;
   }
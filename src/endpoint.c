@@ -3,6 +3,18 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
+#if defined(__linux__) || defined(__ANDROID__)
+// recvmmsg and sendmmsg are used to batch socket I/O on Linux
+#define _GNU_SOURCE
+#define ENDPOINT_BATCH_IO
+#include <sys/socket.h>
+#endif
+
+#if defined(__linux__) && !defined(__ANDROID__) && defined(W_IO_URING)
+// io_uring backend for the data thread and endpoint_flush, used if the ioUring config field is set
+#define ENDPOINT_IO_URING
+#endif
+
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -18,7 +30,13 @@
 #include "boringtun/wireguard_ffi.h"
 #include "globals.h"
 #include "utils.h"
+#include "rt-arena.h"
+#include "peer-cache.h"
+#include "event-recorder.h"
 #include "endpoint.h"
+#ifdef ENDPOINT_IO_URING
+#include "uring.h"
+#endif
 
 // DEBUG: I can't find SO_BINDTODEVICE anywhere, if you know what's going on plz tell me
 #if defined(__linux__)
@@ -26,6 +44,19 @@
 #endif
 
 #define WG_READ_BUF_LEN 1500
+#define WG_WRITE_BUF_LEN 1500
+
+#define URING_DATA_RING_ENTRIES 256 // the CQ is twice this, which is more than the receives can fill
+#define URING_RECV_BUF_COUNT 256 // provided buffers shared by the multishot receives of all endpoints
+// each buffer starts with a struct io_uring_recvmsg_out and the source address, then the packet
+#define URING_RECV_BUF_LEN (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + WG_READ_BUF_LEN)
+#define URING_SEND_SLOT_COUNT 16 // handshakes and keepalives from sendBufToAll in flight on the data ring
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CANCEL 3
+
+#define PROBE_IP_PROTOCOL 253 // in the fake IPv4 header of probes, data packets have 0 (253 is reserved for experiments)
+#define PROBE_LEN 4 // rxOkMask, dataMask, 16 bits each, little endian
 
 static endpoint_t *endpoints = NULL;
 static pthread_t dataThread, openCloseThread;
@@ -36,14 +67,77 @@ static atomic_bool tunnelUp = false;
 static atomic_bool threadsRunning = true;
 static int (*_onPacket)(const uint8_t*, size_t, int) = NULL;
 
+// Which endpoints each packet from endpoint_send goes out on, see ENDPOINT_DISTRIBUTION_*.
+// These are only accessed by the thread calling endpoint_send.
+static int distMode = ENDPOINT_DISTRIBUTION_DUPLICATE, distCopies = 1;
+static double distWeights[MAX_ENDPOINTS]; // from config
+static double distEffWeights[MAX_ENDPOINTS]; // distWeights scaled down by measured send loss
+static double distCurrent[MAX_ENDPOINTS]; // smooth weighted round robin state
+static int distNextIndex = 0; // round robin state
+static unsigned int distWindowPos = 0;
+static unsigned int distLastCongestion[MAX_ENDPOINTS], distLastPackets[MAX_ENDPOINTS];
+
+// Endpoint liveness, see updateHealth. These are only accessed by the data thread, except healthyMask (read by
+// pickEndpoints) and dataSentMask (set by endpoint_send).
+static atomic_uint healthyMask = UINT32_MAX; // endpoints that are ENDPOINT_HEALTH_UP
+static atomic_uint dataSentMask = 0; // endpoints endpoint_send has sent data on since the last probe
+static int healths[MAX_ENDPOINTS]; // ENDPOINT_HEALTH_*
+static int healthySinceUTimes[MAX_ENDPOINTS]; // -1 while not healthy
+static int peerDataSinceUTimes[MAX_ENDPOINTS]; // -1 while the peer is not sending data on the endpoint
+static uint32_t peerRxOkMask = 0, peerDataMask = 0; // from the last probe
+static bool peerSendsProbes = false; // false for older versions, every open endpoint stays up then
+
+#ifdef ENDPOINT_BATCH_IO
+// Outgoing packets from endpoint_send are encrypted directly into sendBatchBufs and then sent to each
+// endpoint with one sendmmsg call per endpoint when endpoint_flush is called or the batch is full.
+// These are only accessed by the thread calling endpoint_send and endpoint_flush.
+static uint8_t sendBatchBufs[ENDPOINT_BATCH_LEN][WG_WRITE_BUF_LEN];
+static struct iovec sendBatchIovecs[ENDPOINT_BATCH_LEN];
+static uint32_t sendBatchTargets[ENDPOINT_BATCH_LEN]; // bitmask of endpoints for each packet
+static struct mmsghdr sendBatchMsgs[ENDPOINT_BATCH_LEN]; // the packets for one endpoint, rebuilt for each
+static int sendBatchLen = 0;
+#endif
+
+static bool useUring = false; // from config, only if built with W_IO_URING
+
+#ifdef ENDPOINT_IO_URING
+// A packet from sendBufToAll, sent to every endpoint from the data ring
+typedef struct {
+  uint8_t buf[WG_WRITE_BUF_LEN];
+  struct iovec iovec;
+  struct msghdr msgs[MAX_ENDPOINTS];
+  struct sockaddr_in peerAddrs[MAX_ENDPOINTS];
+  int refCount; // sends still in flight
+} uring_send_slot_t;
+
+// Multishot receives and sendBufToAll. These are only accessed by the data thread.
+static uring_t dataRing;
+static bool dataRingUp = false;
+static uring_send_slot_t dataSendSlots[URING_SEND_SLOT_COUNT];
+static bool dataFileSet[MAX_ENDPOINTS];
+static unsigned int dataFileGeneration[MAX_ENDPOINTS];
+static bool recvArmed[MAX_ENDPOINTS];
+static unsigned int recvGeneration[MAX_ENDPOINTS];
+static struct msghdr recvMsgHdr = { .msg_namelen = sizeof(struct sockaddr_in) }; // the multishot recvmsg only uses the lengths
+
+// endpoint_flush. These are only accessed by the thread calling endpoint_flush.
+static uring_t sendRing;
+static int sendRingState = 0; // 0: not set up yet, 1: up, -1: not available
+static bool sendFileSet[MAX_ENDPOINTS];
+static unsigned int sendFileGeneration[MAX_ENDPOINTS];
+static struct msghdr sendRingMsgs[MAX_ENDPOINTS][ENDPOINT_BATCH_LEN];
+static struct sockaddr_in sendRingPeerAddrs[MAX_ENDPOINTS];
+#endif
+
 /////////////////////
 // private
 /////////////////////
 
-static void sendBufToAll (const uint8_t *buf, int bufLen) {
+// targets is a bitmask of endpoint indexes
+static void sendBufToEndpoints (const uint8_t *buf, int bufLen, uint32_t targets) {
   for (int i = 0; i < endpointCount; i++) {
     endpoint_t *ep = &endpoints[i];
-    if (ep->state != GotPeerAddr) continue;
+    if (ep->state != GotPeerAddr || !(targets & (1u << i))) continue;
 
     struct sockaddr_in peerAddr = { 0 };
     peerAddr.sin_family = AF_INET;
@@ -65,6 +159,356 @@ static void sendBufToAll (const uint8_t *buf, int bufLen) {
   }
 }
 
+#ifdef ENDPOINT_IO_URING
+// user_data of every SQE: op, send slot, endpoint index and the sockGeneration of the endpoint when it was queued
+static uint64_t makeUserData (int op, int slotIndex, int epIndex, unsigned int generation) {
+  return (uint64_t)op << 56 | (uint64_t)slotIndex << 48 | (uint64_t)epIndex << 40 | generation;
+}
+
+// Points registered file slot epIndex of ring at the endpoint's socket while it is open, and empties it when it
+// isn't, so a closed socket isn't kept alive by the ring. Returns true if the slot holds the current socket.
+static bool syncFileSlot (uring_t *ring, bool *fileSet, unsigned int *fileGeneration, int epIndex, bool open) {
+  endpoint_t *ep = &endpoints[epIndex];
+
+  if (!open) {
+    if (fileSet[epIndex]) uring_updateFile(ring, epIndex, -1);
+    fileSet[epIndex] = false;
+    return false;
+  }
+
+  if (fileSet[epIndex] && fileGeneration[epIndex] == ep->sockGeneration) return true;
+  fileSet[epIndex] = uring_updateFile(ring, epIndex, ep->sock) == 0;
+  fileGeneration[epIndex] = ep->sockGeneration;
+  return fileSet[epIndex];
+}
+
+static void prepSendmsg (struct io_uring_sqe *sqe, int epIndex, struct msghdr *msg) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = epIndex; // registered file slot
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  // fail with EAGAIN instead of waiting for space in the socket buffer, like sendto and sendmmsg on the
+  // nonblocking sockets
+  sqe->msg_flags = MSG_DONTWAIT;
+}
+
+// Copies buf into a send slot and queues it for every open endpoint on the data ring. The data loop submits
+// them with its next uring_submitAndWait. Returns -1 if there is no free slot.
+static int queueSendToAll (const uint8_t *buf, int bufLen) {
+  int slotIndex = -1;
+  for (int i = 0; i < URING_SEND_SLOT_COUNT; i++) {
+    if (dataSendSlots[i].refCount == 0) {
+      slotIndex = i;
+      break;
+    }
+  }
+  if (slotIndex < 0 || bufLen > WG_WRITE_BUF_LEN) return -1;
+
+  uring_send_slot_t *slot = &dataSendSlots[slotIndex];
+  memcpy(slot->buf, buf, bufLen);
+  slot->iovec.iov_base = slot->buf;
+  slot->iovec.iov_len = bufLen;
+
+  for (int i = 0; i < endpointCount; i++) {
+    endpoint_t *ep = &endpoints[i];
+    if (ep->state != GotPeerAddr) continue;
+
+    struct io_uring_sqe *sqe = NULL;
+    if (syncFileSlot(&dataRing, dataFileSet, dataFileGeneration, i, true)) sqe = uring_getSqe(&dataRing);
+    if (sqe == NULL) {
+      sendBufToEndpoints(buf, bufLen, 1u << i);
+      continue;
+    }
+
+    struct sockaddr_in *peerAddr = &slot->peerAddrs[i];
+    memset(peerAddr, 0, sizeof(struct sockaddr_in));
+    peerAddr->sin_family = AF_INET;
+    peerAddr->sin_addr.s_addr = ep->peerAddr;
+    peerAddr->sin_port = ep->peerPort;
+
+    struct msghdr *msg = &slot->msgs[i];
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = peerAddr;
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_iov = &slot->iovec;
+    msg->msg_iovlen = 1;
+
+    prepSendmsg(sqe, i, msg);
+    sqe->user_data = makeUserData(URING_OP_SEND, slotIndex, i, dataFileGeneration[i]);
+    slot->refCount++;
+  }
+
+  return 0;
+}
+#endif
+
+// Endpoints still in discovery also try the peer at its cached address, so after a restart or reopen the
+// handshake doesn't have to wait for the discovery server. See handleRes.
+static void sendBufToCachedPeers (const uint8_t *buf, int bufLen) {
+  for (int i = 0; i < endpointCount; i++) {
+    endpoint_t *ep = &endpoints[i];
+    struct sockaddr_in peerAddr = { 0 };
+    if (ep->state != Discovery || !peercache_get(i, &peerAddr.sin_addr.s_addr, &peerAddr.sin_port)) continue;
+
+    peerAddr.sin_family = AF_INET;
+    ssize_t sendLen = sendto(ep->sock, buf, bufLen, 0, (struct sockaddr*)&peerAddr, sizeof(peerAddr));
+    // Accounts for IP and UDP headers
+    // TODO: This assumes IPv4
+    if (sendLen >= 0) globals_add1uiv(statsEndpoints, bytesOut, i, bufLen + 28);
+  }
+}
+
+// WireGuard handshakes and keepalives always go on every endpoint
+static void sendBufToAll (const uint8_t *buf, int bufLen) {
+  sendBufToCachedPeers(buf, bufLen);
+  #ifdef ENDPOINT_IO_URING
+  if (dataRingUp && queueSendToAll(buf, bufLen) == 0) return;
+  #endif
+  sendBufToEndpoints(buf, bufLen, UINT32_MAX);
+}
+
+// every ENDPOINT_DISTRIBUTION_WINDOW packets, scale each endpoint's weight by the fraction of its packets
+// that were sent without congestion over the window
+static void updateEffWeights (void) {
+  if (++distWindowPos < ENDPOINT_DISTRIBUTION_WINDOW) return;
+  distWindowPos = 0;
+
+  for (int i = 0; i < endpointCount; i++) {
+    unsigned int congestion = globals_get1uiv(statsEndpoints, sendCongestion, i);
+    unsigned int packets = globals_get1uiv(statsEndpoints, dataPacketsOut, i);
+    unsigned int congestionDelta = congestion - distLastCongestion[i];
+    unsigned int packetsDelta = packets - distLastPackets[i];
+    distLastCongestion[i] = congestion;
+    distLastPackets[i] = packets;
+
+    double loss = packetsDelta == 0 ? 0.0 : (double)congestionDelta / packetsDelta;
+    if (loss > 0.95) loss = 0.95; // keep a trickle going so we notice when the link recovers
+    distEffWeights[i] = distWeights[i] * (1.0 - loss);
+  }
+}
+
+// returns a bitmask of the endpoints the next data packet should be sent on
+static uint32_t pickEndpoints (void) {
+  uint32_t upMask = atomic_load_explicit(&healthyMask, memory_order_relaxed);
+  uint32_t openMask = 0, openUpMask = 0;
+  int openCount = 0, openUpCount = 0;
+  for (int i = 0; i < endpointCount; i++) {
+    if (endpoints[i].state != GotPeerAddr) continue;
+    openMask |= 1u << i;
+    openCount++;
+    if (!(upMask & (1u << i))) continue;
+    openUpMask |= 1u << i;
+    openUpCount++;
+  }
+
+  // degraded endpoints stay open but don't get data, unless all of them are degraded
+  if (openUpCount > 0) {
+    openMask = openUpMask;
+    openCount = openUpCount;
+  }
+
+  if (distMode == ENDPOINT_DISTRIBUTION_DUPLICATE || openCount <= distCopies) return openMask;
+
+  uint32_t targets = 0;
+
+  if (distMode == ENDPOINT_DISTRIBUTION_ROUND_ROBIN) {
+    int picked = 0;
+    while (picked < distCopies) {
+      int i = distNextIndex;
+      if (++distNextIndex == endpointCount) distNextIndex = 0;
+      if (!(openMask & (1u << i))) continue;
+      targets |= 1u << i;
+      picked++;
+    }
+    return targets;
+  }
+
+  // ENDPOINT_DISTRIBUTION_WEIGHTED: smooth weighted round robin, picking distCopies endpoints each time
+  updateEffWeights();
+  double totalWeight = 0.0;
+  for (int i = 0; i < endpointCount; i++) {
+    if (!(openMask & (1u << i))) continue;
+    distCurrent[i] += distEffWeights[i];
+    totalWeight += distEffWeights[i];
+  }
+
+  for (int picked = 0; picked < distCopies; picked++) {
+    int best = -1;
+    for (int i = 0; i < endpointCount; i++) {
+      if (!(openMask & (1u << i)) || (targets & (1u << i))) continue;
+      if (best == -1 || distCurrent[i] > distCurrent[best]) best = i;
+    }
+    targets |= 1u << best;
+    distCurrent[best] -= totalWeight / distCopies;
+  }
+
+  return targets;
+}
+
+#ifdef ENDPOINT_IO_URING
+// Same as the sendmmsg loop in flushSendBatch, but the batches for all endpoints go to the kernel with one
+// io_uring_enter. The sends for each endpoint are linked so they go out in order, and like sendmmsg the rest of
+// an endpoint's batch is dropped (cancelled) after the first send that fails.
+// Returns -1 if io_uring can't be used, the batch has not been sent then.
+static int flushSendBatchUring (void) {
+  if (sendRingState == 0) {
+    // set up here so the ring belongs to the thread calling endpoint_flush
+    sendRingState = -1;
+    unsigned flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    int err = uring_init(&sendRing, endpointCount * ENDPOINT_BATCH_LEN, flags);
+    if (err == 0 && (err = uring_registerFiles(&sendRing, endpointCount)) < 0) uring_deinit(&sendRing);
+    if (err < 0) {
+      printf("Endpoint: io_uring not available for sending (%s), using sendmmsg\n", strerror(-err));
+      return -1;
+    }
+    sendRingState = 1;
+  }
+  if (sendRingState < 0) return -1;
+
+  int queuedCount = 0;
+  int msgCounts[MAX_ENDPOINTS] = { 0 };
+  for (int i = 0; i < endpointCount; i++) {
+    endpoint_t *ep = &endpoints[i];
+    if (!syncFileSlot(&sendRing, sendFileSet, sendFileGeneration, i, ep->state == GotPeerAddr)) continue;
+
+    struct sockaddr_in *peerAddr = &sendRingPeerAddrs[i];
+    memset(peerAddr, 0, sizeof(struct sockaddr_in));
+    peerAddr->sin_family = AF_INET;
+    peerAddr->sin_addr.s_addr = ep->peerAddr;
+    peerAddr->sin_port = ep->peerPort;
+
+    struct io_uring_sqe *lastSqe = NULL;
+    for (int j = 0; j < sendBatchLen; j++) {
+      if (!(sendBatchTargets[j] & (1u << i))) continue;
+      struct msghdr *msg = &sendRingMsgs[i][msgCounts[i]++];
+      msg->msg_name = peerAddr;
+      msg->msg_namelen = sizeof(struct sockaddr_in);
+      msg->msg_iov = &sendBatchIovecs[j];
+      msg->msg_iovlen = 1;
+
+      // the ring has room for a full batch on every endpoint, and every flush waits for all of its sends
+      struct io_uring_sqe *sqe = uring_getSqe(&sendRing);
+      prepSendmsg(sqe, i, msg);
+      sqe->flags |= IOSQE_IO_LINK;
+      sqe->user_data = makeUserData(URING_OP_SEND, 0, i, sendFileGeneration[i]);
+      lastSqe = sqe;
+      queuedCount++;
+    }
+    if (lastSqe != NULL) lastSqe->flags &= ~IOSQE_IO_LINK;
+  }
+  if (queuedCount == 0) return 0;
+
+  // the sends don't block (MSG_DONTWAIT), so this only waits for the kernel to run them
+  int sentCounts[MAX_ENDPOINTS] = { 0 };
+  bool failed[MAX_ENDPOINTS] = { 0 };
+  int completedCount = 0;
+  int err = uring_submitAndWait(&sendRing, queuedCount, -1);
+  while (err >= 0 && completedCount < queuedCount) {
+    struct io_uring_cqe *cqe = uring_peekCqe(&sendRing);
+    if (cqe == NULL) {
+      err = uring_submitAndWait(&sendRing, queuedCount - completedCount, -1);
+      continue;
+    }
+
+    int epIndex = (cqe->user_data >> 40) & 0xff;
+    unsigned int generation = cqe->user_data & 0xffffffff;
+    int res = cqe->res;
+    uring_advanceCq(&sendRing);
+    completedCount++;
+
+    if (res >= 0) {
+      // Accounts for IP and UDP headers
+      // TODO: This assumes IPv4
+      globals_add1uiv(statsEndpoints, bytesOut, epIndex, res + 28);
+      sentCounts[epIndex]++;
+    } else if (res == -EAGAIN || (res == -ECANCELED && !failed[epIndex])) {
+      globals_add1uiv(statsEndpoints, sendCongestion, epIndex, 1);
+    } else if (res != -ECANCELED) {
+      // send failed, close this endpoint and re-open after a delay
+      failed[epIndex] = true;
+      if (generation == endpoints[epIndex].sockGeneration) endpoints[epIndex].state = Close;
+    }
+  }
+
+  if (err < 0) {
+    // the ring is in an unknown state, give up on it
+    printf("Endpoint: io_uring send failed (%s), using sendmmsg\n", strerror(-err));
+    uring_deinit(&sendRing);
+    sendRingState = -1;
+  }
+
+  for (int i = 0; i < endpointCount; i++) {
+    if (msgCounts[i] == 0) continue;
+    globals_add1uiv(statsEndpoints, sendBatchCount, i, 1);
+    globals_add1uiv(statsEndpoints, sendBatchPacketCount, i, sentCounts[i]);
+  }
+
+  return 0;
+}
+#endif
+
+#ifdef ENDPOINT_BATCH_IO
+static void flushSendBatch (void) {
+  if (sendBatchLen == 0) return;
+
+  #ifdef ENDPOINT_IO_URING
+  if (useUring && flushSendBatchUring() == 0) {
+    sendBatchLen = 0;
+    return;
+  }
+  #endif
+
+  for (int i = 0; i < endpointCount; i++) {
+    endpoint_t *ep = &endpoints[i];
+    if (ep->state != GotPeerAddr) continue;
+
+    struct sockaddr_in peerAddr = { 0 };
+    peerAddr.sin_family = AF_INET;
+    peerAddr.sin_addr.s_addr = ep->peerAddr;
+    peerAddr.sin_port = ep->peerPort;
+
+    int msgCount = 0;
+    for (int j = 0; j < sendBatchLen; j++) {
+      if (!(sendBatchTargets[j] & (1u << i))) continue;
+      sendBatchMsgs[msgCount].msg_hdr.msg_iov = &sendBatchIovecs[j];
+      sendBatchMsgs[msgCount].msg_hdr.msg_iovlen = 1;
+      sendBatchMsgs[msgCount].msg_hdr.msg_name = &peerAddr;
+      sendBatchMsgs[msgCount].msg_hdr.msg_namelen = sizeof(peerAddr);
+      msgCount++;
+    }
+    if (msgCount == 0) continue;
+
+    // sendmmsg may send fewer messages than requested, if so keep going from where it stopped
+    int sentCount = 0;
+    while (sentCount < msgCount) {
+      int result = sendmmsg(ep->sock, &sendBatchMsgs[sentCount], msgCount - sentCount, 0);
+      if (result < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          globals_add1uiv(statsEndpoints, sendCongestion, i, msgCount - sentCount);
+        } else {
+          // send failed, close this endpoint and re-open after a delay
+          ep->state = Close;
+        }
+        break;
+      }
+
+      for (int j = sentCount; j < sentCount + result; j++) {
+        // Accounts for IP and UDP headers
+        // TODO: This assumes IPv4
+        globals_add1uiv(statsEndpoints, bytesOut, i, sendBatchMsgs[j].msg_len + 28);
+      }
+      sentCount += result;
+    }
+
+    globals_add1uiv(statsEndpoints, sendBatchCount, i, 1);
+    globals_add1uiv(statsEndpoints, sendBatchPacketCount, i, sentCount);
+  }
+
+  sendBatchLen = 0;
+}
+#endif
+
 static void tickDiscovery (int epIndex) {
   static uint8_t sendBuf[65];
   endpoint_t *ep = &endpoints[epIndex];
@@ -86,17 +530,145 @@ static void tickDiscovery (int epIndex) {
 static void tickTunnel (void) {
   static uint8_t tickBuf[1500] = { 0 };
 
-  if (!tunnelUp) {
-    struct stats tunnelStats = wireguard_stats(tunnel);
-    if (tunnelStats.time_since_last_handshake >= 0) {
-      tunnelUp = true;
-    }
+  struct stats tunnelStats = wireguard_stats(tunnel);
+  if (!tunnelUp && tunnelStats.time_since_last_handshake >= 0) {
+    tunnelUp = true;
   }
+  // the receiver uses this to estimate one-way network latency
+  globals_set1i(statsEndpoints, tunnelRttMs, tunnelStats.estimated_rtt);
 
   struct wireguard_result result = wireguard_tick(tunnel, tickBuf, sizeof(tickBuf));
   if (result.op == WRITE_TO_NETWORK) sendBufToAll(tickBuf, result.size);
 }
 
+// Endpoints the peer is sending data on whose last block on some channel is more than ENDPOINT_HEALTH_MAX_SBN_LAG
+// blocks behind the newest block any of them has delivered. Only the receiver gets blocks, so this is always 0 for
+// the sender.
+static uint32_t getLaggingEndpoints (void) {
+  uint32_t checkMask = 0;
+  int checkCount = 0;
+  for (int i = 0; i < endpointCount; i++) {
+    // give an endpoint time to deliver a few blocks after the peer starts sending data on it
+    if (peerDataSinceUTimes[i] < 0 || utils_getElapsedUTime(peerDataSinceUTimes[i]) < ENDPOINT_HEALTH_MAX_GAP_US) continue;
+    checkMask |= 1u << i;
+    checkCount++;
+  }
+  if (checkCount < 2) return 0;
+
+  uint32_t laggingMask = 0;
+  int relSbns[MAX_ENDPOINTS];
+  for (int chId = 0; chId < MUX_MAX_CHANNELS; chId++) {
+    // SBNs are 8 bit and wrap around, so compare them relative to the first endpoint's
+    int firstSbn = -1, maxRelSbn = INT8_MIN;
+    for (int i = 0; i < endpointCount; i++) {
+      if (!(checkMask & (1u << i))) continue;
+      int sbn = globals_get1iv(statsEndpoints, lastSbn, chId * MAX_ENDPOINTS + i);
+      if (firstSbn < 0) firstSbn = sbn;
+      relSbns[i] = (int8_t)(uint8_t)(sbn - firstSbn);
+      if (relSbns[i] > maxRelSbn) maxRelSbn = relSbns[i];
+    }
+
+    for (int i = 0; i < endpointCount; i++) {
+      if (!(checkMask & (1u << i))) continue;
+      if (maxRelSbn - relSbns[i] > ENDPOINT_HEALTH_MAX_SBN_LAG) laggingMask |= 1u << i;
+    }
+  }
+
+  return laggingMask;
+}
+
+static void setHealth (int epIndex, int health) {
+  int prevHealth = healths[epIndex];
+  if (health == prevHealth) return;
+
+  healths[epIndex] = health;
+  globals_set1uiv(statsEndpoints, health, epIndex, health);
+  // opening and closing are not counted, the open stat covers those
+  if (prevHealth == ENDPOINT_HEALTH_DOWN || health == ENDPOINT_HEALTH_DOWN) return;
+
+  globals_add1uiv(statsEndpoints, healthTransitionCount, epIndex, 1);
+  printf("(epIndex %d) %s\n", epIndex, health == ENDPOINT_HEALTH_UP ? "up" : "degraded");
+}
+
+// An endpoint is healthy while this side is receiving on it (something arrives at least every
+// ENDPOINT_HEALTH_MAX_GAP_US and it keeps up with the other endpoints' SBNs) and the peer's last probe says the
+// same about its side. An endpoint that stops being healthy is degraded straight away, and goes back up once it
+// has been healthy for ENDPOINT_HEALTH_RECOVER_US. The sockets stay open the whole time.
+// Returns the endpoints this side is receiving on, for the next probe.
+static uint32_t updateHealth (void) {
+  uint32_t laggingMask = getLaggingEndpoints();
+  uint32_t rxOkMask = 0, upMask = 0;
+
+  for (int i = 0; i < endpointCount; i++) {
+    endpoint_t *ep = &endpoints[i];
+    if (ep->state != GotPeerAddr) {
+      healthySinceUTimes[i] = -1;
+      setHealth(i, ENDPOINT_HEALTH_DOWN);
+      continue;
+    }
+
+    bool rxOk = (
+      ep->lastPacketUTime >= 0 &&
+      utils_getElapsedUTime(ep->lastPacketUTime) <= ENDPOINT_HEALTH_MAX_GAP_US &&
+      !(laggingMask & (1u << i))
+    );
+    if (rxOk) rxOkMask |= 1u << i;
+
+    bool healthy = !peerSendsProbes || (rxOk && (peerRxOkMask & (1u << i)));
+    if (!healthy) {
+      healthySinceUTimes[i] = -1;
+      setHealth(i, ENDPOINT_HEALTH_DEGRADED);
+    } else if (healths[i] == ENDPOINT_HEALTH_DEGRADED) {
+      if (healthySinceUTimes[i] < 0) {
+        healthySinceUTimes[i] = utils_getCurrentUTime();
+      } else if (utils_getElapsedUTime(healthySinceUTimes[i]) >= ENDPOINT_HEALTH_RECOVER_US) {
+        setHealth(i, ENDPOINT_HEALTH_UP);
+      }
+    } else {
+      // endpoints that have just opened start out up
+      setHealth(i, ENDPOINT_HEALTH_UP);
+    }
+
+    if (healths[i] == ENDPOINT_HEALTH_UP) upMask |= 1u << i;
+  }
+
+  atomic_store_explicit(&healthyMask, upMask, memory_order_relaxed);
+  return rxOkMask;
+}
+
+static void onProbe (const uint8_t *buf, size_t len) {
+  if (len < PROBE_LEN) return;
+
+  peerSendsProbes = true;
+  peerRxOkMask = buf[0] | (uint32_t)buf[1] << 8;
+  uint32_t dataMask = buf[2] | (uint32_t)buf[3] << 8;
+  for (int i = 0; i < endpointCount; i++) {
+    if (!(dataMask & (1u << i))) {
+      peerDataSinceUTimes[i] = -1;
+    } else if (!(peerDataMask & (1u << i))) {
+      peerDataSinceUTimes[i] = utils_getCurrentUTime();
+    }
+  }
+  peerDataMask = dataMask;
+}
+
+// A probe goes through the tunnel like a data packet and to every endpoint like a keepalive. Copies of it that
+// arrive on more than one endpoint are dropped by WireGuard as duplicates.
+static void sendProbe (uint32_t rxOkMask) {
+  // same fake IPv4 header as in endpoint_send, with the protocol field set
+  uint8_t srcBuf[ENDPOINT_SEND_HEADROOM + PROBE_LEN] = { 0x45, 0x00, 0x00, ENDPOINT_SEND_HEADROOM + PROBE_LEN, [9] = PROBE_IP_PROTOCOL };
+  uint8_t dstBuf[WG_WRITE_BUF_LEN];
+
+  uint32_t dataMask = atomic_exchange_explicit(&dataSentMask, 0, memory_order_relaxed);
+  srcBuf[20] = rxOkMask & 0xff;
+  srcBuf[21] = (rxOkMask >> 8) & 0xff;
+  srcBuf[22] = dataMask & 0xff;
+  srcBuf[23] = (dataMask >> 8) & 0xff;
+
+  struct wireguard_result result = wireguard_write(tunnel, srcBuf, sizeof(srcBuf), dstBuf, sizeof(dstBuf));
+  if (result.op == WRITE_TO_NETWORK && result.size > 0) sendBufToAll(dstBuf, result.size);
+}
+
 static int openEndpoint (int epIndex) {
   endpoint_t *ep = &endpoints[epIndex];
   ep->peerAddr = 0;
@@ -127,6 +699,8 @@ static int openEndpoint (int epIndex) {
   return 0;
 }
 
+// Returns -1 if WireGuard rejected the packet, or -2 if it was dropped as a copy of a packet that already
+// arrived (usually on another endpoint). Those are not authenticated by WireGuard.
 static int onPeerPacket (const uint8_t *buf, int bufLen, int epIndex) {
   static uint8_t wgReadBuf[WG_READ_BUF_LEN] = { 0 };
 
@@ -141,11 +715,15 @@ static int onPeerPacket (const uint8_t *buf, int bufLen, int epIndex) {
           // TODO: Investigate wg errors when using multihoming.
           // I have observed errors 10, 7 and 2 but they don't seem to cause any issues higher up the stack.
           // printf("wg error: %zu\n", result.size);
+          return -1;
         }
-        return 0;
+        return -2;
 
       case WRITE_TO_TUNNEL_IPV4:
-        if (result.size > 20 && _onPacket != NULL) {
+        if (result.size >= 20 && wgReadBuf[9] == PROBE_IP_PROTOCOL) {
+          onProbe(wgReadBuf + 20, result.size - 20);
+        } else if (result.size > 20 && _onPacket != NULL) {
+          EVENTRECORDER_TRACE(EVENTRECORDER_ID_PACKET_RECEIVE, epIndex);
           _onPacket(wgReadBuf + 20, result.size - 20, epIndex);
         }
         return 0;
@@ -163,7 +741,21 @@ static int onPeerPacket (const uint8_t *buf, int bufLen, int epIndex) {
   return 0;
 }
 
-static void handleRes (int epIndex, uint8_t *buf, ssize_t len) {
+// via is printed after the address
+static void setPeerAddr (int epIndex, uint32_t addr, uint16_t port, const char *via) {
+  endpoint_t *ep = &endpoints[epIndex];
+  // NOTE: the thread calling endpoint_send reads these without a lock, so if the peer moves, one batch can go
+  // to the old address with the new port. That packet is lost like any other.
+  ep->peerAddr = addr;
+  ep->peerPort = port;
+  peercache_set(epIndex, addr, port);
+
+  char addrString[16] = { 0 };
+  inet_ntop(AF_INET, &ep->peerAddr, addrString, sizeof(addrString));
+  printf("(epIndex %d) got peer addr %s:%d%s\n", epIndex, addrString, ntohs(ep->peerPort), via);
+}
+
+static void handleRes (int epIndex, uint8_t *buf, ssize_t len, const struct sockaddr_in *from) {
   endpoint_t *ep = &endpoints[epIndex];
 
   // Accounts for IP and UDP headers
@@ -171,32 +763,47 @@ static void handleRes (int epIndex, uint8_t *buf, ssize_t len) {
   globals_add1uiv(statsEndpoints, bytesIn, epIndex, len + 28);
 
   switch (atomic_load(&ep->state)) {
-    case Discovery:
-      if (len != 38) return;
-
-      for (int i = 0; i < 32; i++) {
-        if (buf[i] != peerPubKey[i]) return;
-      }
+    case Discovery: {
+      if (len == 38 && memcmp(buf, peerPubKey, 32) == 0) {
+        for (int i = 0; i < 6; i++) {
+          // TODO: secure discovery
+          // XOR remote addr and port with myPubKey
+          buf[32 + i] ^= myPubKey[i];
+        }
 
-      for (int i = 0; i < 6; i++) {
-        // TODO: secure discovery
-        // XOR remote addr and port with myPubKey
-        buf[32 + i] ^= myPubKey[i];
+        uint32_t addr;
+        uint16_t port;
+        memcpy(&addr, &buf[32], 4);
+        memcpy(&port, &buf[36], 2);
+        setPeerAddr(epIndex, addr, port, "");
+      } else {
+        // Not from the discovery server, maybe the peer answering what sendBufToCachedPeers sent. If it is from
+        // the cached address and WireGuard authenticates it, the peer is there.
+        // NOTE: a duplicate that WireGuard drops doesn't count, it could be a replay with a forged source address.
+        // Discovery or the next authenticated packet will confirm the address instead.
+        uint32_t addr;
+        uint16_t port;
+        if (!peercache_get(epIndex, &addr, &port) || from->sin_addr.s_addr != addr || from->sin_port != port) return;
+
+        if (onPeerPacket(buf, len, epIndex) != 0) return;
+        setPeerAddr(epIndex, addr, port, " (cached)");
       }
 
-      memcpy(&ep->peerAddr, &buf[32], 4);
-      memcpy(&ep->peerPort, &buf[36], 2);
       ep->state = GotPeerAddr;
       ep->lastPacketUTime = utils_getCurrentUTime();
       globals_set1uiv(statsEndpoints, open, epIndex, 1);
-
-      char addrString[16] = { 0 };
-      inet_ntop(AF_INET, &ep->peerAddr, addrString, sizeof(addrString));
-      printf("(epIndex %d) got peer addr %s:%d\n", epIndex, addrString, ntohs(ep->peerPort));
       break;
+    }
 
     case GotPeerAddr:
-      onPeerPacket(buf, len, epIndex);
+      // WireGuard authenticated the packet, so like WireGuard itself follow the peer to its new address, e.g. after
+      // it restarted and reached this endpoint from a new socket
+      if (
+        onPeerPacket(buf, len, epIndex) == 0 &&
+        (from->sin_addr.s_addr != ep->peerAddr || from->sin_port != ep->peerPort)
+      ) {
+        setPeerAddr(epIndex, from->sin_addr.s_addr, from->sin_port, " (peer moved)");
+      }
       break;
 
     default:
@@ -208,34 +815,54 @@ static void handleRes (int epIndex, uint8_t *buf, ssize_t len) {
 // public
 /////////////////////
 
-// NOTE: this function is not thread safe due to srcBuf and dstBuf being static.
-int endpoint_send (const uint8_t *buf, size_t bufLen) {
+// NOTE: this function is not thread safe due to pickEndpoints state and sendBatchBufs, see endpoint.h
+int endpoint_send (uint8_t *buf, size_t bufLen) {
   if (!tunnelUp) return -1;
+  if (bufLen <= ENDPOINT_SEND_HEADROOM || bufLen > ENDPOINT_SEND_MAX_LEN) return -2;
 
-  // This buffer starts with a fake IPv4 header that passes BoringTun's packet checks.
+  // The headroom becomes a fake IPv4 header that passes BoringTun's packet checks, including the length field.
   // TODO: remove this check from the Rust code
-  static uint8_t srcBuf[1500] = { 0x45, 0x00, 0x00, 0x00 };
-  static const size_t maxSrcDataLen = sizeof(srcBuf) - 20;
-  static uint8_t dstBuf[1500] = { 0 };
-
-  if (bufLen > maxSrcDataLen) return -2;
-
-  size_t srcBufLen = bufLen + 20;
-  // Set length field in the fake header as it is checked by BoringTun.
-  srcBuf[2] = srcBufLen >> 8;
-  srcBuf[3] = srcBufLen & 0xff;
-
-  memcpy(srcBuf + 20, buf, bufLen);
+  memset(buf, 0, ENDPOINT_SEND_HEADROOM);
+  buf[0] = 0x45;
+  buf[2] = bufLen >> 8;
+  buf[3] = bufLen & 0xff;
+
+  uint32_t targets = pickEndpoints();
+  // for the next probe. Reading first avoids an atomic write for every packet.
+  if ((atomic_load_explicit(&dataSentMask, memory_order_relaxed) & targets) != targets) {
+    atomic_fetch_or_explicit(&dataSentMask, targets, memory_order_relaxed);
+  }
+  globals_add1ui(statsEndpoints, dataPacketCount, 1);
+  for (int i = 0; i < endpointCount; i++) {
+    if (targets & (1u << i)) globals_add1uiv(statsEndpoints, dataPacketsOut, i, 1);
+  }
 
   struct wireguard_result result;
-  result = wireguard_write(tunnel, srcBuf, srcBufLen, dstBuf, sizeof(dstBuf));
+  #ifdef ENDPOINT_BATCH_IO
+  uint8_t *dstBuf = sendBatchBufs[sendBatchLen];
+  result = wireguard_write(tunnel, buf, bufLen, dstBuf, WG_WRITE_BUF_LEN);
   if (result.op == WRITE_TO_NETWORK && result.size > 0) {
-    sendBufToAll(dstBuf, result.size);
+    sendBatchIovecs[sendBatchLen].iov_len = result.size;
+    sendBatchTargets[sendBatchLen] = targets;
+    if (++sendBatchLen == ENDPOINT_BATCH_LEN) flushSendBatch();
   }
+  #else
+  uint8_t dstBuf[WG_WRITE_BUF_LEN];
+  result = wireguard_write(tunnel, buf, bufLen, dstBuf, sizeof(dstBuf));
+  if (result.op == WRITE_TO_NETWORK && result.size > 0) {
+    sendBufToEndpoints(dstBuf, result.size, targets);
+  }
+  #endif
 
   return 0;
 }
 
+void endpoint_flush (void) {
+  #ifdef ENDPOINT_BATCH_IO
+  flushSendBatch();
+  #endif
+}
+
 /////////////////////
 // threads
 /////////////////////
@@ -251,6 +878,7 @@ static void *openCloseLoop (UNUSED void *arg) {
           ep->state = Close;
         } else {
           ep->discoveryTickCounter = ENDPOINT_DISCOVERY_INTERVAL;
+          ep->sockGeneration++;
           ep->state = Discovery;
         }
       } else if (ep->state == Close) {
@@ -265,51 +893,83 @@ static void *openCloseLoop (UNUSED void *arg) {
       }
     }
 
+    // not done on the data thread, which is realtime
+    peercache_save();
+
     utils_usleep(ENDPOINT_TICK_INTERVAL_US);
   }
 
   return NULL;
 }
 
-static void *dataLoop (UNUSED void *arg) {
+// Ticks the tunnel, closes endpoints that stopped receiving keepalives and sends discovery packets, every
+// ENDPOINT_TICK_INTERVAL_US
+static void tickData (int *lastTickUTime) {
+  int elapsedUTime = utils_getElapsedUTime(*lastTickUTime);
+  if (elapsedUTime < ENDPOINT_TICK_INTERVAL_US) return;
+
+  tickTunnel();
+  *lastTickUTime = utils_getCurrentUTime();
+
+  for (int i = 0; i < endpointCount; i++) {
+    if (
+      endpoints[i].state == GotPeerAddr &&
+      endpoints[i].lastPacketUTime >= 0 &&
+      utils_getElapsedUTime(endpoints[i].lastPacketUTime) > 5000 * ENDPOINT_KEEP_ALIVE_MS
+    ) {
+      // wait for at least 5 dropped keepalive packets before closing
+      endpoints[i].state = Close;
+    }
+
+    if (endpoints[i].state == Discovery) tickDiscovery(i);
+  }
+}
+
+// Updates endpoint health and sends a probe, every ENDPOINT_HEALTH_PROBE_INTERVAL_US
+static void tickHealth (int *lastProbeUTime) {
+  if (utils_getElapsedUTime(*lastProbeUTime) < ENDPOINT_HEALTH_PROBE_INTERVAL_US) return;
+  *lastProbeUTime = utils_getCurrentUTime();
+
+  uint32_t rxOkMask = updateHealth();
+  if (tunnelUp) sendProbe(rxOkMask);
+}
+
+static void dataLoopPoll (void) {
+  #ifdef ENDPOINT_BATCH_IO
+  // static so they are zero initialised and not on the stack
+  static uint8_t recvBufs[ENDPOINT_BATCH_LEN][1500];
+  static struct sockaddr_in recvAddrs[ENDPOINT_BATCH_LEN];
+  static struct iovec recvIovecs[ENDPOINT_BATCH_LEN];
+  static struct mmsghdr recvMsgs[ENDPOINT_BATCH_LEN];
+  for (int i = 0; i < ENDPOINT_BATCH_LEN; i++) {
+    recvIovecs[i].iov_base = recvBufs[i];
+    recvIovecs[i].iov_len = sizeof(recvBufs[i]);
+    recvMsgs[i].msg_hdr.msg_iov = &recvIovecs[i];
+    recvMsgs[i].msg_hdr.msg_iovlen = 1;
+    recvMsgs[i].msg_hdr.msg_name = &recvAddrs[i];
+  }
+  #else
   uint8_t recvBuf[1500] = { 0 };
   struct sockaddr_in recvAddr = { 0 };
+  #endif
   struct pollfd pfds[endpointCount];
   int lastTickUTime = utils_getCurrentUTime();
+  int lastProbeUTime = lastTickUTime;
 
-  // dividing by 2 means the max possible time between handleTick calls will be 
-  // 1.5 * ENDPOINT_TICK_INTERVAL_US instead of 2 * ENDPOINT_TICK_INTERVAL_US
-  int tickTimeoutUs = ENDPOINT_TICK_INTERVAL_US / 2;
+  // dividing by 2 means the max possible time between tickHealth calls will be
+  // 1.5 * ENDPOINT_HEALTH_PROBE_INTERVAL_US instead of 2 * ENDPOINT_HEALTH_PROBE_INTERVAL_US
+  int tickTimeoutUs = ENDPOINT_HEALTH_PROBE_INTERVAL_US / 2;
   int tickTimeoutMs = tickTimeoutUs / 1000;
 
-  // this thread is relatively lightweight; demux will pass all the heavy decoding
-  // to other thread(s)
-  utils_setCallerThreadRealtime(98, 0);
-
   while (threadsRunning) {
-    bool tick = false;
-    int elapsedUTime = utils_getElapsedUTime(lastTickUTime);
-    if (elapsedUTime >= ENDPOINT_TICK_INTERVAL_US) {
-      tickTunnel();
-      lastTickUTime = utils_getCurrentUTime();
-      tick = true;
-    }
+    tickData(&lastTickUTime);
+    tickHealth(&lastProbeUTime);
 
     bool allClosed = true;
     for (int i = 0; i < endpointCount; i++) {
-      if (tick &&
-        endpoints[i].state == GotPeerAddr &&
-        endpoints[i].lastPacketUTime >= 0 &&
-        utils_getElapsedUTime(endpoints[i].lastPacketUTime) > 5000 * ENDPOINT_KEEP_ALIVE_MS
-      ) {
-        // wait for at least 5 dropped keepalive packets before closing
-        endpoints[i].state = Close;
-      }
-
       switch (atomic_load(&endpoints[i].state)) {
         case Discovery:
-          if (tick) tickDiscovery(i);
-        case GotPeerAddr: // intentional fall-through
+        case GotPeerAddr:
           pfds[i].fd = endpoints[i].sock;
           pfds[i].events = POLLIN;
           allClosed = false;
@@ -342,23 +1002,213 @@ static void *dataLoop (UNUSED void *arg) {
         continue;
       }
 
+      #ifdef ENDPOINT_BATCH_IO
+      // drain up to ENDPOINT_BATCH_LEN packets from the socket with one syscall
+      for (int j = 0; j < ENDPOINT_BATCH_LEN; j++) {
+        recvMsgs[j].msg_hdr.msg_namelen = sizeof(recvAddrs[j]);
+      }
+      int recvCount = recvmmsg(ep->sock, recvMsgs, ENDPOINT_BATCH_LEN, MSG_DONTWAIT, NULL);
+      if (recvCount < 0) {
+        ep->state = Close;
+        continue;
+      }
+
+      globals_add1uiv(statsEndpoints, recvBatchCount, i, 1);
+      globals_add1uiv(statsEndpoints, recvBatchPacketCount, i, recvCount);
+      ep->lastPacketUTime = utils_getCurrentUTime();
+
+      for (int j = 0; j < recvCount; j++) {
+        if (recvMsgs[j].msg_hdr.msg_namelen != sizeof(recvAddrs[j])) {
+          ep->state = Close;
+          break;
+        }
+
+        // this is where all the magic happens for receiver
+        handleRes(i, recvBufs[j], recvMsgs[j].msg_len, &recvAddrs[j]);
+      }
+      #else
       socklen_t recvAddrLen = sizeof(recvAddr);
       ssize_t recvLen = recvfrom(ep->sock, recvBuf, sizeof(recvBuf), 0, (struct sockaddr*)&recvAddr, &recvAddrLen);
-      // DEBUG: I think we should do here: ep->peerPort = recvAddr.sin_port
-      //        otherwise port-restricted cone NAT might not work properly
 
       if (recvLen < 0 || recvAddrLen != sizeof(recvAddr)) {
         ep->state = Close;
         continue;
       }
 
+      globals_add1uiv(statsEndpoints, recvBatchCount, i, 1);
+      globals_add1uiv(statsEndpoints, recvBatchPacketCount, i, 1);
       ep->lastPacketUTime = utils_getCurrentUTime();
 
       // this is where all the magic happens for receiver
-      handleRes(i, recvBuf, recvLen);
+      handleRes(i, recvBuf, recvLen, &recvAddr);
+      #endif
+    }
+  }
+}
+
+#ifdef ENDPOINT_IO_URING
+// Handles the CQEs of the data ring: received packets go to handleRes like in dataLoopPoll
+static void handleDataCqes (void) {
+  int recvCounts[MAX_ENDPOINTS] = { 0 };
+
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_peekCqe(&dataRing)) != NULL) {
+    int op = cqe->user_data >> 56;
+    int slotIndex = (cqe->user_data >> 48) & 0xff;
+    int epIndex = (cqe->user_data >> 40) & 0xff;
+    unsigned int generation = cqe->user_data & 0xffffffff;
+    int res = cqe->res;
+    unsigned int flags = cqe->flags;
+    uring_advanceCq(&dataRing);
+
+    endpoint_t *ep = &endpoints[epIndex];
+    // false for CQEs from before the socket was closed or reopened
+    bool current = generation == ep->sockGeneration;
+
+    if (op == URING_OP_RECV) {
+      // the multishot receive has stopped, e.g. it ran out of buffers (ENOBUFS) or was cancelled.
+      // Re-arm the next time around the data loop.
+      if (!(flags & IORING_CQE_F_MORE) && recvGeneration[epIndex] == generation) recvArmed[epIndex] = false;
+
+      if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t bufId = flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = uring_getBuf(&dataRing, bufId);
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+        size_t headerLen = sizeof(struct io_uring_recvmsg_out) + recvMsgHdr.msg_namelen;
+        if (
+          current && res >= (int)headerLen && out->payloadlen > 0 && !(out->flags & MSG_TRUNC) &&
+          out->namelen == sizeof(struct sockaddr_in)
+        ) {
+          struct sockaddr_in recvAddr;
+          memcpy(&recvAddr, buf + sizeof(struct io_uring_recvmsg_out), sizeof(recvAddr));
+          if (recvCounts[epIndex]++ == 0) ep->lastPacketUTime = utils_getCurrentUTime();
+          // this is where all the magic happens for receiver
+          handleRes(epIndex, buf + headerLen, out->payloadlen, &recvAddr);
+        }
+        uring_recycleBuf(&dataRing, bufId);
+      } else if (current && res < 0 && res != -ECANCELED && res != -ENOBUFS) {
+        ep->state = Close;
+      }
+    } else if (op == URING_OP_SEND) {
+      dataSendSlots[slotIndex].refCount--;
+      if (res >= 0) {
+        // Accounts for IP and UDP headers
+        // TODO: This assumes IPv4
+        globals_add1uiv(statsEndpoints, bytesOut, epIndex, res + 28);
+      } else if (res == -EAGAIN) {
+        globals_add1uiv(statsEndpoints, sendCongestion, epIndex, 1);
+      } else if (current && ep->state == GotPeerAddr) {
+        // send failed, close this endpoint and re-open after a delay
+        ep->state = Close;
+      }
+    }
+    // URING_OP_CANCEL: nothing to do, the cancelled receive posts its own last CQE
+  }
+
+  for (int i = 0; i < endpointCount; i++) {
+    if (recvCounts[i] == 0) continue;
+    globals_add1uiv(statsEndpoints, recvBatchCount, i, 1);
+    globals_add1uiv(statsEndpoints, recvBatchPacketCount, i, recvCounts[i]);
+  }
+}
+
+// Same as dataLoopPoll, but each open endpoint socket has a multishot receive armed on the data ring, so one
+// io_uring_enter per wakeup collects the packets of every endpoint and submits the sends from sendBufToAll.
+// Returns a negative errno if the kernel doesn't support what this needs (6.0 or later), without running the loop.
+static int dataLoopUring (void) {
+  unsigned ringFlags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  int err = uring_init(&dataRing, URING_DATA_RING_ENTRIES, ringFlags);
+  if (err < 0) return err;
+  if (
+    (err = uring_registerFiles(&dataRing, endpointCount)) < 0 ||
+    (err = uring_initBufRing(&dataRing, 0, URING_RECV_BUF_COUNT, URING_RECV_BUF_LEN)) < 0
+  ) {
+    uring_deinit(&dataRing);
+    return err;
+  }
+
+  printf("Endpoint: using io_uring\n");
+  dataRingUp = true;
+  int lastTickUTime = utils_getCurrentUTime();
+  int lastProbeUTime = lastTickUTime;
+  int tickTimeoutUs = ENDPOINT_HEALTH_PROBE_INTERVAL_US / 2;
+
+  while (threadsRunning) {
+    tickData(&lastTickUTime);
+    tickHealth(&lastProbeUTime);
+
+    bool allClosed = true;
+    for (int i = 0; i < endpointCount; i++) {
+      endpoint_t *ep = &endpoints[i];
+      enum endpoint_state state = atomic_load(&ep->state);
+      bool open = state == Discovery || state == GotPeerAddr;
+      if (open) allClosed = false;
+
+      // the socket has been closed (or closed and reopened) since the receive was armed
+      if (recvArmed[i] && (!open || recvGeneration[i] != ep->sockGeneration)) {
+        struct io_uring_sqe *sqe = uring_getSqe(&dataRing);
+        if (sqe == NULL) continue;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = makeUserData(URING_OP_RECV, 0, i, recvGeneration[i]);
+        sqe->user_data = makeUserData(URING_OP_CANCEL, 0, i, recvGeneration[i]);
+        recvArmed[i] = false;
+      }
+
+      if (!syncFileSlot(&dataRing, dataFileSet, dataFileGeneration, i, open) || recvArmed[i]) continue;
+
+      struct io_uring_sqe *sqe = uring_getSqe(&dataRing);
+      if (sqe == NULL) continue;
+      // recvmsg rather than recv for the source address, see handleRes
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = i; // registered file slot
+      sqe->addr = (uint64_t)(uintptr_t)&recvMsgHdr;
+      sqe->len = 1;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->buf_group = 0;
+      sqe->user_data = makeUserData(URING_OP_RECV, 0, i, ep->sockGeneration);
+      recvArmed[i] = true;
+      recvGeneration[i] = ep->sockGeneration;
+    }
+
+    if (allClosed) {
+      // still submit the cancels
+      uring_submitAndWait(&dataRing, 0, 0);
+      handleDataCqes();
+      utils_usleep(tickTimeoutUs);
+      continue;
+    }
+
+    err = uring_submitAndWait(&dataRing, 1, tickTimeoutUs);
+    if (err < 0) {
+      // This is bad, can't really do anything
+      utils_usleep(tickTimeoutUs);
+      continue;
     }
+
+    handleDataCqes();
+  }
+
+  dataRingUp = false;
+  uring_deinit(&dataRing);
+  return 0;
+}
+#endif
+
+static void *dataLoop (UNUSED void *arg) {
+  // this thread is relatively lightweight; demux will pass all the heavy decoding
+  // to other thread(s)
+  utils_setCallerThreadRole(THREAD_ROLE_NETWORK, 0, 98, 0);
+
+  #ifdef ENDPOINT_IO_URING
+  if (useUring) {
+    int err = dataLoopUring();
+    if (err == 0) return NULL;
+    printf("Endpoint: io_uring not available (%s), using poll\n", strerror(-err));
   }
+  #endif
 
+  dataLoopPoll();
   return NULL;
 }
 
@@ -375,8 +1225,47 @@ int endpoint_init (int (*onPacket)(const uint8_t*, size_t, int)) {
 
   int err;
   _onPacket = onPacket;
-  endpoints = (endpoint_t *)malloc(sizeof(endpoint_t) * endpointCount);
-  memset(endpoints, 0, sizeof(endpoint_t) * endpointCount);
+  globals_set1i(statsEndpoints, tunnelRttMs, -1);
+  endpoints = (endpoint_t *)rtarena_alloc(sizeof(endpoint_t) * endpointCount);
+  if (endpoints == NULL) return -1;
+
+  #ifdef ENDPOINT_BATCH_IO
+  for (int i = 0; i < ENDPOINT_BATCH_LEN; i++) {
+    sendBatchIovecs[i].iov_base = sendBatchBufs[i];
+  }
+  sendBatchLen = 0;
+  #endif
+
+  useUring = globals_get1i(endpoints, ioUring) != 0;
+  #ifndef ENDPOINT_IO_URING
+  if (useUring) printf("Endpoint: ioUring is set but this build has no io_uring backend (W_IO_URING), using poll\n");
+  useUring = false;
+  #endif
+
+  atomic_store(&healthyMask, UINT32_MAX);
+  atomic_store(&dataSentMask, 0);
+  peerSendsProbes = false;
+  peerRxOkMask = 0;
+  peerDataMask = 0;
+  for (int i = 0; i < MAX_ENDPOINTS; i++) {
+    healths[i] = ENDPOINT_HEALTH_DOWN;
+    healthySinceUTimes[i] = -1;
+    peerDataSinceUTimes[i] = -1;
+  }
+
+  distMode = globals_get1i(endpoints, distributionMode);
+  distCopies = globals_get1i(endpoints, distributionCopies);
+  if (distCopies < 1) distCopies = 1;
+  distNextIndex = 0;
+  distWindowPos = 0;
+  for (int i = 0; i < endpointCount; i++) {
+    globals_get1ffv(endpoints, weight, i, &distWeights[i]);
+    if (distWeights[i] <= 0.0) distWeights[i] = 1.0;
+    distEffWeights[i] = distWeights[i];
+    distCurrent[i] = 0.0;
+    distLastCongestion[i] = 0;
+    distLastPackets[i] = 0;
+  }
 
   char privKeyStr[SEC_KEY_LENGTH + 1] = { 0 };
   char peerPubKeyStr[SEC_KEY_LENGTH + 1] = { 0 };
@@ -392,6 +1281,10 @@ int endpoint_init (int (*onPacket)(const uint8_t*, size_t, int)) {
   struct x25519_key myPubKeyStruct = x25519_public_key(myPrivKeyStruct);
   memcpy(myPubKey, myPubKeyStruct.key, 32);
 
+  char peerCacheFile[MAX_FILE_PATH_LEN + 1] = { 0 };
+  globals_get1s(endpoints, peerCacheFile, peerCacheFile, sizeof(peerCacheFile));
+  peercache_init(peerCacheFile, peerPubKeyStr, endpointCount);
+
   char ifName[MAX_NET_IF_NAME_LEN + 1] = { 0 };
   for (int i = 0; i < endpointCount; i++) {
     int ifLen = globals_get1sv(endpoints, interface, i, ifName, sizeof(ifName));
@@ -425,7 +1318,14 @@ void endpoint_deinit (void) {
   for (int i = 0; i < endpointCount; i++) {
     close(endpoints[i].sock);
   }
+  peercache_deinit();
+
+  #ifdef ENDPOINT_IO_URING
+  // endpoint_flush must not be called after this
+  if (sendRingState == 1) uring_deinit(&sendRing);
+  sendRingState = 0;
+  #endif
 
-  free(endpoints);
+  rtarena_free(endpoints);
 }
 
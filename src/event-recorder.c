@@ -9,65 +9,149 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "event-recorder.h"
 
-#define RING_SIZE 1048576
+#define FILE_VERSION 1
 
 typedef struct {
-  int32_t ts;
+  uint64_t ticks;
   int32_t id;
   int32_t val;
 } event_t;
 
+typedef struct {
+  event_t *events;
+  atomic_uint count; // written by the owning thread only
+  atomic_uint droppedCount;
+} eventbuf_t;
+
 static atomic_bool running = false;
-static event_t *eventBuf = NULL;
-static atomic_int eventBufPos = 0;
+static eventbuf_t bufs[EVENTRECORDER_MAX_THREADS];
+static atomic_uint bufCount = 0; // number of buffers claimed by threads
+static atomic_uint generation = 0; // so buffers from before a deinit are not reused
+static uint64_t startTicks, startNs;
+static _Thread_local eventbuf_t *threadBuf = NULL;
+static _Thread_local unsigned int threadGeneration = 0;
+
+static inline uint64_t getTicks (void) {
+  #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+  #elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+  #else
+    struct timespec tsp;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tsp);
+    return (uint64_t)tsp.tv_sec * 1000000000ULL + tsp.tv_nsec;
+  #endif
+}
+
+static uint64_t getNs (void) {
+  struct timespec tsp;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &tsp);
+  return (uint64_t)tsp.tv_sec * 1000000000ULL + tsp.tv_nsec;
+}
+
+static void writeU32 (FILE *file, uint32_t val) {
+  fwrite(&val, 4, 1, file);
+}
+
+static void writeU64 (FILE *file, uint64_t val) {
+  fwrite(&val, 8, 1, file);
+}
 
 int eventrecorder_init (void) {
-  eventBuf = (event_t*)malloc(sizeof(event_t) * RING_SIZE);
-  if (eventBuf == NULL) return -2;
-  memset(eventBuf, 0, sizeof(event_t) * RING_SIZE);
+  for (int i = 0; i < EVENTRECORDER_MAX_THREADS; i++) {
+    // allocated up front so that a thread claiming a buffer doesn't malloc
+    bufs[i].events = (event_t *)malloc(sizeof(event_t) * EVENTRECORDER_BUF_LEN);
+    if (bufs[i].events == NULL) return -2;
+    // touch every page now instead of on the realtime threads
+    memset(bufs[i].events, 0, sizeof(event_t) * EVENTRECORDER_BUF_LEN);
+    atomic_store(&bufs[i].count, 0);
+    atomic_store(&bufs[i].droppedCount, 0);
+  }
+  atomic_store(&bufCount, 0);
+  atomic_fetch_add(&generation, 1);
 
+  startTicks = getTicks();
+  startNs = getNs();
   running = true;
   return 0;
 }
 
-// DEBUG: I don't know if this is correct thread-safe code so don't use this in production
 int eventrecorder_event1i (int32_t id, int32_t val) {
-  if (!running) return -1;
+  if (!atomic_load_explicit(&running, memory_order_relaxed)) return -1;
 
-  struct timespec tsp;
-  if (clock_gettime(CLOCK_MONOTONIC_RAW, &tsp) != 0) return -2;
+  unsigned int gen = atomic_load_explicit(&generation, memory_order_relaxed);
+  if (threadBuf == NULL || threadGeneration != gen) {
+    unsigned int bufIndex = atomic_fetch_add_explicit(&bufCount, 1, memory_order_relaxed);
+    if (bufIndex >= EVENTRECORDER_MAX_THREADS) {
+      atomic_fetch_sub_explicit(&bufCount, 1, memory_order_relaxed);
+      return -2; // more threads than buffers
+    }
+    threadBuf = &bufs[bufIndex];
+    threadGeneration = gen;
+  }
 
-  // Atomically increments eventBufPos and saves the non-incremented value locally.
-  // If we get preemted immediately after this operation the two threads won't have
-  // the same eventBufPos value.
-  int eventBufPosLocal = atomic_fetch_add_explicit(&eventBufPos, 1, memory_order_relaxed);
-  if (eventBufPosLocal == RING_SIZE) return -3;
+  unsigned int count = atomic_load_explicit(&threadBuf->count, memory_order_relaxed);
+  if (count == EVENTRECORDER_BUF_LEN) {
+    atomic_fetch_add_explicit(&threadBuf->droppedCount, 1, memory_order_relaxed);
+    return -3;
+  }
 
-  // tv_nsec will fit into a 32-bit signed value as it's between 0 and 999,999,999
-  event_t *event = &eventBuf[eventBufPosLocal];
-  event->ts = tsp.tv_nsec;
+  event_t *event = &threadBuf->events[count];
+  event->ticks = getTicks();
   event->id = id;
   event->val = val;
+  // publish the event to eventrecorder_writeFile
+  atomic_store_explicit(&threadBuf->count, count + 1, memory_order_release);
   return 0;
 }
 
 int eventrecorder_writeFile (const char *filename) {
-  running = false;
+  if (!running) return -1;
 
   FILE *file = fopen(filename, "wb");
-  if (file == NULL) return -1;
+  if (file == NULL) return -2;
+
+  unsigned int bufCountLocal = atomic_load(&bufCount);
+  if (bufCountLocal > EVENTRECORDER_MAX_THREADS) bufCountLocal = EVENTRECORDER_MAX_THREADS;
+
+  fwrite("WSEV", 4, 1, file);
+  writeU32(file, FILE_VERSION);
+  writeU32(file, bufCountLocal);
+  writeU32(file, 0);
+  writeU64(file, startTicks);
+  writeU64(file, startNs);
+  writeU64(file, getTicks());
+  writeU64(file, getNs());
 
-  for (int i = 0; i < eventBufPos; i++) {
-    fwrite(&eventBuf[i].ts, 4, 1, file);
-    fwrite(&eventBuf[i].id, 4, 1, file);
-    fwrite(&eventBuf[i].val, 4, 1, file);
+  for (unsigned int i = 0; i < bufCountLocal; i++) {
+    unsigned int count = atomic_load_explicit(&bufs[i].count, memory_order_acquire);
+    writeU32(file, i);
+    writeU32(file, count);
+    writeU32(file, atomic_load(&bufs[i].droppedCount));
+    writeU32(file, 0);
+    for (unsigned int j = 0; j < count; j++) {
+      writeU64(file, bufs[i].events[j].ticks);
+      writeU32(file, (uint32_t)bufs[i].events[j].id);
+      writeU32(file, (uint32_t)bufs[i].events[j].val);
+    }
   }
 
-  fclose(file);
-  free(eventBuf);
-  eventBuf = NULL;
-  // you can call eventrecorder_init() again now
+  if (fclose(file) != 0) return -3;
   return 0;
 }
+
+void eventrecorder_deinit (void) {
+  running = false;
+  for (int i = 0; i < EVENTRECORDER_MAX_THREADS; i++) {
+    free(bufs[i].events);
+    bufs[i].events = NULL;
+  }
+  // you can call eventrecorder_init() again now
+}
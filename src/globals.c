@@ -5,7 +5,10 @@
 
 #include "globals.h"
 
+atomic_uint globals_nextShardIndex = 0;
+
 globals_define1i(root, mode)
+globals_define1i(root, rtArenaSize)
 globals_define1s(root, privateKey, SEC_KEY_LENGTH)
 globals_define1s(root, peerPublicKey, SEC_KEY_LENGTH)
 
@@ -14,6 +17,11 @@ globals_define1i(discovery, serverPort)
 
 globals_define1i(endpoints, endpointCount)
 globals_define1sv(endpoints, interface, MAX_ENDPOINTS, MAX_NET_IF_NAME_LEN)
+globals_define1ffv(endpoints, weight, MAX_ENDPOINTS)
+globals_define1i(endpoints, ioUring)
+globals_define1s(endpoints, peerCacheFile, MAX_FILE_PATH_LEN)
+globals_define1i(endpoints, distributionMode)
+globals_define1i(endpoints, distributionCopies)
 
 globals_define1ui(mux, maxPacketSize)
 
@@ -22,12 +30,14 @@ globals_define1i(audio, deviceChannelCount)
 globals_define1i(audio, networkSampleRate)
 globals_define1ff(audio, deviceSampleRate)
 globals_define1i(audio, decodeRingLength)
+globals_define1i(audio, resamplerMode)
 globals_define1s(audio, deviceName, MAX_DEVICE_NAME_LEN)
 globals_define1i(audio, cardId)
 globals_define1i(audio, deviceId)
 globals_define1i(audio, bitsPerSample)
 globals_define1i(audio, periodSize)
 globals_define1i(audio, periodCount)
+globals_define1i(audio, loopMode)
 globals_define1i(audio, loopSleep)
 
 globals_define1ff(audio, levelSlowAttack)
@@ -38,40 +48,72 @@ globals_define1ui(audio, encoding)
 
 globals_define1i(opus, bitrate)
 globals_define1i(opus, frameSize)
+globals_define1i(opus, groupCount)
+globals_define1i(opus, inbandFecLossPerc)
 
 globals_define1i(pcm, frameSize)
 globals_define1i(pcm, sampleRate)
+globals_define1i(pcm, crcMode)
 
 globals_define1iv(fec, symbolLen, MUX_CHANNEL_COUNT)
 globals_define1iv(fec, sourceSymbolsPerBlock, MUX_CHANNEL_COUNT)
 globals_define1iv(fec, repairSymbolsPerBlock, MUX_CHANNEL_COUNT)
+globals_define1iv(fec, pacedSend, MUX_CHANNEL_COUNT)
+globals_define1iv(fec, streamPartialBlocks, MUX_CHANNEL_COUNT)
+
+globals_define1iv(threads, priority, THREAD_ROLE_COUNT)
+globals_define1iv(threads, coreCount, THREAD_ROLE_COUNT)
+globals_define1iv(threads, cores, THREAD_ROLE_COUNT * THREAD_ROLE_MAX_CORES)
 
 globals_define1i(monitor, wsPort)
 globals_define1i(monitor, udpPort)
 globals_define1ui(monitor, udpAddr)
 
 globals_define1uiv(statsEndpoints, open, MAX_ENDPOINTS)
-globals_define1uiv(statsEndpoints, bytesOut, MAX_ENDPOINTS)
-globals_define1uiv(statsEndpoints, bytesIn, MAX_ENDPOINTS)
-globals_define1uiv(statsEndpoints, sendCongestion, MAX_ENDPOINTS)
-globals_define1iv(statsEndpoints, lastSbn, MUX_CHANNEL_COUNT * MAX_ENDPOINTS)
-
-globals_define1uiv(statsMux, ringOverrunCount, MUX_CHANNEL_COUNT)
-globals_define1uiv(statsDemux, ringOverrunCount, MUX_CHANNEL_COUNT)
-globals_define1uiv(statsDemux, dupBlockCount, MUX_CHANNEL_COUNT)
-globals_define1uiv(statsDemux, oooBlockCount, MUX_CHANNEL_COUNT)
-globals_define1uiv(statsDemux, blockTimingRingPos, MUX_CHANNEL_COUNT)
-globals_define1uiv(statsDemux, blockTimingRing, MUX_CHANNEL_COUNT * STATS_BLOCK_TIMING_RING_LEN)
-
-globals_define1uiv(statsCh1Audio, clippingCounts, MAX_AUDIO_CHANNELS)
+globals_define1uiv(statsEndpoints, health, MAX_ENDPOINTS)
+globals_define1uiv(statsEndpoints, healthTransitionCount, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, bytesOut, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, bytesIn, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, sendCongestion, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, dataPacketsOut, MAX_ENDPOINTS)
+globals_define1ui(statsEndpoints, dataPacketCount)
+globals_define1ivPadded(statsEndpoints, lastSbn, MUX_MAX_CHANNELS * MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, dupChunkCount, MUX_MAX_CHANNELS * MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, lateChunkCount, MUX_MAX_CHANNELS * MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, recvBatchCount, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, recvBatchPacketCount, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, sendBatchCount, MAX_ENDPOINTS)
+globals_define1uivSharded(statsEndpoints, sendBatchPacketCount, MAX_ENDPOINTS)
+globals_define1i(statsEndpoints, tunnelRttMs)
+
+globals_define1uivSharded(statsMux, ringOverrunCount, MUX_MAX_CHANNELS)
+globals_define1uivPadded(statsMux, encodeQueueDepth, MUX_MAX_CHANNELS)
+globals_define1uivSharded(statsDemux, ringOverrunCount, MUX_MAX_CHANNELS)
+globals_define1uivSharded(statsDemux, dupBlockCount, MUX_MAX_CHANNELS)
+globals_define1uivSharded(statsDemux, oooBlockCount, MUX_MAX_CHANNELS)
+globals_define1uivPadded(statsDemux, blockTimingRingPos, MUX_MAX_CHANNELS)
+globals_define1uiv(statsDemux, blockTimingRing, MUX_MAX_CHANNELS * STATS_BLOCK_TIMING_RING_LEN)
+globals_define1uiv(statsDemux, blockArrivalRing, MUX_MAX_CHANNELS * STATS_BLOCK_TIMING_RING_LEN)
+globals_define1uivSharded(statsDemux, fastPathBlockCount, MUX_MAX_CHANNELS)
+
+globals_define1uivSharded(statsCh1Audio, clippingCounts, MAX_AUDIO_CHANNELS)
 globals_define1ffv(statsCh1Audio, levelsFast, MAX_AUDIO_CHANNELS)
 globals_define1ffv(statsCh1Audio, levelsSlow, MAX_AUDIO_CHANNELS)
 globals_define1i(statsCh1Audio, streamBufferSize)
-globals_define1uiv(statsCh1Audio, streamMeterBins, STATS_STREAM_METER_BINS)
+globals_define1uivSharded(statsCh1Audio, streamMeterBins, STATS_STREAM_METER_BINS)
 globals_define1ui(statsCh1Audio, bufferOverrunCount)
 globals_define1ui(statsCh1Audio, bufferUnderrunCount)
+globals_define1ui(statsCh1Audio, concealedFrameCount)
+globals_define1ui(statsCh1Audio, lateFrameCount)
 globals_define1ui(statsCh1Audio, encodeThreadJitterCount)
 globals_define1ui(statsCh1Audio, audioLoopXrunCount)
+globals_define1ui(statsCh1Audio, audioLoopSpuriousWakeCount)
 globals_define1ff(statsCh1Audio, clockError)
+globals_define1ff(statsCh1Audio, syncError)
+globals_define1ff(statsCh1Audio, syncErrorVariance)
+globals_define1uivSharded(statsCh1AudioLatency, histograms, STATS_LATENCY_STAGE_COUNT * STATS_LATENCY_BINS)
+globals_define1iv(statsCh1AudioLatency, lastUs, STATS_LATENCY_STAGE_COUNT)
 globals_define1ui(statsCh1AudioOpus, codecErrorCount)
 globals_define1ui(statsCh1AudioPCM, crcFailCount)
+globals_define1ui(statsCh1AudioLossless, codecErrorCount)
+globals_define1ff(statsCh1AudioLossless, compressionRatio)
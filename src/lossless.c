@@ -0,0 +1,363 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "sample-convert.h"
+#include "rt-arena.h"
+#include "lossless.h"
+
+// NOTES:
+// - Frame layout, MSB first, channel after channel with no padding in between and zero bits at the end to make a
+//   whole byte:
+//     2 bits type
+//     FIXED: 3 bits order, order 24-bit warmup samples, then for every LOSSLESS_PARTITION_LEN residuals (the last
+//       partition can be shorter): 5 bits Rice parameter k, then each zigzagged residual as (u >> k) zero bits, a
+//       one bit, and the low k bits of u
+//     CONSTANT: one 24-bit sample
+//     VERBATIM: frameSize 24-bit samples
+// - Fixed predictors are used instead of LPC because they need no coefficients in the frame, and with frames this
+//   short the coefficients would eat most of what LPC gains.
+
+#define SUBFRAME_FIXED 0
+#define SUBFRAME_CONSTANT 1
+#define SUBFRAME_VERBATIM 2
+
+#define SUBFRAME_TYPE_BITS 2
+#define ORDER_BITS 3
+#define RICE_PARAM_BITS 5
+#define SAMPLE_BITS 24
+#define MAX_ORDER 4
+#define MAX_RICE_PARAM 30
+
+typedef struct {
+  uint8_t *buf;
+  int pos;
+  uint64_t acc; // the low bits bits have not been written yet
+  int bits;
+} bitwriter_t;
+
+typedef struct {
+  const uint8_t *buf;
+  int len;
+  int pos;
+  uint64_t acc; // the next bits bits to read, MSB aligned, the rest are zero
+  int bits;
+} bitreader_t;
+
+static inline int32_t readS24 (const uint8_t *buf) {
+  return (int32_t)((uint32_t)buf[0] << 8 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 24) >> 8;
+}
+
+static inline void writeS24 (uint8_t *buf, int32_t sample) {
+  buf[0] = sample;
+  buf[1] = sample >> 8;
+  buf[2] = sample >> 16;
+}
+
+/////////////////////
+// bit writer
+/////////////////////
+
+// n <= 32, value < 2^n
+static inline void writeBits (bitwriter_t *w, uint32_t value, int n) {
+  w->acc = (w->acc << n) | value;
+  w->bits += n;
+  while (w->bits >= 8) {
+    w->bits -= 8;
+    w->buf[w->pos++] = w->acc >> w->bits;
+  }
+}
+
+static inline void writeRice (bitwriter_t *w, uint32_t u, int k) {
+  uint32_t q = u >> k;
+  uint32_t low = u & ((1u << k) - 1);
+  if (q <= (uint32_t)(31 - k)) {
+    writeBits(w, 1u << k | low, q + 1 + k);
+    return;
+  }
+
+  for (; q >= 32; q -= 32) writeBits(w, 0, 32);
+  writeBits(w, 1, q + 1);
+  if (k > 0) writeBits(w, low, k);
+}
+
+static inline void flushBits (bitwriter_t *w) {
+  if (w->bits > 0) w->buf[w->pos++] = w->acc << (8 - w->bits);
+  w->bits = 0;
+}
+
+/////////////////////
+// bit reader
+/////////////////////
+
+static inline void refill (bitreader_t *r) {
+  while (r->bits <= 56 && r->pos < r->len) {
+    r->acc |= (uint64_t)r->buf[r->pos++] << (56 - r->bits);
+    r->bits += 8;
+  }
+}
+
+// 1 <= n <= 32, returns -1 if there are not n bits left
+static inline int readBits (bitreader_t *r, int n, uint32_t *value) {
+  refill(r);
+  if (r->bits < n) return -1;
+  *value = r->acc >> (64 - n);
+  r->acc <<= n;
+  r->bits -= n;
+  return 0;
+}
+
+static inline int readRice (bitreader_t *r, int k, uint32_t *u) {
+  uint32_t q = 0;
+  for (;;) {
+    refill(r);
+    if (r->acc != 0) break;
+    if (r->bits == 0) return -1;
+    q += r->bits;
+    r->bits = 0;
+    if (q > (UINT32_MAX >> k)) return -1;
+  }
+
+  // the bits after the valid ones are zero, so the first one bit is always a valid bit
+  int zeros = __builtin_clzll(r->acc);
+  q += zeros;
+  r->acc = r->acc << zeros << 1;
+  r->bits -= zeros + 1;
+  if (q > (UINT32_MAX >> k)) return -1;
+
+  uint32_t low = 0;
+  if (k > 0 && readBits(r, k, &low) < 0) return -1;
+  *u = q << k | low;
+  return 0;
+}
+
+/////////////////////
+// prediction
+/////////////////////
+
+// FLAC's fixed polynomial predictors, i >= order
+static inline int64_t predict (const int32_t *x, int i, int order) {
+  switch (order) {
+    case 1: return x[i-1];
+    case 2: return 2 * (int64_t)x[i-1] - x[i-2];
+    case 3: return 3 * ((int64_t)x[i-1] - x[i-2]) + x[i-3];
+    case 4: return 4 * ((int64_t)x[i-1] + x[i-3]) - 6 * (int64_t)x[i-2] - x[i-4];
+    default: return 0;
+  }
+}
+
+static inline uint32_t zigzag (int32_t residual) {
+  return ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+}
+
+static inline int32_t unzigzag (uint32_t u) {
+  return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+// the order with the smallest sum of absolute residuals, like flake and libFLAC do
+static int pickOrder (const int32_t *x, int n) {
+  int maxOrder = n - 1 < MAX_ORDER ? n - 1 : MAX_ORDER;
+  uint64_t sums[MAX_ORDER + 1] = { 0 };
+
+  for (int i = maxOrder; i < n; i++) {
+    for (int order = 0; order <= maxOrder; order++) {
+      int64_t residual = x[i] - predict(x, i, order);
+      sums[order] += residual < 0 ? -residual : residual;
+    }
+  }
+
+  int best = 0;
+  for (int order = 1; order <= maxOrder; order++) {
+    if (sums[order] < sums[best]) best = order;
+  }
+  return best;
+}
+
+// Picks the Rice parameter for one partition and returns the bits needed for its residuals.
+// For geometrically distributed residuals the best parameter is close to log2 of the mean, so only the parameters
+// either side of that are tried.
+static uint64_t pickRiceParam (const uint32_t *residuals, int count, int *riceParam) {
+  uint64_t sum = 0;
+  for (int i = 0; i < count; i++) sum += residuals[i];
+
+  uint64_t mean = sum / count;
+  int guess = mean > 0 ? 63 - __builtin_clzll(mean) : 0;
+  if (guess > MAX_RICE_PARAM) guess = MAX_RICE_PARAM;
+
+  uint64_t bestBits = UINT64_MAX;
+  for (int k = guess > 0 ? guess - 1 : 0; k <= guess + 1 && k <= MAX_RICE_PARAM; k++) {
+    uint64_t bits = (uint64_t)count * (k + 1);
+    for (int i = 0; i < count; i++) bits += residuals[i] >> k;
+    if (bits < bestBits) {
+      bestBits = bits;
+      *riceParam = k;
+    }
+  }
+  return bestBits;
+}
+
+/////////////////////
+// channels
+/////////////////////
+
+static void encodeChannel (lossless_codec_t *codec, bitwriter_t *w) {
+  const int n = codec->frameSize;
+  const int32_t *x = codec->samples;
+  uint32_t *residuals = codec->residuals;
+
+  bool constant = true;
+  for (int i = 1; i < n && constant; i++) constant = x[i] == x[0];
+  if (constant) {
+    writeBits(w, SUBFRAME_CONSTANT, SUBFRAME_TYPE_BITS);
+    writeBits(w, x[0] & 0xffffff, SAMPLE_BITS);
+    return;
+  }
+
+  int order = pickOrder(x, n);
+  int count = n - order;
+  for (int i = order; i < n; i++) residuals[i - order] = zigzag(x[i] - predict(x, i, order));
+
+  int partitionCount = (count + LOSSLESS_PARTITION_LEN - 1) / LOSSLESS_PARTITION_LEN;
+  int riceParams[partitionCount];
+  uint64_t bits = ORDER_BITS + SAMPLE_BITS * order;
+  for (int p = 0; p < partitionCount; p++) {
+    int start = p * LOSSLESS_PARTITION_LEN;
+    int len = count - start < LOSSLESS_PARTITION_LEN ? count - start : LOSSLESS_PARTITION_LEN;
+    bits += RICE_PARAM_BITS + pickRiceParam(&residuals[start], len, &riceParams[p]);
+  }
+
+  // noise doesn't compress, and this keeps every frame within lossless_getMaxEncodedLen
+  if (bits >= (uint64_t)SAMPLE_BITS * n) {
+    writeBits(w, SUBFRAME_VERBATIM, SUBFRAME_TYPE_BITS);
+    for (int i = 0; i < n; i++) writeBits(w, x[i] & 0xffffff, SAMPLE_BITS);
+    return;
+  }
+
+  writeBits(w, SUBFRAME_FIXED, SUBFRAME_TYPE_BITS);
+  writeBits(w, order, ORDER_BITS);
+  for (int i = 0; i < order; i++) writeBits(w, x[i] & 0xffffff, SAMPLE_BITS);
+  for (int p = 0; p < partitionCount; p++) {
+    int start = p * LOSSLESS_PARTITION_LEN;
+    int end = start + LOSSLESS_PARTITION_LEN < count ? start + LOSSLESS_PARTITION_LEN : count;
+    writeBits(w, riceParams[p], RICE_PARAM_BITS);
+    for (int i = start; i < end; i++) writeRice(w, residuals[i], riceParams[p]);
+  }
+}
+
+static int decodeChannel (bitreader_t *r, int32_t *x, int n) {
+  uint32_t type, value;
+  if (readBits(r, SUBFRAME_TYPE_BITS, &type) < 0) return -1;
+
+  switch (type) {
+    case SUBFRAME_CONSTANT:
+      if (readBits(r, SAMPLE_BITS, &value) < 0) return -1;
+      for (int i = 0; i < n; i++) x[i] = (int32_t)(value << 8) >> 8;
+      return 0;
+
+    case SUBFRAME_VERBATIM:
+      for (int i = 0; i < n; i++) {
+        if (readBits(r, SAMPLE_BITS, &value) < 0) return -1;
+        x[i] = (int32_t)(value << 8) >> 8;
+      }
+      return 0;
+
+    case SUBFRAME_FIXED: {
+      uint32_t order;
+      if (readBits(r, ORDER_BITS, &order) < 0) return -1;
+      if (order > MAX_ORDER || (int)order >= n) return -2;
+
+      for (int i = 0; i < (int)order; i++) {
+        if (readBits(r, SAMPLE_BITS, &value) < 0) return -1;
+        x[i] = (int32_t)(value << 8) >> 8;
+      }
+
+      for (int start = order; start < n; start += LOSSLESS_PARTITION_LEN) {
+        int end = start + LOSSLESS_PARTITION_LEN < n ? start + LOSSLESS_PARTITION_LEN : n;
+        uint32_t riceParam;
+        if (readBits(r, RICE_PARAM_BITS, &riceParam) < 0) return -1;
+        if (riceParam > MAX_RICE_PARAM) return -2;
+
+        for (int i = start; i < end; i++) {
+          if (readRice(r, riceParam, &value) < 0) return -1;
+          int64_t sample = predict(x, i, order) + unzigzag(value);
+          if (sample < -8388608 || sample > 8388607) return -3;
+          x[i] = sample;
+        }
+      }
+      return 0;
+    }
+
+    default:
+      return -2;
+  }
+}
+
+/////////////////////
+// public
+/////////////////////
+
+int lossless_init (lossless_codec_t *codec, int channelCount, int frameSize) {
+  codec->channelCount = channelCount;
+  codec->frameSize = frameSize;
+  codec->packedBuf = (uint8_t *)rtarena_alloc(3 * channelCount * frameSize);
+  codec->samples = (int32_t *)rtarena_alloc(sizeof(int32_t) * frameSize);
+  codec->residuals = (uint32_t *)rtarena_alloc(sizeof(uint32_t) * frameSize);
+  if (codec->packedBuf == NULL || codec->samples == NULL || codec->residuals == NULL) {
+    lossless_deinit(codec);
+    return -1;
+  }
+  return 0;
+}
+
+void lossless_deinit (lossless_codec_t *codec) {
+  rtarena_free(codec->packedBuf);
+  rtarena_free(codec->samples);
+  rtarena_free(codec->residuals);
+  codec->packedBuf = NULL;
+  codec->samples = NULL;
+  codec->residuals = NULL;
+}
+
+int lossless_getMaxEncodedLen (int channelCount, int frameSize) {
+  // every channel is at most a verbatim subframe
+  return (channelCount * (SUBFRAME_TYPE_BITS + SAMPLE_BITS * frameSize) + 7) / 8;
+}
+
+int lossless_encode (lossless_codec_t *codec, const float *inSampleBuf, uint8_t *outData) {
+  const int channelCount = codec->channelCount;
+  const int frameSize = codec->frameSize;
+
+  // the same quantisation as pcm_encode, so both encodings deliver identical samples
+  sampleconvert_kernels->f32ToS24(inSampleBuf, codec->packedBuf, channelCount * frameSize);
+
+  bitwriter_t w = { outData, 0, 0, 0 };
+  for (int ch = 0; ch < channelCount; ch++) {
+    for (int i = 0; i < frameSize; i++) codec->samples[i] = readS24(&codec->packedBuf[3 * (i * channelCount + ch)]);
+    encodeChannel(codec, &w);
+  }
+  flushBits(&w);
+
+  return w.pos;
+}
+
+int lossless_decode (lossless_codec_t *codec, const uint8_t *inData, int inDataLen, const uint8_t **samples) {
+  const int channelCount = codec->channelCount;
+  const int frameSize = codec->frameSize;
+
+  bitreader_t r = { inData, inDataLen, 0, 0, 0 };
+  for (int ch = 0; ch < channelCount; ch++) {
+    int err = decodeChannel(&r, codec->samples, frameSize);
+    if (err < 0) return err;
+    for (int i = 0; i < frameSize; i++) writeS24(&codec->packedBuf[3 * (i * channelCount + ch)], codec->samples[i]);
+  }
+
+  // only the padding bits of the last byte can be left over
+  int bitsRead = 8 * r.pos - r.bits;
+  if ((bitsRead + 7) / 8 != inDataLen) return -4;
+
+  *samples = codec->packedBuf;
+  return channelCount * frameSize;
+}
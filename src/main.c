@@ -3,6 +3,7 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
+#include "xwait.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -17,6 +18,9 @@
 #include "monitor.h"
 #include "audio.h"
 #include "utils.h"
+#include "sample-convert.h"
+#include "event-recorder.h"
+#include "rt-arena.h"
 
 static bool archChecks (void) {
   // We are going to use macros to test for pointer size, so make sure they are consistent with our runtime test.
@@ -54,16 +58,29 @@ int main (int argc, char *argv[]) {
 
   srand(utils_getCurrentUTime());
 
+  sampleconvert_init();
+  printf("Sample conversion kernels: %s\n", sampleconvert_kernels->name);
+  utils_initCrc();
+  printf("CRC32C: %s\n", utils_getCrc32cImplName());
+
   int err = 0;
   if ((err = config_init(argv[1])) < 0) {
     printf("config_init failed: %d\n", err);
     return EXIT_FAILURE;
   }
 
-  // if ((err = eventrecorder_init()) < 0) {
-  //   printf("eventrecorder_init failed: %d\n", err);
-  //   return EXIT_FAILURE;
-  // }
+  // before any module allocates its buffers
+  if ((err = rtarena_init(globals_get1i(root, rtArenaSize))) < 0) {
+    printf("rtarena_init failed: %d\n", err);
+    return EXIT_FAILURE;
+  }
+
+  #ifdef W_EVENT_RECORDER
+  if ((err = eventrecorder_init()) < 0) {
+    printf("eventrecorder_init failed: %d\n", err);
+    return EXIT_FAILURE;
+  }
+  #endif
 
   // TODO: allow graceful deinit if signal happens during network discovery or waiting for config
 
@@ -89,6 +106,7 @@ int main (int argc, char *argv[]) {
     printf("Invalid mode %d\n", mode);
     return EXIT_FAILURE;
   }
+  rtarena_printUsage();
 
   if ((err = monitor_init()) < 0) {
     printf("monitor_init failed: %d, continuing without monitor...\n", err);
@@ -123,6 +141,17 @@ int main (int argc, char *argv[]) {
     }
   }
 
+  #ifdef W_EVENT_RECORDER
+  if ((err = eventrecorder_writeFile(EVENTRECORDER_FILENAME)) < 0) {
+    printf("eventrecorder_writeFile failed: %d\n", err);
+  } else {
+    printf("Trace events written to %s\n", EVENTRECORDER_FILENAME);
+  }
+  eventrecorder_deinit();
+  #endif
+
+  rtarena_deinit();
+
   printf("\ndeinit successful.\n");
   return EXIT_SUCCESS;
 }
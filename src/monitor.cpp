@@ -11,29 +11,87 @@
 #include <atomic>
 #include <stdint.h>
 #include <string.h>
+#include <vector>
+#include <mutex>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "uWebSockets/libuwebsockets.h"
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
 #include "protobufs/monitor.pb.h"
 #pragma GCC diagnostic pop
 #include "globals.h"
+#include "utils.h"
 #include "config.h"
 #include "monitor.h"
 
+typedef struct {
+  uws_ws_t *ws;
+  bool synced; // false until the client gets a key frame, and after a frame to it is dropped
+} monitor_client_t;
+
 static int audioChannelCount, endpointCount;
-// DEBUG: two threads are accessing the members of wsClient (wsThread and statsThread). Make sure these are thread-safe
-static std::atomic<uws_ws_t*> wsClient = NULL;
+// DEBUG: two threads are accessing the members of wsClients (wsThread and statsThread). Make sure these are thread-safe
+static std::mutex clientsMutex;
+static std::vector<monitor_client_t> wsClients;
+static std::atomic_bool keyFrameRequested = true;
+static int udpSock = -1; // monitor UDP mode, see monitor-udp-server
+static struct sockaddr_in udpDestAddr;
+
+// NOTES:
+// - Most frames are deltas. Counters are sent as the increase since the previous frame (proto3 doesn't send
+//   zeros, so a counter that hasn't changed costs nothing), blockTiming and blockArrivalTiming only have the
+//   entries added since the previous frame, and streamMeterBins is only sent every MONITOR_STREAM_METER_INTERVAL
+//   frames. The monitor UI adds the frames up, see monitor/src/monitor-state.ts.
+// - Key frames have the full values, they are sent when a client connects and every MONITOR_KEY_FRAME_INTERVAL frames.
+// - Each frame is serialized once and sent to every WebSocket client, and in UDP mode to monitor-udp-server which
+//   passes it on to its own clients. A client that can't keep up has frames dropped, since the deltas after a
+//   dropped frame are no use to it, it gets nothing more until the next key frame.
+#define MONITOR_FRAME_INTERVAL_US 50000
+#define MONITOR_KEY_FRAME_INTERVAL 100
+#define MONITOR_STREAM_METER_INTERVAL 10
 
 static void openHandler(uws_ws_t *ws) {
-  wsClient = ws;
+  std::lock_guard<std::mutex> lock(clientsMutex);
+  wsClients.push_back({ ws, false });
+  keyFrameRequested = true;
 }
 
 static void messageHandler(UNUSED uws_ws_t *ws, UNUSED const char *msg, UNUSED size_t length, UNUSED unsigned char opCode) {
   // printf("message (code: %d, length: %zu): %.*s\n", opCode, length, length, msg);
 }
 
-static void closeHandler(UNUSED uws_ws_t *ws, UNUSED int code) {
-  wsClient = NULL;
+static void closeHandler(uws_ws_t *ws, UNUSED int code) {
+  std::lock_guard<std::mutex> lock(clientsMutex);
+  for (auto it = wsClients.begin(); it != wsClients.end(); it++) {
+    if (it->ws == ws) {
+      wsClients.erase(it);
+      break;
+    }
+  }
+}
+
+static void sendFrame (const std::string &protoData, bool keyFrame) {
+  if (udpSock >= 0) {
+    // NOTE: a lost datagram is like a dropped frame, the server's clients catch up at the next key frame
+    sendto(udpSock, protoData.data(), protoData.length(), 0, (const struct sockaddr *)&udpDestAddr, sizeof(udpDestAddr));
+  }
+
+  std::lock_guard<std::mutex> lock(clientsMutex);
+  for (auto &client : wsClients) {
+    if (keyFrame) client.synced = true;
+    if (!client.synced) continue;
+    if (uws_wsSend(client.ws, protoData.data(), protoData.length(), UWS_OPCODE_BINARY) < 0) {
+      printf("Monitor: WebSocket client can't keep up, dropping frames until the next key frame\n");
+      client.synced = false;
+    }
+  }
+}
+
+static bool hasClients (void) {
+  if (udpSock >= 0) return true;
+  std::lock_guard<std::mutex> lock(clientsMutex);
+  return !wsClients.empty();
 }
 
 static void listenHandler(void *listenSocket) {
@@ -44,6 +102,7 @@ static void listenHandler(void *listenSocket) {
 }
 
 static void *startWsApp (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_MONITOR, 0, -1, -1);
   uws_app_t *app = uws_createApp();
   uws_appWs(app, "/*", openHandler, messageHandler, closeHandler);
   uws_appListen(app, globals_get1i(monitor, wsPort), listenHandler);
@@ -86,19 +145,40 @@ static void mapStreamMeterBins (unsigned int *rawBins, uint8_t *mappedBins) {
   }
 }
 
-// map a ring buffer to a flat buffer, excluding the element at the write head
-static void mapBlockTimingRing (uint8_t *dest, uint8_t chId) {
-  unsigned int ringPos = globals_get1uiv(statsDemux, blockTimingRingPos, chId);
-  if (++ringPos == STATS_BLOCK_TIMING_RING_LEN) ringPos = 0;
-  for (int i = 0; i < STATS_BLOCK_TIMING_RING_LEN - 1; i++) {
+// map a ring buffer to a flat buffer, from lastPos up to the write head ringPos (not including it)
+// or the whole ring excluding the element at the write head if lastPos is -1
+// arrival selects blockArrivalRing instead of blockTimingRing
+// returns the number of bytes written to dest
+static int mapBlockTimingRing (uint8_t *dest, uint8_t chId, bool arrival, unsigned int ringPos, int lastPos) {
+  int count = STATS_BLOCK_TIMING_RING_LEN - 1;
+  if (lastPos >= 0) {
+    count = ((int)ringPos - lastPos + STATS_BLOCK_TIMING_RING_LEN) % STATS_BLOCK_TIMING_RING_LEN;
+    ringPos = lastPos;
+  } else if (++ringPos == STATS_BLOCK_TIMING_RING_LEN) {
+    ringPos = 0;
+  }
+  for (int i = 0; i < count; i++) {
     unsigned int ringIndex = chId * STATS_BLOCK_TIMING_RING_LEN + ringPos;
-    unsigned int val = globals_get1uiv(statsDemux, blockTimingRing, ringIndex);
+    unsigned int val = arrival
+      ? globals_get1uiv(statsDemux, blockArrivalRing, ringIndex)
+      : globals_get1uiv(statsDemux, blockTimingRing, ringIndex);
     memcpy(&dest[4*i], &val, 4);
     if (++ringPos == STATS_BLOCK_TIMING_RING_LEN) ringPos = 0;
   }
+  return 4 * count;
+}
+
+// Returns how much cur has gone up since the last frame. Only call this in the same order every frame, each
+// call uses the next slot in prevCounters. Key frames clear prevCounters so the full values are sent.
+static unsigned int counterDelta (std::vector<unsigned int> &prevCounters, size_t &counterIndex, unsigned int cur) {
+  if (counterIndex == prevCounters.size()) prevCounters.push_back(0);
+  unsigned int delta = cur - prevCounters[counterIndex];
+  prevCounters[counterIndex++] = cur;
+  return delta;
 }
 
 static void *statsLoop (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_MONITOR, 1, -1, -1);
   MonitorProto proto;
   MonitorProto_MuxChannelStats *protoCh1 = proto.add_muxchannel();
   MonitorProto_AudioChannel **protoAudioChannels = new MonitorProto_AudioChannel*[audioChannelCount];
@@ -106,6 +186,12 @@ static void *statsLoop (UNUSED void *arg) {
   unsigned int *streamMeterBinsRaw = new unsigned int[STATS_STREAM_METER_BINS];
   uint8_t *streamMeterBinsMapped = new uint8_t[STATS_STREAM_METER_BINS];
   uint8_t *blockTimingRingMapped = new uint8_t[4 * (STATS_BLOCK_TIMING_RING_LEN-1)];
+  MonitorProto_LatencyStats *protoLatency[STATS_LATENCY_STAGE_COUNT];
+
+  std::vector<unsigned int> prevCounters;
+  std::string protoData; // reused for every frame
+  int frameCount = 0;
+  int lastBlockTimingPos = -1;
 
   memset(streamMeterBinsRaw, 0, sizeof(unsigned int) * STATS_STREAM_METER_BINS);
   memset(streamMeterBinsMapped, 0, STATS_STREAM_METER_BINS);
@@ -113,6 +199,11 @@ static void *statsLoop (UNUSED void *arg) {
   for (int i = 0; i < audioChannelCount; i++) {
     protoAudioChannels[i] = protoCh1->mutable_audiostats()->add_audiochannel();
   }
+  protoCh1->mutable_audiostats()->set_latencybinus(STATS_LATENCY_BIN_US);
+  for (int i = 0; i < STATS_LATENCY_STAGE_COUNT; i++) {
+    protoLatency[i] = protoCh1->mutable_audiostats()->add_latency();
+    protoLatency[i]->mutable_bins()->Resize(STATS_LATENCY_BINS, 0);
+  }
   for (int i = 0; i < endpointCount; i++) {
     protoEndpoints[i] = protoCh1->add_endpoint();
     std::string ifName(MAX_NET_IF_NAME_LEN + 1, '\0');
@@ -127,11 +218,21 @@ static void *statsLoop (UNUSED void *arg) {
 
   // TODO: need a flag here to break out of the while loop and deinit properly
   while (true) {
-    usleep(50000);
-    if (wsClient == NULL) continue;
+    usleep(MONITOR_FRAME_INTERVAL_US);
+    if (!hasClients()) continue;
+
+    bool keyFrame = keyFrameRequested.exchange(false) || frameCount % MONITOR_KEY_FRAME_INTERVAL == 0;
+    if (keyFrame) {
+      frameCount = 0;
+      std::fill(prevCounters.begin(), prevCounters.end(), 0);
+      lastBlockTimingPos = -1;
+    }
+    size_t counterIndex = 0;
+    #define DELTA(cur) counterDelta(prevCounters, counterIndex, (cur))
+    proto.set_keyframe(keyFrame);
 
     for (int i = 0; i < audioChannelCount; i++) {
-      protoAudioChannels[i]->set_clippingcount(globals_get1uiv(statsCh1Audio, clippingCounts, i));
+      protoAudioChannels[i]->set_clippingcount(DELTA(globals_get1uiv(statsCh1Audio, clippingCounts, i)));
       double levelFast, levelSlow;
       globals_get1ffv(statsCh1Audio, levelsFast, i, &levelFast);
       globals_get1ffv(statsCh1Audio, levelsSlow, i, &levelSlow);
@@ -142,10 +243,16 @@ static void *statsLoop (UNUSED void *arg) {
     // TODO: other channels
     uint8_t chId = 1;
 
-    protoCh1->set_dupblockcount(globals_get1uiv(statsDemux, dupBlockCount, chId));
-    protoCh1->set_oooblockcount(globals_get1uiv(statsDemux, oooBlockCount, chId));
-    mapBlockTimingRing(blockTimingRingMapped, chId);
-    protoCh1->set_blocktiming(blockTimingRingMapped, 4 * (STATS_BLOCK_TIMING_RING_LEN-1));
+    protoCh1->set_dupblockcount(DELTA(globals_get1uiv(statsDemux, dupBlockCount, chId)));
+    protoCh1->set_oooblockcount(DELTA(globals_get1uiv(statsDemux, oooBlockCount, chId)));
+    protoCh1->set_fastpathblockcount(DELTA(globals_get1uiv(statsDemux, fastPathBlockCount, chId)));
+    protoCh1->set_encodequeuedepth(globals_get1uiv(statsMux, encodeQueueDepth, chId));
+    unsigned int blockTimingPos = globals_get1uiv(statsDemux, blockTimingRingPos, chId);
+    int blockTimingLen = mapBlockTimingRing(blockTimingRingMapped, chId, false, blockTimingPos, lastBlockTimingPos);
+    protoCh1->set_blocktiming(blockTimingRingMapped, blockTimingLen);
+    blockTimingLen = mapBlockTimingRing(blockTimingRingMapped, chId, true, blockTimingPos, lastBlockTimingPos);
+    protoCh1->set_blockarrivaltiming(blockTimingRingMapped, blockTimingLen);
+    lastBlockTimingPos = blockTimingPos;
 
     int lastSbn0 = globals_get1iv(statsEndpoints, lastSbn, chId * MAX_ENDPOINTS);
     for (int i = 0; i < endpointCount; i++) {
@@ -154,35 +261,75 @@ static void *statsLoop (UNUSED void *arg) {
       if (relSbn < -128) relSbn += 256;
       protoEndpoints[i]->set_lastrelativesbn(relSbn);
       protoEndpoints[i]->set_open(globals_get1uiv(statsEndpoints, open, i));
-      protoEndpoints[i]->set_bytesout(globals_get1uiv(statsEndpoints, bytesOut, i));
-      protoEndpoints[i]->set_bytesin(globals_get1uiv(statsEndpoints, bytesIn, i));
-      protoEndpoints[i]->set_sendcongestion(globals_get1uiv(statsEndpoints, sendCongestion, i));
+      protoEndpoints[i]->set_health(globals_get1uiv(statsEndpoints, health, i));
+      protoEndpoints[i]->set_healthtransitioncount(DELTA(globals_get1uiv(statsEndpoints, healthTransitionCount, i)));
+      protoEndpoints[i]->set_bytesout(DELTA(globals_get1uiv(statsEndpoints, bytesOut, i)));
+      protoEndpoints[i]->set_bytesin(DELTA(globals_get1uiv(statsEndpoints, bytesIn, i)));
+      protoEndpoints[i]->set_sendcongestion(DELTA(globals_get1uiv(statsEndpoints, sendCongestion, i)));
+      protoEndpoints[i]->set_recvbatchcount(DELTA(globals_get1uiv(statsEndpoints, recvBatchCount, i)));
+      protoEndpoints[i]->set_recvbatchpacketcount(DELTA(globals_get1uiv(statsEndpoints, recvBatchPacketCount, i)));
+      protoEndpoints[i]->set_sendbatchcount(DELTA(globals_get1uiv(statsEndpoints, sendBatchCount, i)));
+      protoEndpoints[i]->set_sendbatchpacketcount(DELTA(globals_get1uiv(statsEndpoints, sendBatchPacketCount, i)));
+      protoEndpoints[i]->set_dupchunkcount(DELTA(globals_get1uiv(statsEndpoints, dupChunkCount, chId * MAX_ENDPOINTS + i)));
+      protoEndpoints[i]->set_latechunkcount(DELTA(globals_get1uiv(statsEndpoints, lateChunkCount, chId * MAX_ENDPOINTS + i)));
+      unsigned int dataPacketCount = globals_get1ui(statsEndpoints, dataPacketCount);
+      if (dataPacketCount > 0) {
+        protoEndpoints[i]->set_sendshare((float)globals_get1uiv(statsEndpoints, dataPacketsOut, i) / dataPacketCount);
+      }
     }
     protoCh1->mutable_audiostats()->set_streambuffersize(globals_get1i(statsCh1Audio, streamBufferSize));
-    protoCh1->mutable_audiostats()->set_bufferoverruncount(globals_get1ui(statsCh1Audio, bufferOverrunCount));
-    protoCh1->mutable_audiostats()->set_bufferunderruncount(globals_get1ui(statsCh1Audio, bufferUnderrunCount));
-    protoCh1->mutable_audiostats()->set_encodethreadjittercount(globals_get1ui(statsCh1Audio, encodeThreadJitterCount));
-    protoCh1->mutable_audiostats()->set_audioloopxruncount(globals_get1ui(statsCh1Audio, audioLoopXrunCount));
+    protoCh1->mutable_audiostats()->set_bufferoverruncount(DELTA(globals_get1ui(statsCh1Audio, bufferOverrunCount)));
+    protoCh1->mutable_audiostats()->set_bufferunderruncount(DELTA(globals_get1ui(statsCh1Audio, bufferUnderrunCount)));
+    protoCh1->mutable_audiostats()->set_concealedframecount(DELTA(globals_get1ui(statsCh1Audio, concealedFrameCount)));
+    protoCh1->mutable_audiostats()->set_lateframecount(DELTA(globals_get1ui(statsCh1Audio, lateFrameCount)));
+    protoCh1->mutable_audiostats()->set_encodethreadjittercount(DELTA(globals_get1ui(statsCh1Audio, encodeThreadJitterCount)));
+    protoCh1->mutable_audiostats()->set_audioloopxruncount(DELTA(globals_get1ui(statsCh1Audio, audioLoopXrunCount)));
+    protoCh1->mutable_audiostats()->set_audioloopspuriouswakecount(DELTA(globals_get1ui(statsCh1Audio, audioLoopSpuriousWakeCount)));
     double clockError;
     globals_get1ff(statsCh1Audio, clockError, &clockError);
     protoCh1->mutable_audiostats()->set_clockerror(clockError);
+    double syncError, syncErrorVariance;
+    globals_get1ff(statsCh1Audio, syncError, &syncError);
+    globals_get1ff(statsCh1Audio, syncErrorVariance, &syncErrorVariance);
+    protoCh1->mutable_audiostats()->set_syncerror(syncError);
+    protoCh1->mutable_audiostats()->set_syncerrorvariance(syncErrorVariance);
 
-    mapStreamMeterBins(streamMeterBinsRaw, streamMeterBinsMapped);
-    protoCh1->mutable_audiostats()->set_streammeterbins(streamMeterBinsMapped, STATS_STREAM_METER_BINS);
+    for (int i = 0; i < STATS_LATENCY_STAGE_COUNT; i++) {
+      for (int j = 0; j < STATS_LATENCY_BINS; j++) {
+        protoLatency[i]->set_bins(j, DELTA(globals_get1uiv(statsCh1AudioLatency, histograms, i * STATS_LATENCY_BINS + j)));
+      }
+      protoLatency[i]->set_lastus(globals_get1iv(statsCh1AudioLatency, lastUs, i));
+    }
+
+    if (frameCount % MONITOR_STREAM_METER_INTERVAL == 0) {
+      mapStreamMeterBins(streamMeterBinsRaw, streamMeterBinsMapped);
+      protoCh1->mutable_audiostats()->set_streammeterbins(streamMeterBinsMapped, STATS_STREAM_METER_BINS);
+    } else {
+      protoCh1->mutable_audiostats()->clear_streammeterbins();
+    }
 
     switch (globals_get1ui(audio, encoding)) {
       case AUDIO_ENCODING_OPUS:
-        protoCh1->mutable_audiostats()->mutable_opusstats()->set_codecerrorcount(globals_get1ui(statsCh1AudioOpus, codecErrorCount));
+        protoCh1->mutable_audiostats()->mutable_opusstats()->set_codecerrorcount(DELTA(globals_get1ui(statsCh1AudioOpus, codecErrorCount)));
         break;
       case AUDIO_ENCODING_PCM:
-        protoCh1->mutable_audiostats()->mutable_pcmstats()->set_crcfailcount(globals_get1ui(statsCh1AudioPCM, crcFailCount));
+        protoCh1->mutable_audiostats()->mutable_pcmstats()->set_crcfailcount(DELTA(globals_get1ui(statsCh1AudioPCM, crcFailCount)));
+        break;
+      case AUDIO_ENCODING_LOSSLESS: {
+        double compressionRatio;
+        globals_get1ff(statsCh1AudioLossless, compressionRatio, &compressionRatio);
+        protoCh1->mutable_audiostats()->mutable_losslessstats()->set_codecerrorcount(DELTA(globals_get1ui(statsCh1AudioLossless, codecErrorCount)));
+        protoCh1->mutable_audiostats()->mutable_losslessstats()->set_compressionratio(compressionRatio);
         break;
+      }
     }
 
-    std::string protoData;
+    #undef DELTA
+    frameCount++;
+
+    // SerializeToString keeps the string's capacity, so after the first few frames this doesn't allocate
     proto.SerializeToString(&protoData);
-    int error = uws_wsSend(wsClient, protoData.c_str(), protoData.length(), UWS_OPCODE_BINARY);
-    if (error < 0) printf("uws_wsSend error: %d\n", error); // DEBUG: log
+    sendFrame(protoData, keyFrame);
   }
 
   delete[] protoAudioChannels;
@@ -197,6 +344,17 @@ int monitor_init (void) {
   audioChannelCount = globals_get1i(audio, networkChannelCount);
   endpointCount = globals_get1i(endpoints, endpointCount);
 
+  int udpPort = globals_get1i(monitor, udpPort);
+  if (udpPort > 0) {
+    udpSock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udpSock < 0) return -1;
+    memset(&udpDestAddr, 0, sizeof(udpDestAddr));
+    udpDestAddr.sin_family = AF_INET;
+    udpDestAddr.sin_addr.s_addr = globals_get1ui(monitor, udpAddr);
+    udpDestAddr.sin_port = htons(udpPort);
+    printf("Monitor: sending frames to UDP port %d\n", udpPort);
+  }
+
   pthread_t wsThread, statsThread;
   int err = pthread_create(&wsThread, NULL, startWsApp, NULL);
   if (err != 0) return -2;
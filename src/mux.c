@@ -9,44 +9,95 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include "raptorq/raptorq.h"
+#include "slot-ring.h"
+#include "rt-arena.h"
 #include "utils.h"
 #include "globals.h"
 #include "mux.h"
 
+// Paced channels spread the packets of each block over this fraction of the measured block interval, so
+// that the schedule doesn't fall behind when a block is handed off slightly early
+#define MUX_PACING_FRACTION 0.9
+
 typedef struct {
   uint8_t chId, sbn;
-  ck_ring_t chunkRing;
-  ck_ring_buffer_t *chunkRingBuf; // encoded block made of chunks
-  uint8_t *blockBuf, *encodedBlockBuf;
+  // unencoded blocks from mux_writeData to the encode thread, one block per slot followed by a 1 byte SBN
+  slotring_t sourceRing;
+  slotring_t blockRing; // one encoded block (made of chunks) per slot, raptorq encodes directly into the slots
+  uint8_t *blockBuf; // the block mux_writeData is filling, either a sourceRing slot or spareBlockBuf
+  uint8_t *spareBlockBuf; // used when sourceRing is full, the block is dropped when it is handed off
   int blockBufPos, blockBufLen, maxDataLen;
-  size_t chunkLen, chunkLenWords, chunkRingLenWords, chunksPerBlock, encodedBlockBufLen;
-  void *raptorqHandle;
+  size_t chunkLen, chunksPerBlock, encodedBlockBufLen;
+  size_t readChunkIndex; // next chunk to send from the block at the head of blockRing, packet thread only
+  bool paced;
+  size_t *sendOrder; // chunk index in the encoded block for each readChunkIndex, only used if paced
+  void *raptorqHandle; // encode thread only
+  pthread_t encodeThread;
+  xwait_t encodeWaitHandle;
 } mux_channel_t;
 
-static mux_channel_t channels[MUX_CHANNEL_COUNT];
+static mux_channel_t channels[MUX_MAX_CHANNELS];
 static int chCount = 0;
 static int anchorChId = -1;
 static size_t maxPacketSize;
-static uint8_t *packetBuf;
-static int (*_onPacket)(const uint8_t *, size_t);
+static size_t packetHeadroom;
+static uint8_t *packetBuf; // packetHeadroom bytes for onPacket, then the packet
+static int (*_onPacket)(uint8_t *, size_t);
+static void (*_onFlush)(void);
 static pthread_t packetThread;
 static atomic_bool packetThreadRunning;
+static atomic_bool encodeThreadsRunning;
 static xwait_t waitHandle;
+// packet thread only
+static int64_t anchorBlockStartNs = 0, anchorBlockIntervalNs = 0;
+
+// called when the packet thread starts sending a new block from the anchor channel
+static void startAnchorBlock (void) {
+  int64_t nowNs = utils_getMonotonicNs();
+
+  if (anchorBlockStartNs != 0) {
+    int64_t intervalNs = nowNs - anchorBlockStartNs;
+    if (anchorBlockIntervalNs == 0) {
+      anchorBlockIntervalNs = intervalNs;
+    } else if (intervalNs < 4 * anchorBlockIntervalNs) {
+      // smooth out jitter, and ignore long gaps e.g. when the sender is starting up
+      anchorBlockIntervalNs += (intervalNs - anchorBlockIntervalNs) / 8;
+    }
+  }
+
+  anchorBlockStartNs = nowNs;
+}
+
+// sleep until the next packet of the current anchor block is due
+static void waitForNextPacket (void) {
+  mux_channel_t *anchor = &channels[anchorChId];
+
+  // readChunkIndex == 0 means the last block has been sent completely
+  if (anchor->readChunkIndex == 0 || anchorBlockIntervalNs == 0) return;
+  // if we are behind, send the rest of this block straight away rather than adding latency
+  if (slotring_size(&anchor->blockRing) > 1) return;
+
+  int64_t packetIntervalNs = MUX_PACING_FRACTION * anchorBlockIntervalNs / anchor->chunksPerBlock;
+  // the packets have to actually leave now, not when the batch is full
+  if (_onFlush != NULL) _onFlush();
+  utils_sleepUntilNs(anchorBlockStartNs + anchor->readChunkIndex * packetIntervalNs);
+}
 
 static int sendPackets (void) {
+  uint8_t *packet = packetBuf + packetHeadroom;
   size_t packetBufPos;
 
   // read one chunk from each of the available chunkRings, assemble and send a packet
   // repeat this until the anchor channel chunkRing is empty
 
   while (true) {
-    packetBuf[0] = 0; // flags
+    packet[0] = 0; // flags
     packetBufPos = 1;
 
     for (uint8_t chId = 0; chId < chCount; chId++) {
       mux_channel_t *chan = &channels[chId];
-      size_t ringSizeWords = ck_ring_size(&chan->chunkRing);
-      if (ringSizeWords < chan->chunkLenWords) {
+      const uint8_t *encodedBlock = slotring_readSlot(&chan->blockRing);
+      if (encodedBlock == NULL) {
         if (chId == anchorChId) {
           return 0;
         } else {
@@ -54,63 +105,82 @@ static int sendPackets (void) {
         }
       }
 
-      if (packetBufPos + 1 + 4*chan->chunkLenWords > maxPacketSize) return -1;
+      if (packetBufPos + 1 + chan->chunkLen > maxPacketSize) return -1;
 
-      packetBuf[packetBufPos] = chId;
+      packet[packetBufPos] = chId;
       packetBufPos++;
 
-      for (size_t i = 0; i < chan->chunkLenWords; i++) {
-        intptr_t chunkWord = 0;
-        ck_ring_dequeue_spsc(&chan->chunkRing, chan->chunkRingBuf, (void*)&chunkWord);
-        memcpy(&packetBuf[packetBufPos], &chunkWord, 4);
-        packetBufPos += 4;
+      if (chId == anchorChId && chan->readChunkIndex == 0) startAnchorBlock();
+      size_t chunkIndex = chan->paced ? chan->sendOrder[chan->readChunkIndex] : chan->readChunkIndex;
+      memcpy(&packet[packetBufPos], &encodedBlock[chan->chunkLen * chunkIndex], chan->chunkLen);
+      packetBufPos += chan->chunkLen;
+
+      if (++chan->readChunkIndex == chan->chunksPerBlock) {
+        // all chunks from this block have been sent, give the slot back to mux_writeData
+        chan->readChunkIndex = 0;
+        slotring_commitRead(&chan->blockRing);
       }
     }
 
-    if (packetBufPos > 1) _onPacket(packetBuf, packetBufPos);
+    if (packetBufPos > 1) _onPacket(packetBuf, packetHeadroom + packetBufPos);
+    if (channels[anchorChId].paced) waitForNextPacket();
   }
 
   return 0;
 }
 
 static void *startPacketThread (UNUSED void *arg) {
-  utils_setCallerThreadRealtime(98, 0);
+  utils_setCallerThreadRole(THREAD_ROLE_MUX_PACKET, 0, 98, 0);
 
   while (atomic_load(&packetThreadRunning)) {
     xwait_wait(&waitHandle);
 
     sendPackets(); // TODO: read sendPackets result and flag error
+    if (_onFlush != NULL) _onFlush();
   }
 
   return NULL;
 }
 
-int mux_init (int (*onPacket)(const uint8_t *, size_t)) {
+int mux_init (int (*onPacket)(uint8_t *, size_t), void (*onFlush)(void), size_t headroom) {
   _onPacket = onPacket;
+  _onFlush = onFlush;
 
   maxPacketSize = globals_get1ui(mux, maxPacketSize);
-  packetBuf = (uint8_t*)malloc(maxPacketSize);
+  packetHeadroom = headroom;
+  packetBuf = (uint8_t*)rtarena_alloc(packetHeadroom + maxPacketSize);
   if (packetBuf == NULL) return -1;
 
   xwait_init(&waitHandle);
   atomic_store(&packetThreadRunning, true);
+  atomic_store(&encodeThreadsRunning, true);
+  anchorBlockStartNs = 0;
+  anchorBlockIntervalNs = 0;
   if (pthread_create(&packetThread, NULL, startPacketThread,  NULL) != 0) return -2;
 
   return 0;
 }
 
 void mux_deinit (void) {
+  atomic_store(&encodeThreadsRunning, false);
+  for (int i = 0; i < chCount; i++) {
+    xwait_notify(&channels[i].encodeWaitHandle);
+    pthread_join(channels[i].encodeThread, NULL);
+    xwait_destroy(&channels[i].encodeWaitHandle);
+  }
+
   atomic_store(&packetThreadRunning, false);
   xwait_notify(&waitHandle);
   pthread_join(packetThread, NULL);
   xwait_destroy(&waitHandle);
-  free(packetBuf);
+  rtarena_free(packetBuf);
 
   for (int i = 0; i < chCount; i++) {
     // raptorq_deinitDecoder(channels[i].raptorqHandle); // DEBUG: this causes a segfault
-    free(channels[i].blockBuf);
-    free(channels[i].encodedBlockBuf);
-    free(channels[i].chunkRingBuf);
+    rtarena_free(channels[i].spareBlockBuf);
+    rtarena_free(channels[i].sendOrder);
+    slotring_deinit(&channels[i].sourceRing);
+    slotring_deinit(&channels[i].blockRing);
   }
 
   chCount = 0;
@@ -123,80 +193,126 @@ int mux_setAnchorChannel (uint8_t chId) {
   return 0;
 }
 
-int mux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen) {
-  if (chCount == MUX_CHANNEL_COUNT) return -1;
+// one realtime thread per channel where all FEC encoding happens
+static void *startEncodeThread (void *arg) {
+  intptr_t chId = (intptr_t)arg;
+  mux_channel_t *chan = &channels[chId];
+
+  // by default pin each channel encode thread to a different core, like the demux decode threads, but offset by
+  // one so that channel 1 doesn't share core 2 with the sender audio encode thread (Linux only)
+  utils_setCallerThreadRole(THREAD_ROLE_MUX_ENCODE, chId, 98, chId + 2);
+
+  while (atomic_load(&encodeThreadsRunning)) {
+    xwait_wait(&chan->encodeWaitHandle);
+
+    const uint8_t *sourceBlock;
+    while ((sourceBlock = slotring_readSlot(&chan->sourceRing)) != NULL) {
+      uint8_t *encodedBlock = slotring_writeSlot(&chan->blockRing);
+      if (encodedBlock == NULL) {
+        // the packet thread is still sending two older blocks, drop this one
+        globals_add1uiv(statsMux, ringOverrunCount, chId, 1);
+      } else {
+        size_t result = raptorq_encodeBlock(
+          chan->raptorqHandle,
+          sourceBlock[chan->blockBufLen],
+          (uint8_t *)sourceBlock,
+          encodedBlock,
+          chan->chunksPerBlock
+        );
+
+        if (result == chan->encodedBlockBufLen) {
+          slotring_commitWrite(&chan->blockRing);
+          if (chId == anchorChId) xwait_notify(&waitHandle);
+        }
+      }
+
+      slotring_commitRead(&chan->sourceRing);
+    }
+  }
+
+  return NULL;
+}
+
+int mux_addChannel (int maxDataLen, int sourceSymbolsPerBlock, int repairSymbolsPerBlock, int symbolLen, bool paced) {
+  if (chCount == MUX_MAX_CHANNELS) return -1;
   if (maxDataLen > symbolLen * sourceSymbolsPerBlock - 8) return -2;
 
   mux_channel_t *chan = &channels[chCount];
 
   chan->chunkLen = 4 + symbolLen;
-  chan->chunkLenWords = chan->chunkLen / 4;
   chan->chunksPerBlock = sourceSymbolsPerBlock + repairSymbolsPerBlock;
   chan->encodedBlockBufLen = chan->chunkLen * chan->chunksPerBlock;
-  // ring space for up to 2 encoded blocks (with Payload IDs and repair symbols)
+  chan->readChunkIndex = 0;
+  // ring space for 2 encoded blocks (with Payload IDs and repair symbols)
   // block size should be large enough so there are not big bursts of raptorq_encodeBlock calls
   // that will overflow the ring
   // if the ring is not already empty by the time the next block is added, consider increasing
   // block size so that this ring does not contribute significantly to latency
-  // assume 4 bytes per ring word to simplify this code (uses twice the memory on 64-bit arch)
   // TODO: can we reduce the ring size to 1 encoded block?
-  chan->chunkRingLenWords = 2 * chan->encodedBlockBufLen / 4;
-
-  // ck requires the size to be a power of two but we will pretend ring is chunkRingLenWords
-  // in size, and ignore the rest
-  int ringAllocSize = utils_roundUpPowerOfTwo(chan->chunkRingLenWords);
-  chan->chunkRingBuf = (ck_ring_buffer_t*)malloc(sizeof(ck_ring_buffer_t) * ringAllocSize);
-  if (chan->chunkRingBuf == NULL) return -3;
-  memset(chan->chunkRingBuf, 0, sizeof(ck_ring_buffer_t) * ringAllocSize);
-  ck_ring_init(&chan->chunkRing, ringAllocSize);
+  if (slotring_init(&chan->blockRing, 2, chan->encodedBlockBufLen) < 0) return -3;
+
+  chan->paced = paced;
+  chan->sendOrder = NULL;
+  if (paced) {
+    // spread the repair symbols evenly between the source symbols so a burst of loss doesn't take out
+    // only source symbols, e.g. 6 source 3 repair: S0 S1 R0 S2 S3 R1 S4 S5 R2
+    chan->sendOrder = (size_t *)rtarena_alloc(chan->chunksPerBlock * sizeof(size_t));
+    if (chan->sendOrder == NULL) return -3;
+    size_t sourceIndex = 0, repairIndex = 0;
+    for (size_t i = 0; i < chan->chunksPerBlock; i++) {
+      if (repairIndex < (i + 1) * repairSymbolsPerBlock / chan->chunksPerBlock) {
+        chan->sendOrder[i] = sourceSymbolsPerBlock + repairIndex++;
+      } else {
+        chan->sendOrder[i] = sourceIndex++;
+      }
+    }
+  }
 
   chan->chId = chCount;
   chan->sbn = 0;
   chan->maxDataLen = maxDataLen;
   chan->blockBufPos = 0;
   chan->blockBufLen = symbolLen * sourceSymbolsPerBlock;
-  chan->blockBuf = (uint8_t *)malloc(chan->blockBufLen);
-  if (chan->blockBuf == NULL) return -4;
-  chan->encodedBlockBuf = (uint8_t *)malloc(chan->encodedBlockBufLen);
-  if (chan->encodedBlockBuf == NULL) return -5;
+  // double buffered: mux_writeData fills one block while the encode thread encodes the other
+  if (slotring_init(&chan->sourceRing, 2, chan->blockBufLen + 1) < 0) return -4;
+  chan->spareBlockBuf = (uint8_t *)rtarena_alloc(chan->blockBufLen + 1);
+  if (chan->spareBlockBuf == NULL) return -4;
+  chan->blockBuf = slotring_writeSlot(&chan->sourceRing);
 
   chan->raptorqHandle = raptorq_initEncoder(chan->blockBufLen, sourceSymbolsPerBlock);
 
+  xwait_init(&chan->encodeWaitHandle);
+  intptr_t arg = chCount;
+  if (pthread_create(&chan->encodeThread, NULL, startEncodeThread, (void*)arg) != 0) return -5;
+
   return chCount++;
 }
 
-static int encodeAndEnqueueBlock (uint8_t chId) {
+// called from mux_writeData when chan->blockBuf is full
+static int enqueueBlock (uint8_t chId) {
   mux_channel_t *chan = &channels[chId];
   chan->blockBufPos = 0;
+  int err = 0;
 
-  size_t result = raptorq_encodeBlock(
-    chan->raptorqHandle,
-    chan->sbn++,
-    chan->blockBuf,
-    chan->encodedBlockBuf,
-    chan->chunksPerBlock
-  );
-
-  if (result != chan->encodedBlockBufLen) return -1;
-
-  if (ck_ring_size(&chan->chunkRing) > chan->chunkRingLenWords/2) {
+  if (chan->blockBuf == chan->spareBlockBuf) {
+    // the encode thread still has two older blocks, drop this one
+    chan->sbn++;
     globals_add1uiv(statsMux, ringOverrunCount, chId, 1);
-    return -2;
-  }
-
-  // chan->chunkRingLenWords/2 == chan->encodedBlockBufLen in words
-  for (size_t i = 0; i < chan->chunkRingLenWords/2; i++) {
-    intptr_t chunkWord = 0;
-    memcpy(&chunkWord, &chan->encodedBlockBuf[4*i], 4);
-    ck_ring_enqueue_spsc(&chan->chunkRing, chan->chunkRingBuf, (void*)chunkWord);
+    err = -2;
+  } else {
+    chan->blockBuf[chan->blockBufLen] = chan->sbn++;
+    slotring_commitWrite(&chan->sourceRing);
+    globals_set1uiv(statsMux, encodeQueueDepth, chId, slotring_size(&chan->sourceRing));
+    xwait_notify(&chan->encodeWaitHandle);
   }
 
-  if (chId == anchorChId) xwait_notify(&waitHandle);
+  chan->blockBuf = slotring_writeSlot(&chan->sourceRing);
+  if (chan->blockBuf == NULL) chan->blockBuf = chan->spareBlockBuf;
 
-  return 0;
+  return err;
 }
 
-// FEC encoding is done here
+// FEC encoding is done in the encode thread
 int mux_writeData (uint8_t chId, const uint8_t *dataBuf, int dataBufLen) {
   mux_channel_t *chan = &channels[chId];
 
@@ -210,7 +326,7 @@ int mux_writeData (uint8_t chId, const uint8_t *dataBuf, int dataBufLen) {
   if (leftoverLen < 5) {
     // all of dataBuf goes at the start of the next block
     memset(&chan->blockBuf[chan->blockBufPos], 0, leftoverLen); // padding
-    err = encodeAndEnqueueBlock(chId); // sets blockBufPos to 0
+    err = enqueueBlock(chId); // sets blockBufPos to 0
     if (err < 0) return err - 2;
     memset(chan->blockBuf, 0, 4); // no partial data
     dataLenField = dataBufLen;
@@ -227,7 +343,7 @@ int mux_writeData (uint8_t chId, const uint8_t *dataBuf, int dataBufLen) {
   if (leftoverLen < 4 + dataBufLen) {
     // dataBuf is split between current and next block
     memcpy(&chan->blockBuf[chan->blockBufPos], dataBuf, leftoverLen - 4);
-    err = encodeAndEnqueueBlock(chId); // sets blockBufPos to 0
+    err = enqueueBlock(chId); // sets blockBufPos to 0
     if (err < 0) return err - 4;
     dataLenField = 4 + dataBufLen - leftoverLen;
     memcpy(chan->blockBuf, &dataLenField, 4);
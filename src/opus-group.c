@@ -0,0 +1,236 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include "opus-group.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "globals.h"
+#include "rt-arena.h"
+#include "utils.h"
+
+static int getGroupBitrate (int channelCount, int groupChannelCount, int bitrate) {
+  return (int64_t)bitrate * groupChannelCount / channelCount;
+}
+
+static int getGroupDataLen (int groupBitrate, int frameSize) {
+  // CBR
+  return (int64_t)groupBitrate * frameSize / (8 * AUDIO_OPUS_SAMPLE_RATE);
+}
+
+// groups are contiguous and differ in size by at most one channel
+static void getGroupChannels (int channelCount, int groupCount, int index, int *channelOffset, int *groupChannelCount) {
+  *channelOffset = index * channelCount / groupCount;
+  *groupChannelCount = (index + 1) * channelCount / groupCount - *channelOffset;
+}
+
+static int createCoder (opusgroup_group_t *grp, bool decoder, int bitrate) {
+  unsigned char mapping[grp->channelCount];
+  for (int i = 0; i < grp->channelCount; i++) mapping[i] = i;
+
+  int err;
+  if (decoder) {
+    grp->decoder = opus_multistream_decoder_create(AUDIO_OPUS_SAMPLE_RATE, grp->channelCount, grp->channelCount, 0, mapping, &err);
+    if (err < 0) {
+      printf("Error: opus_multistream_decoder_create failed: %s\n", opus_strerror(err));
+      return -1;
+    }
+    return 0;
+  }
+
+  grp->encoder = opus_multistream_encoder_create(AUDIO_OPUS_SAMPLE_RATE, grp->channelCount, grp->channelCount, 0, mapping, OPUS_APPLICATION_AUDIO, &err);
+  if (err < 0) {
+    printf("Error: opus_multistream_encoder_create failed: %s\n", opus_strerror(err));
+    return -1;
+  }
+
+  int err1 = opus_multistream_encoder_ctl(grp->encoder, OPUS_SET_BITRATE(bitrate));
+  int err2 = opus_multistream_encoder_ctl(grp->encoder, OPUS_SET_VBR(0));
+  if (err1 < 0 || err2 < 0) {
+    printf("Error: opus_multistream_encoder_ctl failed\n");
+    return -2;
+  }
+
+  return 0;
+}
+
+static void runGroup (opusgroup_group_t *grp) {
+  const opusgroup_t *g = grp->parent;
+
+  if (grp->encoder != NULL) {
+    for (int i = 0; i < g->frameSize; i++) {
+      memcpy(&grp->samples[i * grp->channelCount], &g->inSamples[i * g->channelCount + grp->channelOffset], sizeof(float) * grp->channelCount);
+    }
+    int len = opus_multistream_encode_float(grp->encoder, grp->samples, g->frameSize, &g->outData[grp->dataOffset], grp->dataLen);
+    grp->result = len == grp->dataLen ? 0 : len < 0 ? len : OPUS_INTERNAL_ERROR;
+  } else {
+    // no packet = packet loss concealment
+    const uint8_t *data = g->inData != NULL ? &g->inData[grp->dataOffset] : NULL;
+    int dataLen = g->inData != NULL ? grp->dataLen : 0;
+    int frameCount = opus_multistream_decode_float(grp->decoder, data, dataLen, grp->samples, g->frameSize, g->decodeFec);
+    grp->result = frameCount == g->frameSize ? 0 : frameCount < 0 ? frameCount : OPUS_INTERNAL_ERROR;
+  }
+}
+
+static void *startWorker (void *arg) {
+  opusgroup_group_t *grp = (opusgroup_group_t *)arg;
+  opusgroup_t *g = grp->parent;
+
+  utils_setCallerThreadRole(THREAD_ROLE_OPUS_WORKER, grp->index - 1, 98, OPUSGROUP_FIRST_WORKER_CORE + grp->index - 1);
+
+  for (;;) {
+    xwait_wait(&grp->startWait);
+    if (!g->running) break;
+    runGroup(grp);
+    if (atomic_fetch_sub(&g->pending, 1) == 1) xwait_notify(&g->doneWait);
+  }
+
+  return NULL;
+}
+
+// codes g->groups[0] on the calling thread while the workers code the rest
+static int runFrame (opusgroup_t *g) {
+  atomic_store(&g->pending, g->groupCount - 1);
+  for (int i = 1; i < g->groupCount; i++) xwait_notify(&g->groups[i].startWait);
+  runGroup(&g->groups[0]);
+  if (g->groupCount > 1) xwait_wait(&g->doneWait);
+
+  for (int i = 0; i < g->groupCount; i++) {
+    if (g->groups[i].result < 0) return g->groups[i].result;
+  }
+  return 0;
+}
+
+static int init (opusgroup_t *g, bool decoder, int channelCount, int groupCount, int bitrate, int frameSize) {
+  memset(g, 0, sizeof(opusgroup_t));
+  atomic_store(&g->running, true);
+  xwait_init(&g->doneWait);
+
+  if (groupCount < 1) groupCount = 1;
+  if (groupCount > OPUSGROUP_MAX_GROUPS || groupCount > channelCount) {
+    printf("Error: Opus groupCount must be between 1 and %d, and no more than the channel count.\n", OPUSGROUP_MAX_GROUPS);
+    return -1;
+  }
+  g->channelCount = channelCount;
+  g->groupCount = groupCount;
+  g->frameSize = frameSize;
+
+  for (int i = 0; i < groupCount; i++) {
+    opusgroup_group_t *grp = &g->groups[i];
+    grp->parent = g;
+    grp->index = i;
+    getGroupChannels(channelCount, groupCount, i, &grp->channelOffset, &grp->channelCount);
+    int groupBitrate = getGroupBitrate(channelCount, grp->channelCount, bitrate);
+    grp->dataOffset = g->dataLen;
+    grp->dataLen = getGroupDataLen(groupBitrate, frameSize);
+    g->dataLen += grp->dataLen;
+
+    grp->samples = (float *)rtarena_alloc(sizeof(float) * grp->channelCount * frameSize);
+    if (grp->samples == NULL) return -2;
+    if (createCoder(grp, decoder, groupBitrate) < 0) return -3;
+  }
+
+  for (int i = 1; i < groupCount; i++) {
+    opusgroup_group_t *grp = &g->groups[i];
+    xwait_init(&grp->startWait);
+    if (pthread_create(&grp->thread, NULL, startWorker, grp) != 0) return -4;
+    grp->threadStarted = true;
+  }
+
+  return 0;
+}
+
+/////////////////////
+// public
+/////////////////////
+
+int opusgroup_initEncoder (opusgroup_t *g, int channelCount, int groupCount, int bitrate, int frameSize) {
+  int err = init(g, false, channelCount, groupCount, bitrate, frameSize);
+  if (err < 0) opusgroup_deinit(g);
+  return err;
+}
+
+int opusgroup_initDecoder (opusgroup_t *g, int channelCount, int groupCount, int bitrate, int frameSize) {
+  int err = init(g, true, channelCount, groupCount, bitrate, frameSize);
+  if (err < 0) opusgroup_deinit(g);
+  return err;
+}
+
+void opusgroup_deinit (opusgroup_t *g) {
+  atomic_store(&g->running, false);
+  for (int i = 0; i < g->groupCount; i++) {
+    opusgroup_group_t *grp = &g->groups[i];
+    if (grp->threadStarted) {
+      xwait_notify(&grp->startWait);
+      pthread_join(grp->thread, NULL);
+      xwait_destroy(&grp->startWait);
+      grp->threadStarted = false;
+    }
+    if (grp->encoder != NULL) opus_multistream_encoder_destroy(grp->encoder);
+    if (grp->decoder != NULL) opus_multistream_decoder_destroy(grp->decoder);
+    rtarena_free(grp->samples);
+    grp->encoder = NULL;
+    grp->decoder = NULL;
+    grp->samples = NULL;
+  }
+  xwait_destroy(&g->doneWait);
+}
+
+int opusgroup_getDataLen (int channelCount, int groupCount, int bitrate, int frameSize) {
+  if (groupCount < 1) groupCount = 1;
+  int dataLen = 0;
+  for (int i = 0; i < groupCount; i++) {
+    int channelOffset, groupChannelCount;
+    getGroupChannels(channelCount, groupCount, i, &channelOffset, &groupChannelCount);
+    dataLen += getGroupDataLen(getGroupBitrate(channelCount, groupChannelCount, bitrate), frameSize);
+  }
+  return dataLen;
+}
+
+int opusgroup_encode (opusgroup_t *g, const float *inSamples, uint8_t *outData) {
+  g->inSamples = inSamples;
+  g->outData = outData;
+  int err = runFrame(g);
+  if (err < 0) return err;
+  return g->dataLen;
+}
+
+int opusgroup_setInbandFec (opusgroup_t *g, int lossPerc) {
+  for (int i = 0; i < g->groupCount; i++) {
+    OpusMSEncoder *encoder = g->groups[i].encoder;
+    if (encoder == NULL) return OPUS_BAD_ARG;
+    int err1 = opus_multistream_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(lossPerc > 0 ? 1 : 0));
+    int err2 = opus_multistream_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(lossPerc));
+    if (err1 < 0) return err1;
+    if (err2 < 0) return err2;
+  }
+  return 0;
+}
+
+static int decodeFrame (opusgroup_t *g, const uint8_t *inData, bool decodeFec, float *outSamples) {
+  g->inData = inData;
+  g->decodeFec = decodeFec;
+  int err = runFrame(g);
+  if (err < 0) return err;
+
+  // the workers are done, so interleave here instead of having them write to neighbouring floats of outSamples
+  for (int i = 0; i < g->groupCount; i++) {
+    const opusgroup_group_t *grp = &g->groups[i];
+    for (int j = 0; j < g->frameSize; j++) {
+      memcpy(&outSamples[j * g->channelCount + grp->channelOffset], &grp->samples[j * grp->channelCount], sizeof(float) * grp->channelCount);
+    }
+  }
+  return g->frameSize;
+}
+
+int opusgroup_decode (opusgroup_t *g, const uint8_t *inData, int inDataLen, float *outSamples) {
+  if (inDataLen != g->dataLen) return OPUS_BAD_ARG;
+  return decodeFrame(g, inData, false, outSamples);
+}
+
+int opusgroup_decodeLost (opusgroup_t *g, const uint8_t *nextData, int nextDataLen, float *outSamples) {
+  if (nextData != NULL && nextDataLen != g->dataLen) return OPUS_BAD_ARG;
+  return decodeFrame(g, nextData, nextData != NULL, outSamples);
+}
@@ -4,36 +4,61 @@
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
 #include <string.h>
+#include "globals.h"
 #include "utils.h"
+#include "sample-convert.h"
 #include "pcm.h"
 
-int pcm_encode (pcm_codec_t *codec, const double *inSampleBuf, int sampleCount, uint8_t *outData) {
-  for (int i = 0; i < sampleCount; i++) {
-    double sampleDouble = inSampleBuf[i];
-    if (sampleDouble < -1.0) sampleDouble = -1.0;
-    else if (sampleDouble > 1.0) sampleDouble = 1.0;
-    // Convert double samples to 24-bit signed int
-    // http://blog.bjornroche.com/2009/12/int-float-int-its-jungle-out-there.html
-    // TODO: I don't think dithering is necessary here but I'm not 100% sure. I need to measure the waveform to check.
-    int32_t sampleInt = sampleDouble > 0.0 ? 8388607.0 * sampleDouble : 8388608.0 * sampleDouble;
-    memcpy(&outData[3*i], &sampleInt, 3);
+void pcm_init (pcm_codec_t *codec, int crcMode) {
+  codec->crc = 0;
+  codec->crcMode = crcMode;
+}
+
+int pcm_getCrcLen (int crcMode) {
+  switch (crcMode) {
+    case PCM_CRC_MODE_CRC32C: return 4;
+    case PCM_CRC_MODE_NONE: return 0;
+    default: return 2;
   }
+}
 
-  codec->crc = utils_crc16(codec->crc, outData, 3 * sampleCount);
-  utils_writeU16LE(&outData[3*sampleCount], codec->crc);
+// The CRC of each frame continues from the CRC of the previous frame
+static uint32_t updateCrc (const pcm_codec_t *codec, const uint8_t *buf, int bufLen) {
+  if (codec->crcMode == PCM_CRC_MODE_CRC32C) return utils_crc32c(codec->crc, buf, bufLen);
+  return utils_crc16(codec->crc, buf, bufLen);
+}
 
-  return 3 * sampleCount + 2;
+int pcm_encode (pcm_codec_t *codec, const float *inSampleBuf, int sampleCount, uint8_t *outData) {
+  // Convert float samples to 24-bit signed int
+  // TODO: I don't think dithering is necessary here but I'm not 100% sure. I need to measure the waveform to check.
+  sampleconvert_kernels->f32ToS24(inSampleBuf, outData, sampleCount);
+
+  int len = 3 * sampleCount;
+  switch (codec->crcMode) {
+    case PCM_CRC_MODE_CRC32C:
+      codec->crc = updateCrc(codec, outData, len);
+      return len + utils_writeU32LE(&outData[len], codec->crc);
+    case PCM_CRC_MODE_NONE:
+      return len;
+    default:
+      codec->crc = updateCrc(codec, outData, len);
+      return len + utils_writeU16LE(&outData[len], codec->crc);
+  }
 }
 
 int pcm_decode (pcm_codec_t *codec, const uint8_t *inData, int inDataLen, const uint8_t **samples) {
-  inDataLen -= 2; // exclude 2 byte CRC at the end
+  inDataLen -= pcm_getCrcLen(codec->crcMode); // exclude the CRC at the end
   if (inDataLen < 3) return -1; // at least 1 24-bit sample
   if (inDataLen % 3 != 0) return -2;
 
-  uint16_t calculatedCRC = utils_crc16(codec->crc, inData, inDataLen);
-  uint16_t receivedCRC = utils_readU16LE(&inData[inDataLen]);
-  codec->crc = receivedCRC;
-  if (calculatedCRC != receivedCRC) return -3;
+  if (codec->crcMode != PCM_CRC_MODE_NONE) {
+    uint32_t calculatedCRC = updateCrc(codec, inData, inDataLen);
+    uint32_t receivedCRC = codec->crcMode == PCM_CRC_MODE_CRC32C
+      ? utils_readU32LE(&inData[inDataLen])
+      : utils_readU16LE(&inData[inDataLen]);
+    codec->crc = receivedCRC;
+    if (calculatedCRC != receivedCRC) return -3;
+  }
 
   *samples = inData;
   return inDataLen / 3;
@@ -0,0 +1,121 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include "globals.h"
+#include "peer-cache.h"
+
+// addr << 16 | port, 0 = no address
+static atomic_uint_fast64_t entries[MAX_ENDPOINTS];
+static atomic_bool dirty = false;
+static bool warnedWrite = false;
+static int cacheEndpointCount = 0;
+static char cachePath[MAX_FILE_PATH_LEN + 1] = { 0 };
+static char cachePeerPubKey[SEC_KEY_LENGTH + 1] = { 0 };
+static char ifNames[MAX_ENDPOINTS][MAX_NET_IF_NAME_LEN + 1];
+
+static int load (void) {
+  FILE *file = fopen(cachePath, "r");
+  if (file == NULL) return 0;
+
+  int loadedCount = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char pubKey[SEC_KEY_LENGTH + 1] = { 0 };
+    char ifName[MAX_NET_IF_NAME_LEN + 1] = { 0 };
+    char addrString[16] = { 0 };
+    int epIndex;
+    unsigned int port;
+    // NOTE: the field widths must match SEC_KEY_LENGTH and MAX_NET_IF_NAME_LEN
+    if (sscanf(line, "%44s %d %20s %15[0-9.]:%u", pubKey, &epIndex, ifName, addrString, &port) != 5) continue;
+    if (strcmp(pubKey, cachePeerPubKey) != 0) continue;
+    if (epIndex < 0 || epIndex >= cacheEndpointCount || strcmp(ifName, ifNames[epIndex]) != 0) continue;
+
+    uint32_t addr;
+    if (inet_pton(AF_INET, addrString, &addr) != 1 || port == 0 || port > 65535) continue;
+    peercache_set(epIndex, addr, htons(port));
+    loadedCount++;
+  }
+
+  fclose(file);
+  atomic_store(&dirty, false);
+  return loadedCount;
+}
+
+int peercache_init (const char *path, const char *peerPubKeyStr, int endpointCount) {
+  cacheEndpointCount = endpointCount > MAX_ENDPOINTS ? MAX_ENDPOINTS : endpointCount;
+  for (int i = 0; i < MAX_ENDPOINTS; i++) atomic_store(&entries[i], 0);
+  for (int i = 0; i < cacheEndpointCount; i++) {
+    globals_get1sv(endpoints, interface, i, ifNames[i], sizeof(ifNames[i]));
+  }
+  snprintf(cachePeerPubKey, sizeof(cachePeerPubKey), "%s", peerPubKeyStr);
+  snprintf(cachePath, sizeof(cachePath), "%s", path != NULL ? path : "");
+  warnedWrite = false;
+  atomic_store(&dirty, false);
+
+  if (cachePath[0] == '\0') return 0;
+
+  int loadedCount = load();
+  printf("Peer cache: %d of %d endpoint addresses loaded from %s\n", loadedCount, cacheEndpointCount, cachePath);
+  return loadedCount;
+}
+
+void peercache_deinit (void) {
+  peercache_save();
+  cachePath[0] = '\0';
+}
+
+bool peercache_get (int epIndex, uint32_t *addr, uint16_t *port) {
+  if (epIndex < 0 || epIndex >= MAX_ENDPOINTS) return false;
+  uint_fast64_t entry = atomic_load_explicit(&entries[epIndex], memory_order_relaxed);
+  if (entry == 0) return false;
+
+  *addr = entry >> 16;
+  *port = entry & 0xffff;
+  return true;
+}
+
+void peercache_set (int epIndex, uint32_t addr, uint16_t port) {
+  if (epIndex < 0 || epIndex >= MAX_ENDPOINTS) return;
+  uint_fast64_t entry = (uint_fast64_t)addr << 16 | port;
+  if (atomic_exchange_explicit(&entries[epIndex], entry, memory_order_relaxed) != entry) {
+    atomic_store_explicit(&dirty, true, memory_order_relaxed);
+  }
+}
+
+int peercache_save (void) {
+  if (cachePath[0] == '\0' || !atomic_exchange(&dirty, false)) return 0;
+
+  // write a new file and rename it over the old one, so a crash while writing doesn't lose the cache
+  char tmpPath[MAX_FILE_PATH_LEN + 5];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath);
+  FILE *file = fopen(tmpPath, "w");
+  if (file == NULL) {
+    if (!warnedWrite) printf("Peer cache: can't write %s\n", tmpPath);
+    warnedWrite = true;
+    return -1;
+  }
+
+  for (int i = 0; i < cacheEndpointCount; i++) {
+    uint32_t addr;
+    uint16_t port;
+    if (!peercache_get(i, &addr, &port)) continue;
+
+    char addrString[16] = { 0 };
+    inet_ntop(AF_INET, &addr, addrString, sizeof(addrString));
+    fprintf(file, "%s %d %s %s:%d\n", cachePeerPubKey, i, ifNames[i], addrString, ntohs(port));
+  }
+
+  if (fclose(file) != 0 || rename(tmpPath, cachePath) != 0) {
+    if (!warnedWrite) printf("Peer cache: can't write %s\n", cachePath);
+    warnedWrite = true;
+    return -2;
+  }
+
+  return 0;
+}
@@ -6,21 +6,25 @@
 #include "xwait.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include "opus/opus_multistream.h"
 #include "globals.h"
+#include "rt-arena.h"
 #include "demux.h"
 #include "syncer.h"
 #include "audio.h"
 #include "utils.h"
+#include "opus-group.h"
 #include "pcm.h"
+#include "lossless.h"
+#include "sample-convert.h"
 #include "endpoint.h"
 #include "config.h"
+#include "event-recorder.h"
 #include "receiver.h"
 
-static OpusMSDecoder *decoder = NULL;
+static opusgroup_t opusDecoder;
 static pcm_codec_t pcmDecoder = { 0 };
-static ck_ring_t decodeRing;
-static ck_ring_buffer_t *decodeRingBuf;
+static lossless_codec_t losslessDecoder = { 0 };
+static samplering_t decodeRing;
 static xwait_t configWaitHandle;
 static uint8_t *receivedConfigData = NULL;
 static int receivedConfigDataLen = 0;
@@ -29,9 +33,119 @@ static unsigned int audioEncoding;
 static int networkChannelCount;
 static int encodedPacketSize, audioFrameSize, decodeRingMaxSize;
 static float *sampleBufFloat;
+static int deviceLatencyUs;
+static double deviceSampleRate;
+
+// Packet loss concealment, see concealFrames. These are only accessed by the audio channel decode thread.
+static int lastSeq = -1;
+static int maxConcealedFrames;
+static uint8_t *lastPcmFrame = NULL; // PCM and lossless: the last frame decoded, packed S24
+static bool haveLastPcmFrame = false, fadeInNext = false;
+
+static void addLatency (int stage, int us) {
+  if (us < 0) us = 0;
+  int bin = us / STATS_LATENCY_BIN_US;
+  if (bin >= STATS_LATENCY_BINS) bin = STATS_LATENCY_BINS - 1;
+  globals_add1uiv(statsCh1AudioLatency, histograms, stage * STATS_LATENCY_BINS + bin, 1);
+  globals_set1iv(statsCh1AudioLatency, lastUs, stage, us);
+}
+
+// NOTES:
+// - The two clocks are not synchronised, so the network stage can't be measured directly. The smallest
+//   receive - send time over the last STATS_LATENCY_BASELINE_WINDOW packets is taken to be a packet that went
+//   through with no queueing, and that one is assumed to have taken half of WireGuard's handshake RTT.
+// - utils_getCurrentUTime wraps every 1000 s, so time differences are brought back into +/- 500 s.
+static void updateLatencyStats (const uint8_t *header, int receiveUs) {
+  static int baseline = 0, windowMin = 0, windowPos = 0;
+  static bool haveBaseline = false;
+
+  int senderUs = utils_readU16LE(&header[2]);
+  int diff = receiveUs - (int)utils_readU32LE(&header[4]) % 1000000000;
+  diff %= 1000000000;
+  if (diff > 500000000) diff -= 1000000000;
+  else if (diff < -500000000) diff += 1000000000;
+
+  if (windowPos == 0 || diff < windowMin) windowMin = diff;
+  // running minimum until the first window is complete
+  if ((!haveBaseline && windowPos == 0) || diff < baseline) baseline = diff;
+  if (++windowPos == STATS_LATENCY_BASELINE_WINDOW) {
+    // start again from this window so the baseline follows clock drift between the two machines
+    baseline = windowMin;
+    haveBaseline = true;
+    windowPos = 0;
+  }
+
+  int rttMs = globals_get1i(statsEndpoints, tunnelRttMs);
+  int networkUs = diff - baseline + (rttMs > 0 ? 500 * rttMs : 0);
+  int decodeRingUs = (int)(1000000.0 * samplering_size(&decodeRing) / networkChannelCount / deviceSampleRate);
+
+  addLatency(STATS_LATENCY_STAGE_SENDER, senderUs);
+  addLatency(STATS_LATENCY_STAGE_NETWORK, networkUs);
+  addLatency(STATS_LATENCY_STAGE_DECODE_RING, decodeRingUs);
+  addLatency(STATS_LATENCY_STAGE_DEVICE, deviceLatencyUs);
+  addLatency(STATS_LATENCY_STAGE_TOTAL, senderUs + networkUs + decodeRingUs + deviceLatencyUs);
+}
+
+// Returns how many frames were lost just before this one, or -1 if this packet is a copy or arrived too late
+static int checkSeq (int seq) {
+  if (lastSeq < 0) {
+    lastSeq = seq;
+    return 0;
+  }
+
+  int seqDiff = (seq - lastSeq) & 0xffff;
+  if (seqDiff == 0 || 65536 - seqDiff <= AUDIO_LATE_SEQ_WINDOW) return -1;
+  lastSeq = seq;
+
+  // a longer gap would more than refill the decode ring, the audio callback handles that as an underrun
+  if (seqDiff - 1 > maxConcealedFrames) return 0;
+  return seqDiff - 1;
+}
+
+// NOTES:
+// - Fills in count lost frames so the decode ring and the resampler keep running through the gap.
+// - Opus: PLC, or in-band FEC from nextBuf for the last lost frame (see opusgroup_decodeLost). Opus smooths the
+//   way back into the next real frame itself.
+// - PCM and lossless: the first lost frame is the last good frame played backwards (so it starts at the same
+//   sample values) fading out to silence, after that silence. The next good frame fades in.
+// - The decoder runs even if enqueue is false (the ring is being let down after an overrun), so Opus keeps its state.
+static void concealFrames (int count, const uint8_t *nextBuf, int nextLen, bool enqueue) {
+  int sampleCount = networkChannelCount * audioFrameSize;
+
+  for (int i = 0; i < count; i++) {
+    if (audioEncoding == AUDIO_ENCODING_OPUS) {
+      bool last = i == count - 1;
+      int result = opusgroup_decodeLost(&opusDecoder, last ? nextBuf : NULL, nextLen, sampleBufFloat);
+      if (result != audioFrameSize) memset(sampleBufFloat, 0, sizeof(float) * sampleCount);
+    } else if (i == 0 && haveLastPcmFrame) {
+      sampleconvert_kernels->s24ToF32(lastPcmFrame, sampleBufFloat, sampleCount);
+      for (int j = 0; j < audioFrameSize / 2; j++) {
+        for (int ch = 0; ch < networkChannelCount; ch++) {
+          float *a = &sampleBufFloat[j * networkChannelCount + ch];
+          float *b = &sampleBufFloat[(audioFrameSize - 1 - j) * networkChannelCount + ch];
+          float tmp = *a;
+          *a = *b;
+          *b = tmp;
+        }
+      }
+      for (int j = 0; j < audioFrameSize; j++) {
+        float gain = 1.0f - (float)j / audioFrameSize;
+        for (int ch = 0; ch < networkChannelCount; ch++) sampleBufFloat[j * networkChannelCount + ch] *= gain;
+      }
+    } else if (i <= 1) {
+      // silence, which stays in sampleBufFloat for the rest of the lost frames
+      memset(sampleBufFloat, 0, sizeof(float) * sampleCount);
+    }
+
+    if (enqueue) syncer_enqueueBufF32(sampleBufFloat, audioFrameSize, networkChannelCount, false);
+  }
+
+  fadeInNext = audioEncoding != AUDIO_ENCODING_OPUS;
+  globals_add1ui(statsCh1Audio, concealedFrameCount, count);
+}
 
 void onDataConfigChannel (const uint8_t *data, int dataLen) {
-  // here we are in the realtime decode thread created by demux_addChannel, one thread per channel
+  // here we are in a realtime demux decode worker, see demux.h
 
   // DEBUG: I'm only allowing one shot at parsing the data. Could it be invalid during block loss?
   // If so, need to add a CRC
@@ -44,54 +158,96 @@ void onDataConfigChannel (const uint8_t *data, int dataLen) {
 }
 
 void onDataAudioChannel (const uint8_t *buf, int len) {
-  // static is OK here because onDataAudioChannel is only called from a single thread
+  // static is OK here because demux never calls onDataAudioChannel concurrently
   static bool overrun = false;
 
-  if (len != encodedPacketSize) return;
+  if (audioEncoding == AUDIO_ENCODING_LOSSLESS) {
+    // lossless packets vary in size, encodedPacketSize is the largest they can be
+    if (len <= AUDIO_PACKET_HEADER_LEN || len > encodedPacketSize) return;
+  } else if (len != encodedPacketSize) {
+    return;
+  }
 
+  int receiveUs = utils_getCurrentUTime();
+  const uint8_t *header = buf;
   int seq = utils_readU16LE(buf);
-  buf += 2;
-  len -= 2;
+  buf += AUDIO_PACKET_HEADER_LEN;
+  len -= AUDIO_PACKET_HEADER_LEN;
+
+  int lostCount = checkSeq(seq);
+  if (lostCount < 0) {
+    globals_add1ui(statsCh1Audio, lateFrameCount, 1);
+    return;
+  }
 
   // update receiver sync
   syncer_onPacket(seq, audioFrameSize);
 
-  int ringCurrentSize = utils_ringSize(&decodeRing);
+  int ringCurrentSize = samplering_size(&decodeRing);
+  // Let the audio callback empty the ring to about half-way before pushing to it again.
+  bool dropping = overrun && ringCurrentSize > decodeRingMaxSize / 2;
   const uint8_t *pcmSamples;
   int result;
 
+  if (lostCount > 0) concealFrames(lostCount, buf, len, !dropping);
+
+  // a frame that doesn't decode is concealed like a lost one
   if (audioEncoding == AUDIO_ENCODING_OPUS) {
-    result = opus_multistream_decode_float(decoder, buf, len, sampleBufFloat, audioFrameSize, 0);
+    result = opusgroup_decode(&opusDecoder, buf, len, sampleBufFloat);
     if (result != audioFrameSize) {
       globals_add1ui(statsCh1AudioOpus, codecErrorCount, 1);
+      concealFrames(1, NULL, 0, !dropping);
       return;
     }
-  } else { // audioEncoding == AUDIO_ENCODING_PCM
+  } else if (audioEncoding == AUDIO_ENCODING_PCM) {
     result = pcm_decode(&pcmDecoder, buf, len, &pcmSamples);
     if (result != networkChannelCount * audioFrameSize) {
       if (result == -3) globals_add1ui(statsCh1AudioPCM, crcFailCount, 1);
+      concealFrames(1, NULL, 0, !dropping);
       return;
     }
-  }
-
-  if (overrun) {
-    // Let the audio callback empty the ring to about half-way before pushing to it again.
-    if (ringCurrentSize > decodeRingMaxSize / 2) {
+  } else { // audioEncoding == AUDIO_ENCODING_LOSSLESS
+    result = lossless_decode(&losslessDecoder, buf, len, &pcmSamples);
+    if (result != networkChannelCount * audioFrameSize) {
+      globals_add1ui(statsCh1AudioLossless, codecErrorCount, 1);
+      concealFrames(1, NULL, 0, !dropping);
       return;
-    } else {
-      overrun = false;
     }
+    globals_set1ff(statsCh1AudioLossless, compressionRatio, (double)len / (3 * networkChannelCount * audioFrameSize));
+  }
+  EVENTRECORDER_TRACE(EVENTRECORDER_ID_AUDIO_DECODE, seq);
+
+  bool fadeIn = fadeInNext;
+  if (audioEncoding != AUDIO_ENCODING_OPUS) {
+    // for concealing the next lost frame
+    memcpy(lastPcmFrame, pcmSamples, 3 * networkChannelCount * audioFrameSize);
+    haveLastPcmFrame = true;
+    fadeInNext = false;
   }
 
+  if (dropping) return;
+  overrun = false;
+
   if (audioEncoding == AUDIO_ENCODING_OPUS) {
     result = syncer_enqueueBufF32(sampleBufFloat, audioFrameSize, networkChannelCount, false);
-  } else { // audioEncoding == AUDIO_ENCODING_PCM
+  } else if (fadeIn) {
+    // first frame after concealed ones, see concealFrames
+    sampleconvert_kernels->s24ToF32(pcmSamples, sampleBufFloat, networkChannelCount * audioFrameSize);
+    for (int j = 0; j < audioFrameSize; j++) {
+      float gain = (float)j / audioFrameSize;
+      for (int ch = 0; ch < networkChannelCount; ch++) sampleBufFloat[j * networkChannelCount + ch] *= gain;
+    }
+    result = syncer_enqueueBufF32(sampleBufFloat, audioFrameSize, networkChannelCount, false);
+  } else { // audioEncoding == AUDIO_ENCODING_PCM or AUDIO_ENCODING_LOSSLESS
     result = syncer_enqueueBufS24Packed(pcmSamples, audioFrameSize, networkChannelCount, false);
   }
+  EVENTRECORDER_TRACE(EVENTRECORDER_ID_SYNCER_ENQUEUE, result);
 
   if (result == -1) {
     globals_add1ui(statsCh1Audio, bufferOverrunCount, 1);
     overrun = true;
+  } else if (result >= 0) {
+    updateLatencyStats(header, receiveUs);
   }
 }
 
@@ -108,22 +264,26 @@ int receiver_waitForConfig (void) {
   networkChannelCount = globals_get1i(audio, networkChannelCount);
   audioEncoding = globals_get1ui(audio, encoding);
 
-  unsigned char mapping[networkChannelCount]; // only for opus but can't put this inside switch case
   switch (audioEncoding) {
     case AUDIO_ENCODING_OPUS:
       audioFrameSize = globals_get1i(opus, frameSize);
-      // CBR + 2 bytes for sequence number
-      encodedPacketSize = globals_get1i(opus, bitrate) * globals_get1i(opus, frameSize) / (8 * AUDIO_OPUS_SAMPLE_RATE) + 2;
-
-      for (int i = 0; i < networkChannelCount; i++) mapping[i] = i;
-      decoder = opus_multistream_decoder_create(AUDIO_OPUS_SAMPLE_RATE, networkChannelCount, networkChannelCount, 0, mapping, &err);
-      if (err < 0) return -2;
+      if (opusgroup_initDecoder(&opusDecoder, networkChannelCount, globals_get1i(opus, groupCount), globals_get1i(opus, bitrate), audioFrameSize) < 0) return -2;
+      // CBR + packet header
+      encodedPacketSize = opusDecoder.dataLen + AUDIO_PACKET_HEADER_LEN;
       break;
 
     case AUDIO_ENCODING_PCM:
       audioFrameSize = globals_get1i(pcm, frameSize);
-      // 24-bit samples + 2 bytes for CRC + 2 bytes for sequence number
-      encodedPacketSize = 3 * networkChannelCount * audioFrameSize + 4;
+      pcm_init(&pcmDecoder, globals_get1i(pcm, crcMode));
+      // 24-bit samples + CRC + packet header
+      encodedPacketSize = 3 * networkChannelCount * audioFrameSize + pcm_getCrcLen(globals_get1i(pcm, crcMode)) + AUDIO_PACKET_HEADER_LEN;
+      break;
+
+    case AUDIO_ENCODING_LOSSLESS:
+      audioFrameSize = globals_get1i(pcm, frameSize);
+      if (lossless_init(&losslessDecoder, networkChannelCount, audioFrameSize) < 0) return -2;
+      // largest possible frame + packet header
+      encodedPacketSize = lossless_getMaxEncodedLen(networkChannelCount, audioFrameSize) + AUDIO_PACKET_HEADER_LEN;
       break;
 
     default:
@@ -135,17 +295,24 @@ int receiver_waitForConfig (void) {
   decodeRingMaxSize = networkChannelCount * decodeRingLength;
   globals_set1i(statsCh1Audio, streamBufferSize, decodeRingLength);
 
-  sampleBufFloat = (float *)malloc(4 * networkChannelCount * audioFrameSize);
+  sampleBufFloat = (float *)rtarena_alloc(4 * networkChannelCount * audioFrameSize);
   if (sampleBufFloat == NULL) return -4;
+  if (audioEncoding != AUDIO_ENCODING_OPUS) {
+    lastPcmFrame = (uint8_t *)rtarena_alloc(3 * networkChannelCount * audioFrameSize);
+    if (lastPcmFrame == NULL) return -4;
+  }
+  maxConcealedFrames = decodeRingLength / 2 / audioFrameSize;
 
-  if (utils_ringInit(&decodeRing, &decodeRingBuf, decodeRingMaxSize) < 0) return -5;
+  if (samplering_init(&decodeRing, decodeRingMaxSize) < 0) return -5;
 
   err = audio_init(true);
   if (err < 0) return err - 5;
+  deviceLatencyUs = 1000000.0 * audio_getDeviceLatency();
+  globals_get1ff(audio, deviceSampleRate, &deviceSampleRate);
 
   // start audio before demux_addChannel so that we don't call syncer_enqueueBuf before
   // audio module has called syncer_init
-  err = audio_start(&decodeRing, decodeRingBuf, decodeRingMaxSize);
+  err = audio_start(&decodeRing, decodeRingMaxSize);
   if (err < 0) return err - 100;
 
   err = demux_addChannel(
@@ -153,6 +320,8 @@ int receiver_waitForConfig (void) {
     globals_get1iv(fec, sourceSymbolsPerBlock, 1),
     globals_get1iv(fec, repairSymbolsPerBlock, 1),
     globals_get1iv(fec, symbolLen, 1),
+    globals_get1iv(fec, pacedSend, 1),
+    globals_get1iv(fec, streamPartialBlocks, 1),
     onDataAudioChannel
   );
   if (err < 0) return -200;
@@ -163,11 +332,16 @@ int receiver_waitForConfig (void) {
 int receiver_init (void) {
   xwait_init(&configWaitHandle);
 
-  int err = demux_addChannel(
+  int err = demux_init(0);
+  if (err < 0) return -1;
+
+  err = demux_addChannel(
     500, // leave plenty of room for ALSA mixer control config
     globals_get1iv(fec, sourceSymbolsPerBlock, 0),
     globals_get1iv(fec, repairSymbolsPerBlock, 0),
     globals_get1iv(fec, symbolLen, 0),
+    globals_get1iv(fec, pacedSend, 0),
+    false, // the config must be complete before it is used
     onDataConfigChannel
   );
   if (err < 0) return -1;
@@ -192,6 +366,8 @@ int receiver_init (void) {
 int receiver_deinit (void) {
   xwait_destroy(&configWaitHandle);
   demux_deinit();
+  // NOTE: after demux_deinit, because the decode workers call onDataAudioChannel
+  if (audioEncoding == AUDIO_ENCODING_OPUS) opusgroup_deinit(&opusDecoder);
   if (receivedConfigData != NULL) free(receivedConfigData);
   return audio_deinit();
 }
@@ -0,0 +1,128 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#if defined(__linux__) || defined(__ANDROID__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "rt-arena.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static uint8_t *base = NULL;
+static size_t arenaSize = 0, used = 0, mallocBytes = 0;
+static bool locked = false;
+static bool warnedFull = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool inArena (const void *ptr) {
+  return base != NULL && (const uint8_t *)ptr >= base && (const uint8_t *)ptr < base + arenaSize;
+}
+
+int rtarena_init (int sizeMb) {
+  if (sizeMb <= 0) sizeMb = RTARENA_DEFAULT_SIZE_MB;
+  size_t size = (size_t)sizeMb * 1024 * 1024;
+  const char *pages = "normal pages";
+
+#if defined(__linux__) || defined(__ANDROID__)
+  // explicit huge pages only work if some have been reserved (vm.nr_hugepages), so this often fails
+  size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    pages = "huge pages";
+  } else {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+    if (madvise(mem, size, MADV_HUGEPAGE) == 0) pages = "transparent huge pages";
+  }
+#else
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (mem == MAP_FAILED) return -1;
+#endif
+
+  // fault every page in now, in case MAP_POPULATE was not enough (or not available)
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (pageSize <= 0) pageSize = 4096;
+  for (size_t i = 0; i < size; i += pageSize) ((volatile uint8_t *)mem)[i] = 0;
+
+  // needs RLIMIT_MEMLOCK to be at least size, or CAP_IPC_LOCK
+  locked = mlock(mem, size) == 0;
+  int lockErrno = errno;
+
+  pthread_mutex_lock(&lock);
+  base = (uint8_t *)mem;
+  arenaSize = size;
+  used = 0;
+  pthread_mutex_unlock(&lock);
+
+  if (locked) {
+    printf("RT arena: %zu MB, %s, locked\n", size / (1024 * 1024), pages);
+  } else {
+    printf("RT arena: %zu MB, %s, NOT locked (mlock: %s), raise the memlock limit to fix this\n", size / (1024 * 1024), pages, strerror(lockErrno));
+  }
+  return 0;
+}
+
+void rtarena_deinit (void) {
+  pthread_mutex_lock(&lock);
+  if (base != NULL) {
+    if (locked) munlock(base, arenaSize);
+    munmap(base, arenaSize);
+  }
+  base = NULL;
+  arenaSize = 0;
+  used = 0;
+  locked = false;
+  pthread_mutex_unlock(&lock);
+}
+
+void *rtarena_alloc (size_t size) {
+  if (size == 0) size = 1;
+
+  pthread_mutex_lock(&lock);
+  size_t start = (used + RTARENA_ALIGN - 1) & ~(size_t)(RTARENA_ALIGN - 1);
+  if (base != NULL && start <= arenaSize && size <= arenaSize - start) {
+    used = start + size;
+    void *ptr = &base[start];
+    pthread_mutex_unlock(&lock);
+    // the arena is zeroed when it is mapped, but not after rtarena_deinit and rtarena_init
+    memset(ptr, 0, size);
+    return ptr;
+  }
+
+  bool warn = base != NULL && !warnedFull;
+  if (warn) warnedFull = true;
+  mallocBytes += size;
+  pthread_mutex_unlock(&lock);
+
+  if (warn) printf("RT arena full, falling back to malloc for %zu bytes. Increase rtArenaSize.\n", size);
+
+  void *ptr = NULL;
+  if (posix_memalign(&ptr, RTARENA_ALIGN, size) != 0) return NULL;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void rtarena_free (void *ptr) {
+  if (ptr == NULL || inArena(ptr)) return;
+  free(ptr);
+}
+
+void rtarena_printUsage (void) {
+  pthread_mutex_lock(&lock);
+  printf("RT arena: %zu of %zu KB used", used / 1024, arenaSize / 1024);
+  if (mallocBytes > 0) printf(", %zu KB outside the arena", mallocBytes / 1024);
+  printf("\n");
+  pthread_mutex_unlock(&lock);
+}
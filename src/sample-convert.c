@@ -0,0 +1,378 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "sample-convert.h"
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define W_SAMPLECONVERT_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define W_SAMPLECONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+// the largest float below 2^31, see NOTES in sample-convert.h
+#define S32_MAX_FLOAT 2147483520.0f
+
+////////////////////////////////////////////////////////////////////////////////
+// scalar
+////////////////////////////////////////////////////////////////////////////////
+
+static void scalarS16ToF32 (const int16_t *in, float *out, int count) {
+  for (int i = 0; i < count; i++) {
+    float sample = in[i];
+    out[i] = sample * (sample > 0.0f ? 1.0f/32767.0f : 1.0f/32768.0f);
+  }
+}
+
+static void scalarS24ToF32 (const uint8_t *in, float *out, int count) {
+  for (int i = 0; i < count; i++) {
+    int32_t sampleInt = 0;
+    // Leave the least significant byte of sampleInt empty and then shift back into it to sign extend.
+    memcpy((uint8_t *)&sampleInt + 1, &in[3*i], 3);
+    sampleInt >>= 8;
+    float sample = sampleInt;
+    out[i] = sample * (sample > 0.0f ? 1.0f/8388607.0f : 1.0f/8388608.0f);
+  }
+}
+
+static void scalarS32ToF32 (const int32_t *in, float *out, int count) {
+  for (int i = 0; i < count; i++) {
+    float sample = in[i];
+    out[i] = sample * (sample > 0.0f ? 1.0f/2147483647.0f : 1.0f/2147483648.0f);
+  }
+}
+
+static void scalarF32ToS32 (const float *in, int32_t *out, int count) {
+  for (int i = 0; i < count; i++) {
+    float sample = in[i];
+    if (sample < -1.0f) sample = -1.0f;
+    else if (sample > 1.0f) sample = 1.0f;
+    sample *= sample > 0.0f ? 2147483647.0f : 2147483648.0f;
+    if (sample > S32_MAX_FLOAT) sample = S32_MAX_FLOAT;
+    out[i] = sample;
+  }
+}
+
+static void scalarF32ToS24 (const float *in, uint8_t *out, int count) {
+  for (int i = 0; i < count; i++) {
+    float sample = in[i];
+    if (sample < -1.0f) sample = -1.0f;
+    else if (sample > 1.0f) sample = 1.0f;
+    int32_t sampleInt = sample * (sample > 0.0f ? 8388607.0f : 8388608.0f);
+    memcpy(&out[3*i], &sampleInt, 3);
+  }
+}
+
+static const sampleconvert_kernels_t scalarKernels = {
+  "scalar",
+  scalarS16ToF32,
+  scalarS24ToF32,
+  scalarS32ToF32,
+  scalarF32ToS32,
+  scalarF32ToS24
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2 and AVX2 (x64)
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef W_SAMPLECONVERT_X86
+
+// x > 0 ? x * pos : x * neg
+static inline __m128 sse2ScaleSigned (__m128 x, __m128 pos, __m128 neg) {
+  __m128 mask = _mm_cmpgt_ps(x, _mm_setzero_ps());
+  return _mm_mul_ps(x, _mm_or_ps(_mm_and_ps(mask, pos), _mm_andnot_ps(mask, neg)));
+}
+
+static inline __m128 sse2Clamp (__m128 x) {
+  return _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+}
+
+static void sse2S16ToF32 (const int16_t *in, float *out, int count) {
+  const __m128 pos = _mm_set1_ps(1.0f/32767.0f), neg = _mm_set1_ps(1.0f/32768.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&in[i]);
+    // sign extend by unpacking into the high half of each 32-bit lane then shifting back down
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(&out[i], sse2ScaleSigned(_mm_cvtepi32_ps(lo), pos, neg));
+    _mm_storeu_ps(&out[i + 4], sse2ScaleSigned(_mm_cvtepi32_ps(hi), pos, neg));
+  }
+  scalarS16ToF32(&in[i], &out[i], count - i);
+}
+
+static void sse2S24ToF32 (const uint8_t *in, float *out, int count) {
+  const __m128 pos = _mm_set1_ps(1.0f/8388607.0f), neg = _mm_set1_ps(1.0f/8388608.0f);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // no byte shuffle in SSE2, so assemble the lanes with scalar loads and do the rest in SIMD
+    int32_t x[4];
+    for (int k = 0; k < 4; k++) {
+      x[k] = 0;
+      memcpy((uint8_t *)&x[k] + 1, &in[3*(i + k)], 3);
+    }
+    __m128i v = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)x), 8);
+    _mm_storeu_ps(&out[i], sse2ScaleSigned(_mm_cvtepi32_ps(v), pos, neg));
+  }
+  scalarS24ToF32(&in[3*i], &out[i], count - i);
+}
+
+static void sse2S32ToF32 (const int32_t *in, float *out, int count) {
+  const __m128 pos = _mm_set1_ps(1.0f/2147483647.0f), neg = _mm_set1_ps(1.0f/2147483648.0f);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&in[i]));
+    _mm_storeu_ps(&out[i], sse2ScaleSigned(x, pos, neg));
+  }
+  scalarS32ToF32(&in[i], &out[i], count - i);
+}
+
+static void sse2F32ToS32 (const float *in, int32_t *out, int count) {
+  const __m128 pos = _mm_set1_ps(2147483647.0f), neg = _mm_set1_ps(2147483648.0f);
+  const __m128 max = _mm_set1_ps(S32_MAX_FLOAT);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_min_ps(sse2ScaleSigned(sse2Clamp(_mm_loadu_ps(&in[i])), pos, neg), max);
+    _mm_storeu_si128((__m128i *)&out[i], _mm_cvttps_epi32(x));
+  }
+  scalarF32ToS32(&in[i], &out[i], count - i);
+}
+
+static void sse2F32ToS24 (const float *in, uint8_t *out, int count) {
+  const __m128 pos = _mm_set1_ps(8388607.0f), neg = _mm_set1_ps(8388608.0f);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int32_t x[4];
+    __m128 v = sse2ScaleSigned(sse2Clamp(_mm_loadu_ps(&in[i])), pos, neg);
+    _mm_storeu_si128((__m128i *)x, _mm_cvttps_epi32(v));
+    for (int k = 0; k < 4; k++) memcpy(&out[3*(i + k)], &x[k], 3);
+  }
+  scalarF32ToS24(&in[i], &out[3*i], count - i);
+}
+
+static const sampleconvert_kernels_t sse2Kernels = {
+  "sse2",
+  sse2S16ToF32,
+  sse2S24ToF32,
+  sse2S32ToF32,
+  sse2F32ToS32,
+  sse2F32ToS24
+};
+
+#define AVX2_FN __attribute__ ((target ("avx2")))
+
+AVX2_FN static inline __m256 avx2ScaleSigned (__m256 x, __m256 pos, __m256 neg) {
+  return _mm256_mul_ps(x, _mm256_blendv_ps(neg, pos, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ)));
+}
+
+AVX2_FN static inline __m256 avx2Clamp (__m256 x) {
+  return _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+}
+
+AVX2_FN static void avx2S16ToF32 (const int16_t *in, float *out, int count) {
+  const __m256 pos = _mm256_set1_ps(1.0f/32767.0f), neg = _mm256_set1_ps(1.0f/32768.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&in[i]));
+    _mm256_storeu_ps(&out[i], avx2ScaleSigned(_mm256_cvtepi32_ps(x), pos, neg));
+  }
+  scalarS16ToF32(&in[i], &out[i], count - i);
+}
+
+AVX2_FN static void avx2S24ToF32 (const uint8_t *in, float *out, int count) {
+  const __m256 pos = _mm256_set1_ps(1.0f/8388607.0f), neg = _mm256_set1_ps(1.0f/8388608.0f);
+  // move each 3 byte sample into the top 3 bytes of a 32-bit lane, then shift right to sign extend
+  const __m128i shuffle = _mm_setr_epi8(-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11);
+  int i = 0;
+  // each 16 byte load reads 4 bytes past the 4 samples it uses, so stop early enough to stay inside in
+  for (; i + 10 <= count; i += 8) {
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&in[3*i]), shuffle);
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&in[3*i + 12]), shuffle);
+    __m256i x = _mm256_srai_epi32(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), 8);
+    _mm256_storeu_ps(&out[i], avx2ScaleSigned(_mm256_cvtepi32_ps(x), pos, neg));
+  }
+  scalarS24ToF32(&in[3*i], &out[i], count - i);
+}
+
+AVX2_FN static void avx2S32ToF32 (const int32_t *in, float *out, int count) {
+  const __m256 pos = _mm256_set1_ps(1.0f/2147483647.0f), neg = _mm256_set1_ps(1.0f/2147483648.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)&in[i]));
+    _mm256_storeu_ps(&out[i], avx2ScaleSigned(x, pos, neg));
+  }
+  scalarS32ToF32(&in[i], &out[i], count - i);
+}
+
+AVX2_FN static void avx2F32ToS32 (const float *in, int32_t *out, int count) {
+  const __m256 pos = _mm256_set1_ps(2147483647.0f), neg = _mm256_set1_ps(2147483648.0f);
+  const __m256 max = _mm256_set1_ps(S32_MAX_FLOAT);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_min_ps(avx2ScaleSigned(avx2Clamp(_mm256_loadu_ps(&in[i])), pos, neg), max);
+    _mm256_storeu_si256((__m256i *)&out[i], _mm256_cvttps_epi32(x));
+  }
+  scalarF32ToS32(&in[i], &out[i], count - i);
+}
+
+AVX2_FN static void avx2F32ToS24 (const float *in, uint8_t *out, int count) {
+  const __m256 pos = _mm256_set1_ps(8388607.0f), neg = _mm256_set1_ps(8388608.0f);
+  // pack the low 3 bytes of each 32-bit lane into the first 12 bytes
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128);
+  int i = 0;
+  // each 16 byte store writes 4 bytes of zeros past its 4 samples, which are overwritten by the next store
+  for (; i + 10 <= count; i += 8) {
+    __m256i x = _mm256_cvttps_epi32(avx2ScaleSigned(avx2Clamp(_mm256_loadu_ps(&in[i])), pos, neg));
+    _mm_storeu_si128((__m128i *)&out[3*i], _mm_shuffle_epi8(_mm256_castsi256_si128(x), shuffle));
+    _mm_storeu_si128((__m128i *)&out[3*i + 12], _mm_shuffle_epi8(_mm256_extracti128_si256(x, 1), shuffle));
+  }
+  scalarF32ToS24(&in[i], &out[3*i], count - i);
+}
+
+static const sampleconvert_kernels_t avx2Kernels = {
+  "avx2",
+  avx2S16ToF32,
+  avx2S24ToF32,
+  avx2S32ToF32,
+  avx2F32ToS32,
+  avx2F32ToS24
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// NEON (Raspberry Pi, Android)
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef W_SAMPLECONVERT_NEON
+
+// x > 0 ? x * pos : x * neg
+static inline float32x4_t neonScaleSigned (float32x4_t x, float32x4_t pos, float32x4_t neg) {
+  return vmulq_f32(x, vbslq_f32(vcgtq_f32(x, vdupq_n_f32(0.0f)), pos, neg));
+}
+
+static inline float32x4_t neonClamp (float32x4_t x) {
+  return vminq_f32(vmaxq_f32(x, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+}
+
+static void neonS16ToF32 (const int16_t *in, float *out, int count) {
+  const float32x4_t pos = vdupq_n_f32(1.0f/32767.0f), neg = vdupq_n_f32(1.0f/32768.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t x = vld1q_s16(&in[i]);
+    vst1q_f32(&out[i], neonScaleSigned(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), pos, neg));
+    vst1q_f32(&out[i + 4], neonScaleSigned(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), pos, neg));
+  }
+  scalarS16ToF32(&in[i], &out[i], count - i);
+}
+
+static inline int32x4_t neonS24ToS32 (uint16x4_t low16, uint16x4_t high8) {
+  uint32x4_t x = vorrq_u32(vmovl_u16(low16), vshlq_n_u32(vmovl_u16(high8), 16));
+  // sign extend from 24 bits
+  return vshrq_n_s32(vshlq_n_s32(vreinterpretq_s32_u32(x), 8), 8);
+}
+
+static void neonS24ToF32 (const uint8_t *in, float *out, int count) {
+  const float32x4_t pos = vdupq_n_f32(1.0f/8388607.0f), neg = vdupq_n_f32(1.0f/8388608.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    // vld3 deinterleaves the 3 bytes of each sample into separate registers
+    uint8x8x3_t b = vld3_u8(&in[3*i]);
+    uint16x8_t low16 = vorrq_u16(vmovl_u8(b.val[0]), vshll_n_u8(b.val[1], 8));
+    uint16x8_t high8 = vmovl_u8(b.val[2]);
+    int32x4_t lo = neonS24ToS32(vget_low_u16(low16), vget_low_u16(high8));
+    int32x4_t hi = neonS24ToS32(vget_high_u16(low16), vget_high_u16(high8));
+    vst1q_f32(&out[i], neonScaleSigned(vcvtq_f32_s32(lo), pos, neg));
+    vst1q_f32(&out[i + 4], neonScaleSigned(vcvtq_f32_s32(hi), pos, neg));
+  }
+  scalarS24ToF32(&in[3*i], &out[i], count - i);
+}
+
+static void neonS32ToF32 (const int32_t *in, float *out, int count) {
+  const float32x4_t pos = vdupq_n_f32(1.0f/2147483647.0f), neg = vdupq_n_f32(1.0f/2147483648.0f);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    vst1q_f32(&out[i], neonScaleSigned(vcvtq_f32_s32(vld1q_s32(&in[i])), pos, neg));
+  }
+  scalarS32ToF32(&in[i], &out[i], count - i);
+}
+
+static void neonF32ToS32 (const float *in, int32_t *out, int count) {
+  const float32x4_t pos = vdupq_n_f32(2147483647.0f), neg = vdupq_n_f32(2147483648.0f);
+  const float32x4_t max = vdupq_n_f32(S32_MAX_FLOAT);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t x = vminq_f32(neonScaleSigned(neonClamp(vld1q_f32(&in[i])), pos, neg), max);
+    vst1q_s32(&out[i], vcvtq_s32_f32(x));
+  }
+  scalarF32ToS32(&in[i], &out[i], count - i);
+}
+
+static void neonF32ToS24 (const float *in, uint8_t *out, int count) {
+  const float32x4_t pos = vdupq_n_f32(8388607.0f), neg = vdupq_n_f32(8388608.0f);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int32_t x[4];
+    vst1q_s32(x, vcvtq_s32_f32(neonScaleSigned(neonClamp(vld1q_f32(&in[i])), pos, neg)));
+    for (int k = 0; k < 4; k++) memcpy(&out[3*(i + k)], &x[k], 3);
+  }
+  scalarF32ToS24(&in[i], &out[3*i], count - i);
+}
+
+static const sampleconvert_kernels_t neonKernels = {
+  "neon",
+  neonS16ToF32,
+  neonS24ToF32,
+  neonS32ToF32,
+  neonF32ToS32,
+  neonF32ToS24
+};
+
+#endif
+
+/////////////////////
+// public
+/////////////////////
+
+const sampleconvert_kernels_t *sampleconvert_kernels = &scalarKernels;
+
+const sampleconvert_kernels_t *sampleconvert_getKernels (int impl) {
+  switch (impl) {
+    case SAMPLECONVERT_IMPL_SCALAR:
+      return &scalarKernels;
+
+    #ifdef W_SAMPLECONVERT_X86
+    case SAMPLECONVERT_IMPL_SSE2:
+      return &sse2Kernels; // always available on x86_64
+    case SAMPLECONVERT_IMPL_AVX2:
+      return __builtin_cpu_supports("avx2") ? &avx2Kernels : NULL;
+    #endif
+
+    #ifdef W_SAMPLECONVERT_NEON
+    case SAMPLECONVERT_IMPL_NEON:
+      return &neonKernels; // NEON is a compile time choice on ARM
+    #endif
+
+    default:
+      return NULL;
+  }
+}
+
+void sampleconvert_init (void) {
+  // most preferred first
+  const int impls[] = { SAMPLECONVERT_IMPL_AVX2, SAMPLECONVERT_IMPL_NEON, SAMPLECONVERT_IMPL_SSE2, SAMPLECONVERT_IMPL_SCALAR };
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    const sampleconvert_kernels_t *kernels = sampleconvert_getKernels(impls[i]);
+    if (kernels != NULL) {
+      sampleconvert_kernels = kernels;
+      return;
+    }
+  }
+}
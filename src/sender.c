@@ -3,25 +3,26 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
+#include "xwait.h"
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
-#include <time.h>
 #include "utils.h"
-#include "opus/opus_multistream.h"
 #include "globals.h"
+#include "rt-arena.h"
 #include "endpoint.h"
 #include "mux.h"
+#include "opus-group.h"
 #include "pcm.h"
+#include "lossless.h"
 #include "audio.h"
 #include "config.h"
 #include "sender.h"
 
-static ck_ring_t encodeRing;
-static ck_ring_buffer_t *encodeRingBuf;
+static samplering_t encodeRing;
 static int targetEncodeRingSize, encodeRingMaxSize;
 static int audioFrameSize;
 static int encodedPacketSize;
@@ -30,73 +31,49 @@ static uint8_t *receiverConfigBuf = NULL;
 static int receiverConfigBufLen = 0;
 
 static atomic_bool threadsRunning;
+static xwait_t encodeRingWait; // notified by the audio callback when encodeRing has at least one frame
 static pthread_t audioLoopThread, configLoopThread;
-static OpusMSEncoder *opusEncoder = NULL;
+static opusgroup_t opusEncoder;
 static pcm_codec_t pcmEncoder = { 0 };
-float *sampleBufFloat; // For Opus
-double *sampleBufDouble; // For PCM
+static lossless_codec_t losslessEncoder = { 0 };
+samplering_sample_t *sampleBufRing; // samples straight out of encodeRing
+float *sampleBufFloat;
 uint8_t *audioEncodedBuf;
 
-static int initOpusEncoder (OpusMSEncoder **encoder) {
-  const int networkChannelCount = globals_get1i(audio, networkChannelCount);
-  unsigned char mapping[networkChannelCount];
-  for (int i = 0; i < networkChannelCount; i++) mapping[i] = i;
-
-  int err1, err2;
-  *encoder = opus_multistream_encoder_create(AUDIO_OPUS_SAMPLE_RATE, networkChannelCount, networkChannelCount, 0, mapping, OPUS_APPLICATION_AUDIO, &err1);
-  if (err1 < 0) {
-    printf("Error: opus_multistream_encoder_create failed: %s\n", opus_strerror(err1));
-    return -1;
-  }
-
-  err1 = opus_multistream_encoder_ctl(*encoder, OPUS_SET_BITRATE(globals_get1i(opus, bitrate)));
-  err2 = opus_multistream_encoder_ctl(*encoder, OPUS_SET_VBR(0));
-  if (err1 < 0 || err2 < 0) {
-    printf("Error: opus_multistream_encoder_ctl failed\n");
-    return -2;
-  }
-
-  return 0;
-}
-
 static int initAudioLoop (void) {
   const int networkChannelCount = globals_get1i(audio, networkChannelCount);
   const unsigned int audioEncoding = globals_get1ui(audio, encoding);
 
-  sampleBufFloat = (float*)malloc(4 * networkChannelCount * audioFrameSize); // For Opus
-  sampleBufDouble = (double*)malloc(8 * networkChannelCount * audioFrameSize); // For PCM
-  audioEncodedBuf = (uint8_t*)malloc(encodedPacketSize);
+  sampleBufRing = (samplering_sample_t*)rtarena_alloc(sizeof(samplering_sample_t) * networkChannelCount * audioFrameSize);
+  sampleBufFloat = (float*)rtarena_alloc(4 * networkChannelCount * audioFrameSize);
+  audioEncodedBuf = (uint8_t*)rtarena_alloc(encodedPacketSize);
 
-  if (sampleBufFloat == NULL || sampleBufDouble == NULL || audioEncodedBuf == NULL) return -1;
-  if (audioEncoding == AUDIO_ENCODING_OPUS && initOpusEncoder(&opusEncoder) < 0) return -2;
+  if (sampleBufRing == NULL || sampleBufFloat == NULL || audioEncodedBuf == NULL) return -1;
+  if (audioEncoding == AUDIO_ENCODING_OPUS && opusgroup_initEncoder(&opusEncoder, networkChannelCount, globals_get1i(opus, groupCount), globals_get1i(opus, bitrate), audioFrameSize) < 0) return -2;
+  if (audioEncoding == AUDIO_ENCODING_OPUS && opusgroup_setInbandFec(&opusEncoder, globals_get1i(opus, inbandFecLossPerc)) < 0) return -4;
+  if (audioEncoding == AUDIO_ENCODING_LOSSLESS && lossless_init(&losslessEncoder, networkChannelCount, audioFrameSize) < 0) return -3;
 
   return 0;
 }
 
 static void *startAudioLoop (UNUSED void *arg) {
   const int networkChannelCount = globals_get1i(audio, networkChannelCount);
-  const double networkSampleRate = globals_get1i(audio, networkSampleRate); // Hz
   const unsigned int audioEncoding = globals_get1ui(audio, encoding);
+  const double networkSampleRate = globals_get1i(audio, networkSampleRate);
+  const int deviceLatencyUs = 1000000.0 * audio_getDeviceLatency();
   uint16_t audioPacketSeq = 0;
 
-  // Sleep for 30% of our desired interval time to make sure encodeRingSize doesn't get too full despite OS jitter.
-  double targetSizeNs = 300000000.0 * targetEncodeRingSize / (double)(networkChannelCount * networkSampleRate);
-  struct timespec loopSleep;
-  loopSleep.tv_nsec = targetSizeNs;
-  loopSleep.tv_sec = 0;
-
-  // pin each channel encode thread to a different core, leaving core 0 for other stuff (Linux only)
-  // DEBUG: check the CPU core count before calling this
-  utils_setCallerThreadRealtime(98, 2);
+  // by default on core 2, away from the network and mux packet threads on core 0 (Linux only)
+  utils_setCallerThreadRole(THREAD_ROLE_ENCODE, 0, 98, 2);
 
   while (threadsRunning) {
-    int encodeRingSize = utils_ringSize(&encodeRing);
+    int encodeRingSize = samplering_size(&encodeRing);
     int encodeRingSizeFrames = encodeRingSize / networkChannelCount;
     globals_add1uiv(statsCh1Audio, streamMeterBins, STATS_STREAM_METER_BINS * encodeRingSize / encodeRingMaxSize, 1);
 
-    // TODO: do xwait_notify from audio thread instead of nanosleeping here; I'm pretty sure xwait_notify doesn't do a syscall
     if (encodeRingSizeFrames < audioFrameSize) {
-      nanosleep(&loopSleep, NULL);
+      // the audio callback notifies once there is at least a frame in encodeRing
+      xwait_wait(&encodeRingWait);
       continue;
     }
 
@@ -105,31 +82,47 @@ static void *startAudioLoop (UNUSED void *arg) {
       globals_add1ui(statsCh1Audio, encodeThreadJitterCount, 1);
     }
 
+    // The oldest frame in encodeRing was captured about this long ago, plus the capture buffer
+    int captureUs = utils_getCurrentUTime();
+    int senderUs = deviceLatencyUs + (int)(1000000.0 * encodeRingSizeFrames / networkSampleRate);
+
+    // one bulk copy out of the ring per frame, encodeRingSizeFrames is checked above
+    samplering_read(&encodeRing, sampleBufRing, networkChannelCount * audioFrameSize);
     for (int i = 0; i < networkChannelCount * audioFrameSize; i++) {
-      sampleBufDouble[i] = utils_ringDequeueSample(&encodeRing, encodeRingBuf);
-      sampleBufFloat[i] = sampleBufDouble[i];
+      sampleBufFloat[i] = sampleBufRing[i];
     }
 
-    // Write sequence number to audioEncodedBuf
+    // Write sequence number to audioEncodedBuf, the rest of the header is written after encoding
     utils_writeU16LE(audioEncodedBuf, audioPacketSeq++);
 
+    uint8_t *payload = &audioEncodedBuf[AUDIO_PACKET_HEADER_LEN];
     int encodedLen = 0;
     switch (audioEncoding) {
       case AUDIO_ENCODING_OPUS:
-        encodedLen = opus_multistream_encode_float(opusEncoder, sampleBufFloat, audioFrameSize, &audioEncodedBuf[2], encodedPacketSize - 2);
-        if (encodedLen < 0 || encodedLen != encodedPacketSize - 2) {
+        encodedLen = opusgroup_encode(&opusEncoder, sampleBufFloat, payload);
+        if (encodedLen < 0 || encodedLen != encodedPacketSize - AUDIO_PACKET_HEADER_LEN) {
           globals_add1ui(statsCh1AudioOpus, codecErrorCount, 1);
           continue;
         }
         break;
 
       case AUDIO_ENCODING_PCM:
-        encodedLen = pcm_encode(&pcmEncoder, sampleBufDouble, networkChannelCount * audioFrameSize, &audioEncodedBuf[2]);
+        encodedLen = pcm_encode(&pcmEncoder, sampleBufFloat, networkChannelCount * audioFrameSize, payload);
+        break;
+
+      case AUDIO_ENCODING_LOSSLESS:
+        encodedLen = lossless_encode(&losslessEncoder, sampleBufFloat, payload);
+        globals_set1ff(statsCh1AudioLossless, compressionRatio, (double)encodedLen / (3 * networkChannelCount * audioFrameSize));
         break;
     }
 
+    int sendUs = utils_getCurrentUTime();
+    senderUs += utils_getElapsedUTime(captureUs);
+    utils_writeU16LE(&audioEncodedBuf[2], senderUs > 65535 ? 65535 : senderUs);
+    utils_writeU32LE(&audioEncodedBuf[4], (uint32_t)sendUs);
+
     // TODO: do something if mux_writeData returns error
-    /*int err = */mux_writeData(chIdAudio, audioEncodedBuf, encodedLen + 2);
+    /*int err = */mux_writeData(chIdAudio, audioEncodedBuf, encodedLen + AUDIO_PACKET_HEADER_LEN);
   }
 
   return NULL;
@@ -156,20 +149,26 @@ int sender_init (void) {
   switch (audioEncoding) {
     case AUDIO_ENCODING_OPUS:
       audioFrameSize = globals_get1i(opus, frameSize);
-      // CBR + 2 bytes for sequence number
-      encodedPacketSize = globals_get1i(opus, bitrate) * globals_get1i(opus, frameSize) / (8 * AUDIO_OPUS_SAMPLE_RATE) + 2;
+      // CBR + packet header
+      encodedPacketSize = opusgroup_getDataLen(networkChannelCount, globals_get1i(opus, groupCount), globals_get1i(opus, bitrate), audioFrameSize) + AUDIO_PACKET_HEADER_LEN;
       break;
     case AUDIO_ENCODING_PCM:
       audioFrameSize = globals_get1i(pcm, frameSize);
-      // 24-bit samples + 2 bytes for CRC + 2 bytes for sequence number
-      encodedPacketSize = 3 * networkChannelCount * audioFrameSize + 4;
+      pcm_init(&pcmEncoder, globals_get1i(pcm, crcMode));
+      // 24-bit samples + CRC + packet header
+      encodedPacketSize = 3 * networkChannelCount * audioFrameSize + pcm_getCrcLen(globals_get1i(pcm, crcMode)) + AUDIO_PACKET_HEADER_LEN;
+      break;
+    case AUDIO_ENCODING_LOSSLESS:
+      audioFrameSize = globals_get1i(pcm, frameSize);
+      // largest possible frame + packet header, most frames are much smaller
+      encodedPacketSize = lossless_getMaxEncodedLen(networkChannelCount, audioFrameSize) + AUDIO_PACKET_HEADER_LEN;
       break;
     default:
       printf("Error: Audio encoding %d not implemented.\n", audioEncoding);
       return -1;
   }
 
-  if (mux_init(endpoint_send) < 0) return -2;
+  if (mux_init(endpoint_send, endpoint_flush, ENDPOINT_SEND_HEADROOM) < 0) return -2;
 
   receiverConfigBufLen = config_encodeReceiverConfig(&receiverConfigBuf);
   if (receiverConfigBufLen < 0) return receiverConfigBufLen - 2;
@@ -178,7 +177,8 @@ int sender_init (void) {
     receiverConfigBufLen,
     globals_get1iv(fec, sourceSymbolsPerBlock, 0),
     globals_get1iv(fec, repairSymbolsPerBlock, 0),
-    globals_get1iv(fec, symbolLen, 0)
+    globals_get1iv(fec, symbolLen, 0),
+    globals_get1iv(fec, pacedSend, 0)
   );
   if (chId < 0) return -5;
   chIdConfig = chId;
@@ -187,7 +187,8 @@ int sender_init (void) {
     encodedPacketSize,
     globals_get1iv(fec, sourceSymbolsPerBlock, 1),
     globals_get1iv(fec, repairSymbolsPerBlock, 1),
-    globals_get1iv(fec, symbolLen, 1)
+    globals_get1iv(fec, symbolLen, 1),
+    globals_get1iv(fec, pacedSend, 1)
   );
   if (chId < 0) return -6;
   chIdAudio = chId;
@@ -224,18 +225,21 @@ int sender_init (void) {
   }
   targetEncodeRingSize *= networkChannelCount;
 
-  // encodeRingMaxSize is the maximum number of double values that can be stored in encodeRing, with
-  // networkChannelCount values per frame.
+  // encodeRingMaxSize is the maximum number of samples that can be stored in encodeRing, with
+  // networkChannelCount samples per frame.
   // In theory the encode thread should loop often enough that the encodeRing never gets much larger than
   // targetEncodeRingSize, but we multiply by 4 to allow plenty of room in encodeRing
-  // for timing jitter caused by the operating system's scheduler. Also ck requires a power of two size.
+  // for timing jitter caused by the operating system's scheduler. Also samplering requires a power of two size.
   encodeRingMaxSize = utils_roundUpPowerOfTwo(4 * targetEncodeRingSize);
   globals_set1i(statsCh1Audio, streamBufferSize, encodeRingMaxSize / networkChannelCount);
 
-  err = utils_ringInit(&encodeRing, &encodeRingBuf, encodeRingMaxSize);
+  err = samplering_init(&encodeRing, encodeRingMaxSize);
   if (err < 0) return err - 23;
 
-  err = audio_start(&encodeRing, encodeRingBuf, encodeRingMaxSize);
+  xwait_init(&encodeRingWait);
+  audio_setRingNotify(&encodeRingWait, networkChannelCount * audioFrameSize);
+
+  err = audio_start(&encodeRing, encodeRingMaxSize);
   if (err < 0) return err - 24;
 
   err = initAudioLoop();
@@ -250,8 +254,12 @@ int sender_init (void) {
 
 int sender_deinit (void) {
   threadsRunning = false;
+  xwait_notify(&encodeRingWait);
   pthread_join(audioLoopThread, NULL);
+  xwait_destroy(&encodeRingWait);
   pthread_join(configLoopThread, NULL);
+  // the audio loop was the only user of the encoder, stop its group threads before rtarena_deinit
+  if (globals_get1ui(audio, encoding) == AUDIO_ENCODING_OPUS) opusgroup_deinit(&opusEncoder);
   mux_deinit();
   return audio_deinit();
 }
@@ -5,16 +5,21 @@
 
 #include <string.h>
 #include "globals.h"
+#include "rt-arena.h"
 #include "utils.h"
+#include "sample-convert.h"
+#include "audio-meter.h"
 #include "syncer.h"
 
 enum InBufTypeEnum { S16, S24, S32, F32 };
 
-static ck_ring_t *_ring;
-static ck_ring_buffer_t *_ringBuf;
+static samplering_t *_ring;
 static int networkChannelCount;
 static double **inBufsDouble;
+static float *inBufFloat; // interleaved, after format conversion
+static int inBufFloatLen;
 static int _fullRingSize;
+static int resamplerMode;
 
 /////////////////////
 // private
@@ -22,73 +27,110 @@ static int _fullRingSize;
 
 int _syncer_enqueueSamples (double **samples, int frameCount, bool setStats) {
   // Don't ever let the ring fill completely, that way the channels stay in order
-  if ((int)utils_ringSize(_ring) + networkChannelCount*frameCount > _fullRingSize) return -1;
-
-  for (int i = 0; i < frameCount; i++) {
-    for (int j = 0; j < networkChannelCount; j++) {
-      // NOTE: Sometimes the resampler pushes things a little bit outside of (-1.0, 1.0).
-      // If that happens, it will show on the stats.
-      if (setStats) utils_setAudioStats(samples[j][i], j);
-      utils_ringEnqueueSample(_ring, _ringBuf, samples[j][i]);
+  int sampleCount = networkChannelCount * frameCount;
+  if ((int)samplering_size(_ring) + sampleCount > _fullRingSize) return -1;
+
+  samplering_span_t span;
+  if (samplering_writeSpan(_ring, sampleCount, &span) < 0) return -1;
+
+  // NOTE: Sometimes the resampler pushes things a little bit outside of (-1.0, 1.0).
+  // If that happens, it will show on the stats.
+  if (setStats) audiometer_meterPlanar(samples, frameCount, networkChannelCount);
+
+  // interleave the channels into the span, which may wrap around the end of the ring part way through a frame
+  int i = 0, j = 0;
+  for (int s = 0; s < 2; s++) {
+    for (unsigned int k = 0; k < span.len[s]; k++) {
+      span.ptr[s][k] = samples[j][i];
+      if (++j == networkChannelCount) {
+        j = 0;
+        i++;
+      }
     }
   }
 
+  samplering_commitWrite(_ring, sampleCount);
   return frameCount;
 }
 
 static int syncer_enqueueBuf(enum InBufTypeEnum inBufType, const void *inBuf, int inFrameCount, int inChannelCount, bool setStats) {
-  for (int i = 0; i < networkChannelCount; i++) {
-    for (int j = 0; j < inFrameCount; j++) {
-      // If the inBuf has more channels than we want to send over the network, use the first n channels of the inBuf.
-      switch (inBufType) {
-        case S16:
-          inBufsDouble[i][j] = utils_s16ToDouble((const int16_t *)inBuf, inChannelCount*j + i);
-          break;
-        case S24:
-          inBufsDouble[i][j] = utils_s24ToDouble((const uint8_t *)inBuf, inChannelCount*j + i);
-          break;
-        case S32:
-          inBufsDouble[i][j] = utils_s32ToDouble((const int32_t *)inBuf, inChannelCount*j + i);
-          break;
-        case F32:
-          inBufsDouble[i][j] = ((const float *)inBuf)[inChannelCount*j + i];
-          break;
-      }
-    }
+  int inSampleCount = inChannelCount * inFrameCount;
+  if (inBufType != F32 && inSampleCount > inBufFloatLen) return -6;
+
+  // Convert the whole interleaved buffer in one go with the SIMD kernel for this format, then deinterleave
+  const float *inFloat = inBufFloat;
+  switch (inBufType) {
+    case S16:
+      sampleconvert_kernels->s16ToF32((const int16_t *)inBuf, inBufFloat, inSampleCount);
+      break;
+    case S24:
+      sampleconvert_kernels->s24ToF32((const uint8_t *)inBuf, inBufFloat, inSampleCount);
+      break;
+    case S32:
+      sampleconvert_kernels->s32ToF32((const int32_t *)inBuf, inBufFloat, inSampleCount);
+      break;
+    case F32:
+      inFloat = (const float *)inBuf;
+      break;
   }
 
-  int outFrameCount = _syncer_stepResampState(inBufsDouble, inFrameCount, setStats, 0);
-  if (outFrameCount < 0) return outFrameCount;
+  for (int j = 0; j < inFrameCount; j++) {
+    // If the inBuf has more channels than we want to send over the network, use the first n channels of the inBuf.
+    for (int i = 0; i < networkChannelCount; i++) {
+      inBufsDouble[i][j] = inFloat[inChannelCount*j + i];
+    }
+  }
 
-  return outFrameCount;
+  if (resamplerMode == SYNCER_RESAMPLER_VARIABLE) return _syncer_stepVariResamp(inBufsDouble, inFrameCount, setStats);
+  return _syncer_stepResampState(inBufsDouble, inFrameCount, setStats, 0);
 }
 
 /////////////////////
 // public
 /////////////////////
 
-int syncer_init (double srcRate, double dstRate, int maxInBufFrames, ck_ring_t *ring, ck_ring_buffer_t *ringBuf, int fullRingSize) {
+int syncer_init (double srcRate, double dstRate, int maxInBufFrames, samplering_t *ring, int fullRingSize) {
   try {
     _fullRingSize = fullRingSize;
     _ring = ring;
-    _ringBuf = ringBuf;
     networkChannelCount = globals_get1i(audio, networkChannelCount);
-    inBufsDouble = new double*[networkChannelCount];
+    resamplerMode = globals_get1i(audio, resamplerMode);
+    inBufsDouble = (double **)rtarena_alloc(sizeof(double *) * networkChannelCount);
+    // the sender converts deviceChannelCount channels, the receiver converts networkChannelCount channels
+    int deviceChannelCount = globals_get1i(audio, deviceChannelCount);
+    inBufFloatLen = maxInBufFrames * (deviceChannelCount > networkChannelCount ? deviceChannelCount : networkChannelCount);
+    inBufFloat = (float *)rtarena_alloc(sizeof(float) * inBufFloatLen);
+    if (inBufsDouble == NULL || inBufFloat == NULL) return -1;
 
-    utils_setAudioLevelFilters();
+    audiometer_init();
 
     for (int i = 0; i < networkChannelCount; i++) {
-      inBufsDouble[i] = new double[maxInBufFrames];
+      inBufsDouble[i] = (double *)rtarena_alloc(sizeof(double) * maxInBufFrames);
+      if (inBufsDouble[i] == NULL) return -1;
     }
   } catch (...) {
     return -1;
   }
 
-  if (_syncer_initResampState(srcRate, dstRate, maxInBufFrames) < 0) return -1;
+  if (resamplerMode == SYNCER_RESAMPLER_VARIABLE) {
+    if (_syncer_initVariResamp(srcRate, dstRate, maxInBufFrames) < 0) return -1;
+  } else {
+    if (_syncer_initResampState(srcRate, dstRate, maxInBufFrames) < 0) return -1;
+  }
   if (_syncer_initReceiverSync(srcRate) < 0) return -1;
   return 0;
 }
 
+double syncer_getRateRatio (void) {
+  if (resamplerMode == SYNCER_RESAMPLER_VARIABLE) return _syncer_getVariResampRatio();
+  return _syncer_getResampStateRatio();
+}
+
+int syncer_changeRate (double srcRate) {
+  if (resamplerMode == SYNCER_RESAMPLER_VARIABLE) return _syncer_changeVariResampRate(srcRate);
+  return _syncer_changeResampStateRate(srcRate);
+}
+
 int syncer_enqueueBufS16 (const int16_t *inBuf, int inFrameCount, int inChannelCount, bool setStats) {
   return syncer_enqueueBuf(S16, inBuf, inFrameCount, inChannelCount, setStats);
 }
@@ -107,10 +149,15 @@ int syncer_enqueueBufF32 (const float *inBuf, int inFrameCount, int inChannelCou
 
 void syncer_deinit (void) {
   for (int i = 0; i < networkChannelCount; i++) {
-    delete[] inBufsDouble[i];
+    rtarena_free(inBufsDouble[i]);
   }
-  delete[] inBufsDouble;
+  rtarena_free(inBufsDouble);
+  rtarena_free(inBufFloat);
 
-  _syncer_deinitResampState();
+  if (resamplerMode == SYNCER_RESAMPLER_VARIABLE) {
+    _syncer_deinitVariResamp();
+  } else {
+    _syncer_deinitResampState();
+  }
   _syncer_deinitReceiverSync();
 }
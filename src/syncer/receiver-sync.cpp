@@ -7,106 +7,153 @@
 #include <atomic>
 #include <math.h>
 #include "globals.h"
+#include "utils.h"
 #include "syncer.h"
 
 static double _srcRate = 0.0;
 static pthread_t receiverSyncThread;
 static atomic_int threadState;
 static atomic_bool active = false;
-static atomic_int_fast64_t receiverSync = 0;
+// receiverSync = packetFrames - audioFrames, in RS_FIXED_ONE units per frame. Each counter only has one writer so
+// it is updated with a plain store instead of a read-modify-write.
+// NOTE: unsigned because they only grow, by RS_FIXED_ONE per frame, and a signed counter would overflow after
+// about 22 days at 48 kHz. They wrap instead, and the difference is still right once converted to signed.
+static atomic_uint_fast64_t packetFrames = 0; // written by syncer_onPacket only, scaled by the rate ratio
+static atomic_uint_fast64_t audioFrames = 0; // written by syncer_onAudio only
+static atomic_int_fast64_t rateRatioFixed = RS_FIXED_ONE;
 
 /////////////////////
 // private
 /////////////////////
 
-// NOTE: not bounds checked, make sure length >= 2 and tail < length
-static double linearRegressionSlope (const double *data, int tail, int length) {
-  double yAvg = 0.0;
-  for (int i = 0; i < length; i++) {
-    yAvg += data[tail];
-    if (++tail == length) tail = 0;
-  }
-  yAvg /= (double)length;
-
-  double xAvg = (length - 1) / 2.0;
-  double variance = 0.0, covariance = 0.0;
-  for (int i = 0; i < length; i++) {
-    double xDiff = i - xAvg;
-    variance += xDiff * xDiff;
-    covariance += xDiff * (data[tail] - yAvg);
-    if (++tail == length) tail = 0;
-  }
+// Sliding window over the last capacity values with running sums, for O(1) regression slope and variance.
+// x is the position in the window, 0 for the oldest value.
+typedef struct {
+  double *data; // ring buffer
+  int capacity, head, count; // head is the oldest value
+  int pushesSinceResync;
+  double sumY, sumXY, sumYY;
+} slidingwindow_t;
+
+static void windowClear (slidingwindow_t *w) {
+  w->head = 0;
+  w->count = 0;
+  w->pushesSinceResync = 0;
+  w->sumY = 0.0;
+  w->sumXY = 0.0;
+  w->sumYY = 0.0;
+}
 
-  if (variance == 0.0) return 0.0; // division by zero check, not sure if it's required
-  return covariance / variance;
+static void windowInit (slidingwindow_t *w, double *data, int capacity) {
+  w->data = data;
+  w->capacity = capacity;
+  windowClear(w);
 }
 
-// NOTE: not bounds checked, make sure length >= 2 and tail < length
-static double variance (const double *data, int tail, int length) {
-  double avg = 0.0;
-  for (int i = 0; i < length; i++) {
-    avg += data[tail];
-    if (++tail == length) tail = 0;
+// recalculate the sums from scratch so rounding errors from the adds and subtracts don't build up
+static void windowResync (slidingwindow_t *w) {
+  w->sumY = 0.0;
+  w->sumXY = 0.0;
+  w->sumYY = 0.0;
+  int j = w->head;
+  for (int i = 0; i < w->count; i++) {
+    double y = w->data[j];
+    w->sumY += y;
+    w->sumXY += i * y;
+    w->sumYY += y * y;
+    if (++j == w->capacity) j = 0;
   }
-  avg /= (double)length;
+  w->pushesSinceResync = 0;
+}
 
-  double squaresSum = 0.0;
-  for (int i = 0; i < length; i++) {
-    double diff = data[tail] - avg;
-    squaresSum += diff * diff;
-    if (++tail == length) tail = 0;
+static void windowPush (slidingwindow_t *w, double y) {
+  if (w->count < w->capacity) {
+    int j = w->head + w->count;
+    if (j >= w->capacity) j -= w->capacity;
+    w->data[j] = y;
+    w->sumXY += w->count * y;
+    w->count++;
+  } else {
+    // drop the oldest value, every other x moves down by one
+    double yOldest = w->data[w->head];
+    w->sumY -= yOldest;
+    w->sumYY -= yOldest * yOldest;
+    w->sumXY -= w->sumY;
+    w->data[w->head] = y;
+    if (++w->head == w->capacity) w->head = 0;
+    w->sumXY += (w->count - 1) * y;
   }
-  return squaresSum / (double)(length - 1);
+  w->sumY += y;
+  w->sumYY += y * y;
+
+  // amortised O(1)
+  if (++w->pushesSinceResync >= w->capacity) windowResync(w);
+}
+
+static double windowSlope (const slidingwindow_t *w) {
+  if (w->count < 2) return 0.0;
+  double n = w->count;
+  double xAvg = (n - 1.0) / 2.0;
+  double xVariance = n * (n * n - 1.0) / 12.0; // sum of (x - xAvg)^2 for x = 0..n-1
+  return (w->sumXY - xAvg * w->sumY) / xVariance;
+}
+
+static double windowVariance (const slidingwindow_t *w) {
+  if (w->count < 2) return 0.0;
+  double n = w->count;
+  double squaresSum = w->sumYY - w->sumY * w->sumY / n;
+  if (squaresSum < 0.0) squaresSum = 0.0; // rounding
+  return squaresSum / (n - 1.0);
 }
 
 // this is not a realtime thread
 static void *startReceiverSync (UNUSED void *arg) {
-  double rsHistory[RS_HISTORY_LENGTH] = { 0.0 }; // ring buffer
-  double errorWindow[RS_ERROR_VARIANCE_WINDOW] = { 0.0 }; // ring buffer
-  int rsSampleCount = 0, errorSampleCount = 0;
+  utils_setCallerThreadRole(THREAD_ROLE_RECEIVER_SYNC, 0, -1, -1);
+
+  double rsHistoryData[RS_HISTORY_LENGTH];
+  double errorWindowData[RS_ERROR_VARIANCE_WINDOW];
+  slidingwindow_t rsHistory, errorWindow;
+  windowInit(&rsHistory, rsHistoryData, RS_HISTORY_LENGTH);
+  windowInit(&errorWindow, errorWindowData, RS_ERROR_VARIANCE_WINDOW);
   double rsAdjustedA = 0.0, rsAdjustedB = 0.0;
   bool rsB = false;
   static double currentSrcRate = _srcRate;
+  // the variable resampler makes small corrections for free, the crossfade one rebuilds resamplers for each
+  double errorThreshold = globals_get1i(audio, resamplerMode) == SYNCER_RESAMPLER_VARIABLE ? RS_VARIABLE_ERROR_THRESHOLD : RS_ERROR_THRESHOLD;
 
   while (true) {
     atomic_wait(&threadState, 1);
     if (atomic_load(&threadState) == 0) return NULL; // 0 means deinit
     atomic_store(&threadState, 1);
 
-    int_fast64_t rs = atomic_load(&receiverSync);
+    int_fast64_t rs = (int_fast64_t)(atomic_load(&packetFrames) - atomic_load(&audioFrames));
 
     if (rsB) {
-      rsAdjustedB = 0.00000001 * (double)rs;
+      rsAdjustedB = (double)rs / RS_FIXED_ONE;
     } else {
-      rsAdjustedA = 0.00000001 * (double)rs;
+      rsAdjustedA = (double)rs / RS_FIXED_ONE;
     }
     rsB = !rsB;
 
-    rsHistory[rsSampleCount % RS_HISTORY_LENGTH] = rsAdjustedA > rsAdjustedB ? rsAdjustedA : rsAdjustedB;
-    rsSampleCount++;
-    if (rsSampleCount < 2) continue;
-
-    double errorSamplesPerSecond;
-    if (rsSampleCount <= RS_HISTORY_LENGTH) {
-      errorSamplesPerSecond = linearRegressionSlope(rsHistory, 0, rsSampleCount);
-    } else {
-      errorSamplesPerSecond = linearRegressionSlope(rsHistory, rsSampleCount % RS_HISTORY_LENGTH, RS_HISTORY_LENGTH);
-    }
+    windowPush(&rsHistory, rsAdjustedA > rsAdjustedB ? rsAdjustedA : rsAdjustedB);
+    if (rsHistory.count < 2) continue;
 
+    double errorSamplesPerSecond = windowSlope(&rsHistory);
     errorSamplesPerSecond /= RS_SAMPLE_INTERVAL; // DEBUG: not sure if this scaling is correct
-    errorWindow[errorSampleCount % RS_ERROR_VARIANCE_WINDOW] = errorSamplesPerSecond;
-    errorSampleCount++;
+    windowPush(&errorWindow, errorSamplesPerSecond);
+    globals_set1ff(statsCh1Audio, syncError, errorSamplesPerSecond);
 
-    if (errorSampleCount >= RS_ERROR_VARIANCE_WINDOW) {
-      double errorVariance = variance(errorWindow, errorSampleCount % RS_ERROR_VARIANCE_WINDOW, RS_ERROR_VARIANCE_WINDOW);
-      if (errorVariance < RS_ERROR_VARIANCE_TARGET && fabs(errorSamplesPerSecond) > RS_ERROR_THRESHOLD) {
+    if (errorWindow.count >= RS_ERROR_VARIANCE_WINDOW) {
+      double errorVariance = windowVariance(&errorWindow);
+      globals_set1ff(statsCh1Audio, syncErrorVariance, errorVariance);
+      if (errorVariance < RS_ERROR_VARIANCE_TARGET && fabs(errorSamplesPerSecond) > errorThreshold) {
         currentSrcRate += errorSamplesPerSecond; 
         double clockErrorPPM = 1000000.0 * (1.0 - _srcRate / currentSrcRate);
         globals_set1ff(statsCh1Audio, clockError, clockErrorPPM);
 
         // clear rsHistory and errorWindow
-        rsSampleCount = 0;
-        errorSampleCount = 0;
+        windowClear(&rsHistory);
+        windowClear(&errorWindow);
 
         syncer_changeRate(currentSrcRate);
       }
@@ -124,8 +171,13 @@ int _syncer_initReceiverSync (double srcRate) {
   return 0;
 }
 
+void _syncer_setRateRatio (double ratio) {
+  atomic_store_explicit(&rateRatioFixed, (int_fast64_t)llround(ratio * RS_FIXED_ONE), memory_order_relaxed);
+}
+
 void _syncer_deinitReceiverSync (void) {
   atomic_store(&threadState, 0);
+  atomic_notify_one(&threadState); // otherwise it waits for the next syncer_onAudio, which may never come
   pthread_join(receiverSyncThread, NULL);
 }
 
@@ -141,9 +193,11 @@ void _syncer_deinitReceiverSync (void) {
 // - must call _syncer_initReceiverSync first (not checked)
 void syncer_onAudio (unsigned int frameCount) {
   static int sampleIntervalFrames = 0;
+  static uint_fast64_t audioFramesLocal = 0;
 
   if (atomic_load_explicit(&active, memory_order_relaxed)) {
-    atomic_fetch_sub_explicit(&receiverSync, 100000000 * (int_fast64_t)frameCount, memory_order_relaxed);
+    audioFramesLocal += RS_FIXED_ONE * (uint_fast64_t)frameCount;
+    atomic_store_explicit(&audioFrames, audioFramesLocal, memory_order_relaxed);
 
     sampleIntervalFrames += frameCount;
     if (sampleIntervalFrames >= RS_SAMPLE_INTERVAL * (int)_srcRate) {
@@ -160,9 +214,8 @@ void syncer_onAudio (unsigned int frameCount) {
 // - must call _syncer_initReceiverSync first (not checked)
 void syncer_onPacket (int seq, int frameCount) {
   static int seqLast = -1;
-
-  // TODO: this can be optimised by having resamp-state update it, instead of calling syncer_getRateRatio for every packet
-  double rateRatio = syncer_getRateRatio();
+  static uint_fast64_t packetFramesLocal = 0;
+  static bool activeLocal = false;
 
   if (seqLast >= 0) {
     int seqDiff = seq - seqLast;
@@ -174,9 +227,13 @@ void syncer_onPacket (int seq, int frameCount) {
     }
 
     if (seqDiff >= 1) {
-      double rsDiff = 100000000.0 * rateRatio * (double)frameCount * (double)seqDiff;
-      atomic_fetch_add_explicit(&receiverSync, (int_fast64_t)rsDiff, memory_order_relaxed);
-      atomic_store_explicit(&active, true, memory_order_relaxed);
+      int_fast64_t ratio = atomic_load_explicit(&rateRatioFixed, memory_order_relaxed);
+      packetFramesLocal += (uint_fast64_t)(ratio * (int_fast64_t)frameCount * seqDiff);
+      atomic_store_explicit(&packetFrames, packetFramesLocal, memory_order_relaxed);
+      if (!activeLocal) {
+        atomic_store_explicit(&active, true, memory_order_relaxed);
+        activeLocal = true;
+      }
     }
   }
   seqLast = seq;
@@ -4,13 +4,17 @@
 // file, You can obtain one at https://mozilla.org/MPL/2.0/.
 
 #include <stdio.h>
+#include <math.h>
 #include <atomic>
+#include <utility>
 // TODO: fix anonymous structs in r8brain
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
 #include "r8brain-free-src/CDSPResampler.h"
 #pragma GCC diagnostic pop
 #include "globals.h"
+#include "rt-arena.h"
+#include "utils.h"
 #include "syncer.h"
 
 using namespace r8b;
@@ -25,9 +29,20 @@ static int abMixOverflowLen = 0;
 static double **abMixOverflowBufs;
 static CDSPResampler24 **resampsA, **resampsB;
 static double resampsARatio, resampsBRatio;
+// rates are stored as a number of SYNCER_RATE_STEPs from initSrcRate
+static long resampsARateStep, resampsBRateStep;
+
+// spare resampler sets, only touched by the manager thread
+typedef struct {
+  CDSPResampler24 **resamps; // NULL if the slot has not been built yet
+  long rateStep;
+} resamp_cache_slot_t;
+
+static resamp_cache_slot_t resampCache[SYNCER_RESAMP_CACHE_SIZE + 1]; // + 1 so the array is never zero length
 
 static int _maxInBufFrames;
-static double _srcRate, _dstRate;
+static double _dstRate, initSrcRate;
+static std::atomic<long> requestedRateStep;
 static pthread_t resampManagerThread;
 static int networkChannelCount, deviceChannelCount;
 static double **tempBufsDouble;
@@ -36,48 +51,128 @@ static double **tempBufsDouble;
 // private
 /////////////////////
 
+static inline double rateStepToSrcRate (long rateStep) {
+  return initSrcRate + SYNCER_RATE_STEP * rateStep;
+}
+
+static CDSPResampler24 **newResamps (long rateStep) {
+  CDSPResampler24 **resamps = new CDSPResampler24*[networkChannelCount];
+  for (int i = 0; i < networkChannelCount; i++) {
+    resamps[i] = new CDSPResampler24(rateStepToSrcRate(rateStep), _dstRate, _maxInBufFrames, SYNCER_TRANSITION_BAND);
+  }
+  return resamps;
+}
+
+static void deleteResamps (CDSPResampler24 **resamps) {
+  if (resamps == NULL) return;
+  for (int i = 0; i < networkChannelCount; i++) {
+    delete resamps[i];
+  }
+  delete[] resamps;
+}
+
+static int findCacheSlot (long rateStep) {
+  for (int k = 0; k < SYNCER_RESAMP_CACHE_SIZE; k++) {
+    if (resampCache[k].resamps != NULL && resampCache[k].rateStep == rateStep) return k;
+  }
+  return -1;
+}
+
+// Point resamps at a set for rateStep, taking it from resampCache if there is one there. The set that was in
+// resamps goes back into the cache unless the cache already has that rate, otherwise it is deleted.
+static void installResamps (CDSPResampler24 **&resamps, long &resampsRateStep, long rateStep) {
+  int k = findCacheSlot(rateStep);
+  bool keepOld = findCacheSlot(resampsRateStep) < 0;
+
+  if (k < 0) {
+    deleteResamps(resamps);
+    resamps = newResamps(rateStep);
+  } else {
+    std::swap(resamps, resampCache[k].resamps);
+    if (keepOld) {
+      resampCache[k].rateStep = resampsRateStep;
+    } else {
+      deleteResamps(resampCache[k].resamps);
+      resampCache[k].resamps = NULL;
+    }
+    // a cached set may have been running before, so reset its filter state
+    for (int i = 0; i < networkChannelCount; i++) resamps[i]->clear();
+  }
+  resampsRateStep = rateStep;
+}
+
+static int getFeedSampleCount (CDSPResampler24 **resamps) {
+  int count = resamps[0]->getInputRequiredForOutput(1);
+  for (int i = 1; i < networkChannelCount; i++) {
+    if (resamps[i]->getInputRequiredForOutput(1) != count) {
+      // DEBUG: feedSampleCounts were not all the same. What should we do? This never happens!
+      printf("syncer: resampler desync!\n");
+    }
+  }
+  return count;
+}
+
+// n-th rate the cache should hold around rateStep: +1, -1, +2, -2...
+static inline long wantedCacheRateStep (long rateStep, int n) {
+  return rateStep + (n % 2 == 0 ? 1 : -1) * (n / 2 + 1);
+}
+
+static bool isCacheSlotWanted (int k, long rateStep) {
+  if (resampCache[k].resamps == NULL) return false;
+  for (int n = 0; n < SYNCER_RESAMP_CACHE_SIZE; n++) {
+    if (resampCache[k].rateStep == wantedCacheRateStep(rateStep, n)) return true;
+  }
+  return false;
+}
+
+// Build the spare sets for the rates either side of rateStep, keeping any that are already there
+static void refillResampCache (long rateStep) {
+  for (int n = 0; n < SYNCER_RESAMP_CACHE_SIZE; n++) {
+    long wantedStep = wantedCacheRateStep(rateStep, n);
+    if (findCacheSlot(wantedStep) >= 0) continue;
+
+    for (int k = 0; k < SYNCER_RESAMP_CACHE_SIZE; k++) {
+      if (isCacheSlotWanted(k, rateStep)) continue;
+      deleteResamps(resampCache[k].resamps);
+      resampCache[k].resamps = newResamps(wantedStep);
+      resampCache[k].rateStep = wantedStep;
+      break;
+    }
+  }
+}
+
 // CDSPResampler24 construction and destruction can be expensive so it's done in this lower priority thread to not cause an audio glitch
 static void *startResampManager (UNUSED void *arg) {
+  utils_setCallerThreadRole(THREAD_ROLE_RESAMP_MANAGER, 0, -1, -1);
+
+  refillResampCache(0);
+
   while (true) {
     managerFlag.wait(false);
     managerFlag.clear();
 
+    long rateStep = requestedRateStep;
     switch (resampState) {
       case StoppingManager:
-        for (int i = 0; i < networkChannelCount; i++) {
-          delete resampsA[i];
-          delete resampsB[i];
-        }
+        deleteResamps(resampsA);
+        deleteResamps(resampsB);
+        for (int k = 0; k < SYNCER_RESAMP_CACHE_SIZE; k++) deleteResamps(resampCache[k].resamps);
         return NULL;
 
       case RunningA:
-        for (int i = 0; i < networkChannelCount; i++) {
-          delete resampsB[i];
-          resampsB[i] = new CDSPResampler24(_srcRate, _dstRate, _maxInBufFrames, SYNCER_TRANSITION_BAND);
-          resampsBRatio = _dstRate / _srcRate;
-          if (i == 0) {
-            feedSampleCount = resampsB[i]->getInputRequiredForOutput(1);
-          } else if (resampsB[i]->getInputRequiredForOutput(1) != feedSampleCount) {
-            // DEBUG: feedSampleCounts were not all the same. What should we do? This never happens!
-            printf("syncer: resampler desync!\n");
-          }
-        }
+        installResamps(resampsB, resampsBRateStep, rateStep);
+        resampsBRatio = _dstRate / rateStepToSrcRate(rateStep);
+        feedSampleCount = getFeedSampleCount(resampsB);
         resampState = FeedingB;
+        refillResampCache(rateStep);
         break;
 
       case RunningB:
-        for (int i = 0; i < networkChannelCount; i++) {
-          delete resampsA[i];
-          resampsA[i] = new CDSPResampler24(_srcRate, _dstRate, _maxInBufFrames, SYNCER_TRANSITION_BAND);
-          resampsARatio = _dstRate / _srcRate;
-          if (i == 0) {
-            feedSampleCount = resampsA[i]->getInputRequiredForOutput(1);
-          } else if (resampsA[i]->getInputRequiredForOutput(1) != feedSampleCount) {
-            // DEBUG: feedSampleCounts were not all the same. What should we do? This never happens!
-            printf("syncer: resampler desync!\n");
-          }
-        }
+        installResamps(resampsA, resampsARateStep, rateStep);
+        resampsARatio = _dstRate / rateStepToSrcRate(rateStep);
+        feedSampleCount = getFeedSampleCount(resampsA);
         resampState = FeedingA;
+        refillResampCache(rateStep);
         break;
 
       default:
@@ -90,23 +185,27 @@ static void *startResampManager (UNUSED void *arg) {
 
 int _syncer_initResampState (double srcRate, double dstRate, int maxInBufFrames) {
   try {
-    _srcRate = srcRate;
+    initSrcRate = srcRate;
     _dstRate = dstRate;
     _maxInBufFrames = maxInBufFrames;
+    requestedRateStep = 0;
 
     networkChannelCount = globals_get1i(audio, networkChannelCount);
     deviceChannelCount = globals_get1i(audio, deviceChannelCount);
 
-    resampsA = new CDSPResampler24*[networkChannelCount];
-    resampsB = new CDSPResampler24*[networkChannelCount];
-    abMixOverflowBufs = new double*[networkChannelCount];
-    tempBufsDouble = new double*[networkChannelCount];
+    resampsA = newResamps(0);
+    resampsB = newResamps(0);
+    resampsARateStep = resampsBRateStep = 0;
+    resampsARatio = resampsBRatio = dstRate / srcRate;
+    _syncer_setRateRatio(resampsARatio);
+    for (int k = 0; k < SYNCER_RESAMP_CACHE_SIZE; k++) resampCache[k].resamps = NULL;
 
+    abMixOverflowBufs = (double **)rtarena_alloc(sizeof(double *) * networkChannelCount);
+    tempBufsDouble = (double **)rtarena_alloc(sizeof(double *) * networkChannelCount);
+    if (abMixOverflowBufs == NULL || tempBufsDouble == NULL) return -1;
     for (int i = 0; i < networkChannelCount; i++) {
-      resampsA[i] = new CDSPResampler24(srcRate, dstRate, maxInBufFrames, SYNCER_TRANSITION_BAND);
-      resampsB[i] = new CDSPResampler24(srcRate, dstRate, maxInBufFrames, SYNCER_TRANSITION_BAND);
-      resampsARatio = resampsBRatio = dstRate / srcRate;
-      abMixOverflowBufs[i] = new double[SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES];
+      abMixOverflowBufs[i] = (double *)rtarena_alloc(sizeof(double) * SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES);
+      if (abMixOverflowBufs[i] == NULL) return -1;
     }
 
     pthread_create(&resampManagerThread, NULL, startResampManager, NULL);
@@ -118,8 +217,11 @@ int _syncer_initResampState (double srcRate, double dstRate, int maxInBufFrames)
 }
 
 static int mixResamps (double **samples, int inFrameCount, int offset, CDSPResampler24 **fromResamps, CDSPResampler24 **toResamps, bool fromOverflows, bool setStats) {
-  double abMixSaved = abMix;
-  int abMixOverflowLenSaved = abMixOverflowLen;
+  // Every channel gets exactly the same crossfade, so each one starts from the same abMix and abMixOverflowLen
+  // and the shared state is only updated once at the end, instead of being saved and restored per channel.
+  const double abMixStart = abMix;
+  const int abMixOverflowLenStart = abMixOverflowLen;
+  int abMixOverflowLenEnd = abMixOverflowLenStart;
   int outFrameCount = 0;
   int returnErr = 0;
 
@@ -137,57 +239,48 @@ static int mixResamps (double **samples, int inFrameCount, int offset, CDSPResam
       continue;
     }
 
-    // NOTE: I'm allowed to modify toOutBuf after process() because I'm special, see here: https://github.com/avaneev/r8brain-free-src/issues/17#issuecomment-1621159016
-    int outBufPos = 0;
-    if (fromOverflows) { // abMixOverflowBufs contains samples from fromResamps
-      // mix all of abMixOverflowBufs, then fromOutBuf with toOutBuf
-      for (int j = 0; j < toOutLen; j++) {
-        double fromSample = abMixOverflowLen > 0 ? abMixOverflowBufs[i][--abMixOverflowLen] : fromOutBuf[outBufPos++];
-        double toSample = toOutBuf[j];
-        toOutBuf[j] = (1.0-abMix)*fromSample + abMix*toSample;
-        abMix += SYNCER_SWITCH_SPEED;
-        if (abMix > 1.0) abMix = 1.0;
-      }
-      // add any remaning samples in fromOutBuf to abMixOverflowBufs
-      for (int j = outBufPos; j < fromOutLen; j++) {
-        if (abMixOverflowLen == SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES) {
-          returnErr = -3;
-          // DEBUG: log
-          printf("syncer: overflow in mixResamps, rate change was too much\n");
-          continue;
-        }
-        abMixOverflowBufs[i][abMixOverflowLen++] = fromOutBuf[j];
-      }
-      // Provide the mixed samples to be enqueued onto the ring. The pointer returned by process() above will remain alive until the next call to process() and can be used outside this function.
-      tempBufsDouble[i] = toOutBuf;
-      outFrameCount = toOutLen;
-    } else { // abMixOverflowBufs contains samples from toResamps
-      for (int j = 0; j < fromOutLen; j++) {
-        double fromSample = fromOutBuf[j];
-        double toSample = abMixOverflowLen > 0 ? abMixOverflowBufs[i][--abMixOverflowLen] : toOutBuf[outBufPos++];
-        fromOutBuf[j] = (1.0-abMix)*fromSample + abMix*toSample;
-        abMix += SYNCER_SWITCH_SPEED;
-        if (abMix > 1.0) abMix = 1.0;
-      }
-      for (int j = outBufPos; j < toOutLen; j++) {
-        if (abMixOverflowLen == SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES) {
-          returnErr = -4;
-          // DEBUG: log
-          printf("syncer: overflow in mixResamps, rate change was too much\n");
-          continue;
-        }
-        abMixOverflowBufs[i][abMixOverflowLen++] = toOutBuf[j];
-      }
-      tempBufsDouble[i] = fromOutBuf;
-      outFrameCount = fromOutLen;
+    // outBuf is from the resampler with fewer output frames and gets the mixed samples, overBuf is from the one
+    // with more, its extra frames go into abMixOverflowBufs.
+    // NOTE: I'm allowed to modify the buffers after process() because I'm special, see here: https://github.com/avaneev/r8brain-free-src/issues/17#issuecomment-1621159016
+    double *outBuf = fromOverflows ? toOutBuf : fromOutBuf;
+    int outLen = fromOverflows ? toOutLen : fromOutLen;
+    const double *overBuf = fromOverflows ? fromOutBuf : toOutBuf;
+    int overLen = fromOverflows ? fromOutLen : toOutLen;
+    double *overflowBuf = abMixOverflowBufs[i];
+    int overflowLen = abMixOverflowLenStart;
+    int overBufPos = 0;
+
+    // mix all of abMixOverflowBufs, then overBuf with outBuf
+    for (int j = 0; j < outLen; j++) {
+      double overSample = overflowLen > 0 ? overflowBuf[--overflowLen] : overBuf[overBufPos++];
+      double mix = abMixStart + j * SYNCER_SWITCH_SPEED;
+      if (mix > 1.0) mix = 1.0;
+      double fromSample = fromOverflows ? overSample : outBuf[j];
+      double toSample = fromOverflows ? outBuf[j] : overSample;
+      outBuf[j] = (1.0-mix)*fromSample + mix*toSample;
     }
 
-    if (i < networkChannelCount - 1) {
-      abMixOverflowLen = abMixOverflowLenSaved;
-      abMix = abMixSaved;
+    // add any remaning samples in overBuf to abMixOverflowBufs
+    for (int j = overBufPos; j < overLen; j++) {
+      if (overflowLen == SYNCER_AB_MIX_OVERFLOW_MAX_FRAMES) {
+        returnErr = fromOverflows ? -3 : -4;
+        // DEBUG: log
+        printf("syncer: overflow in mixResamps, rate change was too much\n");
+        break;
+      }
+      overflowBuf[overflowLen++] = overBuf[j];
     }
+
+    // Provide the mixed samples to be enqueued onto the ring. The pointer returned by process() above will remain alive until the next call to process() and can be used outside this function.
+    tempBufsDouble[i] = outBuf;
+    outFrameCount = outLen;
+    abMixOverflowLenEnd = overflowLen;
   }
 
+  abMix = abMixStart + outFrameCount * SYNCER_SWITCH_SPEED;
+  if (abMix > 1.0) abMix = 1.0;
+  abMixOverflowLen = abMixOverflowLenEnd;
+
   // Wait until we are out of the loop before we error out, this way every resampler gets fed exactly the same, even if there is an error.
   if (returnErr < 0) {
     abMixOverflowLen = 0;
@@ -243,6 +336,13 @@ static int processResamp (double **samples, int frameCount, CDSPResampler24 **re
   return _syncer_enqueueSamples(tempBufsDouble, outFrameCount, setStats);
 }
 
+// The published rate ratio only changes when we switch to running on the other resampler, so that is the only
+// place it's pushed to receiver sync.
+static void setRunning (bool a) {
+  resampState = a ? RunningA : RunningB;
+  _syncer_setRateRatio(a ? resampsARatio : resampsBRatio);
+}
+
 int _syncer_stepResampState (double **samples, int frameCount, bool setStats, int offset) {
   int outFrameCount = 0, result;
   CDSPResampler24 **fromResamps, **toResamps;
@@ -263,7 +363,7 @@ int _syncer_stepResampState (double **samples, int frameCount, bool setStats, in
       outFrameCount = processResamp(samples, processSampleCount, fromResamps, setStats);
       if (outFrameCount < 0) {
         // ring is full, don't bother with smooth rate change
-        resampState = onA ? RunningA : RunningB;
+        setRunning(onA);
         return outFrameCount;
       }
 
@@ -276,7 +376,7 @@ int _syncer_stepResampState (double **samples, int frameCount, bool setStats, in
         // run mixResamps on the remaining samples that were not fed to resamps
         result = _syncer_stepResampState(samples, frameCount, setStats, processSampleCount);
         if (result < 0) {
-          resampState = onA ? RunningA : RunningB;
+          setRunning(onA);
           return result;
         }
         outFrameCount += result;
@@ -291,13 +391,13 @@ int _syncer_stepResampState (double **samples, int frameCount, bool setStats, in
       outFrameCount = mixResamps(samples, frameCount, offset, fromResamps, toResamps, fromOverflows, setStats);
       if (outFrameCount < 0) {
         // mixResamps failed, let's continue anyways
-        resampState = onA ? RunningB : RunningA;
+        setRunning(!onA);
         return outFrameCount;
       }
       if (abMix >= 1.0) {
         // mixResamps completed successfully
         abMix = 0.0;
-        resampState = onA ? RunningB : RunningA;
+        setRunning(!onA);
       }
       break;
 
@@ -316,23 +416,17 @@ void _syncer_deinitResampState (void) {
   pthread_join(resampManagerThread, NULL);
 
   for (int i = 0; i < networkChannelCount; i++) {
-    delete[] abMixOverflowBufs[i];
+    rtarena_free(abMixOverflowBufs[i]);
   }
 
-  delete[] resampsA;
-  delete[] resampsB;
-  delete[] tempBufsDouble;
-  delete[] abMixOverflowBufs;
+  rtarena_free(tempBufsDouble);
+  rtarena_free(abMixOverflowBufs);
 }
 
-/////////////////////
-// public
-/////////////////////
-
 // NOTE: this is thread-safe because if the manager thread is modifying
 // resamps(A|B)Ratio, it will be the opposite to the one we are reading here,
 // protected by resampState which is atomic.
-double syncer_getRateRatio (void) {
+double _syncer_getResampStateRatio (void) {
   switch (resampState) {
     case RunningA:
     case FeedingB:
@@ -348,10 +442,14 @@ double syncer_getRateRatio (void) {
   return 1.0; // never gonna be here, return whatever to make g++ happy
 }
 
-int syncer_changeRate (double srcRate) {
+int _syncer_changeResampStateRate (double srcRate) {
   if (resampState != RunningA && resampState != RunningB) return -1; // currently switching
 
-  _srcRate = srcRate;
+  long rateStep = lround((srcRate - initSrcRate) / SYNCER_RATE_STEP);
+  long currentRateStep = resampState == RunningA ? resampsARateStep : resampsBRateStep;
+  if (rateStep == currentRateStep) return 0; // rounds to the rate we are already on
+
+  requestedRateStep = rateStep;
   managerFlag.test_and_set();
   managerFlag.notify_one();
   return 0;
@@ -0,0 +1,189 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include "globals.h"
+#include "rt-arena.h"
+#include "syncer.h"
+
+// NOTES:
+// - Polyphase windowed-sinc resampler with a continuously adjustable ratio, used when resamplerMode is
+//   SYNCER_RESAMPLER_VARIABLE instead of the A/B pair of r8brain resamplers in resamp-state.cpp.
+// - The filter is a Kaiser windowed sinc with SYNCER_VARI_TAPS taps. It is tabulated at SYNCER_VARI_PHASES
+//   fractional phases, and the phase coefficients for each output frame are linearly interpolated between the two
+//   nearest rows. The interpolated row is shared by every channel.
+// - A rate change only changes the input step per output frame, which slews towards the new value by at most
+//   SYNCER_VARI_SLEW per frame. So there is no reconstruction, no crossfade and no overflow buffer.
+// - Only one thread may call _syncer_stepVariResamp. syncer_changeRate can be called from any thread.
+
+#define HALF_TAPS (SYNCER_VARI_TAPS / 2)
+
+static int networkChannelCount;
+static float *coeffs; // (SYNCER_VARI_PHASES + 1) rows of SYNCER_VARI_TAPS
+static double interpCoeffs[SYNCER_VARI_TAPS];
+static double **histBufs; // per channel: HALF_TAPS - 1 frames of history, then the new input
+static int histLen, histCapacity;
+static double **outBufs;
+static int outCapacity;
+static double pos; // input position of the next output frame, relative to the start of histBufs
+static double step; // input frames per output frame = srcRate / dstRate
+static std::atomic<double> targetStep, currentRatio;
+static double _dstRate;
+
+static double besselI0 (double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 50; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < 1e-12 * sum) break;
+  }
+  return sum;
+}
+
+// cutoff is in cycles per input frame
+static void initCoeffs (double cutoff) {
+  double i0Beta = besselI0(SYNCER_VARI_KAISER_BETA);
+  for (int p = 0; p <= SYNCER_VARI_PHASES; p++) {
+    double frac = (double)p / SYNCER_VARI_PHASES;
+    float *row = &coeffs[p * SYNCER_VARI_TAPS];
+    double rowSum = 0.0;
+    double rowDouble[SYNCER_VARI_TAPS];
+
+    for (int k = 0; k < SYNCER_VARI_TAPS; k++) {
+      // distance from the output position to input frame k
+      double t = frac - (k - (HALF_TAPS - 1));
+      double x = 2.0 * M_PI * cutoff * t;
+      double sinc = fabs(x) < 1e-12 ? 1.0 : sin(x) / x;
+      double w = t / HALF_TAPS;
+      double window = fabs(w) >= 1.0 ? 0.0 : besselI0(SYNCER_VARI_KAISER_BETA * sqrt(1.0 - w * w)) / i0Beta;
+      rowDouble[k] = 2.0 * cutoff * sinc * window;
+      rowSum += rowDouble[k];
+    }
+
+    // unity gain at DC for every phase, otherwise the phase modulates the level slightly
+    for (int k = 0; k < SYNCER_VARI_TAPS; k++) row[k] = rowDouble[k] / rowSum;
+  }
+}
+
+/////////////////////
+// private
+/////////////////////
+
+int _syncer_initVariResamp (double srcRate, double dstRate, int maxInBufFrames) {
+  networkChannelCount = globals_get1i(audio, networkChannelCount);
+  _dstRate = dstRate;
+  step = srcRate / dstRate;
+  targetStep = step;
+  currentRatio = dstRate / srcRate;
+  _syncer_setRateRatio(currentRatio);
+
+  // With SYNCER_VARI_TAPS taps the Kaiser window's transition band is about 2 * SYNCER_VARI_KAISER_BETA / (pi * taps)
+  // wide (in cycles per frame), keep the -6 dB point that far below the lower of the two Nyquist frequencies.
+  double nyquist = 0.5 * (dstRate < srcRate ? dstRate / srcRate : 1.0);
+  double transition = 2.0 * SYNCER_VARI_KAISER_BETA / (M_PI * SYNCER_VARI_TAPS);
+  double cutoff = nyquist - transition / 2.0;
+
+  histCapacity = SYNCER_VARI_TAPS + maxInBufFrames;
+  // a little extra for the ratio drifting away from its initial value
+  outCapacity = (int)(histCapacity * 1.01 * dstRate / srcRate) + 2;
+
+  coeffs = (float *)rtarena_alloc(sizeof(float) * (SYNCER_VARI_PHASES + 1) * SYNCER_VARI_TAPS);
+  histBufs = (double **)rtarena_alloc(sizeof(double *) * networkChannelCount);
+  outBufs = (double **)rtarena_alloc(sizeof(double *) * networkChannelCount);
+  if (coeffs == NULL || histBufs == NULL || outBufs == NULL) return -1;
+  for (int i = 0; i < networkChannelCount; i++) {
+    // zeroed by rtarena_alloc
+    histBufs[i] = (double *)rtarena_alloc(sizeof(double) * histCapacity);
+    outBufs[i] = (double *)rtarena_alloc(sizeof(double) * outCapacity);
+    if (histBufs[i] == NULL || outBufs[i] == NULL) return -1;
+  }
+
+  initCoeffs(cutoff);
+
+  // start with silence for the taps before the first input frame
+  histLen = SYNCER_VARI_TAPS - 1;
+  pos = HALF_TAPS - 1;
+  return 0;
+}
+
+int _syncer_stepVariResamp (double **samples, int frameCount, bool setStats) {
+  if (histLen + frameCount > histCapacity) return -7;
+
+  for (int i = 0; i < networkChannelCount; i++) {
+    memcpy(&histBufs[i][histLen], samples[i], sizeof(double) * frameCount);
+  }
+  histLen += frameCount;
+
+  double target = targetStep.load(std::memory_order_relaxed);
+  int outFrameCount = 0;
+
+  // the last tap of the next output frame must be inside histBufs
+  while ((int)pos + HALF_TAPS < histLen && outFrameCount < outCapacity) {
+    int base = (int)pos - (HALF_TAPS - 1);
+    double phase = (pos - (int)pos) * SYNCER_VARI_PHASES;
+    int p = (int)phase;
+    double a = phase - p;
+    const float *row0 = &coeffs[p * SYNCER_VARI_TAPS];
+    const float *row1 = row0 + SYNCER_VARI_TAPS;
+    for (int k = 0; k < SYNCER_VARI_TAPS; k++) {
+      interpCoeffs[k] = row0[k] + a * (row1[k] - row0[k]);
+    }
+
+    for (int i = 0; i < networkChannelCount; i++) {
+      const double *in = &histBufs[i][base];
+      double sum = 0.0;
+      for (int k = 0; k < SYNCER_VARI_TAPS; k++) sum += interpCoeffs[k] * in[k];
+      outBufs[i][outFrameCount] = sum;
+    }
+    outFrameCount++;
+
+    // slew towards the requested ratio
+    double diff = target - step;
+    if (diff > SYNCER_VARI_SLEW) diff = SYNCER_VARI_SLEW;
+    else if (diff < -SYNCER_VARI_SLEW) diff = -SYNCER_VARI_SLEW;
+    step += diff;
+    pos += step;
+  }
+
+  double ratio = 1.0 / step;
+  if (ratio != currentRatio.load(std::memory_order_relaxed)) {
+    currentRatio.store(ratio, std::memory_order_relaxed);
+    _syncer_setRateRatio(ratio);
+  }
+
+  // drop the input frames that no future output frame will use
+  int drop = (int)pos - (HALF_TAPS - 1);
+  if (drop > histLen) drop = histLen;
+  if (drop > 0) {
+    for (int i = 0; i < networkChannelCount; i++) {
+      memmove(histBufs[i], &histBufs[i][drop], sizeof(double) * (histLen - drop));
+    }
+    histLen -= drop;
+    pos -= drop;
+  }
+
+  return _syncer_enqueueSamples(outBufs, outFrameCount, setStats);
+}
+
+double _syncer_getVariResampRatio (void) {
+  return currentRatio.load(std::memory_order_relaxed);
+}
+
+int _syncer_changeVariResampRate (double srcRate) {
+  targetStep.store(srcRate / _dstRate, std::memory_order_relaxed);
+  return 0;
+}
+
+void _syncer_deinitVariResamp (void) {
+  for (int i = 0; i < networkChannelCount; i++) {
+    rtarena_free(histBufs[i]);
+    rtarena_free(outBufs[i]);
+  }
+  rtarena_free(histBufs);
+  rtarena_free(outBufs);
+  rtarena_free(coeffs);
+}
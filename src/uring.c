@@ -0,0 +1,180 @@
+// Copyright 2023 Sam Johnson
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// syscall
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+static size_t roundUpToPage (size_t len) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  return (len + pageSize - 1) / pageSize * pageSize;
+}
+
+int uring_init (uring_t *ring, unsigned entries, unsigned flags) {
+  memset(ring, 0, sizeof(uring_t));
+  ring->fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = flags;
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) return -errno;
+  ring->fd = fd;
+
+  // both are in every kernel new enough for the features the endpoint backend uses
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    uring_deinit(ring);
+    return -ENOSYS;
+  }
+
+  size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ringLen = sqLen > cqLen ? sqLen : cqLen;
+  void *ringPtr = mmap(NULL, ring->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ringPtr == MAP_FAILED) {
+    int err = -errno;
+    uring_deinit(ring);
+    return err;
+  }
+  ring->ringPtr = ringPtr;
+
+  ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int err = -errno;
+    uring_deinit(ring);
+    return err;
+  }
+  ring->sqes = (struct io_uring_sqe *)sqes;
+
+  uint8_t *p = (uint8_t *)ringPtr;
+  ring->sqHead = (unsigned *)(p + params.sq_off.head);
+  ring->sqTail = (unsigned *)(p + params.sq_off.tail);
+  ring->sqMask = *(unsigned *)(p + params.sq_off.ring_mask);
+  ring->sqEntries = *(unsigned *)(p + params.sq_off.ring_entries);
+  ring->sqArray = (unsigned *)(p + params.sq_off.array);
+  ring->cqHead = (unsigned *)(p + params.cq_off.head);
+  ring->cqTail = (unsigned *)(p + params.cq_off.tail);
+  ring->cqMask = *(unsigned *)(p + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(p + params.cq_off.cqes);
+
+  // SQEs are always submitted in the order they are filled in, so the index array never changes
+  for (unsigned i = 0; i < ring->sqEntries; i++) ring->sqArray[i] = i;
+  ring->sqLocalTail = *ring->sqTail;
+
+  return 0;
+}
+
+void uring_deinit (uring_t *ring) {
+  // closing the ring cancels everything still in flight
+  if (ring->fd >= 0) close(ring->fd);
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqesLen);
+  if (ring->ringPtr != NULL) munmap(ring->ringPtr, ring->ringLen);
+  if (ring->bufRing != NULL) munmap(ring->bufRing, ring->bufRingLen);
+  memset(ring, 0, sizeof(uring_t));
+  ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_getSqe (uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head >= ring->sqEntries) return NULL;
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+  ring->sqLocalTail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+int uring_submitAndWait (uring_t *ring, unsigned waitCount, int timeoutUs) {
+  unsigned submitCount = ring->sqLocalTail - *ring->sqTail;
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  if (submitCount == 0 && waitCount == 0) return 0;
+
+  unsigned enterFlags = 0;
+  struct __kernel_timespec ts = { 0 };
+  struct io_uring_getevents_arg arg = { 0 };
+  void *argPtr = NULL;
+  size_t argLen = 0;
+  if (waitCount > 0) {
+    enterFlags |= IORING_ENTER_GETEVENTS;
+    if (timeoutUs >= 0) {
+      ts.tv_sec = timeoutUs / 1000000;
+      ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+      enterFlags |= IORING_ENTER_EXT_ARG;
+      argPtr = &arg;
+      argLen = sizeof(arg);
+    }
+  }
+
+  int result = syscall(__NR_io_uring_enter, ring->fd, submitCount, waitCount, enterFlags, argPtr, argLen);
+  if (result < 0) {
+    if (errno == ETIME || errno == EINTR) return 0;
+    return -errno;
+  }
+  return result;
+}
+
+int uring_registerFiles (uring_t *ring, unsigned count) {
+  int fds[count];
+  for (unsigned i = 0; i < count; i++) fds[i] = -1;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count) < 0) return -errno;
+  return 0;
+}
+
+int uring_updateFile (uring_t *ring, unsigned index, int fd) {
+  struct io_uring_files_update update = { 0 };
+  update.offset = index;
+  update.fds = (uint64_t)(uintptr_t)&fd;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) return -errno;
+  return 0;
+}
+
+int uring_initBufRing (uring_t *ring, uint16_t groupId, unsigned bufCount, unsigned bufLen) {
+  if (bufCount == 0 || (bufCount & (bufCount - 1)) != 0 || bufCount > 32768) return -EINVAL;
+
+  // the ring of buffer descriptors must be page aligned, the buffers go straight after it in the same mapping
+  size_t descLen = roundUpToPage(bufCount * sizeof(struct io_uring_buf));
+  size_t len = descLen + roundUpToPage((size_t)bufCount * bufLen);
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (mem == MAP_FAILED) return -errno;
+
+  struct io_uring_buf_reg reg = { 0 };
+  reg.ring_addr = (uint64_t)(uintptr_t)mem;
+  reg.ring_entries = bufCount;
+  reg.bgid = groupId;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = -errno;
+    munmap(mem, len);
+    return err;
+  }
+
+  ring->bufRing = (struct io_uring_buf_ring *)mem;
+  ring->bufRingLen = len;
+  ring->bufs = (uint8_t *)mem + descLen;
+  ring->bufCount = bufCount;
+  ring->bufLen = bufLen;
+  ring->bufGroupId = groupId;
+  ring->bufTail = 0;
+  for (unsigned i = 0; i < bufCount; i++) uring_recycleBuf(ring, i);
+
+  return 0;
+}
+
+void uring_recycleBuf (uring_t *ring, uint16_t bufId) {
+  // the tail shares its memory with bufs[0].resv, so filling in the descriptors doesn't touch it
+  struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (ring->bufCount - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_getBuf(ring, bufId);
+  buf->len = ring->bufLen;
+  buf->bid = bufId;
+  ring->bufTail++;
+  __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
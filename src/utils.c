@@ -11,6 +11,18 @@
 #include <sched.h>
 #endif
 
+#if defined(__x86_64__)
+#define W_CRC32C_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define W_CRC32C_ARM
+#include <arm_acle.h>
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 #include <pthread.h>
 #include <stdbool.h>
 #include <netinet/in.h>
@@ -26,74 +38,6 @@
 #include "audio.h"
 #include "utils.h"
 
-static double levelFastAttack = 0.0, levelFastRelease = 0.0, levelSlowAttack = 0.0, levelSlowRelease = 0.0;
-
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-
-int utils_ringInit (ck_ring_t *ring, ck_ring_buffer_t **ringBuf, int size) {
-  #ifdef W_32_BIT_POINTERS
-  // on 32-bit arch we will store 1 double using 2 ring elements (2 x intptr_t)
-  size *= 2;
-  #endif
-
-  // ck requires the size to be a power of two but we will pretend ring contains
-  // size number of double values, and ignore the rest.
-  int ringAllocSize = utils_roundUpPowerOfTwo(size);
-  *ringBuf = (ck_ring_buffer_t*)malloc(sizeof(ck_ring_buffer_t) * ringAllocSize);
-  if (*ringBuf == NULL) return -1;
-  memset(*ringBuf, 0, sizeof(ck_ring_buffer_t) * ringAllocSize);
-
-  ck_ring_init(ring, ringAllocSize);
-  return 0;
-}
-
-// DEBUG: making these functions inline would be nice because they are used to process samples,
-// but I need to solve "static function is used in an inline function with external linkage"
-
-unsigned int utils_ringSize (const ck_ring_t *ring) {
-  #ifdef W_32_BIT_POINTERS
-  return ck_ring_size(ring) / 2;
-  #else
-  return ck_ring_size(ring);
-  #endif
-}
-
-double utils_ringDequeueSample (ck_ring_t *ring, ck_ring_buffer_t *ringBuf) {
-  double sampleDouble;
-
-  #ifdef W_32_BIT_POINTERS
-  intptr_t sample[2] __attribute__ ((aligned (8)));
-  ck_ring_dequeue_spsc(ring, ringBuf, (void*)&sample[0]);
-  ck_ring_dequeue_spsc(ring, ringBuf, (void*)&sample[1]);
-  // https://gist.github.com/shafik/848ae25ee209f698763cffee272a58f8#how-do-we-type-pun-correctly
-  memcpy(&sampleDouble, sample, 8);
-  #else
-  intptr_t sample = 0;
-  ck_ring_dequeue_spsc(ring, ringBuf, (void*)&sample);
-  memcpy(&sampleDouble, &sample, 8);
-  #endif
-
-  return sampleDouble;
-}
-
-void utils_ringEnqueueSample (ck_ring_t *ring, ck_ring_buffer_t *ringBuf, double x) {
-  #ifdef W_32_BIT_POINTERS
-  intptr_t sample[2] __attribute__ ((aligned (8)));
-  memcpy(sample, &x, 8);
-  ck_ring_enqueue_spsc(ring, ringBuf, (void*)sample[0]);
-  ck_ring_enqueue_spsc(ring, ringBuf, (void*)sample[1]);
-  #else
-  intptr_t sample = 0;
-  memcpy(&sample, &x, 8);
-  ck_ring_enqueue_spsc(ring, ringBuf, (void*)sample);
-  #endif
-}
-
-void utils_ringDeinit (UNUSED ck_ring_t *ring, ck_ring_buffer_t *ringBuf) {
-  free(ringBuf);
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -121,22 +65,54 @@ int utils_getElapsedUTime (int lastUTime) {
   return intervalUTime < 0 ? intervalUTime + 1000000000 : intervalUTime;
 }
 
+int64_t utils_getMonotonicNs (void) {
+  struct timespec tsp = { 0 };
+  #if defined(__linux__) || defined(__ANDROID__)
+  // same clock as clock_nanosleep in utils_sleepUntilNs
+  clock_gettime(CLOCK_MONOTONIC, &tsp);
+  #else
+  clock_gettime(CLOCK_MONOTONIC_RAW, &tsp);
+  #endif
+  return 1000000000LL * tsp.tv_sec + tsp.tv_nsec;
+}
+
+void utils_sleepUntilNs (int64_t ns) {
+  #if defined(__linux__) || defined(__ANDROID__)
+  struct timespec tsp;
+  tsp.tv_sec = ns / 1000000000LL;
+  tsp.tv_nsec = ns % 1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tsp, NULL);
+  #else
+  // no clock_nanosleep on macOS
+  int64_t sleepNs = ns - utils_getMonotonicNs();
+  if (sleepNs <= 0) return;
+  struct timespec tsp;
+  tsp.tv_sec = sleepNs / 1000000000LL;
+  tsp.tv_nsec = sleepNs % 1000000000LL;
+  nanosleep(&tsp, NULL);
+  #endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 int utils_setCallerThreadRealtime (UNUSED int priority, UNUSED int core) {
 #if defined(__linux__) || defined(__ANDROID__)
   // Pin to CPU core
-  cpu_set_t cpuSet;
-  CPU_ZERO(&cpuSet);
-  CPU_SET(core, &cpuSet);
-  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) < 0) return -1;
+  if (core >= 0) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(core, &cpuSet);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) < 0) return -1;
+  }
 
   // Set to RT
-  struct sched_param sp;
-  memset(&sp, 0, sizeof(sp));
-  sp.sched_priority = priority;
-  if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) return -2;
+  if (priority > 0) {
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) return -2;
+  }
 
   return 0;
 
@@ -147,7 +123,9 @@ int utils_setCallerThreadRealtime (UNUSED int priority, UNUSED int core) {
   // - https://gist.github.com/cjappl/20fed4c5631099989af9ca900db68bfa
   // NOTE: 
   // - audio_init() must be called first
-  // - priority and core are ignored for macOS
+  // - core is ignored for macOS, and priority only turns the time constraint policy on (> 0) or off
+
+  if (priority <= 0) return 0;
 
   double deviceLatency = audio_getDeviceLatency();
   if (deviceLatency == 0.0) return -1;
@@ -175,75 +153,90 @@ int utils_setCallerThreadRealtime (UNUSED int priority, UNUSED int core) {
 #endif
 }
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
+static const char *threadRoleNames[THREAD_ROLE_COUNT] = {
+  "audio", "network", "mux-packet", "mux-encode", "decode", "encode", "opus-worker", "resamp-manager",
+  "receiver-sync", "monitor"
+};
 
-inline uint16_t utils_readU16LE (const uint8_t *buf) {
-  return ((uint16_t)buf[1] << 8) | buf[0];
+int utils_getThreadRole (const char *name) {
+  for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+    if (strcmp(name, threadRoleNames[i]) == 0) return i;
+  }
+  return -1;
 }
 
-inline int utils_writeU16LE (uint8_t *buf, uint16_t val) {
-  buf[0] = val & 0xff;
-  buf[1] = val >> 8;
-  return 2;
+// reads back what the OS actually gave the calling thread
+static void printThreadPlacement (int role, int instance, int err) {
+#if defined(__linux__) || defined(__ANDROID__)
+  char cores[128] = "?";
+  cpu_set_t cpuSet;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0) {
+    // e.g. "0-3,6"
+    int len = 0;
+    for (int i = 0; i < CPU_SETSIZE && len < (int)sizeof(cores) - 16; i++) {
+      if (!CPU_ISSET(i, &cpuSet) || (i > 0 && CPU_ISSET(i - 1, &cpuSet))) continue;
+      int last = i;
+      while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpuSet)) last++;
+      len += last > i
+        ? snprintf(&cores[len], sizeof(cores) - len, "%s%d-%d", len > 0 ? "," : "", i, last)
+        : snprintf(&cores[len], sizeof(cores) - len, "%s%d", len > 0 ? "," : "", i);
+    }
+  }
+
+  struct sched_param sp;
+  int policy = sched_getscheduler(0);
+  if (sched_getparam(0, &sp) < 0) sp.sched_priority = 0;
+  printf("Thread %s %d: cores %s, %s %d", threadRoleNames[role], instance, cores, policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER", sp.sched_priority);
+#else
+  printf("Thread %s %d: time constraint policy", threadRoleNames[role], instance);
+#endif
+  if (err < 0) printf(" (placement failed: %d)", err);
+  printf("\n");
 }
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
+int utils_setCallerThreadRole (int role, int instance, int defaultPriority, int defaultCore) {
+  int priority = globals_get1iv(threads, priority, role);
+  if (priority == 0) priority = defaultPriority;
 
-void utils_setAudioLevelFilters (void) {
-  globals_get1ff(audio, levelFastAttack, &levelFastAttack);
-  globals_get1ff(audio, levelFastRelease, &levelFastRelease);
-  globals_get1ff(audio, levelSlowAttack, &levelSlowAttack);
-  globals_get1ff(audio, levelSlowRelease, &levelSlowRelease);
-}
+  int core = defaultCore;
+  int coreCount = globals_get1iv(threads, coreCount, role);
+  if (coreCount > 0) core = globals_get1iv(threads, cores, role * THREAD_ROLE_MAX_CORES + instance % coreCount);
 
-// NOTE: this must be audio callback safe
-void utils_setAudioStats (double sample, int channel) {
-  if (sample >= 1.0 || sample <= -1.0) {
-    globals_add1uiv(statsCh1Audio, clippingCounts, channel, 1);
-  }
+  // Configured cores are checked against the core count by config_parseBuf, but the defaults (e.g. chId + 1) can
+  // be past the last core on small machines. Wrap those instead of leaving the thread unpinned and not realtime.
+  long onlineCores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (core >= 0 && onlineCores > 0) core %= onlineCores;
 
-  double levelFast, levelSlow;
-  globals_get1ffv(statsCh1Audio, levelsFast, channel, &levelFast);
-  globals_get1ffv(statsCh1Audio, levelsSlow, channel, &levelSlow);
+  if (priority <= 0 && core < 0) return 0; // left to the OS
 
-  double levelFastDiff = fabs(sample) - levelFast;
-  double levelSlowDiff = fabs(sample) - levelSlow;
+  int err = utils_setCallerThreadRealtime(priority, core);
+  printThreadPlacement(role, instance, err);
+  return err;
+}
 
-  if (levelFastDiff > 0) {
-    levelFast += levelFastAttack * levelFastDiff;
-  } else {
-    levelFast += levelFastRelease * levelFastDiff;
-  }
-  if (levelSlowDiff > 0) {
-    levelSlow += levelSlowAttack * levelSlowDiff;
-  } else {
-    levelSlow += levelSlowRelease * levelSlowDiff;
-  }
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-  globals_set1ffv(statsCh1Audio, levelsFast, channel, levelFast);
-  globals_set1ffv(statsCh1Audio, levelsSlow, channel, levelSlow);
+inline uint16_t utils_readU16LE (const uint8_t *buf) {
+  return ((uint16_t)buf[1] << 8) | buf[0];
 }
 
-inline double utils_s16ToDouble (const int16_t *inBuf, int index) {
-  double sample = inBuf[index];
-  // http://blog.bjornroche.com/2009/12/int-float-int-its-jungle-out-there.html
-  return sample > 0.0 ? sample/32767.0 : sample/32768.0;
+inline int utils_writeU16LE (uint8_t *buf, uint16_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = val >> 8;
+  return 2;
 }
 
-// 24-bit index, i.e. 1 unit in index equals 3 bytes in inBuf
-inline double utils_s24ToDouble (const uint8_t *inBuf, int index) {
-  int32_t sampleInt = 0;
-  // Leave the least significant byte of sampleInt empty and then shift back into it to sign extend.
-  memcpy((uint8_t *)&sampleInt + 1, inBuf + 3*index, 3);
-  sampleInt >>= 8;
-  return sampleInt > 0 ? sampleInt/8388607.0 : sampleInt/8388608.0;
+inline uint32_t utils_readU32LE (const uint8_t *buf) {
+  return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | buf[0];
 }
 
-inline double utils_s32ToDouble (const int32_t *inBuf, int index) {
-  double sample = inBuf[index];
-  return sample > 0.0 ? sample/2147483647.0 : sample/2147483648.0;
+inline int utils_writeU32LE (uint8_t *buf, uint32_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = (val >> 8) & 0xff;
+  buf[2] = (val >> 16) & 0xff;
+  buf[3] = val >> 24;
+  return 4;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -373,9 +366,19 @@ uint8_t *utils_base64Decode (const uint8_t *src, size_t len, size_t *out_len) {
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+// NOTES:
+// - utils_crc16 and utils_crc32c update a running (reflected) CRC register, with no initial or final inversion.
+// - Both use slicing-by-8 tables, which utils_initCrc fills in. utils_initCrc also picks the hardware CRC32C
+//   instruction (SSE4.2 on x86, the ARMv8 CRC extension on aarch64) when the CPU has it.
+// - Before utils_initCrc, both fall back to the bit-at-a-time loop, which gives the same results.
+
+static uint16_t crc16Table[8][256];
+static uint32_t crc32cTable[8][256];
+static const char *crc32cImplName = "bitwise";
+
 // Poly: 0x8005
 // https://stackoverflow.com/questions/10564491/function-to-calculate-a-crc16-checksum#comment83704063_10569892
-uint16_t utils_crc16 (uint16_t crc, const uint8_t *buf, int bufLen) {
+static uint16_t crc16Bitwise (uint16_t crc, const uint8_t *buf, int bufLen) {
   while (bufLen--) {
     crc ^= *buf++;
     for (int k = 0; k < 8; k++) {
@@ -386,6 +389,117 @@ uint16_t utils_crc16 (uint16_t crc, const uint8_t *buf, int bufLen) {
   return crc;
 }
 
+static uint16_t crc16Slice8 (uint16_t crc, const uint8_t *buf, int bufLen) {
+  for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+    crc = crc16Table[7][(buf[0] ^ crc) & 0xff] ^ crc16Table[6][buf[1] ^ (crc >> 8)] ^
+      crc16Table[5][buf[2]] ^ crc16Table[4][buf[3]] ^ crc16Table[3][buf[4]] ^
+      crc16Table[2][buf[5]] ^ crc16Table[1][buf[6]] ^ crc16Table[0][buf[7]];
+  }
+  while (bufLen--) crc = crc16Table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+// Poly: 0x1EDC6F41 (Castagnoli)
+static uint32_t crc32cBitwise (uint32_t crc, const uint8_t *buf, int bufLen) {
+  while (bufLen--) {
+    crc ^= *buf++;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+  }
+
+  return crc;
+}
+
+static uint32_t crc32cSlice8 (uint32_t crc, const uint8_t *buf, int bufLen) {
+  for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+    uint32_t lo = crc ^ utils_readU32LE(buf);
+    uint32_t hi = utils_readU32LE(&buf[4]);
+    crc = crc32cTable[7][lo & 0xff] ^ crc32cTable[6][(lo >> 8) & 0xff] ^
+      crc32cTable[5][(lo >> 16) & 0xff] ^ crc32cTable[4][lo >> 24] ^
+      crc32cTable[3][hi & 0xff] ^ crc32cTable[2][(hi >> 8) & 0xff] ^
+      crc32cTable[1][(hi >> 16) & 0xff] ^ crc32cTable[0][hi >> 24];
+  }
+  while (bufLen--) crc = crc32cTable[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(W_CRC32C_X86)
+__attribute__ ((target ("sse4.2"))) static uint32_t crc32cHardware (uint32_t crc, const uint8_t *buf, int bufLen) {
+  uint64_t crc64 = crc;
+  for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+    uint64_t word;
+    memcpy(&word, buf, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  while (bufLen--) crc = _mm_crc32_u8(crc, *buf++);
+  return crc;
+}
+#elif defined(W_CRC32C_ARM)
+__attribute__ ((target ("+crc"))) static uint32_t crc32cHardware (uint32_t crc, const uint8_t *buf, int bufLen) {
+  for (; bufLen >= 8; bufLen -= 8, buf += 8) {
+    uint64_t word;
+    memcpy(&word, buf, 8);
+    crc = __crc32cd(crc, word);
+  }
+  while (bufLen--) crc = __crc32cb(crc, *buf++);
+  return crc;
+}
+#endif
+
+static bool hasHardwareCrc32c (void) {
+  #if defined(W_CRC32C_X86)
+  return __builtin_cpu_supports("sse4.2");
+  #elif defined(W_CRC32C_ARM) && defined(__APPLE__)
+  return true; // every Apple arm64 CPU has the CRC extension
+  #elif defined(W_CRC32C_ARM) && defined(HWCAP_CRC32)
+  return getauxval(AT_HWCAP) & HWCAP_CRC32;
+  #else
+  return false;
+  #endif
+}
+
+static uint16_t (*crc16Impl) (uint16_t crc, const uint8_t *buf, int bufLen) = crc16Bitwise;
+static uint32_t (*crc32cImpl) (uint32_t crc, const uint8_t *buf, int bufLen) = crc32cBitwise;
+
+void utils_initCrc (void) {
+  for (int b = 0; b < 256; b++) {
+    uint8_t byte = b;
+    crc16Table[0][b] = crc16Bitwise(0, &byte, 1);
+    crc32cTable[0][b] = crc32cBitwise(0, &byte, 1);
+  }
+  for (int k = 1; k < 8; k++) {
+    for (int b = 0; b < 256; b++) {
+      crc16Table[k][b] = (crc16Table[k-1][b] >> 8) ^ crc16Table[0][crc16Table[k-1][b] & 0xff];
+      crc32cTable[k][b] = (crc32cTable[k-1][b] >> 8) ^ crc32cTable[0][crc32cTable[k-1][b] & 0xff];
+    }
+  }
+
+  crc16Impl = crc16Slice8;
+  crc32cImpl = crc32cSlice8;
+  crc32cImplName = "slicing-by-8";
+
+  #if defined(W_CRC32C_X86) || defined(W_CRC32C_ARM)
+  if (hasHardwareCrc32c()) {
+    crc32cImpl = crc32cHardware;
+    crc32cImplName = "hardware";
+  }
+  #endif
+}
+
+const char *utils_getCrc32cImplName (void) {
+  return crc32cImplName;
+}
+
+uint16_t utils_crc16 (uint16_t crc, const uint8_t *buf, int bufLen) {
+  return crc16Impl(crc, buf, bufLen);
+}
+
+uint32_t utils_crc32c (uint32_t crc, const uint8_t *buf, int bufLen) {
+  return crc32cImpl(crc, buf, bufLen);
+}
+
 // Poly: 0x04C11DB7
 // https://web.mit.edu/freebsd/head/sys/libkern/crc32.c
 static const uint32_t crc32Table[] = {